@@ -0,0 +1,233 @@
+/*
+ * BK390A glyph table generator
+ *
+ * Build step for bk390-sdl2.  Renders the glyphs bk390-sdl2 draws
+ * with (printable ASCII and the units' symbols) from the embedded
+ * RobotoMono at each size given, with SDL_ttf the same way
+ * glyphs_rasterize() does, and writes them out as a C header:
+ *
+ *	bk390-glyphgen 12 14 16 20 24 -d 36 42 50 60 72 > robotomono-glyphs.h
+ *
+ * Sizes after -d only get the display alphabet, what a reading can
+ * be made of, since at the reading sizes that's all that's drawn;
+ * the labels and footer are a third the size and need the lot.
+ *
+ * Only the coverage (alpha) of each glyph is kept, run length
+ * encoded, since the glyphs are drawn white and tinted.  At those
+ * sizes bk390-sdl2 then starts without FreeType at all.
+ *
+ */
+
+#include <SDL.h>
+#include <SDL_ttf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "robotomono.h"
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SIZES_MAX 32
+#define GLYPHS_MAX 128
+
+/*
+ * The set glyphs_rasterize() renders, or with display only the
+ * characters of a reading (digits, sign, O.L., the prefixes and
+ * units, COM.FLT) and '?', which stands in for anything missing
+ */
+static int glyph_set(uint16_t *set, int display) {
+	static const uint16_t extra[] = { 0x00B0, 0x00B5, 0x03A9, 0x2126 };
+	static const char alphabet[] = " -.0123456789?ACDFHLMOPRTVkmnprz";
+	int n = 0;
+
+	if (display) {
+		for (const char *p = alphabet; *p; p++) set[n++] = *p;
+	} else {
+		for (int c = 32; c < 127; c++) set[n++] = c;
+	}
+	for (size_t k = 0; k < sizeof(extra) / sizeof(extra[0]); k++) set[n++] = extra[k];
+	return n;
+}
+
+static unsigned long out_bytes, out_col;
+
+static void out_byte(uint8_t b) {
+	if (out_col == 0) fprintf(stdout,"\t");
+	fprintf(stdout,"%u,", b);
+	out_bytes++;
+	if (++out_col == 24) {
+		fprintf(stdout,"\n");
+		out_col = 0;
+	}
+}
+
+/*
+ * PackBits: a control byte c below 128 is followed by c + 1 bytes as
+ * they are, 128 and up by one byte that repeats c - 125 times.  Glyph
+ * coverage is mostly long runs of 0 and 255.
+ */
+static void out_rle(const uint8_t *a, int n) {
+	int i = 0;
+
+	while (i < n) {
+		int run = 1, lit;
+
+		while (i + run < n && run < 130 && a[i + run] == a[i]) run++;
+		if (run >= 3) {
+			out_byte(run + 125);
+			out_byte(a[i]);
+			i += run;
+			continue;
+		}
+
+		/*
+		 * Literals up to the next run of three or more
+		 */
+		lit = 0;
+		while (i + lit < n && lit < 128) {
+			if (i + lit + 2 < n && a[i + lit] == a[i + lit + 1] && a[i + lit] == a[i + lit + 2]) break;
+			lit++;
+		}
+		out_byte(lit - 1);
+		for (int k = 0; k < lit; k++) out_byte(a[i + k]);
+		i += lit;
+	}
+}
+
+int main(int argc, char **argv) {
+	int sizes[SIZES_MAX], display[SIZES_MAX], count = 0, d = 0;
+	uint16_t set[SIZES_MAX][GLYPHS_MAX];
+	int n[SIZES_MAX];
+	SDL_Color white = { 255, 255, 255, 255 };
+	struct {
+		uint16_t w, h;
+		int16_t adv;
+		uint32_t offset;
+	} meta[SIZES_MAX][GLYPHS_MAX];
+	int height[SIZES_MAX];
+
+	for (int i = 1; i < argc && count < SIZES_MAX; i++) {
+		if (strcmp(argv[i], "-d") == 0) {
+			d = 1;
+			continue;
+		}
+		if (argv[i][0] == '-') {
+			fprintf(stderr,"BK390A glyph table generator\r\nBuild %d / %s\r\n\r\n"
+					"\tbk390-glyphgen <size> [<size>...] [-d <size>...] > robotomono-glyphs.h\r\n"
+					"\t-d: the sizes after it only get the display alphabet\r\n", BUILD_VER, BUILD_DATE);
+			exit(argv[i][1] == 'h' ? 0 : 1);
+		}
+		sizes[count] = atoi(argv[i]);
+		if (sizes[count] < 1) {
+			fprintf(stderr,"Invalid size '%s'\n", argv[i]);
+			exit(1);
+		}
+		int dup = 0;
+		for (int k = 0; k < count; k++) {
+			if (sizes[k] == sizes[count]) dup = 1;
+		}
+		if (dup) continue;
+		display[count] = d;
+		n[count] = glyph_set(set[count], d);
+		count++;
+	}
+
+	if (SDL_Init(0) != 0 || TTF_Init() != 0) {
+		fprintf(stderr,"Unable to start SDL_ttf (%s)\n", SDL_GetError());
+		exit(1);
+	}
+
+	fprintf(stdout,"/*\n"
+			" * Generated by bk390-glyphgen from robotomono.h, don't edit.\n"
+			" *\n"
+			" * RobotoMono glyphs pre-rendered by SDL_ttf at the sizes bk390-sdl2\n"
+			" * can start at without FreeType, see glyphs_prebuilt().\n"
+			" */\n"
+			"\n"
+			"#define PREBUILT_SIZES %d\n"
+			"\n"
+			"struct prebuilt_glyph {\n"
+			"\tuint16_t ch;\n"
+			"\tuint16_t w, h;               // 0 if SDL_ttf couldn't render it\n"
+			"\tint16_t adv;\n"
+			"\tuint32_t offset;             // PackBits coverage in prebuilt_alpha[]\n"
+			"};\n"
+			"\n"
+			"struct prebuilt_size {\n"
+			"\tint size;\n"
+			"\tint height;                  // TTF_FontHeight()\n"
+			"\tint display;                 // only the display alphabet\n"
+			"\tint count;\n"
+			"\tconst struct prebuilt_glyph *g;\n"
+			"};\n"
+			"\n"
+			"static const uint8_t prebuilt_alpha[] = {\n"
+			, count);
+
+	for (int s = 0; s < count; s++) {
+		TTF_Font *font = TTF_OpenFontRW(SDL_RWFromMem((void *)RobotoMono_Regular_ttf, sizeof(RobotoMono_Regular_ttf)), 1, sizes[s]);
+
+		if (!font) {
+			fprintf(stderr,"Unable to open RobotoMono at %d (%s)\n", sizes[s], TTF_GetError());
+			exit(1);
+		}
+		height[s] = TTF_FontHeight(font);
+
+		for (int i = 0; i < n[s]; i++) {
+			SDL_Surface *gs = TTF_RenderGlyph_Blended(font, set[s][i], white);
+			int adv;
+
+			meta[s][i].offset = out_bytes;
+			meta[s][i].w = meta[s][i].h = 0;
+			if (gs) {
+				SDL_Surface *cs = SDL_ConvertSurfaceFormat(gs, SDL_PIXELFORMAT_RGBA32, 0);
+				uint8_t *a = (uint8_t *)malloc(gs->w * gs->h + 1);
+
+				if (!cs || !a) {
+					fprintf(stderr,"Unable to convert glyph (%s)\n", SDL_GetError());
+					exit(1);
+				}
+				for (int y = 0; y < cs->h; y++) {
+					const uint8_t *row = (const uint8_t *)cs->pixels + y * cs->pitch;
+					for (int x = 0; x < cs->w; x++) a[y * cs->w + x] = row[x * 4 + 3];
+				}
+				meta[s][i].w = cs->w;
+				meta[s][i].h = cs->h;
+				out_rle(a, cs->w * cs->h);
+				free(a);
+				SDL_FreeSurface(cs);
+			}
+			if (TTF_GlyphMetrics(font, set[s][i], NULL, NULL, NULL, NULL, &adv) != 0) adv = gs ? gs->w : 0;
+			meta[s][i].adv = adv;
+			if (gs) SDL_FreeSurface(gs);
+		}
+		TTF_CloseFont(font);
+	}
+	if (out_col) fprintf(stdout,"\n");
+	fprintf(stdout,"};\n\n");
+
+	for (int s = 0; s < count; s++) {
+		fprintf(stdout,"static const struct prebuilt_glyph prebuilt_%d[%d] = {\n", sizes[s], n[s]);
+		for (int i = 0; i < n[s]; i++) {
+			fprintf(stdout,"\t{ %u, %u, %u, %d, %u },\n", set[s][i], meta[s][i].w, meta[s][i].h, meta[s][i].adv, meta[s][i].offset);
+		}
+		fprintf(stdout,"};\n\n");
+	}
+
+	fprintf(stdout,"static const struct prebuilt_size prebuilt_sizes[PREBUILT_SIZES] = {\n");
+	for (int s = 0; s < count; s++) fprintf(stdout,"\t{ %d, %d, %d, %d, prebuilt_%d },\n", sizes[s], height[s], display[s], n[s], sizes[s]);
+	fprintf(stdout,"};\n");
+
+	TTF_Quit();
+	SDL_Quit();
+	fprintf(stderr,"%d sizes, %lu bytes of coverage\n", count, out_bytes);
+	return 0;
+}
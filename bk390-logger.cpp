@@ -0,0 +1,907 @@
+/*
+ * BK390A headless logger
+ *
+ * Acquisition and the reading log without SDL, TTF or the font, for
+ * leaving a meter logging on a small single board computer.  Built
+ * with 'make -f Makefile.sdl2 headless' it's a static binary with the
+ * log's static block index, and everything it needs per meter (the
+ * frame buffers, readings, log batches and rollup buckets) is in
+ * static storage sized by BK390_METERS_MAX, so once the ports are
+ * open and the log writers set up nothing more comes off the heap
+ * however long it runs.
+ *
+ * -r reports the footprint every so many seconds, and always at
+ * exit: binary size, resident set, heap in use and CPU per reading.
+ *
+ * -T shows a dashboard of the meters on the terminal instead of
+ * printing the readings, see struct tui.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "bk390.h"
+#include "bk390log.h"
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define FL __FILE__,__LINE__
+
+#define TEXT_SIZE 64
+
+/*
+ * Terminal dashboard, -T
+ *
+ * For watching the meters over SSH.  Everything is drawn in to a
+ * grid of cells, which is compared with the grid the terminal is
+ * known to be showing and only the runs of cells that differ are
+ * sent, with plain ANSI cursor moves and colours, no curses.
+ *
+ * The terminal is opened a second time non-blocking, and a frame is
+ * only drawn once the previous one has been fully written and the
+ * -Tr interval is up.  A slow link gets fewer frames and never
+ * makes the poll loop wait, so it can't hold up the meters.  stderr
+ * goes through a pipe while it's up and the latest line is shown at
+ * the bottom rather than scribbling over the screen.
+ */
+#define TUI_ROWS 64
+#define TUI_COLS 256
+#define TUI_OUT_SIZE (128 * 1024)
+#define TUI_HISTORY 256              // readings kept per meter for the sparkline
+
+#define TUI_NORMAL 0
+#define TUI_BOLD 1
+#define TUI_DIM 2
+#define TUI_RED 3
+#define TUI_GREEN 4
+
+struct tui_cell {
+	uint16_t ch;
+	uint8_t attr;
+};
+
+struct tui {
+	int fd;                          // the terminal, -1 when off
+	int err_fd;                      // read end of the stderr pipe
+	int saved_stderr;
+	int rows, cols;
+	uint64_t interval_us;
+	uint64_t last_draw;
+	int valid;                       // front is what the terminal shows
+
+	struct tui_cell front[TUI_ROWS][TUI_COLS];
+	struct tui_cell back[TUI_ROWS][TUI_COLS];
+	char out[TUI_OUT_SIZE];          // written, not yet taken by the terminal
+	int out_len, out_pos;
+	int attr;                        // last SGR sent, -1 unknown
+
+	char msg[TUI_COLS];              // latest stderr line
+	char err[512];
+	int err_len;
+
+	double hist[BK390_METERS_MAX][TUI_HISTORY];  // SI, NaN for OL
+	int hist_n[BK390_METERS_MAX];
+	int hist_head[BK390_METERS_MAX];
+	uint8_t hist_function[BK390_METERS_MAX];
+	uint8_t hist_range[BK390_METERS_MAX];
+
+	unsigned long frames, skipped, bytes;
+};
+
+struct logger {
+	int quiet;
+	int report_secs;
+	char *output_file;
+	char tfn[BKLOG_PATH_SIZE];
+	const struct bk390_protocol *protocol;
+	struct bk390_filter_config filter;
+	struct bk390_cal cal;
+
+	struct bk390 bk;
+	struct bklog_config log;
+	struct bklog_writer log_w[BK390_METERS_MAX];
+	int logging;
+
+	char text[BK390_METERS_MAX][TEXT_SIZE];   // last reading shown per meter
+	int dashboard;
+	struct tui tui;
+	unsigned long readings;
+	uint64_t last_report;
+	double cpu_start;
+};
+
+/*
+ * Static, so none of it is on the heap or the stack
+ */
+static struct logger lg;
+static char stdout_buf[BUFSIZ];
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t resized;
+
+static void quit_signal(int sig) {
+	(void)sig;
+	quit = 1;
+}
+
+static void resize_signal(int sig) {
+	(void)sig;
+	resized = 1;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BK390A headless logger\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" [-p <comport#>] [-s <serial port config>] [-L <directory>] [-d] [-q]\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t              repeat -p for more meters, max %d\r\n"
+			"\t-P <bk390a|es51922|auto>: protocol of the meters on the -p ports that follow (default bk390a)\r\n"
+			"\t-a <none|ema[:alpha]|median[:N]|kalman[:q,r]>: smoothing filter for the meters on the -p ports that follow,\r\n"
+			"\t              the readings shown are filtered, the log keeps the raw ones\r\n"
+			"\t-C <certificate|none>: calibration for the meters on the -p ports that follow, the log keeps\r\n"
+			"\t              the calibrated readings, bk390-recal changes them for a new certificate\r\n"
+			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
+			"\t-L <directory>: log readings in to segments in this directory\r\n"
+			"\t-Ls <MB>: rotate segments at this size (default 64)\r\n"
+			"\t-Lt <secs>: rotate segments at this age (default 3600)\r\n"
+			"\t-Lf <none|rotate|secs>: fsync segments never, on rotation, or every secs (default rotate)\r\n"
+			"\t-Lb <readings>: readings buffered per write (default 64, max %d)\r\n"
+			"\t-o <filename>: write the first meter's reading to this file when it doesn't exist\r\n"
+			"\t-r <secs>: report the footprint every secs as well as at exit\r\n"
+			"\t-T: dashboard of the meters on the terminal instead of the readings\r\n"
+			"\t-Tr <Hz>: most times a second the dashboard is redrawn (default 4)\r\n"
+			"\t-d: debug enabled\r\n"
+			"\t-q: quiet, don't print the readings\r\n"
+			"\r\n"
+			"\texample: bk390-logger -p /dev/ttyUSB0 -L /var/log/bk390 -Lf 60 -q\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			, BK390_METERS_MAX
+			, BKLOG_BATCH_MAX
+			);
+}
+
+void parse_parameters(struct logger *l, int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+		switch (argv[i][1]) {
+			case 'h': show_help(); exit(0);
+			case 'd': l->bk.debug = 1; break;
+			case 'q': l->quiet = 1; break;
+
+			case 'p':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -p <comport>\n");
+					exit(1);
+				}
+				if (l->bk.count >= BK390_METERS_MAX) {
+					fprintf(stdout,"Too many meters, max %d\n", BK390_METERS_MAX);
+					exit(1);
+				}
+				{
+					int m = bk390_add(&l->bk, argv[i]);
+					bk390_set_protocol(&l->bk, m, l->protocol);
+					bk390_set_filter(&l->bk, m, &l->filter);
+					bk390_set_cal(&l->bk, m, &l->cal);
+				}
+				break;
+
+			case 'C':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -C <certificate|none>\n");
+					exit(1);
+				}
+				if (strcmp(argv[i], "none") == 0) bk390_cal_identity(&l->cal);
+				else if (bk390_cal_load(&l->cal, argv[i]) != 0) exit(1);
+				break;
+
+			case 'a':
+				i++;
+				if (i >= argc || bk390_filter_parse(&l->filter, argv[i]) != 0) {
+					fprintf(stdout,"Insufficient parameters; -a <none|ema[:alpha]|median[:N]|kalman[:q,r]>\n");
+					exit(1);
+				}
+				break;
+
+			case 'P':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -P <bk390a|es51922|auto>\n");
+					exit(1);
+				}
+				if (strcmp(argv[i], "auto") == 0) {
+					l->protocol = NULL;
+				} else {
+					l->protocol = bk390_protocol_find(argv[i]);
+					if (!l->protocol) {
+						fprintf(stdout,"Unknown protocol '%s'\n", argv[i]);
+						exit(1);
+					}
+				}
+				break;
+
+			case 's':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -s <parameters> [eg 9600:8o1]\n");
+					exit(1);
+				}
+				l->bk.params = argv[i];
+				break;
+
+			case 'o':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -o <output file>\n");
+					exit(1);
+				}
+				l->output_file = argv[i];
+				break;
+
+			case 'T':
+				l->dashboard = 1;
+				if (argv[i][2] != 'r') break;
+				i++;
+				if (i >= argc || atof(argv[i]) <= 0.0) {
+					fprintf(stdout,"Insufficient parameters; -Tr <Hz>\n");
+					exit(1);
+				}
+				l->tui.interval_us = 1e6 / atof(argv[i]);
+				break;
+
+			case 'r':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; -r <seconds>\n");
+					exit(1);
+				}
+				l->report_secs = atoi(argv[i]);
+				break;
+
+			case 'L':
+				i++;
+				if (i >= argc) {
+					fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "value" : "directory");
+					exit(1);
+				}
+				if (argv[i-1][2] == 's') {
+					l->log.rotate_bytes = (uint64_t)atoi(argv[i]) * 1024 * 1024;
+				} else if (argv[i-1][2] == 't') {
+					l->log.rotate_us = (uint64_t)atoi(argv[i]) * 1000000;
+				} else if (argv[i-1][2] == 'f') {
+					if (strcmp(argv[i], "none") == 0) l->log.fsync_mode = BKLOG_FSYNC_NONE;
+					else if (strcmp(argv[i], "rotate") == 0) l->log.fsync_mode = BKLOG_FSYNC_ROTATE;
+					else {
+						l->log.fsync_mode = BKLOG_FSYNC_INTERVAL;
+						l->log.fsync_us = (uint64_t)(atof(argv[i]) * 1000000);
+					}
+				} else if (argv[i-1][2] == 'b') {
+					l->log.batch = atoi(argv[i]);
+					if (l->log.batch < 1) l->log.batch = 1;
+					if (l->log.batch > BKLOG_BATCH_MAX) l->log.batch = BKLOG_BATCH_MAX;
+				} else {
+					l->log.dir = argv[i];
+				}
+				break;
+
+			default:
+				fprintf(stdout,"Unknown parameter '%s'\n", argv[i]);
+				show_help();
+				exit(1);
+		}
+	}
+}
+
+/*
+ * Footprint, read with open()/read() in to the stack rather than
+ * through stdio so the report itself doesn't allocate
+ */
+static long proc_kb(const char *path, const char *key) {
+	char buf[2048], *p;
+	ssize_t n;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return -1;
+	buf[n] = '\0';
+	p = strstr(buf, key);
+	if (!p) return -1;
+	return atol(p + strlen(key));
+}
+
+static double cpu_us(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void report(struct logger *l) {
+	struct mallinfo2 mi = mallinfo2();
+	struct stat st;
+	long rss = proc_kb("/proc/self/status", "VmRSS:");
+	long hwm = proc_kb("/proc/self/status", "VmHWM:");
+	double cpu = cpu_us() - l->cpu_start;
+
+	if (stat("/proc/self/exe", &st) != 0) st.st_size = 0;
+	fprintf(stderr,"footprint: binary %ldkB, rss %ldkB (peak %ldkB, %ldkB per meter), heap %zukB, static %zukB, %lu readings, %.1fus cpu per reading\n"
+			, (long)st.st_size / 1024
+			, rss, hwm, l->bk.count ? rss / l->bk.count : rss
+			, mi.uordblks / 1024
+			, sizeof(lg) / 1024
+			, l->readings
+			, l->readings ? cpu / l->readings : 0.0
+			);
+}
+
+/*
+ * Same as bk390-sdl2 -o, written only when the reader has taken
+ * the last one away
+ */
+static void output_write(struct logger *l) {
+	struct stat st;
+	int fd, n;
+
+	if (stat(l->output_file, &st) == 0) return;
+	fd = open(l->tfn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return;
+	n = strlen(l->text[0]);
+	if (write(fd, l->text[0], n) != n) fprintf(stderr,"%s:%d: Short write to '%s'\n", FL, l->tfn);
+	close(fd);
+	rename(l->tfn, l->output_file);
+}
+
+/*
+ * Terminal dashboard, see struct tui
+ */
+static void tui_size(struct tui *t) {
+	struct winsize ws;
+
+	t->rows = 24;
+	t->cols = 80;
+	if (ioctl(t->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+		t->rows = ws.ws_row;
+		t->cols = ws.ws_col;
+	}
+	if (t->rows > TUI_ROWS) t->rows = TUI_ROWS;
+	if (t->cols > TUI_COLS) t->cols = TUI_COLS;
+}
+
+static void tui_out(struct tui *t, const char *s, int n) {
+	if (t->out_len + n > TUI_OUT_SIZE) {
+		t->valid = 0; // lost some, redraw everything next time
+		return;
+	}
+	memcpy(t->out + t->out_len, s, n);
+	t->out_len += n;
+}
+
+static void tui_outs(struct tui *t, const char *s) {
+	tui_out(t, s, strlen(s));
+}
+
+static int tui_open(struct tui *t) {
+	struct sigaction sa;
+	int p[2];
+
+	if (!isatty(STDOUT_FILENO)) {
+		fprintf(stderr,"%s:%d: -T needs stdout to be a terminal\n", FL);
+		return -1;
+	}
+
+	/*
+	 * A second open of the terminal has file status flags of its
+	 * own, so it can be non-blocking without the shell's stdout
+	 * being left non-blocking after we exit
+	 */
+	t->fd = open(ttyname(STDOUT_FILENO), O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (t->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open the terminal (%s)\n", FL, strerror(errno));
+		return -1;
+	}
+	if (!t->interval_us) t->interval_us = 250000;
+	tui_size(t);
+
+	/*
+	 * libbk390's messages (ports opening, -d frame dumps) go to
+	 * stderr too, and end up on the dashboard's message line
+	 * rather than over it.  A full pipe loses them rather than
+	 * holding up the meters.
+	 */
+	t->err_fd = t->saved_stderr = -1;
+	if (pipe(p) == 0) {
+		fcntl(p[0], F_SETFL, O_NONBLOCK);
+		fcntl(p[1], F_SETFL, O_NONBLOCK);
+		fcntl(p[0], F_SETFD, FD_CLOEXEC);
+		t->saved_stderr = dup(STDERR_FILENO);
+		dup2(p[1], STDERR_FILENO);
+		close(p[1]);
+		t->err_fd = p[0];
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = resize_signal;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	tui_outs(t, "\x1b[?1049h\x1b[?25l\x1b[2J");
+	t->valid = 0;
+	t->attr = -1;
+	return 0;
+}
+
+/*
+ * Puts the screen back the way it was, blocking, it's the last
+ * thing written
+ */
+static void tui_close(struct tui *t) {
+	int flags;
+
+	if (t->fd < 0) return;
+	flags = fcntl(t->fd, F_GETFL);
+	fcntl(t->fd, F_SETFL, flags & ~O_NONBLOCK);
+	tui_outs(t, "\x1b[0m\x1b[?25h\x1b[?1049l");
+	while (t->out_pos < t->out_len) {
+		ssize_t n = write(t->fd, t->out + t->out_pos, t->out_len - t->out_pos);
+		if (n <= 0) break;
+		t->out_pos += n;
+	}
+	close(t->fd);
+	t->fd = -1;
+
+	if (t->saved_stderr >= 0) {
+		dup2(t->saved_stderr, STDERR_FILENO);
+		close(t->saved_stderr);
+		close(t->err_fd);
+		if (t->msg[0]) fprintf(stderr,"%s\n", t->msg);
+	}
+}
+
+/*
+ * The terminal when there's something to write, and stderr
+ */
+static int tui_pollfds(struct tui *t, struct pollfd *pfd) {
+	int n = 0;
+
+	if (t->fd < 0) return 0;
+	pfd[n].fd = t->fd;
+	pfd[n].events = t->out_pos < t->out_len ? POLLOUT : 0;
+	pfd[n++].revents = 0;
+	if (t->err_fd >= 0) {
+		pfd[n].fd = t->err_fd;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+	return n;
+}
+
+static void tui_poll(struct tui *t, struct pollfd *pfd) {
+	if (t->fd < 0) return;
+
+	if (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+		ssize_t n = write(t->fd, t->out + t->out_pos, t->out_len - t->out_pos);
+		if (n > 0) {
+			t->out_pos += n;
+			t->bytes += n;
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			t->out_pos = t->out_len; // terminal's gone, don't spin on it
+		}
+		if (t->out_pos == t->out_len) t->out_pos = t->out_len = 0;
+	}
+
+	/*
+	 * Keep the last complete line written to stderr
+	 */
+	if (t->err_fd >= 0 && (pfd[1].revents & POLLIN)) {
+		ssize_t n;
+
+		while ((n = read(t->err_fd, t->err + t->err_len, sizeof(t->err) - 1 - t->err_len)) > 0) {
+			char *nl;
+
+			t->err_len += n;
+			t->err[t->err_len] = '\0';
+			while ((nl = strchr(t->err, '\n')) != NULL) {
+				*nl = '\0';
+				if (nl > t->err && nl[-1] == '\r') nl[-1] = '\0';
+				if (t->err[0]) snprintf(t->msg, sizeof(t->msg), "%s", t->err);
+				t->err_len -= nl + 1 - t->err;
+				memmove(t->err, nl + 1, t->err_len + 1);
+			}
+			if (t->err_len == (int)sizeof(t->err) - 1) t->err_len = 0;
+		}
+	}
+}
+
+/*
+ * Latest reading of meter m for the sparkline, the trend restarts
+ * when the meter moves to another function or range
+ */
+static void tui_history(struct tui *t, int m, const struct bk390_reading *r) {
+	uint8_t range = r->d[BYTE_RANGE] & 0x0F;
+
+	if (t->hist_n[m] && (t->hist_function[m] != r->d[BYTE_FUNCTION] || t->hist_range[m] != range)) t->hist_n[m] = 0;
+	t->hist_function[m] = r->d[BYTE_FUNCTION];
+	t->hist_range[m] = range;
+
+	t->hist[m][t->hist_head[m]] = r->ol ? NAN : r->fsi;
+	t->hist_head[m] = (t->hist_head[m] + 1) % TUI_HISTORY;
+	if (t->hist_n[m] < TUI_HISTORY) t->hist_n[m]++;
+}
+
+/*
+ * UTF-8 in to the back grid at row, col, clipped to the screen.
+ * Returns the column after it.
+ */
+static int tui_put(struct tui *t, int row, int col, int attr, const char *s) {
+	const uint8_t *p = (const uint8_t *)s;
+
+	while (*p && row < t->rows && col < t->cols) {
+		uint16_t c;
+
+		if (p[0] < 0x80) {
+			c = *p++;
+		} else if ((p[0] & 0xE0) == 0xC0 && p[1]) {
+			c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+			p += 2;
+		} else if ((p[0] & 0xF0) == 0xE0 && p[1] && p[2]) {
+			c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+			p += 3;
+		} else {
+			c = '?';
+			p++;
+		}
+		t->back[row][col].ch = c;
+		t->back[row][col].attr = attr;
+		col++;
+	}
+	return col;
+}
+
+static void tui_sparkline(struct tui *t, int m, int row, int col, int width) {
+	static const uint16_t bars[] = { 0x2581, 0x2582, 0x2583, 0x2584, 0x2585, 0x2586, 0x2587, 0x2588 };
+	int n = t->hist_n[m] < width ? t->hist_n[m] : width;
+	double lo = NAN, hi = NAN;
+
+	for (int k = 0; k < n; k++) {
+		double v = t->hist[m][(t->hist_head[m] - n + k + TUI_HISTORY) % TUI_HISTORY];
+		if (isnan(v)) continue;
+		if (isnan(lo) || v < lo) lo = v;
+		if (isnan(hi) || v > hi) hi = v;
+	}
+	for (int k = 0; k < n && col + k < t->cols; k++) {
+		double v = t->hist[m][(t->hist_head[m] - n + k + TUI_HISTORY) % TUI_HISTORY];
+		struct tui_cell *c = &t->back[row][col + k];
+
+		c->attr = TUI_GREEN;
+		if (isnan(v)) c->ch = ' ';
+		else if (hi == lo) c->ch = bars[3];
+		else c->ch = bars[(int)((v - lo) / (hi - lo) * 7.0 + 0.5)];
+	}
+}
+
+static const char *tui_sgr(int attr) {
+	switch (attr) {
+		case TUI_BOLD: return "\x1b[0;1m";
+		case TUI_DIM: return "\x1b[0;2m";
+		case TUI_RED: return "\x1b[0;1;31m";
+		case TUI_GREEN: return "\x1b[0;32m";
+	}
+	return "\x1b[0m";
+}
+
+/*
+ * Send the cells that differ from what the terminal has.  Runs of a
+ * few unchanged cells between changes are sent anyway, that's
+ * cheaper than another cursor move.
+ */
+static void tui_flush(struct tui *t) {
+	char buf[32];
+
+	if (!t->valid) {
+		tui_outs(t, "\x1b[0m\x1b[2J");
+		t->attr = -1;
+		for (int r = 0; r < TUI_ROWS; r++) {
+			for (int c = 0; c < TUI_COLS; c++) {
+				t->front[r][c].ch = ' ';
+				t->front[r][c].attr = TUI_NORMAL;
+			}
+		}
+		t->valid = 1;
+	}
+
+	for (int r = 0; r < t->rows; r++) {
+		int c = 0;
+
+		while (c < t->cols) {
+			int end, same;
+
+			if (t->front[r][c].ch == t->back[r][c].ch && t->front[r][c].attr == t->back[r][c].attr) {
+				c++;
+				continue;
+			}
+
+			end = c;
+			same = 0;
+			for (int k = c; k < t->cols && same < 4; k++) {
+				if (t->front[r][k].ch == t->back[r][k].ch && t->front[r][k].attr == t->back[r][k].attr) same++;
+				else {
+					same = 0;
+					end = k + 1;
+				}
+			}
+
+			tui_out(t, buf, snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, c + 1));
+			for (; c < end; c++) {
+				struct tui_cell *b = &t->back[r][c];
+				uint16_t ch = b->ch;
+
+				if (b->attr != t->attr) {
+					tui_outs(t, tui_sgr(b->attr));
+					t->attr = b->attr;
+				}
+				if (ch < 0x80) {
+					buf[0] = ch;
+					tui_out(t, buf, 1);
+				} else if (ch < 0x800) {
+					buf[0] = 0xC0 | (ch >> 6);
+					buf[1] = 0x80 | (ch & 0x3F);
+					tui_out(t, buf, 2);
+				} else {
+					buf[0] = 0xE0 | (ch >> 12);
+					buf[1] = 0x80 | ((ch >> 6) & 0x3F);
+					buf[2] = 0x80 | (ch & 0x3F);
+					tui_out(t, buf, 3);
+				}
+				t->front[r][c] = *b;
+			}
+		}
+	}
+}
+
+/*
+ * Three rows per meter: reading, stats, link counters and the trend
+ */
+static void tui_draw(struct logger *l, uint64_t now) {
+	struct tui *t = &l->tui;
+	char buf[TUI_COLS + 1];
+	time_t secs = now / 1000000;
+	struct tm tm;
+	int row = 2;
+
+	if (resized) {
+		resized = 0;
+		tui_size(t);
+		t->valid = 0;
+	}
+
+	for (int r = 0; r < TUI_ROWS; r++) {
+		for (int c = 0; c < TUI_COLS; c++) {
+			t->back[r][c].ch = ' ';
+			t->back[r][c].attr = TUI_NORMAL;
+		}
+	}
+
+	localtime_r(&secs, &tm);
+	strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+	tui_put(t, 0, 0, TUI_BOLD, "bk390-logger");
+	tui_put(t, 0, 14, TUI_NORMAL, buf);
+	snprintf(buf, sizeof(buf), "%d meter%s  %lu readings  log %s  %lu frames drawn, %lu skipped"
+			, l->bk.count, l->bk.count == 1 ? "" : "s", l->readings, l->logging ? l->log.dir : "off", t->frames, t->skipped);
+	tui_put(t, 0, 24, TUI_DIM, buf);
+
+	for (int m = 0; m < l->bk.count && row + 3 <= t->rows - 1; m++, row += 3) {
+		struct bk390_meter *mt = &l->bk.meter[m];
+		struct bk390_reading *r = &mt->r;
+		struct bk390_stats *s = &mt->stats;
+		int col;
+
+		snprintf(buf, sizeof(buf), "M%d %s", m, mt->serial.device ? mt->serial.device : "");
+		tui_put(t, row, 0, TUI_BOLD, buf);
+		if (mt->comms_error) {
+			tui_put(t, row, 24, TUI_RED, "COM.FLT");
+		} else if (mt->dt_loaded) {
+			double age = (now - r->ts) / 1e6;
+
+			col = tui_put(t, row, 24, r->ol ? TUI_RED : TUI_BOLD, r->ftext);
+			col = tui_put(t, row, col + 2, TUI_NORMAL, r->mmmode);
+			if (age >= 2.0) {
+				snprintf(buf, sizeof(buf), "%.0fs old", age);
+				tui_put(t, row, col + 2, TUI_RED, buf);
+			}
+		} else {
+			tui_put(t, row, 24, TUI_DIM, "waiting");
+		}
+
+		if (s->count > s->ol) {
+			const struct bk390_sketch *sk = bk390_sketch_find(&l->bk, m, s->function, s->range);
+
+			col = snprintf(buf, sizeof(buf), "   min %.6g  max %.6g  mean %.6g  sd %.3g", s->min, s->max, s->mean, bk390_stats_stddev(s));
+			if (sk) {
+				col += snprintf(buf + col, sizeof(buf) - col, "  p1 %.6g  p50 %.6g  p99 %.6g"
+						, bk390_sketch_quantile(sk, 0.01), bk390_sketch_quantile(sk, 0.5), bk390_sketch_quantile(sk, 0.99));
+			}
+			snprintf(buf + col, sizeof(buf) - col, "  n %lu  ol %lu  %s", s->count, s->ol, r->units);
+			tui_put(t, row + 1, 0, TUI_NORMAL, buf);
+		}
+
+		snprintf(buf, sizeof(buf), "   frames %lu  bad %lu  repeated %lu  errors %lu  reconnects %lu"
+				, mt->frames, mt->frames_invalid, mt->frames_repeated, mt->comms_errors, mt->reconnects);
+		col = tui_put(t, row + 2, 0, TUI_DIM, buf) + 2;
+		if (t->cols - col >= 8) tui_sparkline(t, m, row + 2, col, t->cols - col);
+	}
+
+	tui_put(t, t->rows - 1, 0, TUI_DIM, t->msg);
+	tui_flush(t);
+	t->frames++;
+}
+
+/*
+ * A frame is drawn when the interval is up and the terminal has
+ * taken all of the last one, returns how long poll() can wait
+ */
+static int tui_tick(struct logger *l, uint64_t now) {
+	struct tui *t = &l->tui;
+	uint64_t due = t->last_draw + t->interval_us;
+
+	if (t->fd < 0) return 250;
+	if (now < due) return (due - now) / 1000 + 1;
+	if (t->out_len) {
+		t->skipped++;
+		t->last_draw = now;
+		return t->interval_us / 1000;
+	}
+	tui_draw(l, now);
+	t->last_draw = now;
+	return t->interval_us / 1000;
+}
+
+/*
+ * libbk390 callback, fresh readings are logged and printed
+ */
+static void logger_reading(struct bk390 *b, int m, struct bk390_reading *r, int fresh, void *user) {
+	struct logger *l = (struct logger *)user;
+	struct bklog_record lr;
+
+	(void)b;
+	if (!fresh) return;
+	l->readings++;
+	snprintf(l->text[m], TEXT_SIZE, "%s", r->ftext);
+	if (l->dashboard) tui_history(&l->tui, m, r);
+
+	if (l->logging) {
+		memset(&lr, 0, sizeof(lr));
+		lr.ts = r->ts;
+		lr.counts = r->counts;
+		lr.meter = r->meter;
+		lr.function = r->d[BYTE_FUNCTION];
+		lr.range = r->d[BYTE_RANGE] & 0x0F;
+		lr.status = r->d[BYTE_STATUS] & 0x0F;
+		lr.option1 = r->d[BYTE_OPTION_1] & 0x0F;
+		lr.option2 = r->d[BYTE_OPTION_2] & 0x0F;
+		lr.dps = r->dps;
+		lr.exponent = r->exponent;
+		bklog_write(&l->log_w[m], &lr);
+	}
+
+	if (!l->quiet && !l->dashboard) {
+		fprintf(stdout,"%llu.%06u %d %s\n", (unsigned long long)(r->ts / 1000000), (unsigned int)(r->ts % 1000000), m, r->ftext);
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct sigaction sa;
+	struct pollfd pfd[BK390_METERS_MAX + 2];
+	unsigned long records = 0, segments = 0, errors = 0;
+
+	setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+
+	bk390_init(&lg.bk);
+	lg.protocol = &bk390_protocols[0];
+	lg.log.rotate_bytes = 64 * 1024 * 1024;
+	lg.log.rotate_us = 3600ULL * 1000000;
+	lg.log.fsync_mode = BKLOG_FSYNC_ROTATE;
+	lg.log.batch = 64;
+
+	parse_parameters(&lg, argc, argv);
+
+	if (lg.bk.count == 0) {
+		int m = bk390_add(&lg.bk, NULL);
+		bk390_set_protocol(&lg.bk, m, lg.protocol);
+		bk390_set_filter(&lg.bk, m, &lg.filter);
+		bk390_set_cal(&lg.bk, m, &lg.cal);
+	}
+	lg.tui.fd = -1;
+	if (lg.dashboard) lg.bk.show_mode = 1;
+	if (lg.output_file) snprintf(lg.tfn, sizeof(lg.tfn), "%s.tmp", lg.output_file);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = quit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (lg.log.dir) {
+		mkdir(lg.log.dir, 0755);
+		if (bklog_dir_lock(lg.log.dir) != 0) exit(1);
+		for (int m = 0; m < lg.bk.count; m++) bklog_writer_init(&lg.log_w[m], &lg.log, m);
+		bklog_compressor_start(&lg.log);
+		lg.logging = 1;
+	}
+
+	bk390_set_callback(&lg.bk, logger_reading, &lg);
+	for (int m = 0; m < lg.bk.count; m++) {
+		if (bk390_open(&lg.bk, m) < 0) exit(1); // only a port that later goes away gets retried
+	}
+	if (lg.dashboard && tui_open(&lg.tui) != 0) exit(1);
+
+	lg.cpu_start = cpu_us();
+	lg.last_report = bk390_now_us();
+
+	while (!quit) {
+		uint64_t now;
+		int nfds = bk390_pollfds(&lg.bk, pfd);
+		int tfds = tui_pollfds(&lg.tui, pfd + nfds);
+		int timeout = tui_tick(&lg, bk390_now_us());
+
+		if (timeout > 250) timeout = 250;
+		if (poll(pfd, nfds + tfds, timeout) > 0) {
+			if (bk390_process(&lg.bk, pfd) && lg.output_file) output_write(&lg);
+			tui_poll(&lg.tui, pfd + nfds);
+		}
+
+		now = bk390_now_us();
+		bk390_tick(&lg.bk, now);
+		if (lg.logging) {
+			for (int m = 0; m < lg.bk.count; m++) bklog_tick(&lg.log_w[m], now);
+		}
+
+		if (lg.report_secs > 0 && now - lg.last_report >= (uint64_t)lg.report_secs * 1000000) {
+			report(&lg);
+			lg.last_report = now;
+		}
+	}
+
+	bk390_close(&lg.bk);
+	tui_close(&lg.tui);
+
+	if (lg.logging) {
+		for (int m = 0; m < lg.bk.count; m++) {
+			bklog_writer_close(&lg.log_w[m]);
+			records += lg.log_w[m].records;
+			segments += lg.log_w[m].segments;
+			errors += lg.log_w[m].errors;
+		}
+		bklog_compressor_drain();
+		if (!lg.quiet) fprintf(stderr,"log: %lu readings in %lu segments, %lu errors\n", records, segments, errors);
+	}
+
+	report(&lg);
+
+	return 0;
+}
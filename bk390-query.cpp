@@ -0,0 +1,677 @@
+/*
+ * BK390A log query
+ *
+ * Pulls the readings for a time range (and optionally a value
+ * range) out of a -L log directory.  Compressed segments are
+ * located through their block index and blocks whose min/max
+ * can't satisfy the value range are skipped without decoding.
+ *
+ * With -r the readings are bucketed to that resolution and served
+ * from the coarsest rollup tier that's fine enough, falling back to
+ * the raw readings when no tier divides it (under 10s).
+ *
+ * With -e the readings are exported as sigrok sessions instead of
+ * printed, one thread per meter each streaming its meter's segments
+ * through a bksr_writer, so memory stays at a chunk per meter
+ * however long the capture.
+ *
+ * With -p the readings go in to a quantile sketch per meter,
+ * function and range for each segment, and the segments' sketches
+ * are merged (and then the meters') for p1/p50/p99 over the whole
+ * selection in a fixed amount of memory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "bk390.h"
+#include "bk390log.h"
+#include "bk390sr.h"
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+/*
+ * A sketch per meter, function and range for -p
+ */
+struct pct_key {
+	int meter;
+	uint8_t function;
+	uint8_t range;
+	struct bk390_sketch s;
+};
+
+struct query {
+	char *dir;
+	int meter;            // -1 for all
+	uint64_t from, to;
+	double gt, lt;        // NaN when not set
+	int ol;               // only OL readings
+	int quiet;
+
+	uint64_t res;         // -r bucket width, 0 for raw readings
+	struct bklog_rollup out;
+
+	char *export_prefix;  // -e, sigrok sessions rather than printing
+	unsigned int samplerate;
+
+	int pct;              // -p, percentiles rather than readings
+	struct pct_key *seg;  // sketches of the segment being read
+	struct pct_key *total;
+	int nseg, ntotal, size;
+
+	unsigned long files, blocks, skipped, matches, readings;
+	unsigned long sessions, errors;
+};
+
+static const char *function_units(uint8_t function) {
+	switch (function) {
+		case 0b00111011: return "V";
+		case 0b00111101:
+		case 0b00111001:
+		case 0b00111111: return "A";
+		case 0b00110011: return "Ω";
+		case 0b00110110: return "F";
+		case 0b00110010: return "Hz";
+		case 0b00110100: return "\u00B0C";
+	}
+	return "";
+}
+
+/*
+ * Units as the decoder would have shown them, voltage carries AC/DC
+ */
+static void record_units(const struct bklog_record *r, char *units, size_t size) {
+	const char *acdc = "";
+
+	if (r->function == 0b00111011) {
+		if (r->option2 & 0x04) acdc = "AC";
+		else if (r->option2 & 0x08) acdc = "DC";
+	}
+	snprintf(units, size, "%s%s", function_units(r->function), acdc);
+}
+
+void show_help(void) {
+	fprintf(stdout,"BK390A log query\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			"\t-d <directory>: log directory written by bk390-sdl2 -L\r\n"
+			"\t-m <meter>: only this meter (default all)\r\n"
+			"\t-f <time>: from, epoch seconds or \"YYYY-MM-DD HH:MM[:SS]\" local time\r\n"
+			"\t-t <time>: to, as for -f\r\n"
+			"\t-gt <value>: only readings above this, in SI units (V, A, Ω..)\r\n"
+			"\t-lt <value>: only readings below this\r\n"
+			"\t-ol: only overload readings\r\n"
+			"\t-r <seconds>: min/max/mean/count per bucket of this width, from the rollups where possible\r\n"
+			"\t              -gt/-lt/-ol then select the buckets holding such readings\r\n"
+			"\t-e <prefix>: export sigrok sessions <prefix>-m<meter>-<time>.sr for PulseView rather than printing\r\n"
+			"\t             the value range is ignored, overloads are NaN\r\n"
+			"\t-es <Hz>: samplerate of the export (default 10)\r\n"
+			"\t-p: count, min, p1, p50, p99 and max per meter, function and range rather than the readings\r\n"
+			"\t    and the same over all the meters, within 1%% of the true value\r\n"
+			"\t-q: no summary\r\n"
+			"\r\n"
+			"\texample: bk390-query -d logs -m 0 -f \"2026-10-16 02:14\" -t \"2026-10-16 02:20\" -gt 12.5\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+static uint64_t parse_time(const char *s) {
+	const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL };
+	struct tm tm;
+
+	if (strspn(s, "0123456789.") == strlen(s)) return (uint64_t)(atof(s) * 1000000);
+
+	for (int i = 0; formats[i]; i++) {
+		const char *e;
+		memset(&tm, 0, sizeof(tm));
+		e = strptime(s, formats[i], &tm);
+		if (e && *e == '\0') {
+			tm.tm_isdst = -1;
+			return (uint64_t)mktime(&tm) * 1000000;
+		}
+	}
+
+	fprintf(stdout,"Unable to parse time '%s'\n", s);
+	exit(1);
+}
+
+static int match(struct query *q, const struct bklog_record *r) {
+	double v;
+
+	if (r->ts < q->from || r->ts > q->to) return 0;
+	if (q->res) return 1;
+	if (r->status & BKLOG_STATUS_OL) return q->ol;
+	if (q->ol) return 0;
+
+	v = bklog_si(r);
+	if (!isnan(q->gt) && !(v > q->gt)) return 0;
+	if (!isnan(q->lt) && !(v < q->lt)) return 0;
+	return 1;
+}
+
+/*
+ * With -r the value range picks whole buckets, any bucket that has
+ * a reading in range is printed
+ */
+static int bucket_match(struct query *q, const struct bklog_rollup *r) {
+	if (q->ol) return r->ol > 0;
+	if (isnan(q->gt) && isnan(q->lt)) return 1;
+	if (r->count == r->ol) return 0;
+	if (!isnan(q->gt) && !(r->max > q->gt)) return 0;
+	if (!isnan(q->lt) && !(r->min < q->lt)) return 0;
+	return 1;
+}
+
+static void bucket_print(struct query *q) {
+	struct bklog_rollup *o = &q->out;
+	char stamp[32];
+	time_t t;
+	struct tm tm;
+
+	if (!o->count) return;
+	if (!bucket_match(q, o)) {
+		o->count = 0;
+		return;
+	}
+
+	t = o->ts / 1000000;
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	if (o->count == o->ol) {
+		fprintf(stdout,"%s.%06u,%d,,,,%u,%u,%s\n", stamp, (unsigned int)(o->ts % 1000000), o->meter, o->count, o->ol, function_units(o->function));
+	} else {
+		fprintf(stdout,"%s.%06u,%d,%.6g,%.6g,%.6g,%u,%u,%s\n", stamp, (unsigned int)(o->ts % 1000000), o->meter
+				, o->min, o->max, o->sum / (o->count - o->ol), o->count, o->ol, function_units(o->function));
+	}
+	q->matches++;
+	o->count = 0;
+}
+
+/*
+ * Fold a reading or a rollup row in to the -r output bucket
+ */
+static void bucket_add(struct query *q, const struct bklog_rollup *in) {
+	uint64_t start = in->ts - in->ts % q->res;
+	struct bklog_rollup *o = &q->out;
+
+	if (o->count && (o->ts != start || o->meter != in->meter || o->function != in->function || o->range != in->range)) bucket_print(q);
+	if (!o->count) o->ts = start;
+	bklog_rollup_merge(o, in);
+}
+
+/*
+ * The sketch for a key in one of the -p tables, a new one if it
+ * isn't there yet
+ */
+static struct bk390_sketch *pct_find(struct query *q, struct pct_key **keys, int *n, int meter, uint8_t function, uint8_t range) {
+	struct pct_key *k;
+
+	for (int i = 0; i < *n; i++) {
+		k = &(*keys)[i];
+		if (k->meter == meter && k->function == function && k->range == range) return &k->s;
+	}
+
+	/*
+	 * Both tables are grown together, the totals have every key
+	 * a segment could have
+	 */
+	if (*n >= q->size) {
+		q->size = q->size ? q->size * 2 : 16;
+		q->seg = (struct pct_key *)realloc(q->seg, q->size * sizeof(struct pct_key));
+		q->total = (struct pct_key *)realloc(q->total, q->size * sizeof(struct pct_key));
+		if (!q->seg || !q->total) {
+			fprintf(stderr,"Out of memory\n");
+			exit(1);
+		}
+	}
+	k = &(*keys)[(*n)++];
+	k->meter = meter;
+	k->function = function;
+	k->range = range;
+	bk390_sketch_init(&k->s, BK390_SKETCH_ALPHA);
+	return &k->s;
+}
+
+/*
+ * End of a segment, its sketches go in to the totals
+ */
+static void pct_merge(struct query *q) {
+	for (int i = 0; i < q->nseg; i++) {
+		struct bk390_sketch *t = pct_find(q, &q->total, &q->ntotal, q->seg[i].meter, q->seg[i].function, q->seg[i].range);
+
+		/*
+		 * pct_find() can move seg as well
+		 */
+		bk390_sketch_merge(t, &q->seg[i].s);
+	}
+	q->nseg = 0;
+}
+
+static void pct_line(const char *meter, const struct pct_key *k) {
+	const struct bk390_sketch *s = &k->s;
+
+	fprintf(stdout,"%s,%s,%u,%llu,%.6g,%.6g,%.6g,%.6g,%.6g\n", meter, function_units(k->function), k->range, (unsigned long long)s->count
+			, s->min, bk390_sketch_quantile(s, 0.01), bk390_sketch_quantile(s, 0.5), bk390_sketch_quantile(s, 0.99), s->max);
+}
+
+/*
+ * meter,units,range,count,min,p1,p50,p99,max and then "all" lines
+ * with the meters merged, where more than one was on a function and
+ * range
+ */
+static void pct_print(struct query *q) {
+	char meter[16];
+
+	for (int i = 0; i < q->ntotal; i++) {
+		snprintf(meter, sizeof(meter), "%d", q->total[i].meter);
+		pct_line(meter, &q->total[i]);
+		q->matches++;
+	}
+
+	for (int i = 0; i < q->ntotal; i++) {
+		struct pct_key all = q->total[i];
+		int meters = 1, first = 1;
+
+		for (int j = 0; j < q->ntotal && first; j++) {
+			if (q->total[j].function == all.function && q->total[j].range == all.range && j < i) first = 0;
+		}
+		if (!first) continue;
+		for (int j = i + 1; j < q->ntotal; j++) {
+			if (q->total[j].function != all.function || q->total[j].range != all.range) continue;
+			bk390_sketch_merge(&all.s, &q->total[j].s);
+			meters++;
+		}
+		if (meters > 1) pct_line("all", &all);
+	}
+}
+
+static void emit(struct query *q, const struct bklog_record *r) {
+	if (q->pct) {
+		if (!(r->status & BKLOG_STATUS_OL)) {
+			bk390_sketch_add(pct_find(q, &q->seg, &q->nseg, r->meter, r->function, r->range & 0x0F), bklog_si(r));
+			q->readings++;
+		}
+		return;
+	}
+
+	if (q->res) {
+		struct bklog_rollup one;
+
+		memset(&one, 0, sizeof(one));
+		one.ts = r->ts;
+		one.count = 1;
+		one.meter = r->meter;
+		one.function = r->function;
+		one.range = r->range;
+		if (r->status & BKLOG_STATUS_OL) {
+			one.ol = 1;
+			one.min = one.max = NAN;
+		} else {
+			one.min = one.max = one.sum = bklog_si(r);
+		}
+		bucket_add(q, &one);
+		return;
+	}
+
+	char stamp[32];
+	time_t t = r->ts / 1000000;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	if (r->status & BKLOG_STATUS_OL) {
+		fprintf(stdout,"%s.%06u,%d,OL,%s\n", stamp, (unsigned int)(r->ts % 1000000), r->meter, function_units(r->function));
+	} else {
+		fprintf(stdout,"%s.%06u,%d,%.*g,%s\n", stamp, (unsigned int)(r->ts % 1000000), r->meter, 6, bklog_si(r), function_units(r->function));
+	}
+	q->matches++;
+}
+
+/*
+ * Could anything in this block match the value range
+ */
+static int block_may_match(struct query *q, const struct bklog_block *b) {
+	if (b->ts_first > q->to || b->ts_last < q->from) return 0;
+	if (q->res) return 1;
+	if (q->ol) return b->ol > 0;
+	if (b->count == b->ol) return 0;
+	if (!isnan(q->gt) && !(b->max > q->gt)) return 0;
+	if (!isnan(q->lt) && !(b->min < q->lt)) return 0;
+	return 1;
+}
+
+static void query_file(struct query *q, const char *path) {
+	struct bklog_reader rd;
+	struct bklog_record r;
+	uint64_t first, last;
+
+	if (bklog_open(&rd, path) != 0) {
+		fprintf(stderr,"Unable to open '%s', skipping\n", path);
+		return;
+	}
+
+	if (bklog_span(&rd, &first, &last) != 0 || first > q->to || last < q->from) {
+		bklog_close(&rd);
+		return;
+	}
+	q->files++;
+
+	if (!rd.compressed) {
+		if (bklog_seek_ts(&rd, q->from) == 0) {
+			while (bklog_next(&rd, &r) == 0 && r.ts <= q->to) {
+				if (match(q, &r)) emit(q, &r);
+			}
+		}
+		bklog_close(&rd);
+		if (q->pct) pct_merge(q);
+		return;
+	}
+
+	/*
+	 * Compressed, walk the index from the first block that ends
+	 * after -f and only decode the blocks that might match
+	 */
+	bklog_seek_ts(&rd, q->from);
+	for (uint32_t b = rd.block; b < rd.nblocks && rd.blocks[b].ts_first <= q->to; b++) {
+		q->blocks++;
+		if (!block_may_match(q, &rd.blocks[b])) {
+			q->skipped++;
+			continue;
+		}
+		if (b != rd.block) bklog_seek_block(&rd, b);
+		while (rd.block == b && rd.left && bklog_next(&rd, &r) == 0) {
+			if (match(q, &r)) emit(q, &r);
+		}
+	}
+
+	bklog_close(&rd);
+	if (q->pct) pct_merge(q);
+}
+
+static void query_rollups(struct query *q, const char *path, int tier) {
+	struct bklog_rollups rs;
+	uint32_t secs = bklog_tier_secs[tier];
+
+	if (bklog_rollups_open(&rs, path) != 0) {
+		fprintf(stderr,"Unable to open '%s', skipping\n", path);
+		return;
+	}
+	q->files++;
+
+	for (uint64_t i = bklog_rollups_find(&rs, q->from, secs); i < rs.count && rs.r[i].ts <= q->to; i++) {
+		q->blocks++;
+		bucket_add(q, &rs.r[i]);
+	}
+
+	bklog_rollups_close(&rs);
+}
+
+/*
+ * sigrok export, one of these per meter
+ */
+struct exporter {
+	struct query *q;
+	int meter;
+	char **names;
+	int count;
+	pthread_t thread;
+	unsigned long readings;
+	struct bksr_writer w;
+};
+
+static void *export_thread(void *arg) {
+	struct exporter *e = (struct exporter *)arg;
+	struct query *q = e->q;
+	struct bklog_reader rd;
+	struct bklog_record r;
+	uint64_t first, last;
+	char units[16];
+
+	for (int i = 0; i < e->count; i++) {
+		if (bklog_open(&rd, e->names[i]) != 0) {
+			fprintf(stderr,"Unable to open '%s', skipping\n", e->names[i]);
+			continue;
+		}
+		if (bklog_span(&rd, &first, &last) == 0 && first <= q->to && last >= q->from && bklog_seek_ts(&rd, q->from) == 0) {
+			while (bklog_next(&rd, &r) == 0 && r.ts <= q->to) {
+				record_units(&r, units, sizeof(units));
+				bksr_add(&e->w, r.ts, (r.status & BKLOG_STATUS_OL) ? NAN : bklog_si(&r), units);
+				e->readings++;
+			}
+		}
+		bklog_close(&rd);
+	}
+	bksr_writer_close(&e->w);
+	return NULL;
+}
+
+static void export_sessions(struct query *q, char **names, int count) {
+	struct exporter *ex = NULL;
+	int n = 0;
+
+	/*
+	 * names are sorted, so each meter's segments are in time order,
+	 * split them up by meter
+	 */
+	for (int i = 0; i < count; i++) {
+		const char *base = strrchr(names[i], '/');
+		struct exporter *e = NULL;
+		int m;
+
+		if (sscanf(base ? base + 1 : names[i], "bk390-m%d-", &m) != 1) continue;
+		for (int k = 0; k < n; k++) {
+			if (ex[k].meter == m) e = &ex[k];
+		}
+		if (!e) {
+			ex = (struct exporter *)realloc(ex, (n + 1) * sizeof(struct exporter));
+			if (!ex) {
+				fprintf(stderr,"Out of memory\n");
+				exit(1);
+			}
+			e = &ex[n++];
+			memset(e, 0, sizeof(*e));
+			e->q = q;
+			e->meter = m;
+			bksr_writer_init(&e->w, q->export_prefix, m, q->samplerate);
+		}
+		e->names = (char **)realloc(e->names, (e->count + 1) * sizeof(char *));
+		if (!e->names) {
+			fprintf(stderr,"Out of memory\n");
+			exit(1);
+		}
+		e->names[e->count++] = names[i];
+	}
+
+	for (int k = 0; k < n; k++) {
+		if (pthread_create(&ex[k].thread, NULL, export_thread, &ex[k]) != 0) {
+			fprintf(stderr,"Unable to start export thread (%s)\n", strerror(errno));
+			exit(1);
+		}
+	}
+	for (int k = 0; k < n; k++) {
+		pthread_join(ex[k].thread, NULL);
+		q->files += ex[k].count;
+		q->matches += ex[k].readings;
+		q->sessions += ex[k].w.sessions;
+		q->errors += ex[k].w.errors;
+		free(ex[k].names);
+	}
+	free(ex);
+}
+
+static int name_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int main(int argc, char **argv) {
+	struct query q;
+	struct timeval start, end;
+	DIR *dir;
+	struct dirent *de;
+	char **names = NULL;
+	int count = 0, size = 0;
+	int tier;
+
+	memset(&q, 0, sizeof(q));
+	q.meter = -1;
+	q.to = UINT64_MAX;
+	q.gt = q.lt = NAN;
+	q.samplerate = 10;
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+		switch (argv[i][1]) {
+			case 'h': show_help(); exit(0);
+			case 'q': q.quiet = 1; break;
+			case 'o': q.ol = 1; break;
+			case 'p': q.pct = 1; break;
+			case 'd':
+			case 'm':
+			case 'f':
+			case 't':
+			case 'g':
+			case 'l':
+			case 'r':
+			case 'e':
+				if (i + 1 >= argc) {
+					fprintf(stdout,"Insufficient parameters; %s <value>\n", argv[i]);
+					exit(1);
+				}
+				i++;
+				switch (argv[i-1][1]) {
+					case 'd': q.dir = argv[i]; break;
+					case 'm': q.meter = atoi(argv[i]); break;
+					case 'f': q.from = parse_time(argv[i]); break;
+					case 't': q.to = parse_time(argv[i]); break;
+					case 'g': q.gt = atof(argv[i]); break;
+					case 'l': q.lt = atof(argv[i]); break;
+					case 'r': q.res = (uint64_t)(atof(argv[i]) * 1000000); break;
+					case 'e':
+						if (argv[i-1][2] == 's') q.samplerate = atoi(argv[i]);
+						else q.export_prefix = argv[i];
+						break;
+				}
+				break;
+			default:
+				fprintf(stdout,"Unknown parameter '%s'\n", argv[i]);
+				show_help();
+				exit(1);
+		}
+	}
+
+	if (!q.dir) {
+		show_help();
+		exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+
+	/*
+	 * Coarsest tier that still divides the requested resolution
+	 */
+	tier = -1;
+	if (q.export_prefix || q.pct) q.res = 0;
+	for (int t = 0; q.res && t < BKLOG_TIERS; t++) {
+		uint64_t width = (uint64_t)bklog_tier_secs[t] * 1000000;
+		if (width <= q.res && q.res % width == 0) tier = t;
+	}
+
+	/*
+	 * Segment names carry the meter and start time, so sorting
+	 * them puts each meter's readings in time order
+	 */
+rescan:
+	dir = opendir(q.dir);
+	if (!dir) {
+		fprintf(stdout,"Unable to open directory '%s'\n", q.dir);
+		exit(1);
+	}
+	while ((de = readdir(dir))) {
+		size_t l = strlen(de->d_name);
+		int m;
+
+		if (strncmp(de->d_name, "bk390-m", 7) != 0) continue;
+		if (sscanf(de->d_name, "bk390-m%d-", &m) != 1 || (q.meter >= 0 && m != q.meter)) continue;
+		if (tier >= 0) {
+			char want[64];
+			snprintf(want, sizeof(want), "bk390-m%d-r%u.rollup", m, bklog_tier_secs[tier]);
+			if (strcmp(de->d_name, want) != 0) continue;
+		} else {
+			if (!(l > 4 && (strcmp(de->d_name + l - 4, ".seg") == 0 || strcmp(de->d_name + l - 4, ".bkz") == 0))) continue;
+		}
+
+		if (count >= size) {
+			size = size ? size * 2 : 256;
+			names = (char **)realloc(names, size * sizeof(char *));
+			if (!names) {
+				fprintf(stderr,"Out of memory\n");
+				exit(1);
+			}
+		}
+		if (asprintf(&names[count], "%s/%s", q.dir, de->d_name) < 0) exit(1);
+		count++;
+	}
+	closedir(dir);
+
+	/*
+	 * Logs from before the rollups were kept, do it the long way
+	 */
+	if (tier >= 0 && !count) {
+		tier = -1;
+		goto rescan;
+	}
+	if (count) qsort(names, count, sizeof(char *), name_cmp);
+
+	if (q.export_prefix) {
+		export_sessions(&q, names, count);
+		for (int i = 0; i < count; i++) free(names[i]);
+		count = 0;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (tier >= 0) query_rollups(&q, names[i], tier);
+		else query_file(&q, names[i]);
+		free(names[i]);
+	}
+	free(names);
+	if (q.res) bucket_print(&q);
+	if (q.pct) pct_print(&q);
+	free(q.seg);
+	free(q.total);
+
+	gettimeofday(&end, NULL);
+	if (!q.quiet) {
+		double ms = ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)) / 1000.0;
+
+		if (q.pct) {
+			fprintf(stderr,"%lu readings in %lu sketches from %lu segments, %lu of %lu blocks skipped, %.1fms\n"
+					, q.readings, q.matches, q.files, q.skipped, q.blocks, ms);
+		} else if (q.export_prefix) {
+			fprintf(stderr,"%lu readings from %lu segments exported in to %lu sessions at %uHz, %lu errors, %.1fms\n"
+					, q.matches, q.files, q.sessions, q.samplerate, q.errors, ms);
+		} else if (tier >= 0) {
+			fprintf(stderr,"%lu buckets from %lu %us rollup rows in %lu files, %.1fms\n", q.matches, q.blocks, bklog_tier_secs[tier], q.files, ms);
+		} else {
+			fprintf(stderr,"%lu %s from %lu segments, %lu of %lu blocks skipped, %.1fms\n"
+					, q.matches, q.res ? "buckets" : "readings", q.files, q.skipped, q.blocks, ms);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * BK390A log re-calibration
+ *
+ * Re-applies a meter's calibration to what it has already logged,
+ * when a new certificate replaces the one the readings were taken
+ * with.  Each segment is rewritten with the old calibration taken
+ * back off the counts and the new one put on, and the rollups are
+ * adjusted to match.
+ *
+ * Segments are shared out between threads, and each block of
+ * readings is recalibrated in one go, a run of readings on the same
+ * function and range at a time, so a year of logging takes seconds.
+ *
+ * The logger must not be writing to the directory while this runs.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "bk390.h"
+#include "bk390log.h"
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define THREADS_MAX 64
+
+struct recal {
+	char *dir;
+	int meter;
+	int threads;
+	int quiet;
+	struct bk390_cal from, to;
+
+	char **names;
+	int count;
+	int next;                 // next segment for a thread to take
+
+	unsigned long files, readings, rows, errors;
+};
+
+void show_help(void) {
+	fprintf(stdout,"BK390A log re-calibration\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			"\t-d <directory>: log directory written by bk390-sdl2 -L or bk390-logger -L\r\n"
+			"\t-m <meter>: the meter the certificates are for\r\n"
+			"\t-c <certificate>: calibration the readings were logged with (default none)\r\n"
+			"\t-n <certificate>: calibration to apply instead, \"none\" for the raw readings\r\n"
+			"\t-j <threads>: segments rewritten at once (default one per CPU)\r\n"
+			"\t-q: no summary\r\n"
+			"\r\n"
+			"\texample: bk390-recal -d /var/log/bk390 -m 0 -c cal-2025.txt -n cal-2026.txt\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+static void cal_load(struct bk390_cal *c, const char *path) {
+	if (strcmp(path, "none") == 0) {
+		bk390_cal_identity(c);
+		return;
+	}
+	if (bk390_cal_load(c, path) != 0) exit(1);
+}
+
+static int entry_same(const struct bk390_cal_entry *a, const struct bk390_cal_entry *b) {
+	return a->gain == b->gain && a->offset == b->offset;
+}
+
+/*
+ * One block of readings.  The counts are pulled out in to an array
+ * of their own, recalibrated a run at a time and put back.
+ */
+static void recal_batch(struct bklog_record *r, int n, void *arg) {
+	struct recal *rc = (struct recal *)arg;
+	int32_t counts[BKLOG_BLOCK_SIZE];
+	int start = 0;
+
+	for (int k = 0; k < n; k++) counts[k] = r[k].counts;
+
+	while (start < n) {
+		const struct bklog_record *s = &r[start];
+		const struct bk390_cal_entry *from = &rc->from.e[s->function & 0x0F][s->range & 0x0F];
+		const struct bk390_cal_entry *to = &rc->to.e[s->function & 0x0F][s->range & 0x0F];
+		int ol = s->status & BKLOG_STATUS_OL;
+		int end = start + 1;
+
+		while (end < n && r[end].function == s->function && r[end].range == s->range && (r[end].status & BKLOG_STATUS_OL) == ol) end++;
+		if (!ol && !entry_same(from, to)) bk390_cal_recal(from, to, counts + start, end - start);
+		start = end;
+	}
+
+	for (int k = 0; k < n; k++) r[k].counts = counts[k];
+	__atomic_add_fetch(&rc->readings, n, __ATOMIC_RELAXED);
+}
+
+static void *recal_thread(void *arg) {
+	struct recal *rc = (struct recal *)arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&rc->next, 1, __ATOMIC_RELAXED)) < rc->count) {
+		if (bklog_rewrite(rc->names[i], recal_batch, rc) != 0) {
+			fprintf(stderr,"Unable to rewrite '%s' (%s)\n", rc->names[i], strerror(errno));
+			__atomic_add_fetch(&rc->errors, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&rc->files, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Rollup rows only have min/max/sum in SI, they get the same change
+ * as a straight line.  Close to what rebuilding them from the
+ * recalibrated readings would give, without the rounding to counts.
+ */
+static void recal_rollups(struct recal *rc, int tier) {
+	struct bklog_rollups rs;
+	char path[BKLOG_PATH_SIZE], tmp[BKLOG_PATH_SIZE + 4];
+	FILE *f;
+	int ok;
+
+	bklog_rollup_path(path, sizeof(path), rc->dir, rc->meter, tier);
+	if (bklog_rollups_open(&rs, path) != 0) return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr,"Unable to open '%s' (%s)\n", tmp, strerror(errno));
+		rc->errors++;
+		bklog_rollups_close(&rs);
+		return;
+	}
+
+	fwrite(rs.map, sizeof(struct bklog_header), 1, f);
+	for (uint64_t i = 0; i < rs.count; i++) {
+		struct bklog_rollup o = rs.r[i];
+		const struct bk390_cal_entry *from = &rc->from.e[o.function & 0x0F][o.range & 0x0F];
+		const struct bk390_cal_entry *to = &rc->to.e[o.function & 0x0F][o.range & 0x0F];
+
+		if (!entry_same(from, to) && o.count > o.ol) {
+			struct bklog_record one;
+			double a = (double)to->gain / from->gain;
+			double b;
+
+			memset(&one, 0, sizeof(one));
+			one.counts = 1;
+			one.dps = o.dps;
+			one.exponent = o.exponent;
+			b = (to->offset - a * from->offset) / 65536.0 * bklog_si(&one);
+
+			o.min = a * o.min + b;
+			o.max = a * o.max + b;
+			o.sum = a * o.sum + b * (o.count - o.ol);
+		}
+		fwrite(&o, sizeof(o), 1, f);
+		rc->rows++;
+	}
+	bklog_rollups_close(&rs);
+
+	ok = (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0);
+	fclose(f);
+	if (!ok || rename(tmp, path) != 0) {
+		fprintf(stderr,"Unable to rewrite '%s' (%s)\n", path, strerror(errno));
+		unlink(tmp);
+		rc->errors++;
+	}
+}
+
+static int name_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int main(int argc, char **argv) {
+	struct recal rc;
+	struct timeval start, end;
+	pthread_t threads[THREADS_MAX];
+	DIR *dir;
+	struct dirent *de;
+	int size = 0, started = 0;
+	char *from = NULL, *to = NULL;
+
+	memset(&rc, 0, sizeof(rc));
+	rc.meter = -1;
+	rc.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+		switch (argv[i][1]) {
+			case 'h': show_help(); exit(0);
+			case 'q': rc.quiet = 1; break;
+			case 'd':
+			case 'm':
+			case 'c':
+			case 'n':
+			case 'j':
+				if (i + 1 >= argc) {
+					fprintf(stdout,"Insufficient parameters; %s <value>\n", argv[i]);
+					exit(1);
+				}
+				i++;
+				switch (argv[i-1][1]) {
+					case 'd': rc.dir = argv[i]; break;
+					case 'm': rc.meter = atoi(argv[i]); break;
+					case 'c': from = argv[i]; break;
+					case 'n': to = argv[i]; break;
+					case 'j': rc.threads = atoi(argv[i]); break;
+				}
+				break;
+			default:
+				fprintf(stdout,"Unknown parameter '%s'\n", argv[i]);
+				show_help();
+				exit(1);
+		}
+	}
+
+	if (!rc.dir || rc.meter < 0 || !to) {
+		show_help();
+		exit(1);
+	}
+	if (rc.threads < 1) rc.threads = 1;
+	if (rc.threads > THREADS_MAX) rc.threads = THREADS_MAX;
+
+	cal_load(&rc.from, from ? from : "none");
+	cal_load(&rc.to, to);
+
+	gettimeofday(&start, NULL);
+
+	dir = opendir(rc.dir);
+	if (!dir) {
+		fprintf(stdout,"Unable to open directory '%s'\n", rc.dir);
+		exit(1);
+	}
+	if (bklog_dir_lock(rc.dir) != 0) exit(1); // the logger has to be stopped first
+	while ((de = readdir(dir))) {
+		size_t l = strlen(de->d_name);
+		int m;
+
+		if (sscanf(de->d_name, "bk390-m%d-", &m) != 1 || m != rc.meter) continue;
+		if (!(l > 4 && (strcmp(de->d_name + l - 4, ".seg") == 0 || strcmp(de->d_name + l - 4, ".bkz") == 0))) continue;
+
+		if (rc.count >= size) {
+			size = size ? size * 2 : 256;
+			rc.names = (char **)realloc(rc.names, size * sizeof(char *));
+			if (!rc.names) {
+				fprintf(stderr,"Out of memory\n");
+				exit(1);
+			}
+		}
+		if (asprintf(&rc.names[rc.count], "%s/%s", rc.dir, de->d_name) < 0) exit(1);
+		rc.count++;
+	}
+	closedir(dir);
+
+	/*
+	 * Oldest first, so the threads work forwards through the log
+	 */
+	if (rc.count) qsort(rc.names, rc.count, sizeof(char *), name_cmp);
+
+	for (int k = 0; k < rc.threads && k < rc.count; k++) {
+		if (pthread_create(&threads[k], NULL, recal_thread, &rc) != 0) {
+			fprintf(stderr,"Unable to start thread (%s)\n", strerror(errno));
+			break;
+		}
+		started++;
+	}
+	if (!started) recal_thread(&rc);
+	for (int k = 0; k < started; k++) pthread_join(threads[k], NULL);
+
+	for (int t = 0; t < BKLOG_TIERS; t++) recal_rollups(&rc, t);
+
+	for (int i = 0; i < rc.count; i++) free(rc.names[i]);
+	free(rc.names);
+
+	gettimeofday(&end, NULL);
+	if (!rc.quiet) {
+		double ms = ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)) / 1000.0;
+
+		fprintf(stderr,"%lu readings in %lu segments and %lu rollup rows recalibrated, %lu errors, %.1fms\n"
+				, rc.readings, rc.files, rc.rows, rc.errors, ms);
+	}
+
+	return rc.errors ? 1 : 0;
+}
@@ -22,9 +22,23 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
 #include <X11/Xlib.h>
 #include "robotomono.h"
+#include "robotomono-glyphs.h"
+#include "bk390log.h"
+#include "bk390sr.h"
+#include "bk390.h"
 
 #define FL __FILE__,__LINE__
 
@@ -41,46 +55,6 @@
 #define BUILD_DATE " "
 #endif
 
-#define BYTE_RANGE 0
-#define BYTE_DIGIT_3 1
-#define BYTE_DIGIT_2 2
-#define BYTE_DIGIT_1 3
-#define BYTE_DIGIT_0 4
-#define BYTE_FUNCTION 5
-#define BYTE_STATUS 6
-#define BYTE_OPTION_1 7
-#define BYTE_OPTION_2 8
-#define DATA_FRAME_SIZE 11 // 9 bytes followed by \r\n
-
-#define FUNCTION_VOLTAGE 0b00111011
-#define FUNCTION_CURRENT_UA 0b00111101
-#define FUNCTION_CURRENT_MA 0b00111001
-#define FUNCTION_CURRENT_A 0b00111111
-#define FUNCTION_OHMS 0b00110011
-#define FUNCTION_CONTINUITY 0b00110101
-#define FUNCTION_DIODE 0b00110001
-#define FUNCTION_FQ_RPM 0b00110010
-#define FUNCTION_CAPACITANCE 0b00110110
-#define FUNCTION_TEMPERATURE 0b00110100
-#define FUNCTION_ADP0 0b00111110
-#define FUNCTION_ADP1 0b00111100
-#define FUNCTION_ADP2 0b00111000
-#define FUNCTION_ADP3 0b00111010
-
-#define STATUS_OL 0x01
-#define STATUS_BATT 0x02
-#define STATUS_SIGN 0x04
-#define STATUS_JUDGE 0x08
-
-#define OPTION1_VAHZ 0x01
-#define OPTION1_PMIN 0x04
-#define OPTION1_PMAX 0x08
-
-#define OPTION2_APO 0x01
-#define OPTION2_AUTO 0x02
-#define OPTION2_AC 0x04
-#define OPTION2_DC 0x08
-
 #define WINDOWS_DPI_DEFAULT 72
 #define FONT_NAME_SIZE 1024
 #define SSIZE 1024
@@ -94,6 +68,139 @@
 #define DEFAULT_WINDOW_WIDTH 9999
 #define DEFAULT_COM_PORT 99
 
+#define METERS_MAX BK390_METERS_MAX
+#define RULES_MAX 1024
+
+/*
+ * Glyph cache, every character the display can show is rendered
+ * once per font, white, in to one atlas texture.  Text is drawn by
+ * copying glyphs out of the atlas with the colour applied as a
+ * colour mod, so a changed reading costs a few RenderCopy()s rather
+ * than a TTF render, a surface and a texture.
+ *
+ * For outlined text the font's outline glyphs are rendered in to the
+ * same atlas alongside the fill glyphs, so an outline costs one more
+ * RenderCopy() per character and nothing is rasterized per frame.
+ *
+ * The common sizes come pre-rendered from robotomono-glyphs.h, which
+ * bk390-glyphgen makes at build time, so a start at one of them
+ * never loads FreeType.  SDL_ttf is only started for other sizes.
+ */
+#define GLYPHS_MAX 128
+#define GLYPH_COLUMNS 16
+
+#define TEXT_PLAIN 0
+#define TEXT_OUTLINE 1               // stroke around the fill, for chroma keying
+#define TEXT_SHADOW 2                // fill drawn again, offset down and right
+
+struct text_effect {
+	int mode;
+	int width;                   // stroke or shadow offset in pixels at the -z size
+	SDL_Color colour;
+};
+
+struct glyph {
+	uint16_t ch;
+	SDL_Rect src;
+	SDL_Rect osrc;               // outline glyph, w 0 if there isn't one
+	int adv;
+};
+
+struct glyph_cache {
+	SDL_Texture *atlas;
+	int height;
+	int count;
+	int stroke;                  // effect width at this size, 0 for plain text
+	int outline;                 // outline glyphs are in the atlas
+	struct glyph g[GLYPHS_MAX];
+	uint8_t ascii[128];          // index + 1 in to g[], 0 if not cached
+};
+
+/*
+ * Size variants, the glyphs rasterized at one font size.  The -z
+ * size is done before the window opens, other sizes are asked for as
+ * the window is resized and rasterized on the font thread, while
+ * they're being done the nearest variant that's ready is drawn
+ * scaled.
+ */
+#define VARIANTS_MAX 8
+#define VARIANT_EMPTY 0
+#define VARIANT_QUEUED 1             // waiting for the font thread
+#define VARIANT_RASTERIZED 2         // atlases done, waiting to be uploaded
+#define VARIANT_READY 3
+#define VARIANT_FAILED 4
+
+struct variant {
+	int size;                    // font size of the readings, labels are a third
+	int state;
+	struct glyph_cache big, small;
+	SDL_Surface *big_s, *small_s;
+	int prebuilt;                // both came from robotomono-glyphs.h
+	uint64_t used;               // last chosen, for reuse
+};
+
+/*
+ * Display, one tile per meter in a single window.  Tiles are drawn
+ * in to a canvas texture that's kept between frames, only those whose
+ * text or colour changed are redrawn, and the canvas goes to the
+ * window with one present per display frame however many meters
+ * updated in it.  The window can be resized, the tiles are stretched
+ * to fill it and the text sized to fit.
+ */
+#define DISPLAY_FRAME_US 16667
+#define TILE_TEXT_SIZE 64
+#define PANEL_US 250000              // histogram panels redrawn no more often than this
+#define PANEL_BARS_MAX 128
+
+struct tile {
+	SDL_Rect rect;
+	char text[TILE_TEXT_SIZE];
+	SDL_Color colour;
+	int dirty;
+	uint64_t panel_count;        // readings in the sketch when the panel was drawn
+	uint64_t panel_at;
+};
+
+struct display {
+	int grid;                    // -g given, tiles in a grid with a label line
+	int columns;                 // -g columns, 0 to keep it near square
+	int rows;
+	int small;                   // labels, footer or panels, variants need the small font too
+	int panel;                   // -D given, histogram panel under each reading
+	struct text_effect fx;
+	int tile_w, tile_h, label_h, footer_h, panel_h;
+
+	int base_size;               // -z, and the layout at that size
+	int base_w, base_h, base_label_h, base_footer_h, base_panel_h;
+	int want;                    // font size that fits the window
+	int cur;                     // variant being drawn
+	double scale;                // want / var[cur].size
+
+	SDL_Renderer *renderer;
+	SDL_Texture *canvas;
+	int canvas_w, canvas_h;
+	struct variant var[VARIANTS_MAX];
+
+	pthread_t thread;            // font thread
+	pthread_mutex_t lock;        // variant states
+	pthread_cond_t cond;
+	int running, stop;
+	int ttf;                     // TTF_Init() done, by whichever thread rasterizes
+
+	struct tile tile[METERS_MAX];
+	struct tile footer;          // integrator totals and derived channels
+	int pending;                 // something to present
+	uint64_t last_present;
+	unsigned long presents, tiles_drawn, rasterized, prebuilt;
+
+	uint64_t started;            // mono_ns() as main() starts
+	uint64_t glyphs_ns;          // -z size uploaded, since started
+	uint64_t first_ns;           // first reading presented, since started
+};
+#define HOOK_QUEUE_SIZE 64
+#define HTTP_CLIENTS_MAX 32
+#define HTTP_OUT_SIZE 32768
+
 
 
 
@@ -108,13 +215,6 @@
 #define dd "\u00B0"
 #define oo "\u03A9"
 
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
-
 struct meter_param {
 	char mode[20];
 	char units[20];
@@ -122,6 +222,383 @@ struct meter_param {
 	char prefix[8][2];
 };
 
+/*
+ * Pre/post trigger capture
+ *
+ * Every fresh reading goes in to a fixed size history ring per meter.
+ * When a trigger fires (function change, overload, a rule with the
+ * capture action, or SIGUSR1) the ring carries on filling for the
+ * post-trigger time and then the whole window is copied in to one
+ * of a small number of preallocated snapshots and written out by
+ * the capture writer thread.  Nothing is allocated after startup.
+ *
+ */
+#define CAPTURE_RATE_MAX 10 // frames per second the history is sized for, the meter does 2-3
+#define CAPTURE_SNAPSHOTS 2
+
+#define TRIGGER_MODE 0x01
+#define TRIGGER_OL 0x02
+#define TRIGGER_RULE 0x04
+#define TRIGGER_SIGNAL 0x08
+
+struct capture_ring {
+	struct bk390_reading *h;     // capture_engine.size entries
+	unsigned int head;           // readings ever added, next goes in h[head % size]
+	int collecting;              // triggered, filling the post-trigger window
+	int reason;
+	uint64_t trigger_ts;
+	uint64_t post_until;
+	unsigned int trigger_head;
+	uint8_t last_function;
+};
+
+struct capture_snapshot {
+	struct bk390_reading *h;
+	int count;
+	int meter;
+	int reason;
+	uint64_t trigger_ts;
+	int full;                    // waiting for the writer
+};
+
+struct capture_engine {
+	char *dir;
+	int pre, post;               // seconds either side of the trigger
+	int triggers;                // TRIGGER_* enabled
+	unsigned int size;
+	struct capture_ring ring[METERS_MAX];
+	struct capture_snapshot snap[CAPTURE_SNAPSHOTS];
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int events, dropped;
+	unsigned long written;       // writer thread only
+};
+
+/*
+ * Charge / energy integrator
+ *
+ * Trapezoidal integration of a value over the reading timestamps.
+ * Works on the SI value so range and prefix changes (uA/mA/A) are
+ * exact, an amp reading integrates to Coulombs whatever range it
+ * came from.  Overloads and gaps longer than -ig seconds aren't
+ * integrated across, they're counted instead.
+ *
+ */
+struct integrator {
+	char name[16];
+	char units[8];               // units of the total once divided by 3600, "Ah", "Wh"
+	double total;                // SI value x seconds, Coulombs for current
+	double comp;                 // Kahan compensation for total
+	double seconds;              // time actually integrated over
+	unsigned int gaps;
+	unsigned int overloads;
+	uint64_t last_ts;            // 0 when there's no previous point to integrate from
+	double last_v;
+};
+
+struct integrator_engine {
+	char *state_file;
+	double gap;                  // seconds between readings before it's a gap
+	int checkpoint;              // seconds between writes of state_file
+	uint64_t last_checkpoint;
+	int count;
+	struct integrator it[METERS_MAX * 2];
+};
+
+/*
+ * Time aligned join of meter streams
+ *
+ * The meters free-run at about 2Hz with no phase relationship, so
+ * a derived channel like P=V*I can't just multiply the latest values.
+ * Each derived channel (-j name=<meter><op><meter>...) takes its
+ * timestamps from the first meter named, and the other meters'
+ * values are taken at that time by nearest neighbour or linear
+ * interpolation (-jm) from a short history, so long as the samples
+ * used are within -js milliseconds.
+ *
+ * Everything is fixed size.  A late meter holds emission up for at
+ * most the max skew, a dead one just causes points to be counted
+ * as missed.
+ *
+ */
+#define JOIN_MAX 8
+#define JOIN_INPUTS_MAX 4
+#define JOIN_HISTORY 8
+#define JOIN_PENDING 8
+
+struct join_sample {
+	uint64_t ts;
+	double v;
+	int valid;
+};
+
+struct join_history {
+	struct join_sample s[JOIN_HISTORY];
+	unsigned int head;
+};
+
+struct join_channel {
+	char *spec;                      // as given to -j
+	char name[16];
+	char units[8];
+	int inputs;
+	int meter[JOIN_INPUTS_MAX];
+	char op[JOIN_INPUTS_MAX];        // op[k] combines input k with the result so far
+	struct join_sample pending[JOIN_PENDING]; // reference points waiting on the other meters
+	unsigned int p_head, p_tail;
+	int have;
+	uint64_t ts;
+	double value;
+	char text[64];
+	unsigned int emitted, missed, overflow;
+};
+
+struct join_engine {
+	int count;
+	int linear;
+	uint64_t max_skew;               // microseconds
+	struct join_history hist[METERS_MAX];
+	struct join_channel ch[JOIN_MAX];
+};
+
+/*
+ * Metrics
+ *
+ * Each counter has exactly one writer thread and is bumped with a
+ * relaxed store, /metrics reads them with relaxed loads and adds
+ * them up when it's scraped, so nothing on the reading path takes
+ * a lock or a locked instruction.
+ *
+ * Stage timings go in to fixed histograms, bucket bounds in
+ * microseconds with the last bucket for everything over.
+ *
+ */
+#define METRIC_INC(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+#define METRIC_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define HIST_BUCKETS 12
+static const unsigned int hist_le_us[HIST_BUCKETS - 1] = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 10000, 100000 };
+
+#define STAGE_DECODE 0
+#define STAGE_RULES 1
+#define STAGE_CAPTURE 2
+#define STAGE_INTEGRATE 3
+#define STAGE_JOIN 4
+#define STAGE_LOG 5
+#define STAGE_RENDER 6
+#define STAGE_HTTP 7
+#define STAGE_SIGROK 8
+#define STAGES 9
+static const char *stage_names[STAGES] = { "decode", "rules", "capture", "integrate", "join", "log", "render", "http", "sigrok" };
+
+struct histogram {
+	uint64_t bucket[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+struct metrics {
+	struct histogram stage[STAGES];
+	unsigned long scrapes;
+};
+
+static uint64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void hist_add(struct histogram *h, uint64_t ns) {
+	int b = 0;
+
+	while (b < HIST_BUCKETS - 1 && ns > (uint64_t)hist_le_us[b] * 1000) b++;
+	METRIC_INC(h->bucket[b]);
+	METRIC_INC(h->count);
+	__atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Output policies
+ *
+ * By default every frame goes to every sink (stdout status line,
+ * the window, the -o file, the -H event stream).  -F sets a per-sink policy so a settled
+ * reading doesn't keep getting rewritten:
+ *
+ *	change      only when the reading changes
+ *	db=<n>c     only when it moves more than n counts
+ *	db=<n>%     only when it moves more than n percent
+ *	hb=<secs>   but at least every secs as a heartbeat
+ *
+ * A change of function, range, flags or comms state always goes
+ * straight through.
+ *
+ */
+#define SINK_STDOUT 0
+#define SINK_RENDER 1
+#define SINK_FILE 2
+#define SINK_HTTP 3
+#define SINKS 4
+
+struct sink_last {
+	int valid;
+	int counts;
+	uint32_t state;                  // function/range/flags/comms packed together
+};
+
+struct output_policy {
+	int filter;                      // 0 every reading, 1 change/deadband
+	int deadband;                    // counts
+	double deadband_pct;
+	uint64_t heartbeat;              // microseconds, 0 for none
+	uint64_t last_ts;
+	struct sink_last last[METERS_MAX];
+	unsigned long emitted, suppressed;
+};
+
+/*
+ * Threshold / alarm rules
+ *
+ * Rules are read from the file given with -r, one per line, and are
+ * compiled once at startup in to a flat array sorted by meter so that
+ * each reading only walks the rules that apply to its own meter.
+ *
+ *	<meter|*> value <|> <level> [hyst <amount>] <action>
+ *	<meter|*> rate <|> <SI units per second> <action>
+ *	<meter|*> stale <seconds> <action>
+ *	<meter|*> flag <batt|apo|ol|auto|ac|dc|max|min> <action>
+ *
+ *	<action> = colour <rrggbb> | udp <host>:<port> | capture | exec <command line>
+ *
+ * Levels are in SI base units (V, A, Ohm, F, Hz) regardless of the
+ * range the meter happens to be on.
+ *
+ */
+#define RULE_VALUE 1
+#define RULE_RATE 2
+#define RULE_STALE 3
+#define RULE_FLAG 4
+
+#define ACTION_COLOUR 1
+#define ACTION_UDP 2
+#define ACTION_EXEC 3
+#define ACTION_CAPTURE 4
+
+struct rule {
+	uint8_t meter;
+	uint8_t kind;
+	uint8_t action;
+	uint8_t active;
+	uint8_t flag_byte, flag_mask; // RULE_FLAG, frame byte and bits to test
+	double dir;                   // +1 for '>', -1 for '<', so one compare serves both
+	double trip, release;         // already multiplied by dir
+	double prev_v;                // RULE_RATE, previous value and time
+	uint64_t prev_ts;
+	uint64_t stale_us;            // RULE_STALE
+	SDL_Color colour;
+	int arg;                      // index in to rules_engine.args for udp/exec
+	int line;                     // line in the rules file, used as the rule id
+};
+
+struct rule_arg {
+	char *cmd;
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+struct hook_job {
+	int arg;
+	int line;
+	int meter;
+	int set;
+	double v;
+	uint64_t ts;
+};
+
+struct rules_engine {
+	struct rule *r;               // flat evaluation array
+	int count;
+	int start[METERS_MAX + 1];    // meter m owns r[start[m]] .. r[start[m+1] - 1]
+	struct rule_arg *args;
+	int arg_count;
+	int *stale;                   // indexes in to r of the stale rules
+	int stale_count;
+	uint64_t stale_min[METERS_MAX]; // shortest stale rule on each meter, UINT64_MAX if none
+	uint64_t stale_next;          // no stale rule can trip before this
+	uint64_t last_seen[METERS_MAX];
+
+	int colour_active[METERS_MAX];
+	SDL_Color colour[METERS_MAX];
+
+	pthread_t worker;             // runs exec hooks so the meter loop never waits on them
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct hook_job jobs[HOOK_QUEUE_SIZE];
+	unsigned int head, tail;
+	unsigned int dropped;
+	unsigned long hooks_run, hooks_failed; // worker thread only
+};
+
+/*
+ * Overlay server
+ *
+ * -H [addr:]port (or unix:/path) serves a small page for OBS
+ * browser sources at /, the current status line at /reading, a
+ * Server-Sent Events stream of readings at /events and Prometheus
+ * metrics at /metrics.  It runs from the main poll() loop,
+ * each reading is encoded once and the same bytes are queued to all
+ * the subscribers.  A subscriber too slow to keep up misses events
+ * rather than holding up the meters.
+ *
+ */
+struct http_client {
+	int fd;                          // -1 when the slot is free
+	int sse;                         // subscribed to /events
+	int closing;                     // close once out has drained
+	char req[1024];
+	int req_len;
+	char out[HTTP_OUT_SIZE];         // bytes the socket didn't take yet
+	int out_len;
+	uint64_t last_send;
+};
+
+/*
+ * Stale watchdog, -W <seconds>
+ *
+ * A meter that powers itself off or has its cable pulled can go
+ * quiet without the port reporting an error, and the last reading
+ * would stay up as if it were current.  Each meter has a deadline
+ * stale_us after its last fresh frame, a frame just moves it on (a
+ * store, no syscall).  One timerfd in the poll set is armed for the
+ * earliest deadline, when it fires the meters that really are past
+ * theirs are marked stale and it's armed again for the next one.
+ * Meters that are still sending will have moved their deadlines on
+ * by then, so however many meters and frames there are it costs a
+ * read and a settime per stale_us.
+ */
+struct watchdog {
+	int fd;                          // timerfd, -1 when off
+	uint64_t stale_us;
+	uint64_t deadline[METERS_MAX];   // CLOCK_MONOTONIC, us
+	uint64_t armed;                  // deadline the timer is set for, 0 if disarmed
+	uint8_t stale[METERS_MAX];
+	unsigned long expiries, wakeups;
+};
+
+struct http_server {
+	char *spec;
+	char *unix_path;
+	int fd;
+	struct http_client *c;           // HTTP_CLIENTS_MAX of them
+	char page[4096];
+	int page_len;
+	char event[4096];                // latest reading, already framed for SSE
+	int event_len;
+	char status[SSIZE];
+	unsigned long events, dropped;
+};
+
 
 /*
  * Global structure, it's a little naughty but
@@ -134,19 +611,42 @@ struct meter_param {
 struct glb {
 	uint8_t debug;
 	uint8_t quiet;
-	uint8_t show_mode;
 	uint16_t flags;
 	char *com_address;
 	char *output_file;
 
-	char *serial_parameters_string;
-	struct serial_params_s serial_params;
-
 	int font_size;
 	int window_width, window_height;
 	int wx_forced, wy_forced;
 	SDL_Color font_color, background_color;
 
+	struct bk390 bk;
+	const struct bk390_protocol *protocol; // for the next -p, NULL to detect
+	struct bk390_filter_config filter;     // for the next -p
+	struct bk390_cal cal;                  // for the next -p
+	struct bk390_settle_config settle;     // for the next -p
+	char settle_units[METERS_MAX][16];     // of each meter's last settle event
+
+	char *rules_file;
+	struct rules_engine rules;
+	struct capture_engine capture;
+	struct integrator_engine integ;
+	struct join_engine join;
+	struct output_policy policy[SINKS];
+
+	struct bklog_config log;
+	struct bklog_writer *log_w;
+
+	char *sr_prefix;
+	unsigned int sr_samplerate;
+	uint64_t sr_rotate_us;
+	struct bksr_writer *sr_w;
+
+	struct watchdog wd;
+	struct http_server http;
+	struct metrics metrics;
+	struct display display;
+
 };
 
 struct glb *glbs;
@@ -157,6 +657,13 @@ bool fileExists(const char *filename) {
 	return (stat(filename, &buf) == 0);
 }
 
+uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 
 
 /*-----------------------------------------------------------------\
@@ -188,8 +695,57 @@ int init(struct glb *g) {
 	g->wx_forced = 0;
 	g->wy_forced = 0;
 
-	g->font_color =  { 10, 255, 10 };
-	g->background_color = { 0, 0, 0 };
+	g->font_color =  { 10, 255, 10, 255 };
+	g->background_color = { 0, 0, 0, 255 };
+
+	bk390_init(&g->bk);
+	g->protocol = &bk390_protocols[0];
+	memset(&g->filter, 0, sizeof(g->filter));
+	memset(&g->settle, 0, sizeof(g->settle));
+	memset(g->settle_units, 0, sizeof(g->settle_units));
+
+	g->rules_file = NULL;
+	memset(&g->rules, 0, sizeof(g->rules));
+
+	memset(&g->capture, 0, sizeof(g->capture));
+	g->capture.pre = 30;
+	g->capture.post = 30;
+	g->capture.triggers = TRIGGER_MODE | TRIGGER_OL | TRIGGER_RULE | TRIGGER_SIGNAL;
+
+	memset(&g->integ, 0, sizeof(g->integ));
+	g->integ.gap = 5.0;
+	g->integ.checkpoint = 10;
+
+	memset(&g->join, 0, sizeof(g->join));
+	g->join.linear = 0;
+	g->join.max_skew = 300000;
+
+	memset(g->policy, 0, sizeof(g->policy));
+
+	memset(&g->log, 0, sizeof(g->log));
+	g->log.rotate_bytes = 64 * 1024 * 1024;
+	g->log.rotate_us = 3600ULL * 1000000;
+	g->log.fsync_mode = BKLOG_FSYNC_ROTATE;
+	g->log.batch = 64;
+	g->log_w = NULL;
+
+	g->sr_prefix = NULL;
+	g->sr_samplerate = 10;
+	g->sr_rotate_us = 3600ULL * 1000000;
+	g->sr_w = NULL;
+
+	memset(&g->wd, 0, sizeof(g->wd));
+	g->wd.fd = -1;
+	g->wd.stale_us = 3000000;
+
+	memset(&g->http, 0, sizeof(g->http));
+	g->http.fd = -1;
+
+	memset(&g->metrics, 0, sizeof(g->metrics));
+
+	memset(&g->display, 0, sizeof(g->display));
+	g->display.fx.width = 2;
+	g->display.fx.colour = { 0, 0, 0, 255 };
 
 	return 0;
 }
@@ -203,14 +759,46 @@ void show_help(void) {
 			"\r\n"
 			"\t-h: This help\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t              repeat -p for more meters, numbered 0, 1, 2.. in order given\r\n"
+			"\t-P <bk390a|es51922|auto>: protocol of the meters on the -p ports that follow (default bk390a)\r\n"
+			"\t-a <none|ema[:alpha]|median[:N]|kalman[:q,r]>: smoothing filter for the meters on the -p ports that follow\r\n"
+			"\t-C <certificate|none>: calibration for the meters on the -p ports that follow, see README\r\n"
+			"\t-e <tolerance>[%%|c][,<window ms>[,<timeout ms>]]|none: settle detection for the meters on the -p ports that follow, see README\r\n"
 			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
+			"\t-g <columns>: dashboard, the meters as labelled tiles in a grid (0 for as square as it gets)\r\n"
+			"\t-D: histogram of each meter's readings on its function and range, with p1/p50/p99\r\n"
 			"\t-o <output file> ( used by FlexBV to read the data )\r\n"
+			"\t-r <rules file>: threshold/alarm rules evaluated on every reading\r\n"
+			"\t-c <directory>: capture readings either side of a trigger in to this directory\r\n"
+			"\t-cb <seconds>: capture time before the trigger (default 30)\r\n"
+			"\t-ca <seconds>: capture time after the trigger (default 30)\r\n"
+			"\t-ct <mode,ol,rule,signal>: capture triggers (default all, signal is SIGUSR1)\r\n"
+			"\t-i <state file>: integrate current readings to Ah, totals kept in the state file\r\n"
+			"\t-ig <seconds>: longest gap between readings to integrate across (default 5)\r\n"
+			"\t-ic <seconds>: how often to checkpoint the state file (default 10)\r\n"
+			"\t-j <name>=<meter><op><meter>: time aligned derived channel, eg: -j P=0*1\r\n"
+			"\t-jm <nearest|linear>: how other meters are aligned to the first (default nearest)\r\n"
+			"\t-js <ms>: max skew between aligned samples (default 300)\r\n"
+			"\t-F <stdout|render|file|http|all>:<change|db=<n>[c|%%]|hb=<secs>>[,...]: output policy per sink\r\n"
+			"\t-H <[address:]port|unix:path>: serve an overlay page, reading stream and /metrics (default address 127.0.0.1)\r\n"
+			"\t-W <seconds>: mark a meter's reading stale after this long without a frame (default 3, 0 never)\r\n"
+			"\t-L <directory>: log every reading in to rotating segments, compressed once closed\r\n"
+			"\t-Ls <MB>: rotate segments at this size (default 64)\r\n"
+			"\t-Lt <seconds>: rotate segments at this age (default 3600)\r\n"
+			"\t-Lf <none|rotate|seconds>: fsync segments never, on rotate or every n seconds (default rotate)\r\n"
+			"\t-Lb <readings>: readings batched per write (default 64, max 1024)\r\n"
+			"\t-S <prefix>: write every reading to sigrok sessions <prefix>-m<meter>-<time>.sr for PulseView\r\n"
+			"\t-Ss <Hz>: samplerate of the sessions (default 10)\r\n"
+			"\t-St <seconds>: start a new session at this age (default 3600, 0 only when the units change)\r\n"
 			"\t-d: debug enabled\r\n"
 			"\t-q: quiet output\r\n"
 			"\t-v: show version\r\n"
 			"\t-z <font size in pt>\r\n"
-			"\t-fc <foreground colour, f0f0ff>\r\n"
-			"\t-bc <background colour, 101010>\r\n"
+			"\t-fc <foreground colour, 0aff0a>\r\n"
+			"\t-bc <background colour, 000000>\r\n"
+			"\t-t <plain|outline|shadow>: text effect, outline keeps the readings clean over a chroma key\r\n"
+			"\t-tw <pixels>: outline width or shadow offset at the -z size (default 2)\r\n"
+			"\t-tc <outline/shadow colour, 000000>\r\n"
 			"\r\n"
 			"\r\n"
 			"\texample: bside-adm20 -p /dev/ttyUSB0\r\n"
@@ -220,6 +808,71 @@ void show_help(void) {
 } 
 
 
+static const char *sink_names[SINKS] = { "stdout", "render", "file", "http" };
+
+/*
+ * -F <sink|all>:<policy>[,<policy>...]
+ */
+void output_policy_parse(struct glb *g, char *spec) {
+	char *p = strchr(spec, ':');
+	int first = 0, last = SINKS - 1;
+	struct output_policy op;
+
+	if (!p) {
+		fprintf(stdout,"Invalid output policy '%s', expected -F <sink>:<policy>\n", spec);
+		exit(1);
+	}
+
+	if (strncmp(spec, "all:", 4) != 0) {
+		for (first = 0; first < SINKS; first++) {
+			if (strncmp(spec, sink_names[first], p - spec) == 0 && (int)strlen(sink_names[first]) == p - spec) break;
+		}
+		if (first == SINKS) {
+			fprintf(stdout,"Unknown sink in '%s', expected stdout, render, file, http or all\n", spec);
+			exit(1);
+		}
+		last = first;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.filter = 1;
+	p++;
+	while (*p) {
+		if (strncmp(p, "change", 6) == 0) {
+			op.deadband = 0;
+		} else if (strncmp(p, "db=", 3) == 0) {
+			char *e;
+			double v = strtod(p + 3, &e);
+			if (*e == '%') op.deadband_pct = v;
+			else op.deadband = (int)v;
+		} else if (strncmp(p, "hb=", 3) == 0) {
+			op.heartbeat = strtod(p + 3, NULL) * 1e6;
+		} else {
+			fprintf(stdout,"Unknown output policy '%s', expected change, db=<n>[c|%%] or hb=<secs>\n", p);
+			exit(1);
+		}
+		p = strchr(p, ',');
+		if (!p) break;
+		p++;
+	}
+
+	for (int k = first; k <= last; k++) g->policy[k] = op;
+}
+
+/*
+ * rrggbb, with or without a leading #
+ */
+int colour_parse(const char *s, SDL_Color *c) {
+	unsigned int r, g, b;
+
+	if (*s == '#') s++;
+	if (strlen(s) != 6 || sscanf(s, "%02x%02x%02x", &r, &g, &b) != 3) return -1;
+	c->r = r;
+	c->g = g;
+	c->b = b;
+	return 0;
+}
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220258
   Function Name	: parse_parameters
@@ -273,13 +926,77 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					 */
 					i++;
 					if (i < argc) {
-						g->serial_params.device = argv[i];
+						int m = bk390_add(&g->bk, argv[i]);
+						if (m < 0) {
+							fprintf(stdout,"Too many meters, max %d\n", METERS_MAX);
+							exit(1);
+						}
+						bk390_set_protocol(&g->bk, m, g->protocol);
+						bk390_set_filter(&g->bk, m, &g->filter);
+						bk390_set_cal(&g->bk, m, &g->cal);
+						bk390_set_settle(&g->bk, m, &g->settle);
 					} else {
 						fprintf(stdout,"Insufficient parameters; -p <com port>\n");
 						exit(1);
 					}
 					break;
 
+				case 'a':
+					/*
+					 * smoothing filter for the -p ports after this
+					 */
+					i++;
+					if (i >= argc || bk390_filter_parse(&g->filter, argv[i]) != 0) {
+						fprintf(stdout,"Insufficient parameters; -a <none|ema[:alpha]|median[:N]|kalman[:q,r]>\n");
+						exit(1);
+					}
+					break;
+
+				case 'e':
+					/*
+					 * settle detection for the -p ports after this
+					 */
+					i++;
+					if (i >= argc || bk390_settle_parse(&g->settle, argv[i]) != 0) {
+						fprintf(stdout,"Insufficient parameters; -e <tolerance>[%%|c][,<window ms>[,<timeout ms>]]|none\n");
+						exit(1);
+					}
+					break;
+
+				case 'C':
+					/*
+					 * calibration certificate for the -p ports
+					 * after this
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; -C <certificate|none>\n");
+						exit(1);
+					}
+					if (strcmp(argv[i], "none") == 0) bk390_cal_identity(&g->cal);
+					else if (bk390_cal_load(&g->cal, argv[i]) != 0) exit(1);
+					break;
+
+				case 'P':
+					/*
+					 * meter protocol for the -p ports after this,
+					 * auto probes each protocol in turn
+					 */
+					i++;
+					if (i < argc) {
+						if (strcmp(argv[i], "auto") == 0) {
+							g->protocol = NULL;
+						} else if ((g->protocol = bk390_protocol_find(argv[i])) == NULL) {
+							fprintf(stdout,"Unknown protocol '%s', known protocols are:\n", argv[i]);
+							for (const struct bk390_protocol *pr = bk390_protocols; pr->name; pr++) fprintf(stdout,"\t%-10s %s\n", pr->name, pr->desc);
+							exit(1);
+						}
+					} else {
+						fprintf(stdout,"Insufficient parameters; -P <protocol|auto>\n");
+						exit(1);
+					}
+					break;
+
 				case 'o':
 					/* 
 					 * output file where this program will put the text
@@ -295,56 +1012,252 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					}
 					break;
 
-				case 'd': g->debug = 1; break;
-
-				case 'q': g->quiet = 1; break;
+				case 'r':
+					/*
+					 * threshold / alarm rules, see struct rule
+					 */
+					i++;
+					if (i < argc) {
+						g->rules_file = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -r <rules file>\n");
+						exit(1);
+					}
+					break;
 
-				case 'v':
-							 fprintf(stdout,"Build %d\r\n", BUILD_VER);
-							 exit(0);
-							 break;
+				case 'c':
+					/*
+					 * pre/post trigger capture, -c <dir> -cb <secs> -ca <secs> -ct <triggers>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "value" : "capture directory");
+						exit(1);
+					}
+					if (argv[i-1][2] == 'b') {
+						g->capture.pre = atoi(argv[i]);
+					} else if (argv[i-1][2] == 'a') {
+						g->capture.post = atoi(argv[i]);
+					} else if (argv[i-1][2] == 't') {
+						g->capture.triggers = 0;
+						if (strstr(argv[i], "mode")) g->capture.triggers |= TRIGGER_MODE;
+						if (strstr(argv[i], "ol")) g->capture.triggers |= TRIGGER_OL;
+						if (strstr(argv[i], "rule")) g->capture.triggers |= TRIGGER_RULE;
+						if (strstr(argv[i], "signal")) g->capture.triggers |= TRIGGER_SIGNAL;
+					} else {
+						g->capture.dir = argv[i];
+					}
+					break;
 
-							 /*
-				case 'f':
-							 if (argv[i][2] == 'c') {
-								 i++;
-								 sscanf(argv[i], "%02x%02x%02x"
-										 , &g->font_color.r
-										 , &g->font_color.g
-										 , &g->font_color.b
-										 );
+				case 'i':
+					/*
+					 * Ah integrator, -i <state file> -ig <gap secs> -ic <checkpoint secs>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "seconds" : "state file");
+						exit(1);
+					}
+					if (argv[i-1][2] == 'g') {
+						g->integ.gap = atof(argv[i]);
+					} else if (argv[i-1][2] == 'c') {
+						g->integ.checkpoint = atoi(argv[i]);
+					} else {
+						g->integ.state_file = argv[i];
+					}
+					break;
 
-							 }
-							 break;
+				case 'j':
+					/*
+					 * derived channels, -j <name>=<expr> -jm <nearest|linear> -js <max skew ms>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "value" : "name=expression");
+						exit(1);
+					}
+					if (argv[i-1][2] == 'm') {
+						g->join.linear = (strcmp(argv[i], "linear") == 0);
+					} else if (argv[i-1][2] == 's') {
+						g->join.max_skew = (uint64_t)atoi(argv[i]) * 1000;
+					} else {
+						if (g->join.count >= JOIN_MAX) {
+							fprintf(stdout,"Too many joins, max %d\n", JOIN_MAX);
+							exit(1);
+						}
+						g->join.ch[g->join.count++].spec = argv[i];
+					}
+					break;
 
-				case 'b':
-							 if (argv[i][2] == 'c') {
-								 i++;
-								 sscanf(argv[i], "%02x%02x%02x"
-										 , &g->background_color.r
-										 , &g->background_color.g
-										 , &g->background_color.b
-										 );
-							 }
-							 break;
-							 */
+				case 'F':
+					/*
+					 * per sink output policy, see struct output_policy
+					 */
+					i++;
+					if (i < argc) {
+						output_policy_parse(g, argv[i]);
+					} else {
+						fprintf(stdout,"Insufficient parameters; -F <sink>:<policy>\n");
+						exit(1);
+					}
+					break;
 
-				case 'w':
-							 if (argv[i][2] == 'x') {
-								 i++;
-								 g->wx_forced = atoi(argv[i]);
-							 } else if (argv[i][2] == 'y') {
-								 i++;
-								 g->wy_forced = atoi(argv[i]);
-							 }
-							 break;
+				case 'L':
+					/*
+					 * reading log, -L <dir> -Ls <MB> -Lt <secs> -Lf <none|rotate|secs> -Lb <readings>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "value" : "directory");
+						exit(1);
+					}
+					if (argv[i-1][2] == 's') {
+						g->log.rotate_bytes = (uint64_t)atoi(argv[i]) * 1024 * 1024;
+					} else if (argv[i-1][2] == 't') {
+						g->log.rotate_us = (uint64_t)atoi(argv[i]) * 1000000;
+					} else if (argv[i-1][2] == 'f') {
+						if (strcmp(argv[i], "none") == 0) g->log.fsync_mode = BKLOG_FSYNC_NONE;
+						else if (strcmp(argv[i], "rotate") == 0) g->log.fsync_mode = BKLOG_FSYNC_ROTATE;
+						else {
+							g->log.fsync_mode = BKLOG_FSYNC_INTERVAL;
+							g->log.fsync_us = (uint64_t)(atof(argv[i]) * 1000000);
+						}
+					} else if (argv[i-1][2] == 'b') {
+						g->log.batch = atoi(argv[i]);
+						if (g->log.batch < 1) g->log.batch = 1;
+						if (g->log.batch > BKLOG_BATCH_MAX) g->log.batch = BKLOG_BATCH_MAX;
+					} else {
+						g->log.dir = argv[i];
+					}
+					break;
 
-				case 's':
-							 i++;
-							 g->serial_parameters_string = argv[i];
-							 // Not needed, we hard code at 2400-8n1 because
-							 // that's what these meters should be doing.  
-							 //
+				case 'g':
+					/*
+					 * dashboard grid, -g <columns>
+					 */
+					i++;
+					if (i < argc) {
+						g->display.grid = 1;
+						g->display.columns = atoi(argv[i]);
+					} else {
+						fprintf(stdout,"Insufficient parameters; -g <columns>\n");
+						exit(1);
+					}
+					break;
+
+				case 'S':
+					/*
+					 * sigrok sessions, -S <prefix> -Ss <Hz> -St <secs>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] ? "value" : "prefix");
+						exit(1);
+					}
+					if (argv[i-1][2] == 's') {
+						g->sr_samplerate = atoi(argv[i]);
+					} else if (argv[i-1][2] == 't') {
+						g->sr_rotate_us = (uint64_t)atoi(argv[i]) * 1000000;
+					} else {
+						g->sr_prefix = argv[i];
+					}
+					break;
+
+				case 'W':
+					/*
+					 * stale watchdog, -W <seconds>
+					 */
+					i++;
+					if (i < argc) {
+						g->wd.stale_us = strtod(argv[i], NULL) * 1e6;
+					} else {
+						fprintf(stdout,"Insufficient parameters; -W <seconds>\n");
+						exit(1);
+					}
+					break;
+
+				case 'H':
+					/*
+					 * overlay server, -H [addr:]port
+					 */
+					i++;
+					if (i < argc) {
+						g->http.spec = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -H <[address:]port|unix:path>\n");
+						exit(1);
+					}
+					break;
+
+				case 'd': g->debug = 1; break;
+
+				case 'D': g->display.panel = 1; break;
+
+				case 'q': g->quiet = 1; break;
+
+				case 'v':
+							 fprintf(stdout,"Build %d\r\n", BUILD_VER);
+							 exit(0);
+							 break;
+
+				case 'f':
+				case 'b':
+					/*
+					 * -fc / -bc <rrggbb>
+					 */
+					i++;
+					if (i >= argc || argv[i-1][2] != 'c' || colour_parse(argv[i], argv[i-1][1] == 'f' ? &g->font_color : &g->background_color) != 0) {
+						fprintf(stdout,"Insufficient parameters; %s <rrggbb>\n", argv[i-1]);
+						exit(1);
+					}
+					break;
+
+				case 't':
+					/*
+					 * text effect, -t <plain|outline|shadow> -tw <pixels> -tc <rrggbb>
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; %s <%s>\n", argv[i-1], argv[i-1][2] == 'w' ? "pixels" : argv[i-1][2] == 'c' ? "rrggbb" : "plain|outline|shadow");
+						exit(1);
+					}
+					if (argv[i-1][2] == 'w') {
+						g->display.fx.width = atoi(argv[i]);
+						if (g->display.fx.width < 0) g->display.fx.width = 0;
+					} else if (argv[i-1][2] == 'c') {
+						if (colour_parse(argv[i], &g->display.fx.colour) != 0) {
+							fprintf(stdout,"Insufficient parameters; -tc <rrggbb>\n");
+							exit(1);
+						}
+					} else if (strcmp(argv[i], "outline") == 0) {
+						g->display.fx.mode = TEXT_OUTLINE;
+					} else if (strcmp(argv[i], "shadow") == 0) {
+						g->display.fx.mode = TEXT_SHADOW;
+					} else if (strcmp(argv[i], "plain") == 0) {
+						g->display.fx.mode = TEXT_PLAIN;
+					} else {
+						fprintf(stdout,"Insufficient parameters; -t <plain|outline|shadow>\n");
+						exit(1);
+					}
+					break;
+
+
+				case 'w':
+							 if (argv[i][2] == 'x') {
+								 i++;
+								 g->wx_forced = atoi(argv[i]);
+							 } else if (argv[i][2] == 'y') {
+								 i++;
+								 g->wy_forced = atoi(argv[i]);
+							 }
+							 break;
+
+				case 's':
+							 i++;
+							 g->bk.params = argv[i];
+							 // Not needed, we hard code at 2400-8n1 because
+							 // that's what these meters should be doing.  
+							 //
 							 // If not, then feel free to adjust the parameter or
 							 // populate this section.
 							 break;
@@ -354,145 +1267,2780 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 		}
 	}
 
-	return 0;
+	return 0;
+}
+
+
+
+/*
+ * Capture writer thread, turns full snapshots in to CSV files
+ * in the capture directory.  Formats in to a fixed buffer and
+ * writes with write() so there's no stdio buffer to allocate.
+ *
+ */
+static const char *trigger_name(int reason) {
+	switch (reason) {
+		case TRIGGER_MODE: return "mode";
+		case TRIGGER_OL: return "ol";
+		case TRIGGER_RULE: return "rule";
+		case TRIGGER_SIGNAL: return "signal";
+	}
+	return "unknown";
+}
+
+static void *capture_writer(void *arg) {
+	struct glb *g = (struct glb *)arg;
+	struct capture_engine *c = &g->capture;
+	static char buf[65536];
+
+	while (1) {
+		struct capture_snapshot *s = NULL;
+		char fn[4096], stamp[32];
+		struct tm tm;
+		time_t t;
+		int fd, l = 0;
+
+		pthread_mutex_lock(&c->lock);
+		while (!s) {
+			for (int i = 0; i < CAPTURE_SNAPSHOTS; i++) {
+				if (c->snap[i].full) { s = &c->snap[i]; break; }
+			}
+			if (!s) pthread_cond_wait(&c->cond, &c->lock);
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		t = s->trigger_ts / 1000000;
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+		snprintf(fn, sizeof(fn), "%s/capture-m%d-%s-%06u.csv", c->dir, s->meter, stamp, (unsigned int)(s->trigger_ts % 1000000));
+
+		fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			fprintf(stderr,"%s:%d: Unable to write capture '%s' (%s)\n", FL, fn, strerror(errno));
+		} else {
+			l = snprintf(buf, sizeof(buf), "# BK390A capture, meter %d, trigger %s at %llu, %ds before / %ds after\n"
+					"# ts_us,offset_s,display,si,ol,frame\n"
+					, s->meter, trigger_name(s->reason), (unsigned long long)s->trigger_ts, c->pre, c->post);
+
+			for (int i = 0; i < s->count; i++) {
+				struct bk390_reading *r = &s->h[i];
+
+				if (l > (int)sizeof(buf) - 256) {
+					if (write(fd, buf, l) != l) break;
+					l = 0;
+				}
+				l += snprintf(buf + l, sizeof(buf) - l, "%llu,%.6f,\"%s\",%.9g,%d,", (unsigned long long)r->ts, ((double)r->ts - (double)s->trigger_ts) / 1e6, r->text, r->si, r->ol);
+				for (int j = 0; j < r->raw_len; j++) l += snprintf(buf + l, sizeof(buf) - l, "%02x", r->raw[j]);
+				buf[l++] = '\n';
+			}
+			if (l && write(fd, buf, l) != l) fprintf(stderr,"%s:%d: Short write on capture '%s'\n", FL, fn);
+			close(fd);
+			METRIC_INC(c->written);
+			if (g->debug) fprintf(stdout,"Capture written to %s (%d readings)\r\n", fn, s->count);
+		}
+
+		pthread_mutex_lock(&c->lock);
+		s->full = 0;
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	return NULL;
+}
+
+void capture_init(struct glb *g) {
+	struct capture_engine *c = &g->capture;
+
+	c->size = (c->pre + c->post) * CAPTURE_RATE_MAX + 16;
+	for (int m = 0; m < g->bk.count; m++) {
+		c->ring[m].h = (struct bk390_reading *)calloc(c->size, sizeof(struct bk390_reading));
+	}
+	for (int i = 0; i < CAPTURE_SNAPSHOTS; i++) {
+		c->snap[i].h = (struct bk390_reading *)calloc(c->size, sizeof(struct bk390_reading));
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_create(&c->writer, NULL, capture_writer, g);
+	pthread_detach(c->writer);
+}
+
+/*
+ * Start the post-trigger window, further triggers are ignored
+ * until this one has been handed to the writer.
+ *
+ */
+void capture_trigger(struct glb *g, int meter, int reason, uint64_t ts) {
+	struct capture_engine *c = &g->capture;
+	struct capture_ring *cr = &c->ring[meter];
+
+	if (!c->dir || !(c->triggers & reason) || cr->collecting) return;
+
+	cr->collecting = 1;
+	cr->reason = reason;
+	cr->trigger_ts = ts;
+	cr->trigger_head = cr->head;
+	cr->post_until = ts + (uint64_t)c->post * 1000000;
+	if (g->debug) fprintf(stdout,"Capture triggered on meter %d (%s)\r\n", meter, trigger_name(reason));
+}
+
+/*
+ * Copy the pre/post window out of the ring in to a free snapshot
+ * and wake the writer.
+ *
+ */
+static void capture_flush(struct glb *g, int meter) {
+	struct capture_engine *c = &g->capture;
+	struct capture_ring *cr = &c->ring[meter];
+	struct capture_snapshot *s = NULL;
+	uint64_t pre_us = (uint64_t)c->pre * 1000000;
+	unsigned int first;
+
+	cr->collecting = 0;
+	c->events++;
+
+	/*
+	 * Walk back from the trigger to the start of the pre-trigger
+	 * window, or as far as the ring still holds.
+	 */
+	first = cr->trigger_head;
+	while (first > 0 && cr->head - (first - 1) <= c->size) {
+		struct bk390_reading *r = &cr->h[(first - 1) % c->size];
+		if (r->ts + pre_us < cr->trigger_ts) break;
+		first--;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for (int i = 0; i < CAPTURE_SNAPSHOTS; i++) {
+		if (!c->snap[i].full) { s = &c->snap[i]; break; }
+	}
+	if (s) {
+		s->count = 0;
+		for (unsigned int i = first; i != cr->head; i++) s->h[s->count++] = cr->h[i % c->size];
+		s->meter = meter;
+		s->reason = cr->reason;
+		s->trigger_ts = cr->trigger_ts;
+		s->full = 1;
+		pthread_cond_signal(&c->cond);
+	} else {
+		c->dropped++;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (!s) fprintf(stderr,"%s:%d: Capture writer busy, event on meter %d dropped\n", FL, meter);
+}
+
+/*
+ * Add a fresh reading to the meter's history, fire the function
+ * change and overload triggers, and finish the post-trigger
+ * window once it's long enough.
+ *
+ */
+void capture_add(struct glb *g, struct bk390_reading *r) {
+	struct capture_engine *c = &g->capture;
+	struct capture_ring *cr = &c->ring[r->meter];
+
+	cr->h[cr->head % c->size] = *r;
+	cr->head++;
+
+	if (cr->head > 1 && r->d[BYTE_FUNCTION] != cr->last_function) capture_trigger(g, r->meter, TRIGGER_MODE, r->ts);
+	if (r->ol) capture_trigger(g, r->meter, TRIGGER_OL, r->ts);
+	cr->last_function = r->d[BYTE_FUNCTION];
+
+	/*
+	 * Finish early if the meter is sending faster than we sized for
+	 * and the ring is about to overwrite the trigger itself
+	 */
+	if (cr->collecting && (r->ts >= cr->post_until || cr->head - cr->trigger_head >= c->size - 1)) capture_flush(g, r->meter);
+}
+
+/*
+ * Finish post-trigger windows for meters that have gone quiet
+ */
+void capture_tick(struct glb *g, uint64_t now) {
+	struct capture_engine *c = &g->capture;
+
+	for (int m = 0; m < g->bk.count; m++) {
+		if (c->ring[m].collecting && now >= c->ring[m].post_until) capture_flush(g, m);
+	}
+}
+
+static volatile sig_atomic_t capture_signalled = 0;
+
+static void capture_signal(int sig) {
+	(void)sig;
+	capture_signalled = 1;
+}
+
+/*
+ * Exec hook worker.
+ *
+ * Hooks are spawned and waited on here rather than in the meter loop,
+ * the loop only drops a job in to the queue.  If the queue fills up
+ * because a hook is hanging, further jobs are dropped and counted.
+ *
+ */
+extern char **environ;
+
+static void *hook_worker(void *arg) {
+	struct rules_engine *e = (struct rules_engine *)arg;
+
+	while (1) {
+		struct hook_job job;
+		char env_rule[64], env_meter[64], env_state[64], env_value[64], env_ts[64];
+		char *envp[1024];
+		char *argv[4];
+		pid_t pid;
+		int n, status, err;
+
+		pthread_mutex_lock(&e->lock);
+		while (e->head == e->tail) pthread_cond_wait(&e->cond, &e->lock);
+		job = e->jobs[e->tail % HOOK_QUEUE_SIZE];
+		e->tail++;
+		pthread_mutex_unlock(&e->lock);
+
+		snprintf(env_rule, sizeof(env_rule), "BK390_RULE=%d", job.line);
+		snprintf(env_meter, sizeof(env_meter), "BK390_METER=%d", job.meter);
+		snprintf(env_state, sizeof(env_state), "BK390_STATE=%s", job.set ? "set" : "clear");
+		snprintf(env_value, sizeof(env_value), "BK390_VALUE=%g", job.v);
+		snprintf(env_ts, sizeof(env_ts), "BK390_TS=%llu", (unsigned long long)job.ts);
+
+		n = 0;
+		envp[n++] = env_rule;
+		envp[n++] = env_meter;
+		envp[n++] = env_state;
+		envp[n++] = env_value;
+		envp[n++] = env_ts;
+		for (char **ep = environ; *ep && n < 1023; ep++) envp[n++] = *ep;
+		envp[n] = NULL;
+
+		argv[0] = (char *)"sh";
+		argv[1] = (char *)"-c";
+		argv[2] = e->args[job.arg].cmd;
+		argv[3] = NULL;
+
+		if ((err = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, envp)) == 0) {
+			waitpid(pid, &status, 0);
+			METRIC_INC(e->hooks_run);
+		} else {
+			fprintf(stderr,"%s:%d: Unable to run hook for rule %d (%s)\n", FL, job.line, strerror(err));
+			METRIC_INC(e->hooks_failed);
+		}
+	}
+
+	return NULL;
+}
+
+static void rule_fire(struct glb *g, struct rule *r, int set, double v, uint64_t ts) {
+	struct rules_engine *e = &g->rules;
+
+	r->active = set;
+	if (g->debug) fprintf(stdout,"Rule %d %s, meter %d value %g\r\n", r->line, set ? "set" : "cleared", r->meter, v);
+
+	switch (r->action) {
+		case ACTION_COLOUR:
+			{
+				/*
+				 * First active colour rule in the file wins
+				 */
+				e->colour_active[r->meter] = 0;
+				for (int i = e->start[r->meter]; i < e->start[r->meter + 1]; i++) {
+					if (e->r[i].action == ACTION_COLOUR && e->r[i].active) {
+						e->colour[r->meter] = e->r[i].colour;
+						e->colour_active[r->meter] = 1;
+						break;
+					}
+				}
+			}
+			break;
+
+		case ACTION_UDP:
+			{
+				char msg[256];
+				int l;
+				l = snprintf(msg, sizeof(msg), "BK390A rule=%d meter=%d state=%s value=%g ts=%llu\n", r->line, r->meter, set ? "set" : "clear", v, (unsigned long long)ts);
+				sendto(e->args[r->arg].fd, msg, l, MSG_DONTWAIT, (struct sockaddr *)&e->args[r->arg].addr, e->args[r->arg].addr_len);
+			}
+			break;
+
+		case ACTION_EXEC:
+			pthread_mutex_lock(&e->lock);
+			if (e->head - e->tail < HOOK_QUEUE_SIZE) {
+				struct hook_job *j = &e->jobs[e->head % HOOK_QUEUE_SIZE];
+				j->arg = r->arg;
+				j->line = r->line;
+				j->meter = r->meter;
+				j->set = set;
+				j->v = v;
+				j->ts = ts;
+				e->head++;
+				pthread_cond_signal(&e->cond);
+			} else {
+				e->dropped++;
+			}
+			pthread_mutex_unlock(&e->lock);
+			break;
+
+		case ACTION_CAPTURE:
+			if (set) capture_trigger(g, r->meter, TRIGGER_RULE, ts);
+			break;
+	}
+}
+
+/*
+ * Evaluate every rule for this reading's meter, fires actions only
+ * on the edge between inactive and active.
+ *
+ */
+void rules_eval(struct glb *g, struct bk390_reading *rd) {
+	struct rules_engine *e = &g->rules;
+	struct rule *r = e->r + e->start[rd->meter];
+	struct rule *end = e->r + e->start[rd->meter + 1];
+	double v = rd->fsi;
+	int hit = 0;
+
+	/*
+	 * An overload counts as being well past any level in
+	 * the direction of the sign
+	 */
+	if (rd->ol) v = (rd->d[BYTE_STATUS] & STATUS_SIGN) ? -HUGE_VAL : HUGE_VAL;
+
+	e->last_seen[rd->meter] = rd->ts;
+
+	/*
+	 * A stale rule this reading clears, or the first reading of
+	 * a meter, can be due before anything rules_tick() knew of
+	 */
+	if (e->stale_count && e->stale_min[rd->meter] != UINT64_MAX && rd->ts + e->stale_min[rd->meter] < e->stale_next) {
+		e->stale_next = rd->ts + e->stale_min[rd->meter];
+	}
+
+	for (; r < end; r++) {
+		switch (r->kind) {
+			case RULE_VALUE:
+				hit = (v * r->dir > (r->active ? r->release : r->trip));
+				break;
+
+			case RULE_RATE:
+				hit = 0;
+				if (r->prev_ts && rd->ts > r->prev_ts && !rd->ol) {
+					double rate = (v - r->prev_v) * 1e6 / (double)(rd->ts - r->prev_ts);
+					hit = (rate * r->dir > (r->active ? r->release : r->trip));
+				}
+				if (rd->ol) r->prev_ts = 0;
+				else {
+					r->prev_v = v;
+					r->prev_ts = rd->ts;
+				}
+				break;
+
+			case RULE_FLAG:
+				hit = ((rd->d[r->flag_byte] & r->flag_mask) != 0);
+				break;
+
+			case RULE_STALE:
+				hit = 0; // a fresh frame is by definition not stale
+				break;
+		}
+
+		if (hit != r->active) rule_fire(g, r, hit, v, rd->ts);
+	}
+}
+
+/*
+ * Stale rules can't wait for a reading to come along, they're
+ * checked from the main loop.  Only the stale rules are looked at,
+ * and only once the earliest of their deadlines has come round,
+ * readings just move the deadlines on.
+ *
+ */
+void rules_tick(struct glb *g, uint64_t now) {
+	struct rules_engine *e = &g->rules;
+	uint64_t next = UINT64_MAX;
+
+	if (e->stale_count == 0 || now < e->stale_next) return;
+
+	for (int k = 0; k < e->stale_count; k++) {
+		struct rule *r = &e->r[e->stale[k]];
+		uint64_t seen = e->last_seen[r->meter];
+
+		if (r->active || !seen) continue;
+		if (now > seen + r->stale_us) rule_fire(g, r, 1, (now - seen) / 1e6, now);
+		else if (seen + r->stale_us < next) next = seen + r->stale_us;
+	}
+	e->stale_next = next;
+}
+
+/*
+ * Stale watchdog, see struct watchdog
+ */
+static void watchdog_arm(struct watchdog *w) {
+	struct itimerspec its;
+	uint64_t next = 0;
+
+	for (int m = 0; m < METERS_MAX; m++) {
+		if (w->deadline[m] && !w->stale[m] && (!next || w->deadline[m] < next)) next = w->deadline[m];
+	}
+	if (next == w->armed) return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000;
+	its.it_value.tv_nsec = (next % 1000000) * 1000;
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		fprintf(stderr,"%s:%d: Unable to arm the stale watchdog (%s)\n", FL, strerror(errno));
+	}
+	w->armed = next;
+}
+
+/*
+ * Meters that haven't sent anything yet have stale_us from startup
+ */
+void watchdog_init(struct glb *g) {
+	struct watchdog *w = &g->wd;
+	uint64_t now = mono_ns() / 1000;
+
+	if (!w->stale_us) return;
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create the stale watchdog timer (%s), readings won't be marked stale\n", FL, strerror(errno));
+		return;
+	}
+	for (int m = 0; m < g->bk.count; m++) w->deadline[m] = now + w->stale_us;
+	watchdog_arm(w);
+}
+
+/*
+ * A fresh frame from meter m, returns 1 if it was stale until now
+ */
+int watchdog_feed(struct glb *g, int m) {
+	struct watchdog *w = &g->wd;
+
+	if (w->fd < 0) return 0;
+	w->deadline[m] = mono_ns() / 1000 + w->stale_us;
+	if (!w->stale[m]) return 0;
+
+	/*
+	 * Back from stale, the timer might have nothing else to do
+	 * and be disarmed
+	 */
+	w->stale[m] = 0;
+	if (!w->armed) watchdog_arm(w);
+	return 1;
+}
+
+int watchdog_pollfds(struct glb *g, struct pollfd *pfd) {
+	if (g->wd.fd < 0) return 0;
+	pfd->fd = g->wd.fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+	return 1;
+}
+
+/*
+ * Returns 1 if a meter went stale
+ */
+int watchdog_poll(struct glb *g, struct pollfd *pfd) {
+	struct watchdog *w = &g->wd;
+	uint64_t expirations, now;
+	int changed = 0;
+
+	if (w->fd < 0 || !(pfd->revents & POLLIN)) return 0;
+	if (read(w->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return 0;
+	w->wakeups++;
+	w->armed = 0;
+
+	now = mono_ns() / 1000;
+	for (int m = 0; m < g->bk.count; m++) {
+		if (w->stale[m] || w->deadline[m] > now) continue;
+		w->stale[m] = 1;
+		w->expiries++;
+		changed = 1;
+		if (!g->quiet) fprintf(stderr,"%s:%d: Meter %d has sent nothing for %.1fs, reading marked stale\n", FL, m, w->stale_us / 1e6);
+	}
+	watchdog_arm(w);
+	return changed;
+}
+
+void watchdog_close(struct glb *g) {
+	if (g->wd.fd >= 0) close(g->wd.fd);
+	g->wd.fd = -1;
+}
+
+static char *next_token(char **p) {
+	char *t;
+
+	while (**p == ' ' || **p == '\t') (*p)++;
+	if (**p == '\0') return NULL;
+	t = *p;
+	while (**p && **p != ' ' && **p != '\t') (*p)++;
+	if (**p) *(*p)++ = '\0';
+	return t;
+}
+
+/*
+ * Read and compile the rules file in to the flat evaluation array.
+ *
+ * Rules for '*' are expanded to one rule per meter here so each
+ * meter carries its own hysteresis state.
+ *
+ */
+/*
+ * Next free action argument, there's one per udp or exec rule line
+ */
+static int rules_arg(struct glb *g, int lineno) {
+	struct rules_engine *e = &g->rules;
+
+	if (e->arg_count >= RULES_MAX) {
+		fprintf(stderr,"%s:%d: %s line %d: too many udp/exec actions (max %d)\n", FL, g->rules_file, lineno, RULES_MAX);
+		exit(1);
+	}
+	return e->arg_count++;
+}
+
+void rules_load(struct glb *g) {
+	struct rules_engine *e = &g->rules;
+	struct rule *tmp;
+	char line[SSIZE];
+	int lineno = 0;
+	int n = 0;
+	int count[METERS_MAX];
+	FILE *f;
+
+	f = fopen(g->rules_file, "r");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to open rules file '%s' (%s)\n", FL, g->rules_file, strerror(errno));
+		exit(1);
+	}
+
+	tmp = (struct rule *)calloc(RULES_MAX, sizeof(struct rule));
+	e->args = (struct rule_arg *)calloc(RULES_MAX, sizeof(struct rule_arg));
+
+	while (fgets(line, sizeof(line), f)) {
+		struct rule r;
+		char *p = line, *t, *op;
+		int first, last;
+
+		lineno++;
+		if ((t = strchr(line, '\n'))) *t = '\0';
+		if ((t = strchr(line, '\r'))) *t = '\0';
+
+		t = next_token(&p);
+		if (!t || *t == '#') continue;
+
+		memset(&r, 0, sizeof(r));
+		r.line = lineno;
+		r.dir = 1.0;
+
+		if (strcmp(t, "*") == 0) {
+			first = 0;
+			last = g->bk.count - 1;
+		} else {
+			first = last = atoi(t);
+			if (first < 0 || first >= g->bk.count) {
+				fprintf(stderr,"%s:%d: %s line %d: no such meter '%s'\n", FL, g->rules_file, lineno, t);
+				exit(1);
+			}
+		}
+
+		t = next_token(&p);
+		if (!t) t = (char *)"";
+
+		if (strcmp(t, "value") == 0 || strcmp(t, "rate") == 0) {
+			double level, hyst = 0.0;
+
+			r.kind = (t[0] == 'v') ? RULE_VALUE : RULE_RATE;
+			op = next_token(&p);
+			t = next_token(&p);
+			if (!op || !t || (op[0] != '<' && op[0] != '>')) {
+				fprintf(stderr,"%s:%d: %s line %d: expected <|> <level>\n", FL, g->rules_file, lineno);
+				exit(1);
+			}
+			if (op[0] == '<') r.dir = -1.0;
+			level = strtod(t, NULL);
+
+			while (*p == ' ' || *p == '\t') p++;
+			if (strncmp(p, "hyst", 4) == 0) {
+				next_token(&p);
+				t = next_token(&p);
+				if (t) hyst = fabs(strtod(t, NULL));
+			}
+			r.trip = r.dir * level;
+			r.release = r.trip - hyst;
+
+		} else if (strcmp(t, "stale") == 0) {
+			r.kind = RULE_STALE;
+			t = next_token(&p);
+			if (!t) {
+				fprintf(stderr,"%s:%d: %s line %d: expected stale <seconds>\n", FL, g->rules_file, lineno);
+				exit(1);
+			}
+			r.stale_us = strtod(t, NULL) * 1e6;
+
+		} else if (strcmp(t, "flag") == 0) {
+			r.kind = RULE_FLAG;
+			t = next_token(&p);
+			if (!t) t = (char *)"";
+			if (strcmp(t, "batt") == 0) { r.flag_byte = BYTE_STATUS; r.flag_mask = STATUS_BATT; }
+			else if (strcmp(t, "ol") == 0) { r.flag_byte = BYTE_STATUS; r.flag_mask = STATUS_OL; }
+			else if (strcmp(t, "apo") == 0) { r.flag_byte = BYTE_OPTION_2; r.flag_mask = OPTION2_APO; }
+			else if (strcmp(t, "auto") == 0) { r.flag_byte = BYTE_OPTION_2; r.flag_mask = OPTION2_AUTO; }
+			else if (strcmp(t, "ac") == 0) { r.flag_byte = BYTE_OPTION_2; r.flag_mask = OPTION2_AC; }
+			else if (strcmp(t, "dc") == 0) { r.flag_byte = BYTE_OPTION_2; r.flag_mask = OPTION2_DC; }
+			else if (strcmp(t, "max") == 0) { r.flag_byte = BYTE_OPTION_1; r.flag_mask = OPTION1_PMAX; }
+			else if (strcmp(t, "min") == 0) { r.flag_byte = BYTE_OPTION_1; r.flag_mask = OPTION1_PMIN; }
+			else {
+				fprintf(stderr,"%s:%d: %s line %d: unknown flag '%s'\n", FL, g->rules_file, lineno, t);
+				exit(1);
+			}
+
+		} else {
+			fprintf(stderr,"%s:%d: %s line %d: unknown rule '%s'\n", FL, g->rules_file, lineno, t);
+			exit(1);
+		}
+
+		/*
+		 * Action
+		 */
+		t = next_token(&p);
+		if (!t) t = (char *)"";
+
+		if (strcmp(t, "colour") == 0 || strcmp(t, "color") == 0) {
+			unsigned int rr = 255, gg = 0, bb = 0;
+			r.action = ACTION_COLOUR;
+			t = next_token(&p);
+			if (t) sscanf(t, "%02x%02x%02x", &rr, &gg, &bb);
+			r.colour = { (uint8_t)rr, (uint8_t)gg, (uint8_t)bb, 255 };
+
+		} else if (strcmp(t, "udp") == 0) {
+			struct addrinfo hints, *ai;
+			char *port;
+
+			r.action = ACTION_UDP;
+			t = next_token(&p);
+			port = t ? strrchr(t, ':') : NULL;
+			if (!port) {
+				fprintf(stderr,"%s:%d: %s line %d: expected udp <host>:<port>\n", FL, g->rules_file, lineno);
+				exit(1);
+			}
+			*port++ = '\0';
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_DGRAM;
+			if (getaddrinfo(t, port, &hints, &ai) != 0) {
+				fprintf(stderr,"%s:%d: %s line %d: unable to resolve '%s'\n", FL, g->rules_file, lineno, t);
+				exit(1);
+			}
+			r.arg = rules_arg(g, lineno);
+			memcpy(&e->args[r.arg].addr, ai->ai_addr, ai->ai_addrlen);
+			e->args[r.arg].addr_len = ai->ai_addrlen;
+			e->args[r.arg].fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+			freeaddrinfo(ai);
+			if (e->args[r.arg].fd < 0) {
+				fprintf(stderr,"%s:%d: %s line %d: unable to open udp socket (%s)\n", FL, g->rules_file, lineno, strerror(errno));
+				exit(1);
+			}
+
+		} else if (strcmp(t, "capture") == 0) {
+			if (!g->capture.dir) {
+				fprintf(stderr,"%s:%d: %s line %d: capture action needs -c <directory>\n", FL, g->rules_file, lineno);
+				exit(1);
+			}
+			r.action = ACTION_CAPTURE;
+
+		} else if (strcmp(t, "exec") == 0) {
+			while (*p == ' ' || *p == '\t') p++;
+			if (*p == '\0') {
+				fprintf(stderr,"%s:%d: %s line %d: expected exec <command>\n", FL, g->rules_file, lineno);
+				exit(1);
+			}
+			r.action = ACTION_EXEC;
+			r.arg = rules_arg(g, lineno);
+			e->args[r.arg].cmd = strdup(p);
+
+		} else {
+			fprintf(stderr,"%s:%d: %s line %d: unknown action '%s'\n", FL, g->rules_file, lineno, t);
+			exit(1);
+		}
+
+		for (int m = first; m <= last; m++) {
+			if (n >= RULES_MAX) {
+				fprintf(stderr,"%s:%d: %s: too many rules (max %d)\n", FL, g->rules_file, RULES_MAX);
+				exit(1);
+			}
+			r.meter = m;
+			tmp[n++] = r;
+		}
+	}
+	fclose(f);
+
+	/*
+	 * Lay the rules out by meter, keeping file order within each
+	 * meter so that "first colour wins" means what it says.
+	 *
+	 */
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < n; i++) count[tmp[i].meter]++;
+	e->start[0] = 0;
+	for (int m = 0; m < METERS_MAX; m++) e->start[m + 1] = e->start[m] + count[m];
+
+	e->r = (struct rule *)calloc(n ? n : 1, sizeof(struct rule));
+	memset(count, 0, sizeof(count));
+	for (int i = 0; i < n; i++) {
+		int m = tmp[i].meter;
+		e->r[e->start[m] + count[m]++] = tmp[i];
+	}
+	e->count = n;
+	free(tmp);
+
+	e->stale = (int *)calloc(n ? n : 1, sizeof(int));
+	e->stale_count = 0;
+	e->stale_next = UINT64_MAX;
+	for (int m = 0; m < METERS_MAX; m++) e->stale_min[m] = UINT64_MAX;
+	for (int i = 0; i < n; i++) {
+		struct rule *r = &e->r[i];
+
+		if (r->kind != RULE_STALE) continue;
+		e->stale[e->stale_count++] = i;
+		if (r->stale_us < e->stale_min[r->meter]) e->stale_min[r->meter] = r->stale_us;
+	}
+
+	/*
+	 * Only start the hook worker if something is going to use it
+	 */
+	for (int i = 0; i < n; i++) {
+		if (e->r[i].action == ACTION_EXEC) {
+			pthread_mutex_init(&e->lock, NULL);
+			pthread_cond_init(&e->cond, NULL);
+			pthread_create(&e->worker, NULL, hook_worker, e);
+			pthread_detach(e->worker);
+			break;
+		}
+	}
+
+	if (!g->quiet) fprintf(stdout,"Loaded %d rules from %s\n", n, g->rules_file);
+}
+
+/*
+ * Add one point to an integrator.  v is only looked at if the
+ * point is valid, an invalid point just breaks the integration.
+ *
+ */
+void integrate_point(struct integrator_engine *ie, struct integrator *it, uint64_t ts, double v) {
+	if (it->last_ts && ts > it->last_ts) {
+		double dt = (ts - it->last_ts) / 1e6;
+
+		if (dt > ie->gap) {
+			it->gaps++;
+		} else {
+			double y = ((it->last_v + v) / 2.0) * dt - it->comp;
+			double t = it->total + y;
+			it->comp = (t - it->total) - y;
+			it->total = t;
+			it->seconds += dt;
+		}
+	}
+	it->last_ts = ts;
+	it->last_v = v;
+}
+
+void integrate_reading(struct glb *g, struct bk390_reading *r) {
+	struct integrator *it = &g->integ.it[r->meter];
+
+	switch (r->d[BYTE_FUNCTION]) {
+		case FUNCTION_CURRENT_UA:
+		case FUNCTION_CURRENT_MA:
+		case FUNCTION_CURRENT_A:
+			break;
+		default:
+			it->last_ts = 0;
+			return;
+	}
+
+	/*
+	 * RMS current doesn't integrate to anything meaningful
+	 */
+	if (r->d[BYTE_OPTION_2] & OPTION2_AC) {
+		it->last_ts = 0;
+		return;
+	}
+
+	if (r->ol) {
+		it->overloads++;
+		it->last_ts = 0;
+		return;
+	}
+
+	integrate_point(&g->integ, it, r->ts, r->si);
+}
+
+/*
+ * Format an integrator total as Ah/Wh with a sensible prefix
+ */
+void integrator_text(struct integrator *it, char *buf, size_t len) {
+	double h = it->total / 3600.0;
+	double a = fabs(h);
+
+	if (a >= 1000.0) snprintf(buf, len, "%.3fk%s", h / 1e3, it->units);
+	else if (a >= 1.0) snprintf(buf, len, "%.4f%s", h, it->units);
+	else if (a >= 1e-3) snprintf(buf, len, "%.4fm%s", h * 1e3, it->units);
+	else snprintf(buf, len, "%.4f\u00B5%s", h * 1e6, it->units);
+}
+
+/*
+ * Totals are checkpointed to the state file (via a .tmp and rename,
+ * same as the -o output) so a restart picks up where it left off.
+ *
+ */
+void integrator_save(struct glb *g) {
+	struct integrator_engine *ie = &g->integ;
+	char tfn[4096];
+	FILE *f;
+
+	snprintf(tfn, sizeof(tfn), "%s.tmp", ie->state_file);
+	f = fopen(tfn, "w");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to write integrator state '%s' (%s)\n", FL, tfn, strerror(errno));
+		return;
+	}
+	fprintf(f, "# BK390A integrator state: name total(SI.s) seconds gaps overloads\n");
+	for (int i = 0; i < ie->count; i++) {
+		struct integrator *it = &ie->it[i];
+		fprintf(f, "%s %.17g %.17g %u %u\n", it->name, it->total, it->seconds, it->gaps, it->overloads);
+	}
+	fclose(f);
+	rename(tfn, ie->state_file);
+}
+
+void integrator_init(struct glb *g) {
+	struct integrator_engine *ie = &g->integ;
+	char line[SSIZE];
+	FILE *f;
+
+	for (int m = 0; m < g->bk.count; m++) {
+		snprintf(ie->it[m].name, sizeof(ie->it[m].name), "m%d", m);
+		snprintf(ie->it[m].units, sizeof(ie->it[m].units), "Ah");
+	}
+	for (int j = 0; j < g->join.count; j++) {
+		struct integrator *it = &ie->it[g->bk.count + j];
+		snprintf(it->name, sizeof(it->name), "%s", g->join.ch[j].name);
+		snprintf(it->units, sizeof(it->units), "Wh");
+	}
+	ie->count = g->bk.count + g->join.count;
+	ie->last_checkpoint = now_us();
+
+	f = fopen(ie->state_file, "r");
+	if (!f) return;
+
+	while (fgets(line, sizeof(line), f)) {
+		char name[16];
+		double total, seconds;
+		unsigned int gaps, overloads;
+
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%15s %lf %lf %u %u", name, &total, &seconds, &gaps, &overloads) != 5) continue;
+		for (int i = 0; i < ie->count; i++) {
+			if (strcmp(ie->it[i].name, name) == 0) {
+				ie->it[i].total = total;
+				ie->it[i].seconds = seconds;
+				ie->it[i].gaps = gaps;
+				ie->it[i].overloads = overloads;
+			}
+		}
+	}
+	fclose(f);
+	if (!g->quiet) fprintf(stdout,"Integrator totals restored from %s\n", ie->state_file);
+}
+
+void integrator_tick(struct glb *g, uint64_t now) {
+	struct integrator_engine *ie = &g->integ;
+
+	if (now - ie->last_checkpoint >= (uint64_t)ie->checkpoint * 1000000) {
+		integrator_save(g);
+		ie->last_checkpoint = now;
+	}
+}
+
+/*
+ * Base SI units of a meter's current function, used to name the
+ * units of derived channels
+ */
+static const char *function_units(uint8_t function) {
+	switch (function) {
+		case FUNCTION_VOLTAGE: return "V";
+		case FUNCTION_CURRENT_UA:
+		case FUNCTION_CURRENT_MA:
+		case FUNCTION_CURRENT_A: return "A";
+		case FUNCTION_OHMS: return "Ω";
+		case FUNCTION_CAPACITANCE: return "F";
+		case FUNCTION_FQ_RPM: return "Hz";
+	}
+	return "";
+}
+
+/*
+ * -j name=0*1 etc, meters combined left to right with * / + -
+ */
+void join_init(struct glb *g) {
+	struct join_engine *je = &g->join;
+
+	for (int j = 0; j < je->count; j++) {
+		struct join_channel *ch = &je->ch[j];
+		char *p = strchr(ch->spec, '=');
+
+		if (!p) {
+			fprintf(stdout,"Invalid join '%s', expected -j <name>=<meter><op><meter>\n", ch->spec);
+			exit(1);
+		}
+		snprintf(ch->name, sizeof(ch->name), "%.*s", (int)(p - ch->spec), ch->spec);
+		p++;
+
+		ch->op[0] = '=';
+		while (*p && ch->inputs < JOIN_INPUTS_MAX) {
+			if (ch->inputs > 0) {
+				if (!strchr("*/+-", *p)) break;
+				ch->op[ch->inputs] = *p++;
+			}
+			if (*p < '0' || *p > '9') break;
+			ch->meter[ch->inputs++] = strtol(p, &p, 10);
+		}
+
+		if (*p || ch->inputs < 2) {
+			fprintf(stdout,"Invalid join '%s', expected -j <name>=<meter><op><meter>\n", ch->spec);
+			exit(1);
+		}
+
+		for (int k = 0; k < ch->inputs; k++) {
+			if (ch->meter[k] >= g->bk.count) {
+				fprintf(stdout,"Join '%s' uses meter %d, only %d meters (-p) given\n", ch->name, ch->meter[k], g->bk.count);
+				exit(1);
+			}
+		}
+	}
+}
+
+/*
+ * Find meter m's value at time t.
+ *
+ * Returns 1 with *v set, 0 if it's worth waiting for a later
+ * sample, -1 if there's no usable value for that time.
+ *
+ */
+static int join_value_at(struct join_engine *je, int m, uint64_t t, uint64_t now, double *v) {
+	struct join_history *h = &je->hist[m];
+	struct join_sample *before = NULL, *after = NULL;
+
+	for (int i = 0; i < JOIN_HISTORY; i++) {
+		struct join_sample *s = &h->s[i];
+		if (!s->ts) continue;
+		if (s->ts <= t && (!before || s->ts > before->ts)) before = s;
+		if (s->ts >= t && (!after || s->ts < after->ts)) after = s;
+	}
+
+	if (!after) {
+		/*
+		 * Nothing at or after t yet, a closer sample could still
+		 * turn up until the skew window has passed
+		 */
+		if (now < t + je->max_skew) return 0;
+		if (before && before->valid && t - before->ts <= je->max_skew) {
+			*v = before->v;
+			return 1;
+		}
+		return -1;
+	}
+
+	if (je->linear && before && before->valid && after->valid && after->ts - before->ts <= 2 * je->max_skew) {
+		if (after->ts == before->ts) *v = after->v;
+		else *v = before->v + (after->v - before->v) * (double)(t - before->ts) / (double)(after->ts - before->ts);
+		return 1;
+	}
+
+	if (before && (t - before->ts) > (after->ts - t)) before = NULL;
+	if (!before) before = after;
+	if (before->valid && (before->ts > t ? before->ts - t : t - before->ts) <= je->max_skew) {
+		*v = before->v;
+		return 1;
+	}
+	return -1;
+}
+
+static void join_emit(struct glb *g, int j, uint64_t ts, double v) {
+	struct join_channel *ch = &g->join.ch[j];
+	double a = fabs(v);
+
+	ch->have = 1;
+	ch->ts = ts;
+	ch->value = v;
+	ch->emitted++;
+
+	if (a >= 1e6) snprintf(ch->text, sizeof(ch->text), "%s %.4fM%s", ch->name, v / 1e6, ch->units);
+	else if (a >= 1e3) snprintf(ch->text, sizeof(ch->text), "%s %.4fk%s", ch->name, v / 1e3, ch->units);
+	else if (a >= 1.0 || a == 0.0) snprintf(ch->text, sizeof(ch->text), "%s %.4f%s", ch->name, v, ch->units);
+	else if (a >= 1e-3) snprintf(ch->text, sizeof(ch->text), "%s %.4fm%s", ch->name, v * 1e3, ch->units);
+	else snprintf(ch->text, sizeof(ch->text), "%s %.4f\u00B5%s", ch->name, v * 1e6, ch->units);
+
+	if (g->debug) fprintf(stdout,"Join %s = %.9g at %llu\r\n", ch->name, v, (unsigned long long)ts);
+
+	/*
+	 * Power (and current) channels integrate to Wh (Ah)
+	 */
+	if (g->integ.state_file && (strcmp(ch->units, "W") == 0 || strcmp(ch->units, "A") == 0)) {
+		struct integrator *it = &g->integ.it[g->bk.count + j];
+		snprintf(it->units, sizeof(it->units), "%sh", ch->units);
+		integrate_point(&g->integ, it, ts, v);
+	}
+}
+
+/*
+ * Emit whatever pending reference points can now be resolved,
+ * in order, stopping at the first one still waiting.
+ *
+ */
+static void join_process(struct glb *g, int j, uint64_t now) {
+	struct join_engine *je = &g->join;
+	struct join_channel *ch = &je->ch[j];
+
+	while (ch->p_tail != ch->p_head) {
+		struct join_sample *ref = &ch->pending[ch->p_tail % JOIN_PENDING];
+		double result = ref->v;
+		int state = ref->valid ? 1 : -1;
+
+		for (int k = 1; k < ch->inputs && state == 1; k++) {
+			double v;
+			state = join_value_at(je, ch->meter[k], ref->ts, now, &v);
+			if (state != 1) break;
+			switch (ch->op[k]) {
+				case '*': result *= v; break;
+				case '/': result = (v != 0.0) ? result / v : HUGE_VAL; break;
+				case '+': result += v; break;
+				case '-': result -= v; break;
+			}
+		}
+
+		if (state == 0) break;
+		if (state == 1) join_emit(g, j, ref->ts, result);
+		else ch->missed++;
+		ch->p_tail++;
+	}
+}
+
+void join_add(struct glb *g, struct bk390_reading *r) {
+	struct join_engine *je = &g->join;
+	struct join_history *h = &je->hist[r->meter];
+	struct join_sample *s = &h->s[h->head % JOIN_HISTORY];
+
+	s->ts = r->ts;
+	s->v = r->si;
+	s->valid = !r->ol;
+	h->head++;
+
+	for (int j = 0; j < je->count; j++) {
+		struct join_channel *ch = &je->ch[j];
+
+		if (ch->meter[0] == r->meter) {
+			if (ch->p_head - ch->p_tail >= JOIN_PENDING) {
+				ch->p_tail++;
+				ch->overflow++;
+			}
+			ch->pending[ch->p_head % JOIN_PENDING] = *s;
+			ch->p_head++;
+
+			/*
+			 * Name the units from whatever the meters are reading now
+			 */
+			const char *u0 = function_units(r->d[BYTE_FUNCTION]);
+			const char *u1 = function_units(g->bk.meter[ch->meter[1]].r.d[BYTE_FUNCTION]);
+			if (ch->op[1] == '*' && ((u0[0] == 'V' && u1[0] == 'A') || (u0[0] == 'A' && u1[0] == 'V'))) snprintf(ch->units, sizeof(ch->units), "W");
+			else if (ch->op[1] == '/' && u0[0] == 'V' && u1[0] == 'A') snprintf(ch->units, sizeof(ch->units), "Ω");
+			else if (ch->op[1] == '+' || ch->op[1] == '-') snprintf(ch->units, sizeof(ch->units), "%s", u0);
+			else ch->units[0] = '\0';
+		}
+		join_process(g, j, r->ts);
+	}
+}
+
+void join_tick(struct glb *g, uint64_t now) {
+	for (int j = 0; j < g->join.count; j++) join_process(g, j, now);
+}
+
+static uint32_t sink_state(struct glb *g, int m) {
+	struct bk390_meter *mt = &g->bk.meter[m];
+	uint8_t *d = mt->r.d;
+
+	return (uint32_t)d[BYTE_FUNCTION] << 24
+		| (uint32_t)(d[BYTE_RANGE] & 0x0F) << 20
+		| (uint32_t)(d[BYTE_STATUS] & ~STATUS_SIGN & 0x0F) << 16
+		| (uint32_t)(d[BYTE_OPTION_1] & 0x0F) << 12
+		| (uint32_t)(d[BYTE_OPTION_2] & 0x0F) << 8
+		| (uint32_t)g->wd.stale[m] << 2
+		| (uint32_t)mt->comms_error << 1
+		| (uint32_t)g->rules.colour_active[m];
+}
+
+/*
+ * Decide if sink k gets this update, meters first..last are the
+ * ones it shows.  Counts what it lets through and what it doesn't.
+ *
+ */
+int output_pass(struct glb *g, int k, int first, int last, uint64_t now) {
+	struct output_policy *op = &g->policy[k];
+	int pass = 0;
+
+	if (!op->filter) {
+		op->emitted++;
+		return 1;
+	}
+
+	if (op->heartbeat && now - op->last_ts >= op->heartbeat) pass = 1;
+
+	for (int m = first; m <= last && !pass; m++) {
+		struct sink_last *sl = &op->last[m];
+		int counts = g->bk.meter[m].r.fcounts;
+		int delta = abs(counts - sl->counts);
+
+		if (!sl->valid || sink_state(g, m) != sl->state) pass = 1;
+		else if (op->deadband_pct > 0.0) pass = (delta > op->deadband_pct / 100.0 * abs(sl->counts));
+		else pass = (delta > op->deadband);
+	}
+
+	if (!pass) {
+		op->suppressed++;
+		return 0;
+	}
+
+	for (int m = first; m <= last; m++) {
+		op->last[m].valid = 1;
+		op->last[m].counts = g->bk.meter[m].r.fcounts;
+		op->last[m].state = sink_state(g, m);
+	}
+	op->last_ts = now;
+	op->emitted++;
+	return 1;
+}
+
+void output_report(struct glb *g) {
+	for (int k = 0; k < SINKS; k++) {
+		if (g->policy[k].filter) fprintf(stderr,"%s: %lu emitted, %lu suppressed\n", sink_names[k], g->policy[k].emitted, g->policy[k].suppressed);
+	}
+
+	/*
+	 * Percentiles of the run, per meter and function/range
+	 */
+	for (int m = 0; m < g->bk.count && !g->quiet; m++) {
+		for (int k = 0; k < BK390_SKETCH_SLOTS; k++) {
+			const struct bk390_sketch *sk = &g->bk.meter[m].sketch[k];
+
+			if (!sk->count) continue;
+			fprintf(stderr,"M%d 0x%02x/%d: %llu readings, min %g p1 %g p50 %g p99 %g max %g %s\n"
+					, m, sk->function, sk->range, (unsigned long long)sk->count, sk->min
+					, bk390_sketch_quantile(sk, 0.01), bk390_sketch_quantile(sk, 0.5), bk390_sketch_quantile(sk, 0.99)
+					, sk->max, function_units(sk->function));
+		}
+	}
+}
+
+/*
+ * Overlay server, see struct http_server
+ */
+static const char http_page[] =
+	"<!DOCTYPE html>\n"
+	"<html><head><meta charset=\"utf-8\"><title>BK390A</title>\n"
+	"<style>body{margin:0;background:%s;font-family:'Roboto Mono',monospace;white-space:pre}</style></head>\n"
+	"<body><div id=\"o\"></div><script>\n"
+	"var q=new URLSearchParams(location.search),fg=q.get('fg')||'%02x%02x%02x',sz=+(q.get('size')||%d),o=document.getElementById('o');\n"
+	"if(q.get('bg'))document.body.style.background='#'+q.get('bg');\n"
+	"function line(t,c,s,st){var d=document.createElement('div');d.textContent=t;d.style.color='#'+c;d.style.fontSize=s+'px';if(st)d.style.opacity=.35;o.appendChild(d);}\n"
+	"new EventSource('events').onmessage=function(e){var d=JSON.parse(e.data);o.textContent='';\n"
+	"d.meters.forEach(function(m){line(m.comms_ok?m.text:'COM.FLT',m.colour||fg,sz,m.stale);});\n"
+	"if(d.line2)line(d.line2,fg,Math.round(sz/3));};\n"
+	"</script></body></html>\n";
+
+void http_init(struct glb *g) {
+	struct http_server *hs = &g->http;
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port;
+	char *p = strrchr(hs->spec, ':');
+	int one = 1;
+
+	hs->c = (struct http_client *)calloc(HTTP_CLIENTS_MAX, sizeof(struct http_client));
+	if (!hs->c) {
+		fprintf(stderr,"%s:%d: Unable to allocate http clients\n", FL);
+		exit(1);
+	}
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) hs->c[k].fd = -1;
+
+	hs->page_len = snprintf(hs->page, sizeof(hs->page), http_page, "transparent"
+			, g->font_color.r, g->font_color.g, g->font_color.b, g->font_size);
+
+	if (strncmp(hs->spec, "unix:", 5) == 0) {
+		struct sockaddr_un sun;
+
+		hs->unix_path = hs->spec + 5;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", hs->unix_path);
+		unlink(hs->unix_path);
+		hs->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (hs->fd < 0 || bind(hs->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(hs->fd, 16) != 0) {
+			fprintf(stdout,"Unable to listen on '%s' (%s)\n", hs->spec, strerror(errno));
+			exit(1);
+		}
+		return;
+	}
+
+	if (p) {
+		snprintf(host, sizeof(host), "%.*s", (int)(p - hs->spec), hs->spec);
+		port = p + 1;
+	} else {
+		snprintf(host, sizeof(host), "127.0.0.1");
+		port = hs->spec;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+		fprintf(stdout,"Unable to resolve overlay address '%s'\n", hs->spec);
+		exit(1);
+	}
+
+	hs->fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (hs->fd >= 0) setsockopt(hs->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (hs->fd < 0 || bind(hs->fd, res->ai_addr, res->ai_addrlen) != 0 || listen(hs->fd, 16) != 0) {
+		fprintf(stdout,"Unable to listen on '%s' (%s)\n", hs->spec, strerror(errno));
+		exit(1);
+	}
+	freeaddrinfo(res);
+}
+
+static void http_drop(struct http_client *c) {
+	close(c->fd);
+	c->fd = -1;
+}
+
+/*
+ * Send what the socket will take now and keep the rest.  Returns 0
+ * if it had to be thrown away, the client is already too far behind.
+ */
+static int http_send(struct http_client *c, const char *buf, int len, uint64_t now) {
+	ssize_t w = 0;
+
+	if (c->out_len + len > HTTP_OUT_SIZE) return 0;
+
+	if (!c->out_len) {
+		w = send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (w < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				c->closing = 1;
+				c->out_len = 0;
+				return 1;
+			}
+			w = 0;
+		}
+	}
+	memcpy(c->out + c->out_len, buf + w, len - w);
+	c->out_len += len - w;
+	c->last_send = now;
+	return 1;
+}
+
+static void http_flush(struct http_client *c) {
+	ssize_t w = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (w < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+		c->out_len = 0;
+		c->closing = 1;
+		return;
+	}
+	memmove(c->out, c->out + w, c->out_len - w);
+	c->out_len -= w;
+}
+
+static int metrics_text(struct glb *g, char *buf, int size);
+static int sketch_json(struct glb *g, char *buf, int size);
+static int settle_json(struct glb *g, char *buf, int size);
+
+static void http_request(struct glb *g, struct http_client *c, uint64_t now) {
+	struct http_server *hs = &g->http;
+	static char metrics[HTTP_OUT_SIZE - 512];
+	char hdr[512];
+	char path[256];
+	char *query = NULL;
+	const char *body = NULL;
+	const char *type = "text/plain; charset=utf-8";
+	int body_len = 0, l;
+
+	if (sscanf(c->req, "GET %255s", path) != 1) {
+		l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		http_send(c, hdr, l, now);
+		c->closing = 1;
+		return;
+	}
+	if (char *q = strchr(path, '?')) {
+		*q = '\0';
+		query = q + 1;
+	}
+
+	if (strcmp(path, "/events") == 0) {
+		l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+				"Access-Control-Allow-Origin: *\r\nConnection: keep-alive\r\n\r\nretry: 1000\n\n");
+		http_send(c, hdr, l, now);
+		if (hs->event_len) http_send(c, hs->event, hs->event_len, now);
+		c->sse = 1;
+		return;
+	}
+
+	if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
+		body = hs->page;
+		body_len = hs->page_len;
+		type = "text/html; charset=utf-8";
+	} else if (strcmp(path, "/reading") == 0) {
+		body = hs->status;
+		body_len = strlen(hs->status);
+	} else if (strcmp(path, "/metrics") == 0) {
+		body = metrics;
+		body_len = metrics_text(g, metrics, sizeof(metrics));
+		type = "text/plain; version=0.0.4; charset=utf-8";
+	} else if (strcmp(path, "/sketch") == 0) {
+		body = metrics;
+		body_len = sketch_json(g, metrics, sizeof(metrics));
+		type = "application/json";
+	} else if (strcmp(path, "/settle") == 0) {
+		/*
+		 * ?arm=<meter> starts a measurement on a meter, plain
+		 * ?arm on all of them.  It's a GET because that's all
+		 * there is here.
+		 */
+		if (query && strncmp(query, "arm", 3) == 0 && (query[3] == '\0' || query[3] == '&' || query[3] == '=')) {
+			char *end;
+			long m = query[3] == '=' ? strtol(query + 4, &end, 10) : -1;
+
+			if (query[3] == '=' && (end == query + 4 || m < 0 || m >= g->bk.count || g->bk.meter[m].settle.c.kind == BK390_SETTLE_OFF)) {
+				l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+				http_send(c, hdr, l, now);
+				c->closing = 1;
+				return;
+			}
+			for (int k = 0; k < g->bk.count; k++) {
+				if ((m < 0 || m == k) && g->bk.meter[k].settle.c.kind != BK390_SETTLE_OFF) bk390_settle_arm(&g->bk, k);
+			}
+		}
+		body = metrics;
+		body_len = settle_json(g, metrics, sizeof(metrics));
+		type = "application/json";
+	}
+
+	if (body) {
+		l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nCache-Control: no-cache\r\n"
+				"Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n", type, body_len);
+		http_send(c, hdr, l, now);
+		http_send(c, body, body_len, now);
+	} else {
+		l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		http_send(c, hdr, l, now);
+	}
+	c->closing = 1;
+}
+
+/*
+ * Fill in the pollfds for the listener and clients, returns how many
+ */
+int http_pollfds(struct glb *g, struct pollfd *pfd) {
+	struct http_server *hs = &g->http;
+	int n = 0;
+
+	pfd[n].fd = hs->fd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		pfd[n].fd = hs->c[k].fd;
+		pfd[n].events = (hs->c[k].out_len ? POLLOUT : 0) | POLLIN;
+		pfd[n++].revents = 0;
+	}
+	return n;
+}
+
+void http_poll(struct glb *g, struct pollfd *pfd, uint64_t now) {
+	struct http_server *hs = &g->http;
+
+	if (pfd[0].revents & POLLIN) {
+		int fd;
+		while ((fd = accept4(hs->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+			int k;
+			for (k = 0; k < HTTP_CLIENTS_MAX && hs->c[k].fd >= 0; k++);
+			if (k == HTTP_CLIENTS_MAX) {
+				close(fd);
+				continue;
+			}
+			hs->c[k].fd = fd;
+			hs->c[k].sse = 0;
+			hs->c[k].closing = 0;
+			hs->c[k].req_len = 0;
+			hs->c[k].out_len = 0;
+			hs->c[k].last_send = now;
+		}
+	}
+
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		struct http_client *c = &hs->c[k];
+		short ev = pfd[k + 1].revents;
+
+		if (c->fd < 0 || pfd[k + 1].fd != c->fd) continue;
+
+		if (ev & POLLOUT) http_flush(c);
+
+		if (ev & (POLLIN | POLLHUP | POLLERR)) {
+			char tmp[512];
+			char *dst = c->sse ? tmp : c->req + c->req_len;
+			int room = c->sse ? (int)sizeof(tmp) : (int)sizeof(c->req) - 1 - c->req_len;
+			ssize_t r = room > 0 ? read(c->fd, dst, room) : 0;
+
+			if (r <= 0 && !(r < 0 && errno == EAGAIN)) {
+				http_drop(c);
+				continue;
+			}
+			if (!c->sse && r > 0) {
+				c->req_len += r;
+				c->req[c->req_len] = '\0';
+				if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) http_request(g, c, now);
+			}
+		}
+
+		if (c->closing && !c->out_len) http_drop(c);
+	}
+}
+
+/*
+ * src escaped for the inside of a JSON string, cut short rather than
+ * overflow dst but never part way through an escape
+ */
+static char *json_str(char *dst, int size, const char *src) {
+	int l = 0;
+
+	for (const unsigned char *p = (const unsigned char *)src; *p; p++) {
+		char esc[8];
+		int n;
+
+		if (*p == '"' || *p == '\\') n = snprintf(esc, sizeof(esc), "\\%c", *p);
+		else if (*p < 0x20) n = snprintf(esc, sizeof(esc), "\\u%04x", *p);
+		else {
+			esc[0] = *p;
+			n = 1;
+		}
+		if (l + n >= size) break;
+		memcpy(dst + l, esc, n);
+		l += n;
+	}
+	dst[l] = '\0';
+	return dst;
+}
+
+/*
+ * Encode the current readings once and queue them to every
+ * subscriber.  Also keeps the /reading text up to date.
+ */
+void http_publish(struct glb *g, const char *status, const char *line2, uint64_t now) {
+	struct http_server *hs = &g->http;
+	char *e = hs->event;
+	int size = sizeof(hs->event);
+	char esc[SSIZE * 2];
+	int l;
+
+	snprintf(hs->status, sizeof(hs->status), "%s", status);
+
+	l = snprintf(e, size, "data: {\"ts\":%llu,\"meters\":[", (unsigned long long)now);
+	for (int m = 0; m < g->bk.count && l < size; m++) {
+		struct bk390_meter *mt = &g->bk.meter[m];
+		struct bk390_reading *r = &mt->r;
+		char value[32], raw[32], colour[16];
+		char text[sizeof(r->ftext) * 2], units[sizeof(r->units) * 2], mode[sizeof(r->mmmode) * 2];
+
+		if (!mt->dt_loaded || r->ol) snprintf(value, sizeof(value), "null");
+		else snprintf(value, sizeof(value), "%.10g", r->fsi);
+		if (!mt->dt_loaded || r->ol) snprintf(raw, sizeof(raw), "null");
+		else snprintf(raw, sizeof(raw), "%.10g", r->si);
+		if (g->rules.colour_active[m]) snprintf(colour, sizeof(colour), "\"%02x%02x%02x\"", g->rules.colour[m].r, g->rules.colour[m].g, g->rules.colour[m].b);
+		else snprintf(colour, sizeof(colour), "null");
+
+		l += snprintf(e + l, size - l, "%s{\"meter\":%d,\"text\":\"%s\",\"value\":%s,\"raw\":%s,\"units\":\"%s\",\"mode\":\"%s\",\"ol\":%s,\"comms_ok\":%s,\"stale\":%s,\"colour\":%s}"
+				, m ? "," : "", m, json_str(text, sizeof(text), r->ftext), value, raw, json_str(units, sizeof(units), r->units)
+				, json_str(mode, sizeof(mode), r->mmmode), r->ol ? "true" : "false", mt->comms_error ? "false" : "true", g->wd.stale[m] ? "true" : "false", colour);
+	}
+	if (l < size) l += snprintf(e + l, size - l, "],\"line2\":\"%s\"}\n\n", json_str(esc, sizeof(esc), line2));
+	if (l >= size) {
+		hs->event_len = 0;
+		return;
+	}
+	hs->event_len = l;
+	hs->events++;
+
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		struct http_client *c = &hs->c[k];
+		if (c->fd >= 0 && c->sse && !c->closing && !http_send(c, hs->event, hs->event_len, now)) hs->dropped++;
+	}
+}
+
+/*
+ * A settle measurement as JSON, for the event and for /settle
+ */
+static int settled_json(char *buf, int size, const struct bk390_settled *e, const char *units) {
+	char value[32], span[32], esc[32];
+
+	if (isnan(e->value)) snprintf(value, sizeof(value), "null");
+	else snprintf(value, sizeof(value), "%.10g", e->value);
+	if (isnan(e->span)) snprintf(span, sizeof(span), "null");
+	else snprintf(span, sizeof(span), "%.6g", e->span);
+
+	return snprintf(buf, size, "{\"meter\":%d,\"settled\":%s,\"armed\":%s,\"value\":%s,\"units\":\"%s\",\"span\":%s,\"readings\":%lu,"
+			"\"function\":%d,\"range\":%d,\"start\":%llu,\"ts\":%llu,\"seconds\":%.3f}"
+			, e->meter, e->settled ? "true" : "false", e->armed ? "true" : "false", value, json_str(esc, sizeof(esc), units), span, e->readings
+			, e->function, e->range, (unsigned long long)e->start, (unsigned long long)e->ts, (e->ts - e->start) / 1e6);
+}
+
+/*
+ * A settle measurement to every subscriber as a named event, so the
+ * overlay page's onmessage doesn't see it
+ */
+void http_settled(struct glb *g, const struct bk390_settled *e, uint64_t now) {
+	struct http_server *hs = &g->http;
+	char buf[512];
+	int l;
+
+	l = snprintf(buf, sizeof(buf), "event: settled\ndata: ");
+	l += settled_json(buf + l, sizeof(buf) - l, e, g->settle_units[e->meter]);
+	if (l + 2 >= (int)sizeof(buf)) return;
+	l += snprintf(buf + l, sizeof(buf) - l, "\n\n");
+
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		struct http_client *c = &hs->c[k];
+		if (c->fd >= 0 && c->sse && !c->closing && !http_send(c, buf, l, now)) hs->dropped++;
+	}
+}
+
+/*
+ * Keep idle streams alive through proxies and notice dead ones
+ */
+void http_tick(struct glb *g, uint64_t now) {
+	struct http_server *hs = &g->http;
+
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		struct http_client *c = &hs->c[k];
+		if (c->fd >= 0 && c->sse && now - c->last_send > 15000000) http_send(c, ":\n\n", 3, now);
+		if (c->fd >= 0 && c->closing && !c->out_len) http_drop(c);
+	}
+}
+
+void http_close(struct glb *g) {
+	struct http_server *hs = &g->http;
+
+	for (int k = 0; k < HTTP_CLIENTS_MAX; k++) {
+		if (hs->c[k].fd >= 0) http_drop(&hs->c[k]);
+	}
+	close(hs->fd);
+	hs->fd = -1;
+	if (hs->unix_path) unlink(hs->unix_path);
+	free(hs->c);
+	hs->c = NULL;
+	if (!g->quiet) fprintf(stderr,"http: %lu events, %lu dropped to slow subscribers\n", hs->events, hs->dropped);
+}
+
+/*
+ * Prometheus text exposition of everything counted above
+ */
+static int metrics_line(char *buf, int size, int l, const char *name, const char *type, const char *help) {
+	if (l >= size) return l;
+	return l + snprintf(buf + l, size - l, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static int metrics_text(struct glb *g, char *buf, int size) {
+	struct {
+		const char *name, *help;
+		size_t offset;
+	} per_meter[] = {
+		{ "bk390_frames_total", "Frames of the right length received", offsetof(struct bk390_meter, frames) },
+		{ "bk390_frames_invalid_total", "Frames of the wrong length received", offsetof(struct bk390_meter, frames_invalid) },
+		{ "bk390_frames_repeated_total", "Wrong length frames where the previous frame was shown again", offsetof(struct bk390_meter, frames_repeated) },
+		{ "bk390_comms_errors_total", "Read errors and hangups on the port", offsetof(struct bk390_meter, comms_errors) },
+		{ "bk390_reconnects_total", "Times the port was reopened after an error", offsetof(struct bk390_meter, reconnects) },
+		{ "bk390_filter_resets_total", "Times the smoothing filter restarted on a function or range change", offsetof(struct bk390_meter, filter.resets) },
+	};
+	unsigned int compress_queue;
+	unsigned long compressed, compress_failed;
+	unsigned long backlog = 0, subscribers = 0, batched = 0;
+	int snaps = 0;
+	int l = 0;
+
+	METRIC_INC(g->metrics.scrapes);
+
+	for (size_t k = 0; k < sizeof(per_meter) / sizeof(per_meter[0]); k++) {
+		l = metrics_line(buf, size, l, per_meter[k].name, "counter", per_meter[k].help);
+		for (int m = 0; m < g->bk.count && l < size; m++) {
+			unsigned long *v = (unsigned long *)((char *)&g->bk.meter[m] + per_meter[k].offset);
+			l += snprintf(buf + l, size - l, "%s{meter=\"%d\"} %lu\n", per_meter[k].name, m, METRIC_GET(*v));
+		}
+	}
+
+	l = metrics_line(buf, size, l, "bk390_stale", "gauge", "1 while the meter's reading is older than -W");
+	for (int m = 0; m < g->bk.count && l < size; m++) l += snprintf(buf + l, size - l, "bk390_stale{meter=\"%d\"} %d\n", m, g->wd.stale[m]);
+	l = metrics_line(buf, size, l, "bk390_watchdog_expiries_total", "counter", "Times a meter went stale");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_watchdog_expiries_total %lu\n", g->wd.expiries);
+	l = metrics_line(buf, size, l, "bk390_watchdog_wakeups_total", "counter", "Times the watchdog timer fired");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_watchdog_wakeups_total %lu\n", g->wd.wakeups);
+
+	l = metrics_line(buf, size, l, "bk390_settle_events_total", "counter", "Settle measurements that settled or timed out, -e");
+	for (int m = 0; m < g->bk.count && l < size; m++) {
+		const struct bk390_settle *s = &g->bk.meter[m].settle;
+
+		if (s->c.kind == BK390_SETTLE_OFF) continue;
+		l += snprintf(buf + l, size - l, "bk390_settle_events_total{meter=\"%d\",result=\"settled\"} %lu\nbk390_settle_events_total{meter=\"%d\",result=\"timeout\"} %lu\n"
+				, m, s->settled, m, s->timeouts);
+	}
+	l = metrics_line(buf, size, l, "bk390_settle_seconds", "gauge", "Time the meter's last settle measurement took");
+	for (int m = 0; m < g->bk.count && l < size; m++) {
+		const struct bk390_settle *s = &g->bk.meter[m].settle;
+
+		if (s->c.kind == BK390_SETTLE_OFF || !(s->settled + s->timeouts)) continue;
+		l += snprintf(buf + l, size - l, "bk390_settle_seconds{meter=\"%d\"} %.3f\n", m, (s->last.ts - s->last.start) / 1e6);
+	}
+
+	l = metrics_line(buf, size, l, "bk390_reading", "summary", "Readings in SI units per function and range, quantiles from the meter's sketch");
+	for (int m = 0; m < g->bk.count && l < size; m++) {
+		for (int k = 0; k < BK390_SKETCH_SLOTS && l < size; k++) {
+			const struct bk390_sketch *sk = &g->bk.meter[m].sketch[k];
+			char labels[64];
+
+			if (!sk->count) continue;
+			snprintf(labels, sizeof(labels), "meter=\"%d\",function=\"0x%02x\",range=\"%d\"", m, sk->function, sk->range);
+			l += snprintf(buf + l, size - l, "bk390_reading{%s,quantile=\"0.01\"} %g\nbk390_reading{%s,quantile=\"0.5\"} %g\nbk390_reading{%s,quantile=\"0.99\"} %g\n"
+					, labels, bk390_sketch_quantile(sk, 0.01), labels, bk390_sketch_quantile(sk, 0.5), labels, bk390_sketch_quantile(sk, 0.99));
+			if (l < size) l += snprintf(buf + l, size - l, "bk390_reading_sum{%s} %.9g\nbk390_reading_count{%s} %llu\n", labels, sk->sum, labels, (unsigned long long)sk->count);
+		}
+	}
+
+	l = metrics_line(buf, size, l, "bk390_stage_seconds", "histogram", "Time spent in each stage per reading");
+	for (int st = 0; st < STAGES && l < size; st++) {
+		struct histogram *h = &g->metrics.stage[st];
+		uint64_t cum = 0;
+
+		if (!METRIC_GET(h->count)) continue;
+		for (int b = 0; b < HIST_BUCKETS && l < size; b++) {
+			cum += METRIC_GET(h->bucket[b]);
+			if (b < HIST_BUCKETS - 1) l += snprintf(buf + l, size - l, "bk390_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[st], hist_le_us[b] / 1e6, (unsigned long long)cum);
+			else l += snprintf(buf + l, size - l, "bk390_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[st], (unsigned long long)cum);
+		}
+		if (l < size) l += snprintf(buf + l, size - l, "bk390_stage_seconds_sum{stage=\"%s\"} %.9f\nbk390_stage_seconds_count{stage=\"%s\"} %llu\n"
+				, stage_names[st], METRIC_GET(h->sum_ns) / 1e9, stage_names[st], (unsigned long long)METRIC_GET(h->count));
+	}
+
+	l = metrics_line(buf, size, l, "bk390_sink_emitted_total", "counter", "Updates passed to each sink by its -F policy, render is the render count");
+	for (int k = 0; k < SINKS && l < size; k++) l += snprintf(buf + l, size - l, "bk390_sink_emitted_total{sink=\"%s\"} %lu\n", sink_names[k], g->policy[k].emitted);
+	l = metrics_line(buf, size, l, "bk390_sink_suppressed_total", "counter", "Updates held back by each sink's -F policy, render is skipped renders");
+	for (int k = 0; k < SINKS && l < size; k++) l += snprintf(buf + l, size - l, "bk390_sink_suppressed_total{sink=\"%s\"} %lu\n", sink_names[k], g->policy[k].suppressed);
+
+	/*
+	 * Queues between the main loop and the other threads
+	 */
+	l = metrics_line(buf, size, l, "bk390_queue_depth", "gauge", "Items waiting in each internal queue");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_queue_depth{queue=\"hook\"} %u\n", METRIC_GET(g->rules.head) - METRIC_GET(g->rules.tail));
+	for (int i = 0; i < CAPTURE_SNAPSHOTS; i++) snaps += METRIC_GET(g->capture.snap[i].full);
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_queue_depth{queue=\"capture\"} %d\n", snaps);
+	bklog_compressor_stats(&compress_queue, &compressed, &compress_failed);
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_queue_depth{queue=\"compress\"} %u\n", compress_queue);
+	for (int m = 0; g->log_w && m < g->bk.count; m++) batched += g->log_w[m].n;
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_queue_depth{queue=\"log_batch\"} %lu\n", batched);
+	for (int k = 0; g->http.c && k < HTTP_CLIENTS_MAX; k++) {
+		if (g->http.c[k].fd >= 0 && g->http.c[k].sse) {
+			subscribers++;
+			backlog += g->http.c[k].out_len;
+		}
+	}
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_queue_depth{queue=\"http_bytes\"} %lu\n", backlog);
+
+	l = metrics_line(buf, size, l, "bk390_http_subscribers", "gauge", "Clients on /events");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_http_subscribers %lu\n", subscribers);
+	l = metrics_line(buf, size, l, "bk390_dropped_total", "counter", "Work thrown away because a queue was full");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_dropped_total{queue=\"hook\"} %u\nbk390_dropped_total{queue=\"capture\"} %u\nbk390_dropped_total{queue=\"http\"} %lu\n"
+			, g->rules.dropped, g->capture.dropped, g->http.dropped);
+	l = metrics_line(buf, size, l, "bk390_worker_jobs_total", "counter", "Jobs finished by the worker threads");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_worker_jobs_total{worker=\"hook\",result=\"ok\"} %lu\nbk390_worker_jobs_total{worker=\"hook\",result=\"failed\"} %lu\n"
+			"bk390_worker_jobs_total{worker=\"capture\",result=\"ok\"} %lu\n"
+			"bk390_worker_jobs_total{worker=\"compress\",result=\"ok\"} %lu\nbk390_worker_jobs_total{worker=\"compress\",result=\"failed\"} %lu\n"
+			, METRIC_GET(g->rules.hooks_run), METRIC_GET(g->rules.hooks_failed), METRIC_GET(g->capture.written), compressed, compress_failed);
+	l = metrics_line(buf, size, l, "bk390_metrics_scrapes_total", "counter", "Times /metrics has been read");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_metrics_scrapes_total %lu\n", g->metrics.scrapes);
+	l = metrics_line(buf, size, l, "bk390_display_presents_total", "counter", "Frames presented to the window");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_presents_total %lu\n", g->display.presents);
+	l = metrics_line(buf, size, l, "bk390_display_tiles_drawn_total", "counter", "Meter tiles redrawn because their reading changed");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_tiles_drawn_total %lu\n", g->display.tiles_drawn);
+	l = metrics_line(buf, size, l, "bk390_display_font_size", "gauge", "Font size the window wants and the size being drawn scaled to it");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_font_size{size=\"wanted\"} %d\nbk390_display_font_size{size=\"drawn\"} %d\n", g->display.want, g->display.var[g->display.cur].size);
+	l = metrics_line(buf, size, l, "bk390_display_sizes_rasterized_total", "counter", "Font sizes rasterized by the font thread");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_sizes_rasterized_total %lu\n", g->display.rasterized);
+	l = metrics_line(buf, size, l, "bk390_display_sizes_prebuilt_total", "counter", "Font sizes that came from the built in glyph table, without FreeType");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_sizes_prebuilt_total %lu\n", g->display.prebuilt);
+	l = metrics_line(buf, size, l, "bk390_display_startup_seconds", "gauge", "Time from start to the glyphs being ready and to the first reading drawn");
+	if (l < size) l += snprintf(buf + l, size - l, "bk390_display_startup_seconds{stage=\"glyphs\"} %.6f\n", g->display.glyphs_ns / 1e9);
+	if (l < size && g->display.first_ns) l += snprintf(buf + l, size - l, "bk390_display_startup_seconds{stage=\"first_reading\"} %.6f\n", g->display.first_ns / 1e9);
+
+	return l < size ? l : size - 1;
+}
+
+/*
+ * The meters' sketches as JSON, the bucket counts sparse as [index,
+ * count] pairs so another program can merge them with its own (or
+ * with bk390-query -p's) as long as alpha is the same.  Sketches
+ * that don't fit are left off and truncated set.
+ */
+static int sketch_json(struct glb *g, char *buf, int size) {
+	int l, n = 0, truncated = 0;
+
+	l = snprintf(buf, size, "{\"alpha\":%g,\"sketches\":[", g->bk.sketch_alpha);
+	for (int m = 0; m < g->bk.count; m++) {
+		for (int k = 0; k < BK390_SKETCH_SLOTS; k++) {
+			const struct bk390_sketch *sk = &g->bk.meter[m].sketch[k];
+			const struct bk390_sketch_store *st[2] = { &sk->pos, &sk->neg };
+			int start = l;
+
+			if (!sk->count) continue;
+			l += snprintf(buf + l, size - l, "%s{\"meter\":%d,\"function\":%d,\"range\":%d,\"count\":%llu,\"zero\":%llu,\"collapsed\":%llu,"
+					"\"min\":%.9g,\"max\":%.9g,\"sum\":%.9g"
+					, n ? "," : "", m, sk->function, sk->range, (unsigned long long)sk->count, (unsigned long long)sk->zero
+					, (unsigned long long)sk->collapsed, sk->min, sk->max, sk->sum);
+			for (int j = 0; j < 2 && l < size; j++) {
+				int first = 1;
+
+				l += snprintf(buf + l, size - l, ",\"%s\":[", j ? "neg" : "pos");
+				for (int32_t i = st[j]->lo; st[j]->n && i <= st[j]->hi && l < size; i++) {
+					uint32_t c = st[j]->bins[i - st[j]->offset];
+					if (!c) continue;
+					l += snprintf(buf + l, size - l, "%s[%d,%u]", first ? "" : ",", i, c);
+					first = 0;
+				}
+				if (l < size) l += snprintf(buf + l, size - l, "]");
+			}
+			if (l < size) l += snprintf(buf + l, size - l, "}");
+
+			/*
+			 * Room has to be left for the close
+			 */
+			if (l >= size - 32) {
+				l = start;
+				truncated = 1;
+				continue;
+			}
+			n++;
+		}
+	}
+	l += snprintf(buf + l, size - l, "],\"truncated\":%s}\n", truncated ? "true" : "false");
+	return l;
+}
+
+/*
+ * Each meter's settle detector, where its measurement is and the
+ * last one it reported
+ */
+static int settle_json(struct glb *g, char *buf, int size) {
+	static const char *states[] = { "idle", "waiting", "done" };
+	static const char *kinds[] = { "off", "abs", "pct", "counts" };
+	int l, n = 0, truncated = 0;
+
+	l = snprintf(buf, size, "{\"meters\":[");
+	for (int m = 0; m < g->bk.count; m++) {
+		const struct bk390_meter *mt = &g->bk.meter[m];
+		const struct bk390_settle *s = &mt->settle;
+		int start = l;
+
+		l += snprintf(buf + l, size - l, "%s{\"meter\":%d,\"kind\":\"%s\",\"tolerance\":%g,\"window_ms\":%llu,\"timeout_ms\":%llu,"
+				"\"state\":\"%s\",\"armed\":%s,\"pending\":%s,\"settled\":%lu,\"timeouts\":%lu,\"last\":"
+				, n ? "," : "", m, kinds[s->c.kind], s->c.tol, (unsigned long long)s->c.window_us / 1000, (unsigned long long)s->c.timeout_us / 1000
+				, states[s->state], s->armed ? "true" : "false", __atomic_load_n(&mt->settle_arm, __ATOMIC_RELAXED) ? "true" : "false"
+				, s->settled, s->timeouts);
+		if (l < size && s->settled + s->timeouts) l += settled_json(buf + l, size - l, &s->last, g->settle_units[m]);
+		else if (l < size) l += snprintf(buf + l, size - l, "null");
+		if (l < size) l += snprintf(buf + l, size - l, "}");
+
+		/*
+		 * Room has to be left for the close, the meters after
+		 * one that didn't fit are left off too
+		 */
+		if (l >= size - 32) {
+			l = start;
+			truncated = 1;
+			break;
+		}
+		n++;
+	}
+	l += snprintf(buf + l, size - l, "],\"truncated\":%s}\n", truncated ? "true" : "false");
+	return l;
+}
+
+/*
+ * Reading log, each fresh reading goes in to its meter's segment
+ */
+void log_init(struct glb *g) {
+	mkdir(g->log.dir, 0755);
+	if (bklog_dir_lock(g->log.dir) != 0) exit(1);
+	g->log_w = (struct bklog_writer *)calloc(g->bk.count, sizeof(struct bklog_writer));
+	if (!g->log_w) {
+		fprintf(stderr,"%s:%d: Unable to allocate log writers\n", FL);
+		exit(1);
+	}
+	for (int m = 0; m < g->bk.count; m++) bklog_writer_init(&g->log_w[m], &g->log, m);
+	bklog_compressor_start(&g->log);
+}
+
+void log_reading(struct glb *g, struct bk390_reading *r) {
+	struct bklog_record lr;
+
+	memset(&lr, 0, sizeof(lr));
+	lr.ts = r->ts;
+	lr.counts = r->counts;
+	lr.meter = r->meter;
+	lr.function = r->d[BYTE_FUNCTION];
+	lr.range = r->d[BYTE_RANGE] & 0x0F;
+	lr.status = r->d[BYTE_STATUS] & 0x0F;
+	lr.option1 = r->d[BYTE_OPTION_1] & 0x0F;
+	lr.option2 = r->d[BYTE_OPTION_2] & 0x0F;
+	lr.dps = r->dps;
+	lr.exponent = r->exponent;
+	bklog_write(&g->log_w[r->meter], &lr);
+}
+
+void log_close(struct glb *g) {
+	unsigned long records = 0, segments = 0, errors = 0;
+
+	for (int m = 0; m < g->bk.count; m++) {
+		bklog_writer_close(&g->log_w[m]);
+		records += g->log_w[m].records;
+		segments += g->log_w[m].segments;
+		errors += g->log_w[m].errors;
+	}
+	bklog_compressor_drain();
+	if (!g->quiet) fprintf(stderr,"log: %lu readings in %lu segments, %lu errors\n", records, segments, errors);
+	free(g->log_w);
+	g->log_w = NULL;
+}
+
+/*
+ * Next code point of a UTF-8 string, enough for the display's
+ * micro, degree and Ohm signs
+ */
+static uint16_t utf8_next(const char **p) {
+	const uint8_t *s = (const uint8_t *)*p;
+	uint16_t c;
+
+	if (s[0] < 0x80) {
+		c = s[0];
+		*p += 1;
+	} else if ((s[0] & 0xE0) == 0xC0 && s[1]) {
+		c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+		*p += 2;
+	} else if ((s[0] & 0xF0) == 0xE0 && s[1] && s[2]) {
+		c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+		*p += 3;
+	} else {
+		c = '?';
+		*p += 1;
+	}
+	return c;
+}
+
+static const struct glyph *glyph_find(struct glyph_cache *gc, uint16_t c) {
+	if (c < 128) return gc->ascii[c] ? &gc->g[gc->ascii[c] - 1] : NULL;
+	for (int i = 0; i < gc->count; i++) {
+		if (gc->g[i].ch == c) return &gc->g[i];
+	}
+	return NULL;
+}
+
+/*
+ * One glyph in to its cell of the atlas, frees the glyph surface
+ */
+static void atlas_put(SDL_Surface *atlas, SDL_Surface *gs, int cell, int cw, int ch, SDL_Rect *r) {
+	r->x = (cell % GLYPH_COLUMNS) * cw;
+	r->y = (cell / GLYPH_COLUMNS) * ch;
+	if (!gs) return;
+	r->w = gs->w;
+	r->h = gs->h;
+	if (atlas) {
+		SDL_SetSurfaceBlendMode(gs, SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(gs, NULL, atlas, r);
+	}
+	SDL_FreeSurface(gs);
+}
+
+/*
+ * Printable ASCII and the few symbols the units use, the Ohm sign is
+ * both the Greek capital omega the decoder uses and U+2126.
+ *
+ * With TEXT_OUTLINE the outline glyphs, stroke pixels bigger all
+ * round, go in the cells after the fill glyphs.
+ *
+ * Only touches the font and surfaces, so it can run on the font
+ * thread, glyphs_upload() makes the texture on the render thread.
+ */
+SDL_Surface *glyphs_rasterize(struct glyph_cache *gc, TTF_Font *font, int mode, int stroke) {
+	static const uint16_t extra[] = { 0x00B0, 0x00B5, 0x03A9, 0x2126 };
+	SDL_Surface *gs[GLYPHS_MAX], *os[GLYPHS_MAX];
+	SDL_Surface *atlas;
+	SDL_Color white = { 255, 255, 255, 255 };
+	int cw = 1, ch = 1, rows;
+
+	memset(gc, 0, sizeof(*gc));
+	memset(os, 0, sizeof(os));
+	for (int c = 32; c < 127; c++) gc->g[gc->count++].ch = c;
+	for (size_t k = 0; k < sizeof(extra) / sizeof(extra[0]); k++) gc->g[gc->count++].ch = extra[k];
+	gc->stroke = mode != TEXT_PLAIN ? stroke : 0;
+	gc->outline = mode == TEXT_OUTLINE && stroke > 0;
+
+	for (int i = 0; i < gc->count; i++) {
+		struct glyph *gl = &gc->g[i];
+
+		gs[i] = TTF_RenderGlyph_Blended(font, gl->ch, white);
+		if (TTF_GlyphMetrics(font, gl->ch, NULL, NULL, NULL, NULL, &gl->adv) != 0) gl->adv = gs[i] ? gs[i]->w : 0;
+		if (gs[i] && gs[i]->w > cw) cw = gs[i]->w;
+		if (gs[i] && gs[i]->h > ch) ch = gs[i]->h;
+	}
+	if (gc->outline) {
+		TTF_SetFontOutline(font, stroke);
+		for (int i = 0; i < gc->count; i++) {
+			os[i] = TTF_RenderGlyph_Blended(font, gc->g[i].ch, white);
+			if (os[i] && os[i]->w > cw) cw = os[i]->w;
+			if (os[i] && os[i]->h > ch) ch = os[i]->h;
+		}
+		TTF_SetFontOutline(font, 0);
+	}
+	gc->height = TTF_FontHeight(font);
+
+	rows = (gc->count * (gc->outline ? 2 : 1) + GLYPH_COLUMNS - 1) / GLYPH_COLUMNS;
+	atlas = SDL_CreateRGBSurfaceWithFormat(0, cw * GLYPH_COLUMNS, ch * rows, 32, SDL_PIXELFORMAT_RGBA32);
+
+	for (int i = 0; i < gc->count; i++) {
+		struct glyph *gl = &gc->g[i];
+
+		atlas_put(atlas, gs[i], i, cw, ch, &gl->src);
+		atlas_put(atlas, os[i], gc->count + i, cw, ch, &gl->osrc);
+		if (gs[i] && gl->ch < 128) gc->ascii[gl->ch] = i + 1;
+	}
+
+	if (!atlas) fprintf(stderr,"%s:%d: Unable to create glyph atlas (%s)\n", FL, SDL_GetError());
+	return atlas;
+}
+
+/*
+ * Unpack a glyph's PackBits coverage in to its atlas cell, white with
+ * the coverage as alpha, as TTF_RenderGlyph_Blended() would have
+ */
+static void prebuilt_unpack(const uint8_t *p, SDL_Surface *atlas, const SDL_Rect *r) {
+	int n = r->w * r->h, i = 0;
+
+	while (i < n) {
+		int c = *p++;
+		int run = c < 128 ? c + 1 : c - 125;
+
+		for (int k = 0; k < run && i < n; k++, i++) {
+			uint8_t *px = (uint8_t *)atlas->pixels + (r->y + i / r->w) * atlas->pitch + (r->x + i % r->w) * 4;
+			px[0] = px[1] = px[2] = 255;
+			px[3] = c < 128 ? p[k] : p[0];
+		}
+		p += c < 128 ? run : 1;
+	}
+}
+
+/*
+ * The glyphs for a size from the built in table, in the same atlas
+ * layout glyphs_rasterize() makes.  NULL if the size isn't in it, or
+ * full is set and the size only has the display alphabet, or there's
+ * an outline, which isn't pre-rendered; the caller rasterizes those.
+ */
+SDL_Surface *glyphs_prebuilt(struct glyph_cache *gc, int size, int full, int mode, int stroke) {
+	const struct prebuilt_size *ps = NULL;
+	SDL_Surface *atlas;
+	int cw = 1, ch = 1, rows;
+
+	if (mode == TEXT_OUTLINE && stroke > 0) return NULL;
+	for (int k = 0; k < PREBUILT_SIZES && !ps; k++) {
+		if (prebuilt_sizes[k].size == size && (!full || !prebuilt_sizes[k].display)) ps = &prebuilt_sizes[k];
+	}
+	if (!ps || ps->count > GLYPHS_MAX) return NULL;
+
+	for (int i = 0; i < ps->count; i++) {
+		if (ps->g[i].w > cw) cw = ps->g[i].w;
+		if (ps->g[i].h > ch) ch = ps->g[i].h;
+	}
+	rows = (ps->count + GLYPH_COLUMNS - 1) / GLYPH_COLUMNS;
+	atlas = SDL_CreateRGBSurfaceWithFormat(0, cw * GLYPH_COLUMNS, ch * rows, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!atlas) return NULL;
+
+	memset(gc, 0, sizeof(*gc));
+	gc->count = ps->count;
+	gc->height = ps->height;
+	gc->stroke = mode != TEXT_PLAIN ? stroke : 0;
+	for (int i = 0; i < gc->count; i++) {
+		const struct prebuilt_glyph *pg = &ps->g[i];
+		struct glyph *gl = &gc->g[i];
+
+		gl->ch = pg->ch;
+		gl->adv = pg->adv;
+		gl->src.x = (i % GLYPH_COLUMNS) * cw;
+		gl->src.y = (i / GLYPH_COLUMNS) * ch;
+		if (!pg->w) continue;
+		gl->src.w = pg->w;
+		gl->src.h = pg->h;
+		prebuilt_unpack(prebuilt_alpha + pg->offset, atlas, &gl->src);
+		if (gl->ch < 128) gc->ascii[gl->ch] = i + 1;
+	}
+	return atlas;
+}
+
+/*
+ * Width and height of a line of text in a glyph cache, what
+ * TTF_SizeUTF8() would say for the monospaced font
+ */
+static void glyphs_size(struct glyph_cache *gc, const char *text, int *w, int *h) {
+	int x = 0;
+
+	while (*text) {
+		const struct glyph *gl = glyph_find(gc, utf8_next(&text));
+		if (!gl) gl = glyph_find(gc, '?');
+		if (gl) x += gl->adv;
+	}
+	if (w) *w = x;
+	if (h) *h = gc->height;
+}
+
+int glyphs_upload(struct glyph_cache *gc, SDL_Renderer *renderer, SDL_Surface *atlas) {
+	if (!atlas) return -1;
+	gc->atlas = SDL_CreateTextureFromSurface(renderer, atlas);
+	SDL_FreeSurface(atlas);
+	if (!gc->atlas) {
+		fprintf(stderr,"%s:%d: Unable to create glyph texture (%s)\n", FL, SDL_GetError());
+		return -1;
+	}
+	SDL_SetTextureBlendMode(gc->atlas, SDL_BLENDMODE_BLEND);
+	return 0;
+}
+
+static int glyphs_pass(struct glyph_cache *gc, SDL_Renderer *renderer, const char *text, int x, int y, double scale, int outline) {
+	double pen = x;
+
+	while (*text) {
+		const struct glyph *gl = glyph_find(gc, utf8_next(&text));
+		if (!gl) gl = glyph_find(gc, '?');
+		if (!gl) continue;
+		const SDL_Rect *src = outline ? &gl->osrc : &gl->src;
+		if (gl->ch != ' ' && src->w) {
+			SDL_Rect dst = { (int)pen, y, (int)(src->w * scale + 0.5), (int)(src->h * scale + 0.5) };
+			SDL_RenderCopy(renderer, gc->atlas, src, &dst);
+		}
+		pen += gl->adv * scale;
+	}
+	return (int)pen;
+}
+
+/*
+ * scale is 1.0 unless the size wanted isn't rasterized yet and a
+ * nearby one is standing in for it.
+ *
+ * Outlines and shadows are drawn for the whole string before the
+ * fill, so a stroke never lands on top of the next character.  An
+ * outline insets the text by its width so it stays inside x, y.
+ */
+int glyphs_draw(struct glyph_cache *gc, SDL_Renderer *renderer, const char *text, int x, int y, SDL_Color colour, double scale, const struct text_effect *fx) {
+	int mode = fx && gc->stroke ? fx->mode : TEXT_PLAIN;
+	int s = (int)(gc->stroke * scale + 0.5);
+
+	if (!gc->atlas) return x;
+	if (mode == TEXT_OUTLINE && !gc->outline) mode = TEXT_PLAIN;
+	if (mode == TEXT_OUTLINE) {
+		SDL_SetTextureColorMod(gc->atlas, fx->colour.r, fx->colour.g, fx->colour.b);
+		glyphs_pass(gc, renderer, text, x, y, scale, 1);
+		x += s;
+		y += s;
+	} else if (mode == TEXT_SHADOW) {
+		SDL_SetTextureColorMod(gc->atlas, fx->colour.r, fx->colour.g, fx->colour.b);
+		glyphs_pass(gc, renderer, text, x + s, y + s, scale, 0);
+	}
+	SDL_SetTextureColorMod(gc->atlas, colour.r, colour.g, colour.b);
+	return glyphs_pass(gc, renderer, text, x, y, scale, 0) + (mode != TEXT_PLAIN ? s : 0);
 }
 
+void glyphs_free(struct glyph_cache *gc) {
+	if (gc->atlas) SDL_DestroyTexture(gc->atlas);
+	gc->atlas = NULL;
+}
 
+/*
+ * Size variants
+ */
+static int small_size(int size) {
+	return size / 3 > FONT_SIZE_MIN ? size / 3 : FONT_SIZE_MIN;
+}
 
 /*
- *
- * Default parameters are 2400:7none1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
- *
+ * Effect width scaled to a font size, at least a pixel if there's
+ * an effect at all, and the room it takes around the text
+ */
+static int stroke_size(struct display *d, int size) {
+	int s;
+
+	if (d->fx.mode == TEXT_PLAIN || d->fx.width <= 0) return 0;
+	s = d->fx.width * size / d->base_size;
+	return s < 1 ? 1 : s;
+}
+
+static int stroke_pad(struct display *d, int size) {
+	return stroke_size(d, size) * (d->fx.mode == TEXT_OUTLINE ? 2 : 1);
+}
+
+static const int size_buckets[] = { 10, 12, 14, 16, 19, 22, 26, 30, 36, 42, 50, 60, 72, 84, 100, 120, 144, 170, 200, 240 };
+
+/*
+ * One size from the TTF, starting SDL_ttf the first time a size
+ * isn't in the built in table
  */
+static SDL_Surface *variant_font(struct display *d, struct glyph_cache *gc, int size) {
+	SDL_Surface *atlas = NULL;
+	TTF_Font *f;
+
+	if (!d->ttf) {
+		if (TTF_Init() != 0) {
+			fprintf(stderr,"%s:%d: Unable to start SDL_ttf (%s)\n", FL, TTF_GetError());
+			return NULL;
+		}
+		d->ttf = 1;
+	}
+	f = TTF_OpenFontRW(SDL_RWFromMem((void *)RobotoMono_Regular_ttf, sizeof(RobotoMono_Regular_ttf)), 1, size);
+	if (f) {
+		atlas = glyphs_rasterize(gc, f, d->fx.mode, stroke_size(d, size));
+		TTF_CloseFont(f);
+	}
+	return atlas;
+}
+
 /*
-void open_port(struct serial_params_s *s) {
-	int r; 
+ * Rasterize a variant, from the built in table where it can be, with
+ * fonts of its own where it can't.  Font thread only, once it's
+ * running.  The readings only need the display alphabet, the labels
+ * need the lot.
+ */
+static void variant_rasterize(struct display *d, struct variant *v) {
+	int small = small_size(v->size);
+
+	v->small_s = NULL;
+	v->big_s = glyphs_prebuilt(&v->big, v->size, 0, d->fx.mode, stroke_size(d, v->size));
+	if (d->small) v->small_s = glyphs_prebuilt(&v->small, small, 1, d->fx.mode, stroke_size(d, small));
+	v->prebuilt = v->big_s && (v->small_s || !d->small);
+
+	if (!v->big_s) v->big_s = variant_font(d, &v->big, v->size);
+	if (d->small && !v->small_s) v->small_s = variant_font(d, &v->small, small);
+}
+
+static void *font_thread(void *arg) {
+	struct display *d = (struct display *)arg;
+
+	pthread_mutex_lock(&d->lock);
+	while (!d->stop) {
+		struct variant *v = NULL;
+
+		for (int i = 0; i < VARIANTS_MAX && !v; i++) {
+			if (d->var[i].state == VARIANT_QUEUED) v = &d->var[i];
+		}
+		if (!v) {
+			pthread_cond_wait(&d->cond, &d->lock);
+			continue;
+		}
 
-	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
+		/*
+		 * Nothing else touches a queued variant, so it's filled
+		 * in without the lock held
+		 */
+		pthread_mutex_unlock(&d->lock);
+		variant_rasterize(d, v);
+		pthread_mutex_lock(&d->lock);
+		v->state = VARIANT_RASTERIZED;
 	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
 
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	s->newtp.c_cflag = B2400 | CS7 | PARODD | CREAD | CRTSCTS ; // Adjust the settings to suit our BK390A / 2400-7o1
+static int variant_find(struct display *d, int size) {
+	for (int i = 0; i < VARIANTS_MAX; i++) {
+		if (d->var[i].state != VARIANT_EMPTY && d->var[i].size == size) return i;
+	}
+	return -1;
+}
 
-	cfsetospeed(&s->newtp, B2400);
-	cfsetispeed(&s->newtp, B2400);
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
+/*
+ * Queue a size for the font thread, reusing the least recently drawn
+ * variant if they're all taken
+ */
+static void variant_request(struct display *d, int size) {
+	struct variant *v = NULL;
+
+	if (variant_find(d, size) >= 0) return;
+
+	pthread_mutex_lock(&d->lock);
+	for (int i = 0; i < VARIANTS_MAX && !v; i++) {
+		if (d->var[i].state == VARIANT_EMPTY) v = &d->var[i];
 	}
+	for (int i = 0; i < VARIANTS_MAX && (!v || v->state != VARIANT_EMPTY); i++) {
+		struct variant *c = &d->var[i];
+		if (i == d->cur || (c->state != VARIANT_READY && c->state != VARIANT_FAILED)) continue;
+		if (!v || c->used < v->used) v = c;
+	}
+	if (!v) {
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+
+	glyphs_free(&v->big);
+	glyphs_free(&v->small);
+	v->size = size;
+	v->used = 0;
+	v->state = VARIANT_QUEUED;
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
 }
-*/
 
+/*
+ * Pick the ready variant closest to the size wanted, a larger one
+ * scaled down over a smaller one scaled up
+ */
+static void variant_choose(struct display *d) {
+	int best = d->cur;
+	double scale;
+
+	for (int i = 0; i < VARIANTS_MAX; i++) {
+		struct variant *v = &d->var[i];
+		struct variant *b = &d->var[best];
+		if (v->state != VARIANT_READY) continue;
+		if (b->state != VARIANT_READY) best = i;
+		else if (v->size == d->want) best = i;
+		else if (b->size == d->want) continue;
+		else if (v->size > d->want && (b->size < d->want || v->size < b->size)) best = i;
+		else if (v->size < d->want && b->size < d->want && v->size > b->size) best = i;
+	}
+
+	scale = (double)d->want / d->var[best].size;
+	if (best != d->cur || scale != d->scale) {
+		d->cur = best;
+		d->scale = scale;
+		for (int m = 0; m < METERS_MAX; m++) d->tile[m].dirty = 1;
+		d->footer.dirty = d->footer_h > 0;
+	}
+	d->var[best].used = mono_ns();
+}
 
 /*
- * Default parameters are 2400:8n1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
- *
+ * Upload whatever the font thread has finished, render thread only
  */
-void open_port( struct glb *g ) {
-#ifdef __linux__
-	struct serial_params_s *s = &(g->serial_params);
-	char *p = g->serial_parameters_string;
-	char default_params[] = "2400:7o1";
-	int r; 
+static void variant_tick(struct display *d) {
+	int changed = 0;
+
+	pthread_mutex_lock(&d->lock);
+	for (int i = 0; i < VARIANTS_MAX; i++) {
+		struct variant *v = &d->var[i];
+		if (v->state != VARIANT_RASTERIZED) continue;
+		v->state = VARIANT_READY;
+		if (glyphs_upload(&v->big, d->renderer, v->big_s) != 0) v->state = VARIANT_FAILED;
+		if (d->small && glyphs_upload(&v->small, d->renderer, v->small_s) != 0) v->state = VARIANT_FAILED;
+		v->big_s = v->small_s = NULL;
+		d->rasterized++;
+		if (v->prebuilt) d->prebuilt++;
+		changed = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (changed) variant_choose(d);
+}
 
-	if (!p) p = default_params;
+/*
+ * Lay the tiles out at the -z size and size the window to fit them,
+ * -wx/-wy still override the window size
+ */
+void display_layout(struct glb *g, int tile_w, int tile_h, int label_h, int footer_h) {
+	struct display *d = &g->display;
+	int n = g->bk.count;
 
-	fprintf(stdout,"Attempting to open '%s'\n", s->device);
-	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
+	/*
+	 * Outlines and shadows need room around the text
+	 */
+	d->base_size = d->want = g->font_size;
+	if (label_h) label_h += stroke_pad(d, small_size(d->base_size));
+	if (footer_h) footer_h += stroke_pad(d, small_size(d->base_size));
+
+	d->label_h = d->grid ? label_h : 0;
+	d->footer_h = footer_h;
+	d->panel_h = d->panel ? 3 * label_h : 0;
+	d->tile_w = tile_w + stroke_pad(d, d->base_size);
+	d->tile_h = tile_h + stroke_pad(d, d->base_size) + d->label_h + d->panel_h;
+
+	if (!d->grid) d->columns = 1;
+	else if (d->columns <= 0) {
+		d->columns = 1;
+		while (d->columns * d->columns < n) d->columns++;
+	}
+	if (d->columns > n) d->columns = n;
+	d->rows = (n + d->columns - 1) / d->columns;
+
+	g->window_width = d->base_w = d->columns * d->tile_w;
+	g->window_height = d->base_h = d->rows * d->tile_h + footer_h;
+	if (g->wx_forced) g->window_width = g->wx_forced;
+	if (g->wy_forced) g->window_height = g->wy_forced;
+
+	d->base_label_h = d->label_h;
+	d->base_footer_h = footer_h;
+	d->base_panel_h = d->panel_h;
+	d->small = d->grid || footer_h || d->panel;
+
+	for (int m = 0; m < n; m++) {
+		struct tile *t = &d->tile[m];
+		t->rect.x = (m % d->columns) * d->tile_w;
+		t->rect.y = (m / d->columns) * d->tile_h;
+		t->rect.w = d->tile_w;
+		t->rect.h = d->tile_h;
+		t->dirty = 1;
 	}
 
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
+	d->footer.rect.x = 0;
+	d->footer.rect.y = g->window_height - footer_h;
+	d->footer.rect.w = g->window_width;
+	d->footer.rect.h = footer_h;
+	d->footer.dirty = footer_h > 0;
+}
 
-	s->newtp.c_cflag = CLOCAL | CREAD ; 
+static int canvas_create(struct glb *g, int w, int h) {
+	struct display *d = &g->display;
 
-	if (strncmp(p, "115200:", 7) == 0) s->newtp.c_cflag |= B115200; 
-	else if (strncmp(p, "57600:", 6) == 0) s->newtp.c_cflag |= B57600;
-	else if (strncmp(p, "38400:", 6) == 0) s->newtp.c_cflag |= B38400;
-	else if (strncmp(p, "19200:", 6) == 0) s->newtp.c_cflag |= B19200;
-	else if (strncmp(p, "9600:", 5) == 0) s->newtp.c_cflag |= B9600;
-	else if (strncmp(p, "4800:", 5) == 0) s->newtp.c_cflag |= B4800;
-	else if (strncmp(p, "2400:", 5) == 0) s->newtp.c_cflag |= B2400; //
-	else {
-		fprintf(stdout,"Invalid serial speed\r\n");
-		exit(1);
+	if (d->canvas) SDL_DestroyTexture(d->canvas);
+	d->canvas = SDL_CreateTexture(d->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, w, h);
+	if (!d->canvas) {
+		fprintf(stderr,"%s:%d: Unable to create display canvas (%s)\n", FL, SDL_GetError());
+		return -1;
 	}
+	d->canvas_w = w;
+	d->canvas_h = h;
+	SDL_SetRenderTarget(d->renderer, d->canvas);
+	SDL_SetRenderDrawColor(d->renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255);
+	SDL_RenderClear(d->renderer);
+	SDL_SetRenderTarget(d->renderer, NULL);
+	d->pending = 1;
+	return 0;
+}
 
+/*
+ * The -z size's glyphs, before the window opens so the layout can be
+ * measured with them and before the font thread is started, which
+ * takes over for other sizes
+ */
+int display_glyphs(struct glb *g) {
+	struct display *d = &g->display;
+	struct variant *v = &d->var[0];
+
+	d->base_size = d->want = g->font_size;
+	d->small = g->integ.state_file || g->join.count || d->grid || d->panel;
+	v->size = d->base_size;
+	variant_rasterize(d, v);
+	if (!v->big_s || (d->small && !v->small_s)) {
+		fprintf(stderr,"Error trying to open font (RobotoMono-Regular.ttf)  :(\n");
+		return -1;
+	}
+	if (v->prebuilt) d->prebuilt++;
+	return 0;
+}
 
-//	s->newtp.c_cc[VMIN] = 0;
-//	s->newtp.c_cc[VTIME] = g->serial_timeout *10; // VTIME is 1/10th's of second
+/*
+ * Uploads the glyphs display_glyphs() made, then starts the font
+ * thread
+ */
+int display_init(struct glb *g, SDL_Renderer *renderer) {
+	struct display *d = &g->display;
+	struct variant *v = &d->var[0];
+
+	d->renderer = renderer;
+	v->state = VARIANT_READY;
+	if (glyphs_upload(&v->big, renderer, v->big_s) != 0) return -1;
+	if (d->small && glyphs_upload(&v->small, renderer, v->small_s) != 0) return -1;
+	v->big_s = v->small_s = NULL;
+	d->cur = 0;
+	d->scale = 1.0;
+	d->glyphs_ns = mono_ns() - d->started;
+
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	if (pthread_create(&d->thread, NULL, font_thread, d) == 0) d->running = 1;
+	else fprintf(stderr,"%s:%d: Unable to start font thread, the window won't resize the text\n", FL);
+
+	return canvas_create(g, g->window_width, g->window_height);
+}
 
-	p = strchr(p,':');
-	if (p) {
-		p++;
-		switch (*p) {
-			case '8': 
-				s->newtp.c_cflag |= CS8;
-				break;
-			case '7': 
-				s->newtp.c_cflag |= CS7;
-				break;
-			default: 
-						 fprintf(stdout, "Meter only accepts 7 or 8 bit mode\n");
+/*
+ * Window resized, fit the readings to it.  The font size is the
+ * largest bucket that fits, so dragging the edge only ever asks for
+ * a handful of sizes and each is rasterized once.
+ */
+void display_fit(struct glb *g, int w, int h) {
+	struct display *d = &g->display;
+	double f, want;
+	int size = FONT_SIZE_MIN;
+
+	if (w < 1 || h < 1) return;
+	if (w == d->canvas_w && h == d->canvas_h) return;
+
+	f = (double)w / d->base_w;
+	if ((double)h / d->base_h < f) f = (double)h / d->base_h;
+	want = d->base_size * f;
+	for (size_t k = 0; k < sizeof(size_buckets) / sizeof(size_buckets[0]); k++) {
+		if (size_buckets[k] <= want) size = size_buckets[k];
+	}
+	if (d->base_size <= want && d->base_size > size) size = d->base_size;
+
+	d->want = size;
+	d->label_h = d->base_label_h * size / d->base_size;
+	d->footer_h = d->base_footer_h * size / d->base_size;
+	d->panel_h = d->base_panel_h * size / d->base_size;
+
+	g->window_width = w;
+	g->window_height = h;
+	for (int m = 0; m < g->bk.count; m++) {
+		struct tile *t = &d->tile[m];
+		t->rect.w = w / d->columns;
+		t->rect.h = (h - d->footer_h) / d->rows;
+		t->rect.x = (m % d->columns) * t->rect.w;
+		t->rect.y = (m / d->columns) * t->rect.h;
+		t->dirty = 1;
+	}
+	d->footer.rect.x = 0;
+	d->footer.rect.y = h - d->footer_h;
+	d->footer.rect.w = w;
+	d->footer.rect.h = d->footer_h;
+	d->footer.dirty = d->footer_h > 0;
+
+	canvas_create(g, w, h);
+	if (d->running) variant_request(d, size);
+	variant_choose(d);
+}
+
+static void tile_set(struct tile *t, const char *text, SDL_Color colour) {
+	if (!t->dirty && strcmp(t->text, text) == 0 && t->colour.r == colour.r && t->colour.g == colour.g && t->colour.b == colour.b) return;
+	snprintf(t->text, sizeof(t->text), "%s", text);
+	t->colour = colour;
+	t->dirty = 1;
+}
+
+/*
+ * Called when the render sink takes an update, marks the tiles that
+ * changed
+ */
+void display_update(struct glb *g, const char *footer) {
+	struct display *d = &g->display;
+
+	for (int m = 0; m < g->bk.count; m++) {
+		struct bk390_meter *mt = &g->bk.meter[m];
+		SDL_Color c = g->rules.colour_active[m] ? g->rules.colour[m] : g->font_color;
+
+		/*
+		 * A stale reading stays up, faded a third of the way
+		 * to the background
+		 */
+		if (g->wd.stale[m] && !mt->comms_error) {
+			c.r = (c.r + 2 * g->background_color.r) / 3;
+			c.g = (c.g + 2 * g->background_color.g) / 3;
+			c.b = (c.b + 2 * g->background_color.b) / 3;
 		}
+		tile_set(&d->tile[m], mt->comms_error ? "COM.FLT" : mt->r.ftext, c);
 
-		p++;
-		switch (*p) {
-			case 'o': 
-				s->newtp.c_cflag |= (PARENB|PARODD);
-				break;
-			case 'n': 
-				s->newtp.c_cflag &= ~(PARODD|PARENB);
-				break;
-			case 'e': 
-				s->newtp.c_cflag |= PARENB;
-				break;
-			default: 
-				fprintf(stdout, "Parity mode is [n]one, [o]dd, or [e]ven\n");
+		/*
+		 * The histogram changes with every reading, but there's
+		 * no point redrawing it faster than it can be read
+		 */
+		if (d->panel_h) {
+			const struct bk390_sketch *sk = bk390_sketch_find(&g->bk, m, mt->r.d[BYTE_FUNCTION], mt->r.d[BYTE_RANGE]);
+			uint64_t now = now_us();
+
+			if (sk && sk->count != d->tile[m].panel_count && now - d->tile[m].panel_at >= PANEL_US) d->tile[m].dirty = 1;
 		}
+	}
+	if (d->footer_h) tile_set(&d->footer, footer, g->font_color);
+}
 
-		p++;
-		switch (*p) {
-			case '1': 
-				s->newtp.c_cflag &= ~CSTOPB;
-				break;
-			case '2': 
-				s->newtp.c_cflag |= CSTOPB;
-				break;
-			default: 
-				fprintf(stdout, "Stop bits are 1, or 2 only\n");
+/*
+ * Histogram of the sketch for the meter's function and range along
+ * the bottom of its tile, min to max, with the p1/p50/p99 marked and
+ * their values on a line underneath
+ */
+static void panel_draw(struct glb *g, int m, struct tile *t) {
+	struct display *d = &g->display;
+	struct variant *v = &d->var[d->cur];
+	struct bk390_meter *mt = &g->bk.meter[m];
+	const struct bk390_sketch *sk = bk390_sketch_find(&g->bk, m, mt->r.d[BYTE_FUNCTION], mt->r.d[BYTE_RANGE]);
+	unsigned long counts[PANEL_BARS_MAX], top = 0;
+	static const double qs[] = { 0.01, 0.5, 0.99 };
+	double q[3], span, scale;
+	char text[TILE_TEXT_SIZE];
+	SDL_Rect area, bar;
+	SDL_Color dim;
+	int bars, line_h = d->panel_h / 3;
+
+	t->panel_at = now_us();
+	t->panel_count = sk ? sk->count : 0;
+	if (!sk) return;
+
+	area.x = t->rect.x + line_h / 4;
+	area.w = t->rect.w - line_h / 2;
+	area.y = t->rect.y + t->rect.h - d->panel_h;
+	area.h = d->panel_h - line_h - 2;
+	if (area.w < 1 || area.h < 1) return;
+
+	bars = area.w / 3;
+	if (bars > PANEL_BARS_MAX) bars = PANEL_BARS_MAX;
+	if (bars < 1) bars = 1;
+	bk390_sketch_histogram(sk, sk->min, sk->max, counts, bars);
+	for (int k = 0; k < bars; k++) if (counts[k] > top) top = counts[k];
+
+	dim.r = (t->colour.r + g->background_color.r) / 2;
+	dim.g = (t->colour.g + g->background_color.g) / 2;
+	dim.b = (t->colour.b + g->background_color.b) / 2;
+	SDL_SetRenderDrawColor(d->renderer, dim.r, dim.g, dim.b, 255);
+	for (int k = 0; k < bars && top; k++) {
+		bar.x = area.x + k * area.w / bars;
+		bar.w = area.x + (k + 1) * area.w / bars - bar.x - 1;
+		bar.h = (int)((double)counts[k] * area.h / top + 0.5);
+		if (counts[k] && bar.h < 1) bar.h = 1;
+		bar.y = area.y + area.h - bar.h;
+		if (bar.w < 1) bar.w = 1;
+		SDL_RenderFillRect(d->renderer, &bar);
+	}
+
+	span = sk->max - sk->min;
+	SDL_SetRenderDrawColor(d->renderer, t->colour.r, t->colour.g, t->colour.b, 255);
+	for (int k = 0; k < 3; k++) {
+		int x;
+
+		q[k] = bk390_sketch_quantile(sk, qs[k]);
+		x = span > 0.0 ? area.x + (int)((q[k] - sk->min) / span * (area.w - 1)) : area.x + area.w / 2;
+		SDL_RenderDrawLine(d->renderer, x, area.y, x, area.y + area.h - 1);
+	}
+
+	/*
+	 * In the prefix the meter is showing, like the reading
+	 */
+	scale = pow(10.0, mt->r.exponent);
+	snprintf(text, sizeof(text), "p1 %.5g p50 %.5g p99 %.5g%s%s", q[0] / scale, q[1] / scale, q[2] / scale, mt->r.prefix, mt->r.units);
+	glyphs_draw(&v->small, d->renderer, text, t->rect.x, t->rect.y + t->rect.h - line_h, g->font_color, d->scale, &d->fx);
+}
+
+static void tile_draw(struct glb *g, int m, struct tile *t) {
+	struct display *d = &g->display;
+	struct variant *v = &d->var[d->cur];
+	SDL_Renderer *renderer = d->renderer;
+
+	SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255);
+	SDL_RenderFillRect(renderer, &t->rect);
+	if (m < 0) {
+		glyphs_draw(&v->small, renderer, t->text, t->rect.x, t->rect.y, t->colour, d->scale, &d->fx);
+	} else {
+		if (d->label_h) {
+			char label[TILE_TEXT_SIZE];
+			snprintf(label, sizeof(label), "M%d %s%s", m, g->bk.meter[m].serial.device ? g->bk.meter[m].serial.device : "", g->wd.stale[m] ? " STALE" : "");
+			glyphs_draw(&v->small, renderer, label, t->rect.x, t->rect.y, g->font_color, d->scale, &d->fx);
+		}
+		glyphs_draw(&v->big, renderer, t->text, t->rect.x, t->rect.y + d->label_h, t->colour, d->scale, &d->fx);
+		if (d->panel_h) panel_draw(g, m, t);
+	}
+	t->dirty = 0;
+	d->tiles_drawn++;
+	d->pending = 1;
+}
+
+/*
+ * Redraw the dirty tiles and present, no more than once a display
+ * frame.  Returns 1 if it presented.
+ */
+int display_frame(struct glb *g, uint64_t now) {
+	struct display *d = &g->display;
+	int dirty;
+	uint64_t t0;
+
+	variant_tick(d);
+
+	dirty = d->footer.dirty;
+	for (int m = 0; m < g->bk.count && !dirty; m++) dirty = d->tile[m].dirty;
+	if (!dirty && !d->pending) return 0;
+	if (now - d->last_present < DISPLAY_FRAME_US && d->first_ns) return 0;
+
+	t0 = mono_ns();
+	if (dirty) {
+		SDL_SetRenderTarget(d->renderer, d->canvas);
+		for (int m = 0; m < g->bk.count; m++) {
+			if (d->tile[m].dirty) tile_draw(g, m, &d->tile[m]);
 		}
+		if (d->footer.dirty) tile_draw(g, -1, &d->footer);
+		SDL_SetRenderTarget(d->renderer, NULL);
+	}
+
+	SDL_RenderCopy(d->renderer, d->canvas, NULL, NULL);
+	SDL_RenderPresent(d->renderer);
+	d->pending = 0;
+	d->last_present = now;
+	d->presents++;
+	hist_add(&g->metrics.stage[STAGE_RENDER], mono_ns() - t0);
+
+	for (int m = 0; m < g->bk.count && !d->first_ns; m++) {
+		if (!d->tile[m].text[0]) continue;
+		d->first_ns = mono_ns() - d->started;
+		if (g->debug) fprintf(stdout,"First reading drawn %.1fms after start, glyphs ready at %.1fms%s\r\n"
+				, d->first_ns / 1e6, d->glyphs_ns / 1e6, d->var[0].prebuilt ? " (built in)" : "");
+	}
+	return 1;
+}
+
+/*
+ * How long poll() can wait before a held back frame is due, or a
+ * size the font thread is working on might be ready.  Until the
+ * first reading is up nothing is held back, so it isn't kept waiting
+ * on the blank window's present.
+ */
+int display_wait(struct glb *g, uint64_t now) {
+	struct display *d = &g->display;
+	int dirty = d->pending || d->footer.dirty;
+	int wait = 100;
 
+	for (int i = 0; i < VARIANTS_MAX; i++) {
+		if (d->var[i].state == VARIANT_QUEUED || d->var[i].state == VARIANT_RASTERIZED) wait = 20;
 	}
+	for (int m = 0; m < g->bk.count && !dirty; m++) dirty = d->tile[m].dirty;
+	if (!dirty) return wait;
+	if (now - d->last_present >= DISPLAY_FRAME_US || !d->first_ns) return 0;
+	return (DISPLAY_FRAME_US - (now - d->last_present)) / 1000 + 1;
+}
 
-	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY );
+void display_close(struct glb *g) {
+	struct display *d = &g->display;
+
+	if (d->running) {
+		pthread_mutex_lock(&d->lock);
+		d->stop = 1;
+		pthread_cond_signal(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		pthread_join(d->thread, NULL);
+		d->running = 0;
+	}
+	for (int i = 0; i < VARIANTS_MAX; i++) {
+		struct variant *v = &d->var[i];
+		glyphs_free(&v->big);
+		glyphs_free(&v->small);
+		if (v->big_s) SDL_FreeSurface(v->big_s);
+		if (v->small_s) SDL_FreeSurface(v->small_s);
+		v->big_s = v->small_s = NULL;
+	}
+	if (d->canvas) SDL_DestroyTexture(d->canvas);
+	d->canvas = NULL;
+	if (d->ttf) TTF_Quit();
+	d->ttf = 0;
+}
 
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
+/*
+ * sigrok sessions, one writer per meter, see bk390sr.h
+ */
+void sigrok_init(struct glb *g) {
+	g->sr_w = (struct bksr_writer *)calloc(g->bk.count, sizeof(struct bksr_writer));
+	if (!g->sr_w) {
+		fprintf(stderr,"%s:%d: Unable to allocate sigrok writers\n", FL);
 		exit(1);
 	}
+	for (int m = 0; m < g->bk.count; m++) {
+		bksr_writer_init(&g->sr_w[m], g->sr_prefix, m, g->sr_samplerate);
+		g->sr_w[m].rotate_us = g->sr_rotate_us;
+	}
+}
 
-	fprintf(stdout,"Serial port opened, FD[%d]\n", s->fd);
-#endif
+void sigrok_close(struct glb *g) {
+	unsigned long samples = 0, sessions = 0, errors = 0;
+
+	for (int m = 0; m < g->bk.count; m++) {
+		bksr_writer_close(&g->sr_w[m]);
+		samples += g->sr_w[m].samples;
+		sessions += g->sr_w[m].sessions;
+		errors += g->sr_w[m].errors;
+	}
+	if (!g->quiet) fprintf(stderr,"sigrok: %lu samples in %lu sessions, %lu errors\n", samples, sessions, errors);
+	free(g->sr_w);
+	g->sr_w = NULL;
+}
+
+/*
+ * libbk390 settle callback, meter m's measurement has settled or
+ * timed out.  Goes out to /events as a settled event.
+ */
+void meter_settled(struct bk390 *b, int m, const struct bk390_settled *e, const struct bk390_reading *r, void *user) {
+	struct glb *g = (struct glb *)user;
+
+	(void)b;
+	snprintf(g->settle_units[m], sizeof(g->settle_units[m]), "%s", r->units);
+	if (g->debug) fprintf(stdout,"Meter %d %s at %.10g%s after %.3fs, %lu readings within %g%s\r\n"
+			, m, e->settled ? "settled" : "timed out", e->value, r->units, (e->ts - e->start) / 1e6, e->readings, e->span, e->armed ? ", armed" : "");
+	if (g->http.fd >= 0) http_settled(g, e, now_us());
 }
 
+/*
+ * libbk390 callback, a frame from meter m has been decoded in to r,
+ * pass fresh readings on to the rules, capture, integrator, join,
+ * log and sigrok sessions.
+ *
+ */
+void meter_reading(struct bk390 *b, int m, struct bk390_reading *r, int fresh, void *user) {
+	struct glb *g = (struct glb *)user;
+	struct histogram *st = g->metrics.stage;
+	uint64_t t0, t1;
+
+	hist_add(&st[STAGE_DECODE], b->meter[m].decode_ns);
+
+	/*
+	 * Only fresh frames are fed onwards, a repeated
+	 * previous frame says nothing new about the meter.
+	 *
+	 */
+	if (!fresh) return;
+
+	watchdog_feed(g, m);
+
+	t1 = mono_ns();
+	rules_eval(g, r);
+	t0 = mono_ns();
+	hist_add(&st[STAGE_RULES], t0 - t1);
+	if (g->capture.dir) {
+		capture_add(g, r);
+		t1 = mono_ns();
+		hist_add(&st[STAGE_CAPTURE], t1 - t0);
+		t0 = t1;
+	}
+	if (g->integ.state_file) {
+		integrate_reading(g, r);
+		t1 = mono_ns();
+		hist_add(&st[STAGE_INTEGRATE], t1 - t0);
+		t0 = t1;
+	}
+	if (g->join.count) {
+		join_add(g, r);
+		t1 = mono_ns();
+		hist_add(&st[STAGE_JOIN], t1 - t0);
+		t0 = t1;
+	}
+	if (g->log_w) {
+		log_reading(g, r);
+		t1 = mono_ns();
+		hist_add(&st[STAGE_LOG], t1 - t0);
+		t0 = t1;
+	}
+	if (g->sr_w) {
+		bksr_add(&g->sr_w[m], r->ts, r->ol ? NAN : r->si, r->units);
+		hist_add(&st[STAGE_SIGROK], mono_ns() - t0);
+	}
+}
 
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
@@ -514,22 +4062,10 @@ Changes:
 int main ( int argc, char **argv ) {
 
 	SDL_Event event;
-	SDL_Surface *surface = nullptr;
-	SDL_Texture *texture = nullptr;
-
-	char linetmp[SSIZE]; // temporary string for building main line of text
-	char prefix[SSIZE]; // Units prefix u, m, k, M etc
-	char units[SSIZE];  // Measurement units F, V, A, R
-	char mmmode[SSIZE]; // Multimeter mode, Resistance/diode/cap etc
-
-	uint8_t d[SSIZE];
-	uint8_t dt[SSIZE];      // Serial data packet
-	int dt_loaded = 0;	// set when we have our first valid data
-	uint8_t dps = 0;     // Number of decimal places
+
 	struct glb g;        // Global structure for passing variables around
-	int i = 0;           // Generic counter
-	char temp_char;        // Temporary character
 	char tfn[4096];
+	int line_height = 0;
 	bool quit = false;
 
 	glbs = &g;
@@ -538,6 +4074,7 @@ int main ( int argc, char **argv ) {
 	 * Initialise the global structure
 	 */
 	init(&g);
+	g.display.started = mono_ns();
 
 	/*
 	 * Parse our command line parameters
@@ -550,49 +4087,87 @@ int main ( int argc, char **argv ) {
 	 */
 	if (g.font_size < 10) g.font_size = 10;
 	if (g.font_size > 240) g.font_size = 240;
+	if (g.bk.count == 0) {
+		int m = bk390_add(&g.bk, NULL);
+		bk390_set_protocol(&g.bk, m, g.protocol);
+		bk390_set_filter(&g.bk, m, &g.filter);
+		bk390_set_cal(&g.bk, m, &g.cal);
+		bk390_set_settle(&g.bk, m, &g.settle);
+	}
 
 	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
 
+	if (g.rules_file) rules_load(&g);
+
+	if (g.capture.dir) {
+		capture_init(&g);
+		signal(SIGUSR1, capture_signal);
+	}
+
+	if (g.join.count) join_init(&g);
+
+	if (g.integ.state_file) integrator_init(&g);
+
+	if (g.log.dir) log_init(&g);
+
+	if (g.sr_prefix) sigrok_init(&g);
+
+	if (g.http.spec) http_init(&g);
+
+	watchdog_init(&g);
+
 	/*
-	 * Handle the COM Port
+	 * Handle the COM Ports
 	 */
-	open_port(&g);
+	g.bk.debug = g.debug;
+	bk390_set_callback(&g.bk, meter_reading, &g);
+	bk390_set_settle_callback(&g.bk, meter_settled, &g);
+	for (int m = 0; m < g.bk.count; m++) {
+		if (bk390_open(&g.bk, m) < 0) exit(1); // only a port that later goes away gets retried
+	}
 
 	/*
-	 * Setup SDL2 and fonts
+	 * Setup SDL2 and the glyphs, at the sizes in the built in
+	 * table SDL_ttf isn't started at all
 	 *
 	 */
 
 	SDL_Init(SDL_INIT_VIDEO);
-	SDL_RWops *s = SDL_RWFromMem( (void *)RobotoMono_Regular_ttf, sizeof(RobotoMono_Regular_ttf));
-	TTF_Init();
-	TTF_Font *font = TTF_OpenFontRW( s, 0, g.font_size ); 
-	if (!font) {
-		fprintf(stderr,"Error trying to open font (RobotoMono-Regular.ttf)  :(\n");
-		exit(1);
-	}
+	if (display_glyphs(&g) != 0) exit(1);
 
 	/*
-	 * Get the required window size.
+	 * Get the required tile size, one line per meter.
 	 *
 	 * Parameters passed can override the font self-detect sizing
 	 *
 	 */
-	TTF_SizeText(font, "-12.34mV  ", &g.window_width, &g.window_height);
-	if (g.wx_forced) g.window_width = g.wx_forced;
-	if (g.wy_forced) g.window_height = g.wy_forced;
-
-	SDL_Window *window = SDL_CreateWindow("BK390A Multimeter OSD", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
-	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+	glyphs_size(&g.display.var[0].big, "-12.34mV  ", &g.window_width, &line_height);
 
-	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255 );
+	/*
+	 * Integrator totals and derived channels go on a smaller
+	 * line underneath, dashboard tiles get a label in it and
+	 * histogram panels their percentiles
+	 */
+	int small_height = 0;
+	if (g.display.small) {
+		glyphs_size(&g.display.var[0].small, "Q -12.3456mAh", NULL, &small_height);
+		if (g.display.panel) {
+			int panel_w;
+			glyphs_size(&g.display.var[0].small, "p1 -12.345 p50 -12.345 p99 -12.345mV", &panel_w, NULL);
+			if (panel_w > g.window_width) g.window_width = panel_w;
+		}
+	}
 
-	/* Clear the entire screen to our selected color. */
-	SDL_RenderClear(renderer);
+	display_layout(&g, g.window_width, line_height, small_height, (g.integ.state_file || g.join.count) ? small_height : 0);
 
-	SDL_Color color = { 55, 255, 55 };
+	SDL_Window *window = SDL_CreateWindow("BK390A Multimeter OSD", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, SDL_WINDOW_RESIZABLE);
+	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
 
+	/*
+	 * Glyphs are rendered once up front, after that the font
+	 * is only needed again for other sizes
+	 */
+	if (display_init(&g, renderer) != 0) exit(1);
 
 	/*
 	 *
@@ -601,12 +4176,13 @@ int main ( int argc, char **argv ) {
 	 *
 	 */
 	while (!quit) {
-		char line1[1024];
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		int comms_error = 0;
-		ssize_t bytes_read = 0;
+		struct pollfd pfd[METERS_MAX + 2 + HTTP_CLIENTS_MAX];
+		int nfds, wfds;
+		char line2[1024];
+		char status[SSIZE];
+		uint64_t now;
+		int update = 0;
+		int l;
 
 		while (SDL_PollEvent(&event)) {
 			switch (event.type)
@@ -614,332 +4190,109 @@ int main ( int argc, char **argv ) {
 				case SDL_QUIT:
 					quit = true;
 					break;
+
+				case SDL_WINDOWEVENT:
+					if (event.window.event == SDL_WINDOWEVENT_EXPOSED) g.display.pending = 1;
+					if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) display_fit(&g, event.window.data1, event.window.data2);
+					break;
 			}
 		} // while SDL poll
 
-		linetmp[0] = '\0';
-
 		/*
 		 * Time to start receiving the serial block data
 		 *
-		 * We initially "stage" here waiting for there to
-		 * be something happening on the com port.  Soon as
-		 * something happens, then we move forward to trying
-		 * to read the data.
+		 * Wait for something to happen on any of the com ports,
+		 * the timeout keeps the window responsive and lets the
+		 * stale rules, capture and join timers run when the
+		 * meters go quiet.
 		 *
 		 */
+		nfds = bk390_pollfds(&g.bk, pfd);
+		wfds = watchdog_pollfds(&g, pfd + nfds);
+		nfds += wfds;
+		if (g.http.fd >= 0) nfds += http_pollfds(&g, pfd + nfds);
+
+		if (poll(pfd, nfds, display_wait(&g, now_us())) > 0) {
+			update |= bk390_process(&g.bk, pfd);
+			if (wfds) update |= watchdog_poll(&g, pfd + g.bk.count);
+			if (g.http.fd >= 0) http_poll(&g, pfd + g.bk.count + wfds, now_us());
+		}
 
-		if (g.debug) { fprintf(stdout,"DATA START: "); }
-
-		end_of_frame_received = 0;
-		comms_error = 0;
-		i = 0;
-
-		do {
-			uint8_t temp_char;
-			bytes_read = read(g.serial_params.fd, &temp_char, 1);
-			if (bytes_read == -1) {
-				comms_error = 1;
-				i = 0;
-				break;
-			}
-
-			if (bytes_read > 0) {
-				d[i] = temp_char;
-				if (g.debug) { fprintf(stdout,"%02x ", d[i]); fflush(stdout); }
-
+		bk390_tick(&g.bk, now_us());
 
-				i++;
+		rules_tick(&g, now_us());
 
-				if ( temp_char == '\n' ) {
-					end_of_frame_received = 1;
-					break;
-				}
+		if (g.capture.dir) {
+			if (capture_signalled) {
+				capture_signalled = 0;
+				for (int m = 0; m < g.bk.count; m++) capture_trigger(&g, m, TRIGGER_SIGNAL, now_us());
 			}
-		} while ((bytes_read > 0) && (i < sizeof(d)) && (!end_of_frame_received));
-
-
-		if (g.debug) { fprintf(stdout,":END [%d bytes]\r\n", i); }
-
-		/*
-		 * Validate the received data
-		 *
-		 */
-		if (i != DATA_FRAME_SIZE) {
-			if (g.debug) { fprintf(stdout,"Invalid number of bytes, expected %d, received %d, loading previous frame\r\n", DATA_FRAME_SIZE, i); }
-			if (dt_loaded) memcpy(d, dt, sizeof(d));
-		} else {
-			memcpy(dt, d, sizeof(d)); // make a copy.
-			dt_loaded = 1;
+			capture_tick(&g, now_us());
 		}
 
-		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
-		 *
-		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+		if (g.join.count) join_tick(&g, now_us());
 
-		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
-		 * linetmp : contains the value we want show
-		 * mmode   : contains the meter mode (resistance, volts, amps etc)
-		 *  "\u00B0C" = 'C
-		 *  "\u00B0F" = 'F
-		 *  "\u2126"  = ohms char
-		 *  "\u00B5"  = mu char (micro)
-		 *
-		 */
+		if (g.integ.state_file) integrator_tick(&g, now_us());
 
+		if (g.log_w) {
+			for (int m = 0; m < g.bk.count; m++) bklog_tick(&g.log_w[m], now_us());
+		}
 
-		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
-		 *
-		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+		if (g.http.fd >= 0) http_tick(&g, now_us());
 
 		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
+		 * Tiles held back by the frame limit go out once it's up
 		 */
-		switch (d[BYTE_FUNCTION]) {
-			case FUNCTION_VOLTAGE:
-				switch (d[BYTE_OPTION_2] & 0xC) {
-					case 0x4:
-						snprintf(units, sizeof(units), "VAC");
-						break;
-					case 0x8:
-						snprintf(units, sizeof(units), "VDC");
-						break;
-					default:
-						snprintf(units, sizeof(units), "V");
-						break;
-				}
-				snprintf(mmmode, sizeof(mmmode), "Volts");
-
-				switch (d[BYTE_RANGE] & 0x0F) {
-					case 0:
-						dps = 1;
-						snprintf(prefix, sizeof(prefix), "m");
-						break;
-					case 1: dps = 3; break;
-					case 2: dps = 2; break;
-					case 3: dps = 1; break;
-					case 4: dps = 0; break;
-				}      // test the range byte for voltages
-				break; // FUNCTION_VOLTAGE
-
-			case FUNCTION_CURRENT_UA:
-				snprintf(units, sizeof(units), "A");
-				snprintf(prefix, sizeof(prefix), "\u00B5");
-				snprintf(mmmode, sizeof(mmmode), "Amps");
-
-				switch (d[BYTE_RANGE] & 0x0F) {
-					case 0: dps = 1; break;
-					case 1: dps = 0; break;
-				}
-				break; // FUNCTION_CURRENT_UA
-
-			case FUNCTION_CURRENT_MA:
-				snprintf(units, sizeof(units), "A");
-				snprintf(prefix, sizeof(prefix), "m");
-				snprintf(mmmode, sizeof(mmmode), "Amps");
+		display_frame(&g, now_us());
 
-				switch (d[BYTE_RANGE] & 0x0F) {
-					case 0: dps = 2; break;
-					case 1: dps = 1; break;
-				}
-				break; // FUNCTION_CURRENT_MA
-
-			case FUNCTION_CURRENT_A:
-				snprintf(units, sizeof(units), "A");
-				snprintf(mmmode, sizeof(mmmode), "Amps");
-				dps = 2;
-				break; // FUNCTION_CURRENT_A
-
-			case FUNCTION_OHMS:
-				snprintf(mmmode, sizeof(mmmode), "Resistance");
-				snprintf(units, sizeof(units), "\u2126");
-
-				switch (d[BYTE_RANGE] & 0x0F) {
-					case 0: dps = 1; break;
-					case 1: dps = 3; snprintf(prefix, sizeof(prefix), "k"); break;
-					case 2: dps = 2; snprintf(prefix, sizeof(prefix), "k"); break;
-					case 3: dps = 1; snprintf(prefix, sizeof(prefix), "k"); break;
-					case 4: dps = 3; snprintf(prefix, sizeof(prefix), "M"); break;
-					case 5: dps = 2; snprintf(prefix, sizeof(prefix), "M"); break;
-				}
-				break; // FUNCTION_OHMS
-
-			case FUNCTION_CONTINUITY:
-				snprintf(mmmode, sizeof(mmmode), "Continuity");
-				snprintf(units, sizeof(units), "\u2126");
-				dps = 1;
-				break; // FUNCTION_CONTINUITY
-
-			case FUNCTION_DIODE:
-				snprintf(mmmode, sizeof(mmmode), "DIODE");
-				snprintf(units, sizeof(units), "V");
-				dps = 3;
-				break; // FUNCTION_DIODE
-
-			case FUNCTION_FQ_RPM:
-				if (!(d[BYTE_STATUS] & STATUS_JUDGE)) {
-					snprintf(mmmode, sizeof(mmmode), "Frequency");
-					snprintf(units, sizeof(units), "Hz");
-					switch (d[BYTE_RANGE] & 0x0F) {
-						case 0: dps = 3; snprintf(prefix, sizeof(prefix), "k"); break;
-						case 1: dps = 2; snprintf(prefix, sizeof(prefix), "k"); break;
-						case 2: dps = 1; snprintf(prefix, sizeof(prefix), "k"); break;
-						case 3: dps = 3; snprintf(prefix, sizeof(prefix), "M"); break;
-						case 4: dps = 2; snprintf(prefix, sizeof(prefix), "M"); break;
-						case 5: dps = 1; snprintf(prefix, sizeof(prefix), "M"); break;
-					} // switch
-
-				} else {
-					snprintf(mmmode, sizeof(mmmode), "RPM");
-					snprintf(units, sizeof(units), "rpm");
-					switch (d[BYTE_RANGE] & 0x0F) {
-						case 0: dps = 2; snprintf(prefix, sizeof(prefix), "k"); break;
-						case 1: dps = 1; snprintf(prefix, sizeof(prefix), "k"); break;
-						case 2: dps = 3; snprintf(prefix, sizeof(prefix), "M"); break;
-						case 3: dps = 2; snprintf(prefix, sizeof(prefix), "M"); break;
-						case 4: dps = 1; snprintf(prefix, sizeof(prefix), "M"); break;
-						case 5: dps = 0; snprintf(prefix, sizeof(prefix), "M"); break;
-					} // switch
-				}
-				break; // FUNCTION_FQ_RPM
-
-			case FUNCTION_CAPACITANCE:
-				snprintf(mmmode, sizeof(mmmode), "Capacitance");
-				snprintf(units, sizeof(units), "F");
-				switch (d[BYTE_RANGE] & 0x0F) {
-					case 0: dps = 3; snprintf(prefix, sizeof(prefix), "n"); break;
-					case 1: dps = 2; snprintf(prefix, sizeof(prefix), "n"); break;
-					case 2: dps = 1; snprintf(prefix, sizeof(prefix), "n"); break;
-					case 3: dps = 3; snprintf(prefix, sizeof(prefix), "\u00B5"); break;
-					case 4: dps = 2; snprintf(prefix, sizeof(prefix), "\u00B5"); break;
-					case 5: dps = 1; snprintf(prefix, sizeof(prefix), "\u00B5"); break;
-					case 6: dps = 3; snprintf(prefix, sizeof(prefix), "m"); break;
-					case 7: dps = 2; snprintf(prefix, sizeof(prefix), "m"); break;
-				}
-				break; // FUNCTION_CAPACITANCE
-
-			case FUNCTION_TEMPERATURE:
-				snprintf(mmmode, sizeof(mmmode), "Temperature");
-				if (d[BYTE_STATUS] & STATUS_JUDGE) {
-					snprintf(units, sizeof(units), "\u00B0C");
-				} else {
-					snprintf(units, sizeof(units), "\u00B0F");
-				}
-				dps = 0;
-				break; // FUNCTION_TEMPERATURE
-		} // SWITCH
+		if (!update) continue;
 
 		/*
-		 * Decode the digit data in to human-readable
-		 *
-		 * bytes 1..4 are ASCII char codes for 0000-9999
 		 *
+		 * END OF DECODING
 		 */
-		v = ((d[1] & 0x0F) * 1000) 
-			+ ((d[2] & 0x0F) * 100) 
-			+ ((d[3] & 0x0F) * 10) 
-			+ ((d[4] & 0x0F) * 1);
 
 		/*
-		 * Sign of output (+/-)
+		 * Derived channels and integrator totals for the second line
 		 */
-		if (d[BYTE_STATUS] & STATUS_SIGN) {
-			v = -v;
+		line2[0] = '\0';
+		l = 0;
+		for (int j = 0; j < g.join.count; j++) {
+			if (g.join.ch[j].have) l += snprintf(line2 + l, sizeof(line2) - l, "%s%s", l ? "  " : "", g.join.ch[j].text);
 		}
-
-		/*
-		 * If we're not showing the meter mode, then just
-		 * zero the string we generated previously
-		 */
-		if (g.show_mode == 0) {
-			mmmode[0] = 0;
+		for (int k = 0; k < g.integ.count; k++) {
+			char tmp[64];
+			struct integrator *it = &g.integ.it[k];
+			if (it->seconds == 0.0 && g.integ.count > 1) continue;
+			integrator_text(it, tmp, sizeof(tmp));
+			if (g.integ.count > 1) l += snprintf(line2 + l, sizeof(line2) - l, "%s%s %s", l ? "  " : "", it->name, tmp);
+			else l += snprintf(line2 + l, sizeof(line2) - l, "%s%s", l ? "  " : "", tmp);
 		}
 
-		/** range checks **/
-		if ((d[BYTE_STATUS] & STATUS_OL) == 1) {
-			snprintf(linetmp, sizeof(linetmp), "O.L.");
-
-		} else {
-			if (dps < 0) dps = 0;
-			if (dps > 3) dps = 3;
-
-			switch (dps) {
-				case 0: snprintf(linetmp, sizeof(linetmp), "% 05.0f%s%s", v, prefix, units); break;
-				case 1: snprintf(linetmp, sizeof(linetmp), "% 06.1f%s%s", v / 10, prefix, units); break;
-				case 2: snprintf(linetmp, sizeof(linetmp), "% 06.2f%s%s", v / 100, prefix, units); break;
-				case 3: snprintf(linetmp, sizeof(linetmp), "% 06.3f%s%s", v / 1000, prefix, units); break;
-			}
+		l = 0;
+		for (int m = 0; m < g.bk.count; m++) {
+			l += snprintf(status + l, sizeof(status) - l, "%s%s%s", m ? " | " : "", g.bk.meter[m].comms_error ? "COM.FLT" : g.bk.meter[m].r.ftext, g.wd.stale[m] && !g.bk.meter[m].comms_error ? " STALE" : "");
 		}
+		if (line2[0]) snprintf(status + l, sizeof(status) - l, "  %s", line2);
 
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-		//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
-
-		/*
-		 *
-		 * END OF DECODING
-		 */
-
-
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-		//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
-
-		if (!g.quiet) fprintf(stdout,"%s\r",line1); fflush(stdout);
+		now = now_us();
+		if (!g.quiet && output_pass(&g, SINK_STDOUT, 0, g.bk.count - 1, now)) {
+			fprintf(stdout,"%-40s\r", status);
+			fflush(stdout);
+		}
 
-		if (comms_error == 1) {
-			snprintf(line1, sizeof(line1), "COM.FLT");
+		if (g.http.fd >= 0 && output_pass(&g, SINK_HTTP, 0, g.bk.count - 1, now)) {
+			uint64_t t0 = mono_ns();
+			http_publish(&g, status, line2, now);
+			hist_add(&g.metrics.stage[STAGE_HTTP], mono_ns() - t0);
 		}
 
 		// SDL Render
 		// SDL Render
 		// SDL Render
-		if (1) {
-			SDL_RenderClear(renderer);
-			if (surface != nullptr) SDL_FreeSurface(surface);
-			surface = TTF_RenderUTF8_Shaded(font, line1, g.font_color, g.background_color);
-			if (texture != nullptr) SDL_DestroyTexture(texture);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-
-			int texW = 0;
-			int texH = 0;
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = { 0, 0, texW, texH };
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-			SDL_RenderPresent(renderer);
+		if (output_pass(&g, SINK_RENDER, 0, g.bk.count - 1, now)) {
+			display_update(&g, line2);
+			display_frame(&g, now);
 		} // SDL render section
 
 
@@ -948,14 +4301,19 @@ int main ( int argc, char **argv ) {
 			 * Only write the file out if it doesn't
 			 * exist. 
 			 *
+			 * FlexBV only wants the one reading, so it's
+			 * always the first meter.  The policy is only
+			 * asked once the file can be written, a reading
+			 * it passes is one that really went out.
+			 *
 			 */
-			if (!fileExists(g.output_file)) {
+			if (!fileExists(g.output_file) && output_pass(&g, SINK_FILE, 0, 0, now)) {
 				FILE *f;
 				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g.output_file);
 				f = fopen(tfn,"w");
 				if (f) {
-					fprintf(f,"%s", linetmp);
-					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, tfn);
+					fprintf(f,"%s", g.wd.stale[0] ? "STALE" : g.bk.meter[0].r.ftext);
+					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, g.bk.meter[0].r.ftext, tfn);
 					fclose(f);
 					rename(tfn, g.output_file);
 				}
@@ -964,15 +4322,23 @@ int main ( int argc, char **argv ) {
 
 	} // while(!quit)
 
-	if (g.serial_params.fd) close(g.serial_params.fd);
+	bk390_close(&g.bk);
+
+	watchdog_close(&g);
+
+	if (g.integ.state_file) integrator_save(&g);
+
+	if (g.log_w) log_close(&g);
+
+	if (g.sr_w) sigrok_close(&g);
+
+	if (g.http.fd >= 0) http_close(&g);
+
+	output_report(&g);
 
-	SDL_DestroyTexture(texture);
-	SDL_FreeSurface(surface);
-	TTF_CloseFont(font);
-	SDL_RWclose(s);
+	display_close(&g);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
-	TTF_Quit();
 	SDL_Quit();
 
 	return 0;
@@ -0,0 +1,617 @@
+/*
+ * BK390A soak test
+ *
+ * Runs libbk390 (and the reading log, with -L) against simulated
+ * meters on ptys for days of virtual time in minutes.  The meters
+ * are stepped through every function and range with overloads, sign
+ * and AC/DC changes, short frames and unplugging/replugging, while
+ * the library runs on a virtual clock so its timestamps, reconnect
+ * timing and the log's rotation and rollups all see the virtual time.
+ *
+ * The run is cut in to windows and at the end of each one RSS, open
+ * fds, CPU time per reading and frame latency percentiles are
+ * recorded.  A least squares fit over the windows (after the first
+ * couple, which include startup) projects the growth over the whole
+ * run, and if any of them trend upward by more than its allowance
+ * the exit status is 1.
+ *
+ * -r replays frames captured from a real meter (cat /dev/ttyUSB0 > file)
+ * in a loop instead of generating them.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "bk390.h"
+#include "bk390log.h"
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define FL __FILE__,__LINE__
+
+#define SOAK_METERS_MAX 8
+#define SOAK_WINDOWS_MAX 100
+#define SOAK_WARMUP 2                // windows left out of the trend fit
+#define FRAME_US 400000              // the meter sends about 2.5 frames a second
+#define LAT_FIFO 64
+
+/*
+ * Latency histogram, 1us buckets to 1ms then 100us buckets to 100ms
+ */
+#define LAT_FINE 1000
+#define LAT_BUCKETS (LAT_FINE + 990 + 1)
+
+struct gen_proto {
+	const char *name;
+	int size, digits, function, status, option2;
+	const uint8_t *functions;
+	int nfunctions;
+};
+
+static const uint8_t bk390a_functions[] = { 0x3B, 0x3D, 0x39, 0x3F, 0x33, 0x35, 0x31, 0x32, 0x36, 0x34 };
+static const uint8_t es51922_functions[] = { 0x3B, 0x3D, 0x3F, 0x30, 0x39, 0x33, 0x35, 0x31, 0x32, 0x36, 0x34 };
+
+static const struct gen_proto gen_protos[] = {
+	{ "bk390a", 11, 4, 5, 6, 8, bk390a_functions, sizeof(bk390a_functions) },
+	{ "es51922", 14, 5, 6, 7, 10, es51922_functions, sizeof(es51922_functions) },
+};
+
+struct sim_meter {
+	char link[64];
+	int master;                      // -1 while unplugged
+	uint64_t replug;                 // virtual time to plug back in
+	uint64_t lat_t[LAT_FIFO];        // mono ns each fresh frame was written
+	unsigned int lat_head, lat_tail;
+};
+
+struct window {
+	uint64_t vend;
+	unsigned long readings;
+	long rss_kb;
+	int fds;
+	double cpu_us;                   // per reading
+	double p50, p99, max;            // latency us
+};
+
+struct soak {
+	double days;
+	double speed;
+	int meters;
+	int nwindows;
+	int quiet;
+	char *log_dir;
+	char *replay;
+	uint64_t unplug_us;              // virtual time between unplugs
+
+	const struct gen_proto *gp;
+	const struct bk390_protocol *proto;
+	struct bk390 bk;
+	struct sim_meter sim[SOAK_METERS_MAX];
+
+	uint8_t *replay_buf;
+	size_t replay_len, replay_pos;
+
+	struct bklog_config log;
+	struct bklog_writer *log_w;
+
+	unsigned long readings, frames_sent, short_sent, unplugs;
+	uint64_t lat[LAT_BUCKETS];
+	struct window w[SOAK_WINDOWS_MAX];
+};
+
+static uint64_t vnow;
+
+static uint64_t virtual_clock(void) {
+	return vnow;
+}
+
+static uint64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BK390A soak test\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			"\t-D <days>: virtual time to run for (default 2)\r\n"
+			"\t-x <speed>: times faster than real time (default 500)\r\n"
+			"\t-m <meters>: simulated meters (default 2, max %d)\r\n"
+			"\t-P <bk390a|es51922>: protocol the meters speak (default bk390a)\r\n"
+			"\t-u <hours>: virtual hours between unplugging each meter (default 6, 0 never)\r\n"
+			"\t-r <file>: replay frames captured from a meter instead of generating them\r\n"
+			"\t-L <directory>: log the readings as bk390-sdl2 -L would\r\n"
+			"\t-w <windows>: measurement windows (default 20)\r\n"
+			"\t-q: only the verdict\r\n"
+			"\r\n"
+			"\texample: bk390-soak -D 3 -x 1000 -m 4 -L /tmp/soaklog\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			, SOAK_METERS_MAX
+			);
+}
+
+static long rss_kb(void) {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f) return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int fd_count(void) {
+	DIR *d = opendir("/proc/self/fd");
+	struct dirent *de;
+	int n = 0;
+
+	if (!d) return 0;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] != '.') n++;
+	}
+	closedir(d);
+	return n - 1; // the one opendir() is using
+}
+
+static double cpu_us(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void lat_add(struct soak *s, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	int b;
+
+	if (us < LAT_FINE) b = us;
+	else if (us < 100000) b = LAT_FINE + (us - LAT_FINE) / 100;
+	else b = LAT_BUCKETS - 1;
+	s->lat[b]++;
+}
+
+static double lat_bucket_us(int b) {
+	if (b < LAT_FINE) return b;
+	if (b < LAT_BUCKETS - 1) return LAT_FINE + (b - LAT_FINE) * 100.0;
+	return 100000;
+}
+
+static double lat_pct(struct soak *s, double pct) {
+	uint64_t total = 0, want, cum = 0;
+
+	for (int b = 0; b < LAT_BUCKETS; b++) total += s->lat[b];
+	if (!total) return 0;
+	want = (uint64_t)ceil(total * pct);
+	for (int b = 0; b < LAT_BUCKETS; b++) {
+		cum += s->lat[b];
+		if (cum >= want) return lat_bucket_us(b);
+	}
+	return lat_bucket_us(LAT_BUCKETS - 1);
+}
+
+static double lat_max(struct soak *s) {
+	for (int b = LAT_BUCKETS - 1; b >= 0; b--) {
+		if (s->lat[b]) return lat_bucket_us(b);
+	}
+	return 0;
+}
+
+/*
+ * Plug a simulated meter in, a new pty behind the same link name
+ * just as a USB adaptor comes back as the same device
+ */
+static int sim_plug(struct sim_meter *sm) {
+	int slave;
+	char name[64];
+
+	if (openpty(&sm->master, &slave, name, NULL, NULL) != 0) {
+		fprintf(stderr,"%s:%d: openpty failed (%s)\n", FL, strerror(errno));
+		return -1;
+	}
+	close(slave);
+	fcntl(sm->master, F_SETFL, O_NONBLOCK);
+	unlink(sm->link);
+	if (symlink(name, sm->link) != 0) {
+		fprintf(stderr,"%s:%d: Unable to link %s to %s (%s)\n", FL, sm->link, name, strerror(errno));
+		return -1;
+	}
+	sm->lat_head = sm->lat_tail = 0;
+	return 0;
+}
+
+static void sim_unplug(struct sim_meter *sm) {
+	close(sm->master);
+	sm->master = -1;
+	unlink(sm->link);
+}
+
+/*
+ * Next generated frame for meter m at step n.  The function moves on
+ * every virtual hour, the range every ten minutes within it, with
+ * overloads, sign, AC/DC and judge flips sprinkled through.
+ */
+static int gen_frame(struct soak *s, int m, uint64_t n, uint8_t *d) {
+	const struct gen_proto *gp = s->gp;
+	uint64_t minute = n * FRAME_US / 60000000;
+	int function = (minute / 60 + m) % gp->nfunctions;
+	int range = (minute / 10) % 8;
+	int status = 0;
+	unsigned int counts = (n * 7919 + m * 104729) % (gp->digits == 5 ? 22000 : 4000);
+	char digits[8];
+
+	if (n % 97 == 0) status |= STATUS_OL;
+	if ((n / 13) % 2) status |= STATUS_SIGN;
+	if ((minute / 60 / gp->nfunctions) % 2) status |= STATUS_JUDGE;
+
+	memset(d, 0x30, gp->size);
+	d[0] = 0x30 | range;
+	snprintf(digits, sizeof(digits), "%0*u", gp->digits, counts);
+	memcpy(d + 1, digits, gp->digits);
+	d[gp->function] = gp->functions[function];
+	d[gp->status] = 0x30 | status;
+	d[gp->option2] = 0x30 | ((n / 50) % 2 ? OPTION2_AC : OPTION2_DC);
+	d[gp->size - 2] = '\r';
+	d[gp->size - 1] = '\n';
+
+	/*
+	 * Now and then a frame that lost bytes on the way
+	 */
+	if (n % 1013 == 0) {
+		d[gp->size - 5] = '\r';
+		d[gp->size - 4] = '\n';
+		return gp->size - 3;
+	}
+	return gp->size;
+}
+
+static int replay_frame(struct soak *s, uint8_t *d) {
+	int l = 0;
+
+	while (l < BK390_FRAME_MAX) {
+		if (s->replay_pos >= s->replay_len) s->replay_pos = 0;
+		d[l] = s->replay_buf[s->replay_pos++];
+		if (d[l++] == '\n') break;
+	}
+	return l;
+}
+
+/*
+ * Readings land here, stamp their latency and log them
+ */
+static void soak_reading(struct bk390 *b, int m, struct bk390_reading *r, int fresh, void *user) {
+	struct soak *s = (struct soak *)user;
+	struct sim_meter *sm = &s->sim[m];
+
+	(void)b;
+	if (!fresh) return;
+	s->readings++;
+	if (sm->lat_tail != sm->lat_head) lat_add(s, mono_ns() - sm->lat_t[sm->lat_tail++ % LAT_FIFO]);
+
+	if (s->log_w) {
+		struct bklog_record lr;
+
+		memset(&lr, 0, sizeof(lr));
+		lr.ts = r->ts;
+		lr.counts = r->counts;
+		lr.meter = r->meter;
+		lr.function = r->d[BYTE_FUNCTION];
+		lr.range = r->d[BYTE_RANGE] & 0x0F;
+		lr.status = r->d[BYTE_STATUS] & 0x0F;
+		lr.option1 = r->d[BYTE_OPTION_1] & 0x0F;
+		lr.option2 = r->d[BYTE_OPTION_2] & 0x0F;
+		lr.dps = r->dps;
+		lr.exponent = r->exponent;
+		bklog_write(&s->log_w[m], &lr);
+	}
+}
+
+/*
+ * Least squares slope of v[] per window, times the windows fitted,
+ * ie how much it grew over the run
+ */
+static double trend(const double *v, int n) {
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int c = 0;
+
+	for (int k = SOAK_WARMUP; k < n; k++) {
+		sx += k;
+		sy += v[k];
+		sxx += (double)k * k;
+		sxy += k * v[k];
+		c++;
+	}
+	if (c < 2 || c * sxx - sx * sx == 0) return 0;
+	return (c * sxy - sx * sy) / (c * sxx - sx * sx) * (c - 1);
+}
+
+static double median(const double *v, int n) {
+	double t[SOAK_WINDOWS_MAX];
+	int c = 0;
+
+	for (int k = SOAK_WARMUP; k < n; k++) {
+		int j = c++;
+		while (j > 0 && t[j - 1] > v[k]) { t[j] = t[j - 1]; j--; }
+		t[j] = v[k];
+	}
+	return c ? t[c / 2] : 0;
+}
+
+int main(int argc, char **argv) {
+	static struct soak s;
+	struct pollfd pfd[SOAK_METERS_MAX];
+	uint64_t start_v, steps, step_ns, t_start, n;
+	double cpu_last;
+	unsigned long readings_last = 0;
+	int win = 0, failed = 0;
+
+	s.days = 2;
+	s.speed = 500;
+	s.meters = 2;
+	s.nwindows = 20;
+	s.unplug_us = 6ULL * 3600 * 1000000;
+	s.gp = &gen_protos[0];
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+		switch (argv[i][1]) {
+			case 'h': show_help(); exit(0);
+			case 'q': s.quiet = 1; break;
+			case 'D':
+			case 'x':
+			case 'm':
+			case 'P':
+			case 'u':
+			case 'r':
+			case 'L':
+			case 'w':
+				if (i + 1 >= argc) {
+					fprintf(stdout,"Insufficient parameters; %s <value>\n", argv[i]);
+					exit(1);
+				}
+				i++;
+				switch (argv[i-1][1]) {
+					case 'D': s.days = atof(argv[i]); break;
+					case 'x': s.speed = atof(argv[i]); break;
+					case 'm': s.meters = atoi(argv[i]); break;
+					case 'u': s.unplug_us = (uint64_t)(atof(argv[i]) * 3600 * 1000000); break;
+					case 'r': s.replay = argv[i]; break;
+					case 'L': s.log_dir = argv[i]; break;
+					case 'w': s.nwindows = atoi(argv[i]); break;
+					case 'P':
+						s.gp = NULL;
+						for (size_t k = 0; k < sizeof(gen_protos) / sizeof(gen_protos[0]); k++) {
+							if (strcmp(gen_protos[k].name, argv[i]) == 0) s.gp = &gen_protos[k];
+						}
+						if (!s.gp) {
+							fprintf(stdout,"Unknown protocol '%s'\n", argv[i]);
+							exit(1);
+						}
+						break;
+				}
+				break;
+			default:
+				fprintf(stdout,"Unknown parameter '%s'\n", argv[i]);
+				show_help();
+				exit(1);
+		}
+	}
+
+	if (s.meters < 1 || s.meters > SOAK_METERS_MAX || s.nwindows < SOAK_WARMUP + 3 || s.nwindows > SOAK_WINDOWS_MAX || s.days <= 0 || s.speed <= 0) {
+		show_help();
+		exit(1);
+	}
+	if (s.unplug_us && s.unplug_us < FRAME_US) {
+		fprintf(stdout,"-u is less than a frame (%gs), use 0 for never\n", FRAME_US / 1e6);
+		exit(1);
+	}
+
+	s.proto =bk390_protocol_find(s.gp->name);
+
+	if (s.replay) {
+		FILE *f = fopen(s.replay, "rb");
+		struct stat st;
+
+		if (!f || fstat(fileno(f), &st) != 0 || st.st_size == 0) {
+			fprintf(stdout,"Unable to read replay file '%s'\n", s.replay);
+			exit(1);
+		}
+		s.replay_buf = (uint8_t *)malloc(st.st_size);
+		if (!s.replay_buf || fread(s.replay_buf, 1, st.st_size, f) != (size_t)st.st_size) {
+			fprintf(stdout,"Unable to read replay file '%s'\n", s.replay);
+			exit(1);
+		}
+		s.replay_len = st.st_size;
+		fclose(f);
+	}
+
+	vnow = bk390_now_us();
+	start_v = vnow;
+	steps = (uint64_t)(s.days * 86400e6 / FRAME_US);
+	step_ns = (uint64_t)(FRAME_US * 1000 / s.speed);
+
+	if (s.log_dir) {
+		mkdir(s.log_dir, 0755);
+		if (bklog_dir_lock(s.log_dir) != 0) exit(1);
+		s.log.dir = s.log_dir;
+		s.log.rotate_bytes = 64 * 1024 * 1024;
+		s.log.rotate_us = 3600ULL * 1000000;
+		s.log.fsync_mode = BKLOG_FSYNC_NONE;
+		s.log.batch = 64;
+		s.log_w = (struct bklog_writer *)calloc(s.meters, sizeof(struct bklog_writer));
+		if (!s.log_w) exit(1);
+		for (int m = 0; m < s.meters; m++) bklog_writer_init(&s.log_w[m], &s.log, m);
+		bklog_compressor_start(&s.log);
+	}
+
+	bk390_init(&s.bk);
+	s.bk.clock = virtual_clock;
+	bk390_set_callback(&s.bk, soak_reading, &s);
+	for (int m = 0; m < s.meters; m++) {
+		struct sim_meter *sm = &s.sim[m];
+
+		snprintf(sm->link, sizeof(sm->link), "/tmp/bk390-soak-%d-%d", (int)getpid(), m);
+		if (sim_plug(sm) != 0) exit(1);
+		bk390_add(&s.bk, sm->link);
+		bk390_set_protocol(&s.bk, m, s.proto);
+		if (bk390_open(&s.bk, m) != 0) exit(1);
+	}
+
+	if (!s.quiet) fprintf(stdout,"%.2f days of %d %s meter%s at %gx, %llu frames each\n"
+			, s.days, s.meters, s.gp->name, s.meters > 1 ? "s" : "", s.speed, (unsigned long long)steps);
+
+	cpu_last = cpu_us();
+	t_start = mono_ns();
+	for (n = 0; n < steps; n++) {
+		struct timespec until;
+		uint64_t due = t_start + (n + 1) * step_ns;
+
+		vnow = start_v + n * FRAME_US;
+
+		for (int m = 0; m < s.meters; m++) {
+			struct sim_meter *sm = &s.sim[m];
+			uint8_t d[BK390_FRAME_MAX];
+			int l;
+
+			/*
+			 * Unplugs are staggered across the meters
+			 */
+			if (sm->master < 0) {
+				if (vnow >= sm->replug && sim_plug(sm) != 0) exit(1);
+				continue;
+			}
+			if (s.unplug_us && n && (n + (uint64_t)m * s.unplug_us / FRAME_US / s.meters) % (s.unplug_us / FRAME_US) == 0) {
+				sim_unplug(sm);
+				sm->replug = vnow + 5000000;
+				s.unplugs++;
+				continue;
+			}
+
+			l = s.replay ? replay_frame(&s, d) : gen_frame(&s, m, n, d);
+			if (write(sm->master, d, l) != l) continue;
+			s.frames_sent++;
+			if (l == s.gp->size) {
+				if (sm->lat_head - sm->lat_tail < LAT_FIFO) sm->lat_t[sm->lat_head++ % LAT_FIFO] = mono_ns();
+			} else {
+				s.short_sent++;
+			}
+		}
+
+		/*
+		 * Let the library take what's been sent, then wait out the
+		 * rest of the step
+		 */
+		for (;;) {
+			int nfds = bk390_pollfds(&s.bk, pfd);
+			uint64_t now_ns = mono_ns();
+
+			if (now_ns >= due || poll(pfd, nfds, (due - now_ns) / 1000000) <= 0) break;
+			bk390_process(&s.bk, pfd);
+		}
+
+		bk390_tick(&s.bk, vnow);
+		for (int m = 0; s.log_w && m < s.meters; m++) bklog_tick(&s.log_w[m], vnow);
+		bk390_latest(&s.bk, n % s.meters, NULL, NULL);
+
+		until.tv_sec = due / 1000000000;
+		until.tv_nsec = due % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+
+		/*
+		 * End of a window, take the measurements
+		 */
+		if ((n + 1) * s.nwindows / steps != (uint64_t)win) {
+			struct window *w = &s.w[win];
+			double cpu = cpu_us();
+
+			w->vend = vnow;
+			w->readings = s.readings - readings_last;
+			w->rss_kb = rss_kb();
+			w->fds = fd_count();
+			w->cpu_us = w->readings ? (cpu - cpu_last) / w->readings : 0;
+			w->p50 = lat_pct(&s, 0.50);
+			w->p99 = lat_pct(&s, 0.99);
+			w->max = lat_max(&s);
+			memset(s.lat, 0, sizeof(s.lat));
+			cpu_last = cpu;
+			readings_last = s.readings;
+
+			if (!s.quiet) fprintf(stdout,"window %2d  day %5.2f  readings %7lu  rss %6ldkB  fds %3d  cpu %6.1fus/reading  latency p50 %5.0fus p99 %5.0fus max %6.0fus\n"
+					, win, (vnow - start_v) / 86400e6, w->readings, w->rss_kb, w->fds, w->cpu_us, w->p50, w->p99, w->max);
+			win++;
+		}
+	}
+
+	bk390_close(&s.bk);
+	for (int m = 0; m < s.meters; m++) {
+		if (s.sim[m].master >= 0) sim_unplug(&s.sim[m]);
+	}
+	if (s.log_w) {
+		for (int m = 0; m < s.meters; m++) bklog_writer_close(&s.log_w[m]);
+		bklog_compressor_drain();
+	}
+
+	/*
+	 * Fit the trends and see if anything's creeping up
+	 */
+	{
+		struct {
+			const char *name;
+			const char *units;
+			double v[SOAK_WINDOWS_MAX];
+			double growth, median, allow;
+		} t[4] = {
+			{ "rss", "kB", { 0 }, 0, 0, 0 },
+			{ "fds", "", { 0 }, 0, 0, 0 },
+			{ "cpu/reading", "us", { 0 }, 0, 0, 0 },
+			{ "latency p99", "us", { 0 }, 0, 0, 0 },
+		};
+
+		for (int k = 0; k < s.nwindows; k++) {
+			t[0].v[k] = s.w[k].rss_kb;
+			t[1].v[k] = s.w[k].fds;
+			t[2].v[k] = s.w[k].cpu_us;
+			t[3].v[k] = s.w[k].p99;
+		}
+		for (int k = 0; k < 4; k++) {
+			t[k].growth = trend(t[k].v, s.nwindows);
+			t[k].median = median(t[k].v, s.nwindows);
+		}
+		t[0].allow = fmax(256, t[0].median * 0.05);
+		t[1].allow = 0.99;                  // not one more
+		t[2].allow = fmax(2, t[2].median * 0.25);
+		t[3].allow = fmax(20, t[3].median * 0.5);
+
+		if (!s.quiet) fprintf(stdout,"%lu frames sent (%lu short), %lu readings, %lu unplugs\n", s.frames_sent, s.short_sent, s.readings, s.unplugs);
+		for (int k = 0; k < 4; k++) {
+			int bad = t[k].growth > t[k].allow;
+			fprintf(stdout,"%-12s median %9.1f%-2s  trend %+9.1f%-2s over the run (allowed %.1f)  %s\n"
+					, t[k].name, t[k].median, t[k].units, t[k].growth, t[k].units, t[k].allow, bad ? "FAIL" : "ok");
+			failed |= bad;
+		}
+	}
+
+	fprintf(stdout,"%s\n", failed ? "SOAK FAILED" : "SOAK PASSED");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,979 @@
+/*
+ * libbk390, BK390A acquisition and decode
+ *
+ * Serial ports, framing, decode, per meter stats and the latest
+ * reading slots.  See bk390.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "bk390.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Counters have the acquisition thread as their only writer,
+ * see the metrics notes in bk390-sdl2.cpp
+ */
+#define BK390_INC(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
+/*
+ * Exact powers of ten, used to turn counts in to values without
+ * picking up the rounding of pow()
+ *
+ */
+static const double decade[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12 };
+
+uint64_t bk390_now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t lib_now(struct bk390 *b) {
+	return b->clock ? b->clock() : bk390_now_us();
+}
+
+static uint64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int bk390_prefix_exponent(const char *prefix) {
+	if (strcmp(prefix, "m") == 0) return -3;
+	if (strcmp(prefix, "\u00B5") == 0) return -6;
+	if (strcmp(prefix, "n") == 0) return -9;
+	if (strcmp(prefix, "k") == 0) return 3;
+	if (strcmp(prefix, "M") == 0) return 6;
+	return 0;
+}
+
+void bk390_init(struct bk390 *b) {
+	memset(b, 0, sizeof(*b));
+	b->sketch_alpha = BK390_SKETCH_ALPHA;
+	for (int m = 0; m < BK390_METERS_MAX; m++) b->meter[m].serial.fd = -1;
+}
+
+/*
+ * Adds a meter on device, the port isn't opened until bk390_open()
+ * and it's taken to be a BK390A unless bk390_set_protocol() says
+ * otherwise.
+ *
+ * Returns the meter number, -1 if there's no room for another
+ *
+ */
+int bk390_add(struct bk390 *b, const char *device) {
+	struct bk390_meter *mt;
+
+	if (b->count >= BK390_METERS_MAX) return -1;
+	mt = &b->meter[b->count];
+	memset(mt, 0, sizeof(*mt));
+	mt->serial.device = device;
+	mt->serial.fd = -1;
+	mt->proto = &bk390_protocols[0];
+	return b->count++;
+}
+
+void bk390_set_callback(struct bk390 *b, bk390_callback cb, void *user) {
+	b->cb = cb;
+	b->user = user;
+}
+
+void bk390_set_settle_callback(struct bk390 *b, bk390_settle_callback cb, void *user) {
+	b->settle_cb = cb;
+	b->settle_user = user;
+}
+
+/*
+ * Default parameters are 2400:7o1, given that the multimeter
+ * is shipped like this and cannot be changed then we shouldn't
+ * have to worry about needing to make changes, but we'll probably
+ * add that for future changes.
+ *
+ */
+static void port_open(struct bk390_serial *s, const char *p) {
+#ifdef __linux__
+	int r; 
+
+	fprintf(stderr,"Attempting to open '%s'\n", s->device);
+	s->fd = open( s->device, O_RDWR | O_NOCTTY | O_NDELAY );
+	if (s->fd <0) {
+		perror( s->device );
+		return;
+	}
+
+	fcntl(s->fd,F_SETFL,0);
+	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
+	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
+	cfmakeraw(&(s->newtp));
+
+	s->newtp.c_cflag = CLOCAL | CREAD ; 
+
+	if (strncmp(p, "115200:", 7) == 0) s->newtp.c_cflag |= B115200; 
+	else if (strncmp(p, "57600:", 6) == 0) s->newtp.c_cflag |= B57600;
+	else if (strncmp(p, "38400:", 6) == 0) s->newtp.c_cflag |= B38400;
+	else if (strncmp(p, "19200:", 6) == 0) s->newtp.c_cflag |= B19200;
+	else if (strncmp(p, "9600:", 5) == 0) s->newtp.c_cflag |= B9600;
+	else if (strncmp(p, "4800:", 5) == 0) s->newtp.c_cflag |= B4800;
+	else if (strncmp(p, "2400:", 5) == 0) s->newtp.c_cflag |= B2400; //
+	else {
+		fprintf(stderr,"Invalid serial speed\r\n");
+		close(s->fd);
+		s->fd = -1;
+		return;
+	}
+
+
+//	s->newtp.c_cc[VMIN] = 0;
+//	s->newtp.c_cc[VTIME] = g->serial_timeout *10; // VTIME is 1/10th's of second
+
+
+	p = strchr(p,':');
+	if (p) {
+		p++;
+		switch (*p) {
+			case '8': 
+				s->newtp.c_cflag |= CS8;
+				break;
+			case '7': 
+				s->newtp.c_cflag |= CS7;
+				break;
+			default: 
+						 fprintf(stderr, "Meter only accepts 7 or 8 bit mode\n");
+		}
+
+		p++;
+		switch (*p) {
+			case 'o': 
+				s->newtp.c_cflag |= (PARENB|PARODD);
+				break;
+			case 'n': 
+				s->newtp.c_cflag &= ~(PARODD|PARENB);
+				break;
+			case 'e': 
+				s->newtp.c_cflag |= PARENB;
+				break;
+			default: 
+				fprintf(stderr, "Parity mode is [n]one, [o]dd, or [e]ven\n");
+		}
+
+		p++;
+		switch (*p) {
+			case '1': 
+				s->newtp.c_cflag &= ~CSTOPB;
+				break;
+			case '2': 
+				s->newtp.c_cflag |= CSTOPB;
+				break;
+			default: 
+				fprintf(stderr, "Stop bits are 1, or 2 only\n");
+		}
+
+	}
+
+	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY );
+
+	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
+	if (r) {
+		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
+		close(s->fd);
+		s->fd = -1;
+		return;
+	}
+
+	fprintf(stderr,"Serial port opened, FD[%d]\n", s->fd);
+#endif
+}
+
+/*
+ * Welford's running mean/variance, restarted when the meter moves
+ * to another function or range since the values aren't comparable
+ */
+static void stats_add(struct bk390_meter *mt, const struct bk390_reading *r) {
+	struct bk390_stats *s = &mt->stats;
+	uint8_t range = r->d[BYTE_RANGE] & 0x0F;
+	double delta;
+	unsigned long n;
+
+	if (__atomic_exchange_n(&mt->stats_reset, 0, __ATOMIC_ACQUIRE) || !s->count
+			|| s->function != r->d[BYTE_FUNCTION] || s->range != range) {
+		memset(s, 0, sizeof(*s));
+		s->since = r->ts;
+		s->function = r->d[BYTE_FUNCTION];
+		s->range = range;
+		s->min = NAN;
+		s->max = NAN;
+	}
+
+	s->count++;
+	if (r->ol) {
+		s->ol++;
+		return;
+	}
+
+	n = s->count - s->ol;
+	if (n == 1 || r->si < s->min) s->min = r->si;
+	if (n == 1 || r->si > s->max) s->max = r->si;
+	delta = r->si - s->mean;
+	s->mean += delta / n;
+	s->m2 += delta * (r->si - s->mean);
+}
+
+double bk390_stats_stddev(const struct bk390_stats *s) {
+	unsigned long n = s->count - s->ol;
+
+	if (n < 2) return 0.0;
+	return sqrt(s->m2 / (n - 1));
+}
+
+/*
+ * Quantile sketch of the fresh, non OL readings, one per function
+ * and range the meter has been on.  The slot of the last reading is
+ * checked first, a new function or range takes an empty slot or the
+ * one that's gone longest without a reading.
+ */
+static void sketch_add(struct bk390 *b, struct bk390_meter *mt, const struct bk390_reading *r) {
+	struct bk390_sketch *s = &mt->sketch[mt->sketch_cur];
+	uint8_t function = r->d[BYTE_FUNCTION];
+	uint8_t range = r->d[BYTE_RANGE] & 0x0F;
+
+	if (b->sketch_alpha <= 0.0 || r->ol) return;
+
+	if (!s->count || s->function != function || s->range != range) {
+		int pick = -1;
+
+		for (int k = 0; k < BK390_SKETCH_SLOTS && pick < 0; k++) {
+			s = &mt->sketch[k];
+			if (s->count && s->function == function && s->range == range) pick = k;
+		}
+		for (int k = 0; k < BK390_SKETCH_SLOTS && pick < 0; k++) {
+			if (!mt->sketch[k].count) pick = k;
+		}
+		if (pick < 0) {
+			pick = 0;
+			for (int k = 1; k < BK390_SKETCH_SLOTS; k++) {
+				if (mt->sketch[k].last < mt->sketch[pick].last) pick = k;
+			}
+		}
+
+		mt->sketch_cur = pick;
+		s = &mt->sketch[pick];
+		if (!s->count || s->function != function || s->range != range) {
+			bk390_sketch_init(s, b->sketch_alpha);
+			s->function = function;
+			s->range = range;
+		}
+	}
+
+	bk390_sketch_add(s, r->si);
+	s->last = r->ts;
+}
+
+void bk390_stats_reset(struct bk390 *b, int meter) {
+	__atomic_store_n(&b->meter[meter].stats_reset, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a settle measurement now, from any thread.  It's picked up
+ * with the next reading, readings from before now don't count.
+ */
+void bk390_settle_arm(struct bk390 *b, int meter) {
+	uint64_t now = lib_now(b);
+
+	__atomic_store_n(&b->meter[meter].settle_arm, now ? now : 1, __ATOMIC_RELEASE);
+}
+
+static void settle_add(struct bk390 *b, int m, struct bk390_meter *mt, const struct bk390_reading *r) {
+	struct bk390_settled e;
+	uint64_t arm;
+
+	if (mt->settle.c.kind == BK390_SETTLE_OFF) return;
+	arm = __atomic_exchange_n(&mt->settle_arm, 0, __ATOMIC_ACQUIRE);
+	if (arm) bk390_settle_start(&mt->settle, arm, 1);
+	if (bk390_settle_add(&mt->settle, r, &e)) {
+		e.meter = m;
+		if (b->settle_cb) b->settle_cb(b, m, &e, r, b->settle_user);
+	}
+}
+
+/*
+ * Seqlock publish of the latest reading, the writer never waits and
+ * a reader just retries if it overlapped an update
+ */
+static void slot_publish(struct bk390_meter *mt) {
+	struct bk390_slot *sl = &mt->slot;
+	unsigned int seq = sl->seq;
+
+	__atomic_store_n(&sl->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	sl->r = mt->r;
+	sl->s = mt->stats;
+	sl->valid = 1;
+	__atomic_store_n(&sl->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy out the latest reading and/or stats for a meter, either
+ * pointer can be NULL.  Returns 0 if the meter has had a reading yet.
+ *
+ */
+int bk390_latest(struct bk390 *b, int meter, struct bk390_reading *r, struct bk390_stats *s) {
+	struct bk390_slot *sl;
+	unsigned int seq;
+	int valid;
+
+	if (meter < 0 || meter >= b->count) return -1;
+	sl = &b->meter[meter].slot;
+
+	do {
+		while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+		valid = sl->valid;
+		if (r) *r = sl->r;
+		if (s) *s = sl->s;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq);
+
+	return valid ? 0 : -1;
+}
+
+/*
+ * Protocols
+ *
+ * The Cyrustek ES519xx family all send much the same frame, a range
+ * byte, ASCII digits, function, status and option bytes and \r\n,
+ * differing in frame size, digit count, speed and tables.  Each one
+ * here is a traits type and the framing and decode are templates over
+ * it, so the frame size, sync byte and byte positions are constants
+ * in the code generated for that protocol.  A port picks its protocol
+ * once when it's opened and the read path calls through that one
+ * pointer per read(), nothing is looked up per byte or per frame.
+ *
+ * Decoders translate their frame in to the BK390A layout in
+ * reading.d, with the function byte mapped to the FUNCTION_* it
+ * matches, so nothing downstream needs to know which meter it was.
+ *
+ */
+#define FN_ACDC 0x01            // units get the AC/DC suffix
+
+#define JUDGE_ANY 0
+#define JUDGE_CLEAR 1
+#define JUDGE_SET 2
+
+struct range_entry {
+	uint8_t known;
+	uint8_t dps;
+	const char *prefix;          // NULL for the function's prefix
+};
+
+struct function_entry {
+	uint8_t code;                // function byte as sent
+	uint8_t judge;               // JUDGE_* the row applies to
+	uint8_t canon;               // FUNCTION_* it's reported as
+	uint8_t flags;
+	int8_t dps;                  // fixed decimal places, -1 to look up the range
+	const char *mode;
+	const char *units;
+	const char *prefix;          // prefix for every range, " " for none
+	struct range_entry range[8];
+};
+
+/*
+ * An unknown range leaves r->dps alone so the previous frame's decimal
+ * places carry over, as they always have on the BK390A.
+ */
+static const struct function_entry bk390a_functions[] = {
+	{ FUNCTION_VOLTAGE, JUDGE_ANY, FUNCTION_VOLTAGE, FN_ACDC, -1, "Volts", "V", " ", { {1,1,"m"}, {1,3,NULL}, {1,2,NULL}, {1,1,NULL}, {1,0,NULL} } },
+	{ FUNCTION_CURRENT_UA, JUDGE_ANY, FUNCTION_CURRENT_UA, 0, -1, "Amps", "A", "\u00B5", { {1,1,NULL}, {1,0,NULL} } },
+	{ FUNCTION_CURRENT_MA, JUDGE_ANY, FUNCTION_CURRENT_MA, 0, -1, "Amps", "A", "m", { {1,2,NULL}, {1,1,NULL} } },
+	{ FUNCTION_CURRENT_A, JUDGE_ANY, FUNCTION_CURRENT_A, 0, 2, "Amps", "A", " ", { } },
+	{ FUNCTION_OHMS, JUDGE_ANY, FUNCTION_OHMS, 0, -1, "Resistance", "Ω", " ", { {1,1,NULL}, {1,3,"k"}, {1,2,"k"}, {1,1,"k"}, {1,3,"M"}, {1,2,"M"} } },
+	{ FUNCTION_CONTINUITY, JUDGE_ANY, FUNCTION_CONTINUITY, 0, 1, "Continuity", "Ω", " ", { } },
+	{ FUNCTION_DIODE, JUDGE_ANY, FUNCTION_DIODE, 0, 3, "DIODE", "V", " ", { } },
+	{ FUNCTION_FQ_RPM, JUDGE_CLEAR, FUNCTION_FQ_RPM, 0, -1, "Frequency", "Hz", " ", { {1,3,"k"}, {1,2,"k"}, {1,1,"k"}, {1,3,"M"}, {1,2,"M"}, {1,1,"M"} } },
+	{ FUNCTION_FQ_RPM, JUDGE_SET, FUNCTION_FQ_RPM, 0, -1, "RPM", "rpm", " ", { {1,2,"k"}, {1,1,"k"}, {1,3,"M"}, {1,2,"M"}, {1,1,"M"}, {1,0,"M"} } },
+	{ FUNCTION_CAPACITANCE, JUDGE_ANY, FUNCTION_CAPACITANCE, 0, -1, "Capacitance", "F", " ", { {1,3,"n"}, {1,2,"n"}, {1,1,"n"}, {1,3,"\u00B5"}, {1,2,"\u00B5"}, {1,1,"\u00B5"}, {1,3,"m"}, {1,2,"m"} } },
+	{ FUNCTION_TEMPERATURE, JUDGE_SET, FUNCTION_TEMPERATURE, 0, 0, "Temperature", "\u00B0C", " ", { } },
+	{ FUNCTION_TEMPERATURE, JUDGE_CLEAR, FUNCTION_TEMPERATURE, 0, 0, "Temperature", "\u00B0F", " ", { } },
+};
+
+/*
+ * ES51922 (UNI-T UT61E and friends), 22000 counts
+ */
+static const struct function_entry es51922_functions[] = {
+	{ 0x3B, JUDGE_ANY, FUNCTION_VOLTAGE, FN_ACDC, -1, "Volts", "V", " ", { {1,4,NULL}, {1,3,NULL}, {1,2,NULL}, {1,1,NULL}, {1,2,"m"} } },
+	{ 0x3D, JUDGE_ANY, FUNCTION_CURRENT_UA, 0, -1, "Amps", "A", "\u00B5", { {1,2,NULL}, {1,1,NULL} } },
+	{ 0x3F, JUDGE_ANY, FUNCTION_CURRENT_MA, 0, -1, "Amps", "A", "m", { {1,3,NULL}, {1,2,NULL} } },
+	{ 0x30, JUDGE_ANY, FUNCTION_CURRENT_A, 0, 3, "Amps", "A", " ", { } },
+	{ 0x39, JUDGE_ANY, FUNCTION_CURRENT_A, 0, -1, "Amps", "A", " ", { {1,4,NULL}, {1,3,NULL}, {1,2,NULL}, {1,1,NULL} } },
+	{ 0x33, JUDGE_ANY, FUNCTION_OHMS, 0, -1, "Resistance", "Ω", " ", { {1,2,NULL}, {1,4,"k"}, {1,3,"k"}, {1,2,"k"}, {1,4,"M"}, {1,3,"M"}, {1,2,"M"} } },
+	{ 0x35, JUDGE_ANY, FUNCTION_CONTINUITY, 0, 2, "Continuity", "Ω", " ", { } },
+	{ 0x31, JUDGE_ANY, FUNCTION_DIODE, 0, 4, "DIODE", "V", " ", { } },
+	{ 0x32, JUDGE_ANY, FUNCTION_FQ_RPM, 0, -1, "Frequency", "Hz", " ", { {1,2,NULL}, {1,1,NULL}, {1,3,"k"}, {1,2,"k"}, {1,4,"M"}, {1,3,"M"}, {1,2,"M"} } },
+	{ 0x36, JUDGE_ANY, FUNCTION_CAPACITANCE, 0, -1, "Capacitance", "F", " ", { {1,3,"n"}, {1,2,"n"}, {1,4,"\u00B5"}, {1,3,"\u00B5"}, {1,2,"\u00B5"}, {1,4,"m"}, {1,3,"m"}, {1,2,"m"} } },
+	{ 0x34, JUDGE_SET, FUNCTION_TEMPERATURE, 0, 0, "Temperature", "\u00B0C", " ", { } },
+	{ 0x34, JUDGE_CLEAR, FUNCTION_TEMPERATURE, 0, 0, "Temperature", "\u00B0F", " ", { } },
+};
+
+/*
+ * BK390A, 11 bytes: range, 4 digits, function, status, option 1,
+ * option 2, \r\n.  Already in the canonical layout.
+ */
+struct proto_bk390a {
+	enum { size = 11, digits = 4, range = 0, digit = 1, function = 5, status = 6 };
+	static const function_entry *table() { return bk390a_functions; }
+	static int table_n() { return sizeof(bk390a_functions) / sizeof(bk390a_functions[0]); }
+	static uint8_t option1(const uint8_t *d) { return d[7]; }
+	static uint8_t option2(const uint8_t *d) { return d[8]; }
+};
+
+/*
+ * ES51922, 14 bytes: range, 5 digits, function, status, option 1-4,
+ * \r\n.  Min/max hold live in option 2 and AC/DC/auto in option 3.
+ */
+struct proto_es51922 {
+	enum { size = 14, digits = 5, range = 0, digit = 1, function = 6, status = 7 };
+	static const function_entry *table() { return es51922_functions; }
+	static int table_n() { return sizeof(es51922_functions) / sizeof(es51922_functions[0]); }
+	static uint8_t option1(const uint8_t *d) {
+		return 0x30 | (d[10] & 0x01 ? OPTION1_VAHZ : 0) | (d[9] & 0x02 ? OPTION1_PMIN : 0) | (d[9] & 0x04 ? OPTION1_PMAX : 0);
+	}
+	static uint8_t option2(const uint8_t *d) { return 0x30 | (d[10] & (OPTION2_AUTO | OPTION2_AC | OPTION2_DC)); }
+};
+
+template <class P> static const function_entry *function_lookup(const uint8_t *d) {
+	const function_entry *t = P::table();
+	int judge = (d[P::status] & STATUS_JUDGE) ? JUDGE_SET : JUDGE_CLEAR;
+
+	for (int k = 0; k < P::table_n(); k++) {
+		if (t[k].code == d[P::function] && (t[k].judge == JUDGE_ANY || t[k].judge == judge)) return &t[k];
+	}
+	return NULL;
+}
+
+/*
+ * The display line for signed counts v with dps decimal places
+ */
+static void reading_text(char *text, size_t size, double v, int dps, const char *prefix, const char *units) {
+	switch (dps) {
+		case 0: snprintf(text, size, "% 05.0f%s%s", v, prefix, units); break;
+		case 1: snprintf(text, size, "% 06.1f%s%s", v / 10, prefix, units); break;
+		case 2: snprintf(text, size, "% 06.2f%s%s", v / 100, prefix, units); break;
+		case 3: snprintf(text, size, "% 06.3f%s%s", v / 1000, prefix, units); break;
+		case 4: snprintf(text, size, "% 06.4f%s%s", v / 10000, prefix, units); break;
+	}
+}
+
+static double counts_si(double v, int dps, int exponent) {
+	if (exponent - dps < 0) return v / decade[dps - exponent];
+	return v * decade[exponent - dps];
+}
+
+/*
+ * Decode a single frame from the meter in to a reading.
+ *
+ */
+template <class P> static void frame_decode(struct bk390 *b, const uint8_t *d, struct bk390_reading *r) {
+	const function_entry *fe = function_lookup<P>(d);
+	int range = d[P::range] & 0x0F;
+	double v = 0.0;
+
+	/*
+	 * Initialise the strings used for units, prefix and mode
+	 * so we don't end up with uncleared prefixes etc
+	 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
+	 *
+	 * Prefix string initialised to single space, prevents 
+	 * annoying string width jump (on monospace, can't stop
+	 * it with variable width strings unless we draw the 
+	 * prefix+units separately in a fixed location
+	 *
+	 */
+	snprintf(r->prefix, sizeof(r->prefix), " ");
+	r->units[0] = '\0';
+	r->mmmode[0] = '\0';
+
+	static_assert(P::size <= BK390_RAW_MAX, "frame longer than BK390_RAW_MAX");
+	memcpy(r->raw, d, P::size);
+	r->raw_len = P::size;
+
+	/*
+	 * Canonical BK390A frame, the last four digits stand in
+	 * for a longer display
+	 */
+	r->d[BYTE_RANGE] = d[P::range];
+	for (int k = 0; k < 4; k++) r->d[BYTE_DIGIT_3 + k] = d[P::digit + P::digits - 4 + k];
+	r->d[BYTE_FUNCTION] = fe ? fe->canon : d[P::function];
+	r->d[BYTE_STATUS] = d[P::status];
+	r->d[BYTE_OPTION_1] = P::option1(d);
+	r->d[BYTE_OPTION_2] = P::option2(d);
+	r->d[9] = '\r';
+	r->d[10] = '\n';
+
+	if (fe) {
+		const struct range_entry *re = (range < 8) ? &fe->range[range] : NULL;
+
+		snprintf(r->mmmode, sizeof(r->mmmode), "%s", fe->mode);
+		snprintf(r->prefix, sizeof(r->prefix), "%s", fe->prefix);
+		if (fe->flags & FN_ACDC) {
+			switch (r->d[BYTE_OPTION_2] & (OPTION2_AC | OPTION2_DC)) {
+				case OPTION2_AC: snprintf(r->units, sizeof(r->units), "%sAC", fe->units); break;
+				case OPTION2_DC: snprintf(r->units, sizeof(r->units), "%sDC", fe->units); break;
+				default: snprintf(r->units, sizeof(r->units), "%s", fe->units); break;
+			}
+		} else {
+			snprintf(r->units, sizeof(r->units), "%s", fe->units);
+		}
+
+		if (fe->dps >= 0) {
+			r->dps = fe->dps;
+		} else if (re && re->known) {
+			r->dps = re->dps;
+			if (re->prefix) snprintf(r->prefix, sizeof(r->prefix), "%s", re->prefix);
+		}
+	}
+
+	/*
+	 * Decode the digit data in to human-readable
+	 *
+	 * ASCII char codes for 0000-9999 (or 00000-99999)
+	 *
+	 */
+	for (int k = 0; k < P::digits; k++) v = v * 10 + (d[P::digit + k] & 0x0F);
+
+	/*
+	 * Sign of output (+/-)
+	 */
+	if (d[P::status] & STATUS_SIGN) {
+		v = -v;
+	}
+
+	/*
+	 * If we're not showing the meter mode, then just
+	 * zero the string we generated previously
+	 */
+	if (b->show_mode == 0) {
+		r->mmmode[0] = 0;
+	}
+
+	if (r->dps > 4) r->dps = 4;
+
+	/** range checks **/
+	if ((d[P::status] & STATUS_OL) == 1) {
+		snprintf(r->text, sizeof(r->text), "O.L.");
+
+	} else {
+		reading_text(r->text, sizeof(r->text), v, r->dps, r->prefix, r->units);
+	}
+
+	/*
+	 * Keep the numeric forms of the reading as well as the text,
+	 * the rules and anything else downstream of the display work
+	 * from these rather than re-parsing the string.
+	 *
+	 */
+	r->counts = (int)v;
+	r->ol = ((d[P::status] & STATUS_OL) == 1);
+	r->exponent = bk390_prefix_exponent(r->prefix);
+	r->value = v / decade[r->dps];
+	r->si = counts_si(v, r->dps, r->exponent);
+}
+
+/*
+ * The meter's calibration for the function and range, on every
+ * frame including a repeated one as it's decoded afresh
+ */
+static void reading_calibrate(struct bk390_meter *mt, struct bk390_reading *r) {
+	const struct bk390_cal_entry *e;
+	int32_t counts;
+
+	if (!mt->cal.active || r->ol) return;
+	e = &mt->cal.e[r->d[BYTE_FUNCTION] & 0x0F][r->d[BYTE_RANGE] & 0x0F];
+	counts = bk390_cal_apply(e, r->counts);
+	if (counts == r->counts) return;
+
+	r->counts = counts;
+	r->value = (double)counts / decade[r->dps];
+	r->si = counts_si(counts, r->dps, r->exponent);
+	reading_text(r->text, sizeof(r->text), counts, r->dps, r->prefix, r->units);
+}
+
+/*
+ * Run a fresh reading through the meter's filter and fill in the
+ * filtered fields.  The text is rounded to the display's resolution,
+ * the numbers keep the fraction of a count.
+ */
+static void reading_filter(struct bk390_meter *mt, struct bk390_reading *r) {
+	struct bk390_filter *f = &mt->filter;
+	uint8_t range = r->d[BYTE_RANGE] & 0x0F;
+	double v, shown;
+
+	if (f->c.kind == BK390_FILTER_NONE || r->ol) {
+		r->fcounts = r->counts;
+		r->fvalue = r->value;
+		r->fsi = r->si;
+		snprintf(r->ftext, sizeof(r->ftext), "%s", r->text);
+		return;
+	}
+
+	if (f->n && (f->function != r->d[BYTE_FUNCTION] || f->range != range)) {
+		bk390_filter_reset(f);
+		BK390_INC(f->resets);
+	}
+	f->function = r->d[BYTE_FUNCTION];
+	f->range = range;
+
+	v = bk390_filter_add(f, r->counts);
+	r->fcounts = (int)(v < 0 ? v - 0.5 : v + 0.5);
+	shown = r->fcounts; // and no -0
+	r->fvalue = v / decade[r->dps];
+	r->fsi = counts_si(v, r->dps, r->exponent);
+	reading_text(r->ftext, sizeof(r->ftext), shown, r->dps, r->prefix, r->units);
+}
+
+/*
+ * Used by auto-detection, a frame that's the right size, ends in
+ * \r\n, has only digits where the digits go and a function we know
+ */
+template <class P> static int frame_valid(const uint8_t *d, int len) {
+	if (len != P::size || d[len - 2] != '\r' || d[len - 1] != '\n') return 0;
+	for (int k = 0; k < P::digits; k++) {
+		if (d[P::digit + k] < '0' || d[P::digit + k] > '9') return 0;
+	}
+	return function_lookup<P>(d) != NULL;
+}
+
+/*
+ * A complete frame (everything up to and including a \n) has
+ * turned up on meter m, validate and decode it then hand the
+ * reading to the callback.
+ *
+ */
+template <class P> static void meter_frame(struct bk390 *b, int m, const uint8_t *d, int i) {
+	struct bk390_meter *mt = &b->meter[m];
+	uint64_t t0;
+	int fresh = (i == P::size);
+
+	if (b->debug) {
+		fprintf(stderr,"DATA START [%d]: ", m);
+		for (int k = 0; k < i; k++) fprintf(stderr,"%02x ", d[k]);
+		fprintf(stderr,":END [%d bytes]\r\n", i);
+	}
+
+	/*
+	 * Validate the received data
+	 *
+	 */
+	if (!fresh) {
+		if (b->debug) { fprintf(stderr,"Invalid number of bytes, expected %d, received %d, loading previous frame\r\n", (int)P::size, i); }
+		BK390_INC(mt->frames_invalid);
+		if (!mt->dt_loaded) return;
+		BK390_INC(mt->frames_repeated);
+		d = mt->dt;
+	} else {
+		memcpy(mt->dt, d, P::size); // make a copy.
+		mt->dt_loaded = 1;
+		mt->r.ts = lib_now(b);
+		BK390_INC(mt->frames);
+	}
+
+	mt->r.meter = m;
+	t0 = mono_ns();
+	frame_decode<P>(b, d, &mt->r);
+	reading_calibrate(mt, &mt->r);
+	mt->decode_ns = mono_ns() - t0;
+
+	/*
+	 * A repeated previous frame says nothing new about the
+	 * meter, it isn't counted in the stats
+	 *
+	 */
+	if (fresh) {
+		reading_filter(mt, &mt->r);
+		stats_add(mt, &mt->r);
+		sketch_add(b, mt, &mt->r);
+		settle_add(b, m, mt, &mt->r);
+		slot_publish(mt);
+	}
+
+	if (b->cb) b->cb(b, m, &mt->r, fresh, b->user);
+}
+
+/*
+ * Read whatever the port has for us and split it in to frames
+ *
+ * Returns 1 if anything on the display needs updating
+ *
+ */
+template <class P> static int meter_read(struct bk390 *b, int m) {
+	struct bk390_meter *mt = &b->meter[m];
+	uint8_t buf[BK390_FRAME_MAX];
+	ssize_t bytes_read;
+
+	bytes_read = read(mt->serial.fd, buf, sizeof(buf));
+	if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+	if (bytes_read <= 0) {
+		fprintf(stderr,"%s:%d: Lost meter %d on %s (%s)\n", FL, m, mt->serial.device, bytes_read ? strerror(errno) : "hangup");
+		BK390_INC(mt->comms_errors);
+		close(mt->serial.fd);
+		mt->serial.fd = -1;
+		mt->comms_error = 1;
+		mt->len = 0;
+		return 1;
+	}
+
+	for (int k = 0; k < bytes_read; k++) {
+		mt->frame[mt->len++] = buf[k];
+		if (buf[k] == '\n' || mt->len >= (int)sizeof(mt->frame)) {
+			meter_frame<P>(b, m, mt->frame, mt->len);
+			mt->len = 0;
+		}
+	}
+
+	return 1;
+}
+
+#define PROTOCOL(P) P::size, meter_read<P>, frame_decode<P>, frame_valid<P>
+
+const struct bk390_protocol bk390_protocols[] = {
+	{ "bk390a", "BK Precision 390A, 11 byte frames, 4 digits", "2400:7o1", PROTOCOL(proto_bk390a) },
+	{ "es51922", "Cyrustek ES51922 (UNI-T UT61E etc), 14 byte frames, 5 digits", "19200:7o1", PROTOCOL(proto_es51922) },
+	{ NULL, NULL, NULL, 0, NULL, NULL, NULL }
+};
+
+const struct bk390_protocol *bk390_protocol_find(const char *name) {
+	for (const struct bk390_protocol *p = bk390_protocols; p->name; p++) {
+		if (strcmp(p->name, name) == 0) return p;
+	}
+	return NULL;
+}
+
+void bk390_set_protocol(struct bk390 *b, int meter, const struct bk390_protocol *proto) {
+	b->meter[meter].proto = proto;
+}
+
+/*
+ * Detection tries one protocol per reopen interval.  The port is
+ * opened with that protocol's parameters, bk390_process() hands
+ * what turns up to probe_read(), and it's the right one if a couple
+ * of valid frames arrive within BK390_PROBE_US.  If not, bk390_tick()
+ * closes the port and the next protocol gets its turn, round and
+ * round, so a meter that was off or unplugged is found once it's
+ * back.  Nothing blocks, the other meters carry on meanwhile.
+ */
+static int probe_start(struct bk390 *b, struct bk390_meter *mt, uint64_t now) {
+	if (!mt->probe || !mt->probe->name) mt->probe = bk390_protocols;
+
+	port_open(&mt->serial, b->params ? b->params : mt->probe->params);
+	if (mt->serial.fd < 0) return -1;
+
+	tcflush(mt->serial.fd, TCIFLUSH);
+	mt->probe_until = now + BK390_PROBE_US;
+	mt->probe_good = 0;
+	mt->len = 0;
+	return 0;
+}
+
+/*
+ * Returns 1 once the protocol being tried has been recognised
+ */
+static int probe_read(struct bk390 *b, int m) {
+	struct bk390_meter *mt = &b->meter[m];
+	uint8_t buf[64];
+	ssize_t n;
+
+	n = read(mt->serial.fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+	if (n <= 0) {
+		close(mt->serial.fd); // bk390_tick() tries again
+		mt->serial.fd = -1;
+		return 0;
+	}
+
+	for (int k = 0; k < n; k++) {
+		mt->frame[mt->len++] = buf[k];
+		if (buf[k] == '\n' || mt->len >= (int)sizeof(mt->frame)) {
+			if (mt->probe->valid(mt->frame, mt->len)) mt->probe_good++;
+			mt->len = 0;
+		}
+	}
+	if (mt->probe_good < 2) return 0;
+
+	mt->proto = mt->probe;
+	mt->probe = NULL;
+	mt->comms_error = 0;
+	mt->len = 0;
+	fprintf(stderr,"Meter %d on %s is %s\n", m, mt->serial.device, mt->proto->name);
+	return 1;
+}
+
+/*
+ * Opens meter's port with its protocol, or if that's NULL starts
+ * detecting it, see probe_start().  A meter being detected has its
+ * port open but no readings until a protocol fits.
+ *
+ * Returns 0 once the port is open, -1 if it couldn't be
+ *
+ */
+int bk390_open(struct bk390 *b, int meter) {
+	struct bk390_meter *mt = &b->meter[meter];
+	struct bk390_serial *s = &mt->serial;
+
+	if (!s->device) {
+		fprintf(stderr,"%s:%d: No port given for meter %d\n", FL, meter);
+		return -1;
+	}
+
+	if (!mt->proto) {
+		mt->probe = NULL;
+		mt->last_reopen = lib_now(b);
+		return probe_start(b, mt, mt->last_reopen);
+	}
+
+	port_open(s, b->params ? b->params : mt->proto->params);
+	return s->fd >= 0 ? 0 : -1;
+}
+
+void bk390_close(struct bk390 *b) {
+	if (b->running) bk390_stop(b);
+	for (int m = 0; m < b->count; m++) {
+		if (b->meter[m].serial.fd >= 0) close(b->meter[m].serial.fd);
+		b->meter[m].serial.fd = -1;
+	}
+}
+
+/*
+ * One pollfd per meter in meter order, a port that's gone away
+ * has fd -1 so poll() skips it.  Returns how many were filled in.
+ */
+int bk390_pollfds(struct bk390 *b, struct pollfd *pfd) {
+	for (int m = 0; m < b->count; m++) {
+		pfd[m].fd = b->meter[m].serial.fd;
+		pfd[m].events = POLLIN;
+		pfd[m].revents = 0;
+	}
+	return b->count;
+}
+
+/*
+ * After poll(), read the meters that have something.  Returns 1 if
+ * any of them had frames or changed comms state.
+ */
+int bk390_process(struct bk390 *b, struct pollfd *pfd) {
+	int update = 0;
+
+	for (int m = 0; m < b->count; m++) {
+		struct bk390_meter *mt = &b->meter[m];
+		if (!pfd[m].revents || mt->serial.fd < 0) continue;
+		if (mt->proto) update |= mt->proto->read(b, m);
+		else if (mt->probe) update |= probe_read(b, m);
+	}
+	return update;
+}
+
+/*
+ * A port that's gone away gets another try every couple of seconds,
+ * a USB adaptor being replugged comes back as the same device.
+ */
+void bk390_tick(struct bk390 *b, uint64_t now) {
+	for (int m = 0; m < b->count; m++) {
+		struct bk390_meter *mt = &b->meter[m];
+		struct bk390_settled e;
+		uint64_t arm;
+
+		/*
+		 * An armed settle still times out if the meter's gone
+		 * quiet or away
+		 */
+		if (mt->settle.c.kind != BK390_SETTLE_OFF && (arm = __atomic_exchange_n(&mt->settle_arm, 0, __ATOMIC_ACQUIRE))) {
+			bk390_settle_start(&mt->settle, arm, 1);
+		}
+		if (bk390_settle_tick(&mt->settle, now, &e)) {
+			e.meter = m;
+			if (b->settle_cb) b->settle_cb(b, m, &e, &mt->r, b->settle_user);
+		}
+
+		/*
+		 * A meter still being detected gives up on this protocol
+		 * once it's had its time, the next one is tried when the
+		 * port is reopened, see probe_start()
+		 */
+		if (!mt->proto && mt->serial.fd >= 0 && now >= mt->probe_until) {
+			close(mt->serial.fd);
+			mt->serial.fd = -1;
+			mt->probe++;
+			if (!mt->probe->name && !mt->comms_error) {
+				fprintf(stderr,"%s:%d: No protocol recognised on %s, still trying\n", FL, mt->serial.device);
+				mt->comms_error = 1;
+			}
+		}
+
+		if (mt->serial.fd >= 0 || now - mt->last_reopen < BK390_REOPEN_US) continue;
+		mt->last_reopen = now;
+		if (!mt->serial.device || access(mt->serial.device, R_OK | W_OK) != 0) continue;
+
+		if (!mt->proto) {
+			probe_start(b, mt, now);
+			continue;
+		}
+		port_open(&mt->serial, b->params ? b->params : mt->proto->params);
+		if (mt->serial.fd >= 0) {
+			mt->comms_error = 0;
+			mt->len = 0;
+			BK390_INC(mt->reconnects);
+			fprintf(stderr,"%s:%d: Meter %d back on %s\n", FL, m, mt->serial.device);
+		}
+	}
+}
+
+/*
+ * Acquisition on a thread of its own, for callers that don't have
+ * a poll() loop to fit in to
+ */
+static void *acquire_thread(void *arg) {
+	struct bk390 *b = (struct bk390 *)arg;
+	struct pollfd pfd[BK390_METERS_MAX];
+
+	while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+		int nfds = bk390_pollfds(b, pfd);
+
+		if (poll(pfd, nfds, 100) > 0) bk390_process(b, pfd);
+		bk390_tick(b, lib_now(b));
+	}
+	return NULL;
+}
+
+int bk390_start(struct bk390 *b) {
+	int r;
+
+	if (b->running) return 0;
+	b->stop = 0;
+	r = pthread_create(&b->thread, NULL, acquire_thread, b);
+	if (r != 0) {
+		fprintf(stderr,"%s:%d: Unable to start acquisition thread (%s)\n", FL, strerror(r));
+		return -1;
+	}
+	b->running = 1;
+	return 0;
+}
+
+void bk390_stop(struct bk390 *b) {
+	if (!b->running) return;
+	__atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(b->thread, NULL);
+	b->running = 0;
+}
@@ -0,0 +1,519 @@
+/*
+ * libbk390, BK390A acquisition and decode
+ *
+ * Opens one or more meters on serial ports, splits what they send
+ * in to frames, decodes the frames in to readings and keeps running
+ * statistics per meter.  Besides the BK390A it knows some of the
+ * other Cyrustek ES519xx based meters, chosen per port or detected.
+ * bk390-sdl2 is one client of this, anything else that wants readings
+ * (a logger, a test rig) can link it too, either libbk390.a or
+ * libbk390.so.
+ *
+ * There are two ways to drive it:
+ *
+ *	- from the caller's own poll() loop, bk390_pollfds() fills in
+ *	  one pollfd per meter and bk390_process() reads whatever
+ *	  they have, bk390_tick() retries ports that have gone away.
+ *
+ *	- on a thread of its own, bk390_start() / bk390_stop().
+ *
+ * Each meter can have a smoothing filter (EMA, moving median or a
+ * 1-D Kalman filter) between the decode and the callback, the
+ * reading carries both the raw and the filtered value.
+ *
+ * Each meter can also have a calibration table, offset and gain per
+ * function and range from its calibration certificate, applied to
+ * the counts as they're decoded.
+ *
+ * Every fresh reading also goes in to a quantile sketch for the
+ * meter's function and range, so percentiles and a histogram of a
+ * long run are there in a fixed amount of memory, and sketches from
+ * other meters or other runs merge in to them.
+ *
+ * A settle detector per meter can say when the reading has stopped
+ * moving, for test fixtures, with its own callback.
+ *
+ * Either way each frame is handed to the callback on the thread
+ * doing the reading, and the latest reading and stats per meter are
+ * also published in a seqlock slot that bk390_latest() can read from
+ * any thread without taking a lock or holding the acquisition up.
+ *
+ * Structures are left open, like bk390log.h, fields marked as
+ * acquisition thread only shouldn't be touched from elsewhere while
+ * it's running.
+ *
+ */
+#ifndef BK390_H
+#define BK390_H
+
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BK390_METERS_MAX 16
+#define BK390_FRAME_MAX 1024
+#define BK390_REOPEN_US 2000000
+#define BK390_PROBE_US 1500000
+
+/*
+ * Frame layout
+ */
+#define BYTE_RANGE 0
+#define BYTE_DIGIT_3 1
+#define BYTE_DIGIT_2 2
+#define BYTE_DIGIT_1 3
+#define BYTE_DIGIT_0 4
+#define BYTE_FUNCTION 5
+#define BYTE_STATUS 6
+#define BYTE_OPTION_1 7
+#define BYTE_OPTION_2 8
+#define DATA_FRAME_SIZE 11 // 9 bytes followed by \r\n
+#define BK390_RAW_MAX 16    // longest frame of any protocol
+
+#define FUNCTION_VOLTAGE 0b00111011
+#define FUNCTION_CURRENT_UA 0b00111101
+#define FUNCTION_CURRENT_MA 0b00111001
+#define FUNCTION_CURRENT_A 0b00111111
+#define FUNCTION_OHMS 0b00110011
+#define FUNCTION_CONTINUITY 0b00110101
+#define FUNCTION_DIODE 0b00110001
+#define FUNCTION_FQ_RPM 0b00110010
+#define FUNCTION_CAPACITANCE 0b00110110
+#define FUNCTION_TEMPERATURE 0b00110100
+#define FUNCTION_ADP0 0b00111110
+#define FUNCTION_ADP1 0b00111100
+#define FUNCTION_ADP2 0b00111000
+#define FUNCTION_ADP3 0b00111010
+
+#define STATUS_OL 0x01
+#define STATUS_BATT 0x02
+#define STATUS_SIGN 0x04
+#define STATUS_JUDGE 0x08
+
+#define OPTION1_VAHZ 0x01
+#define OPTION1_PMIN 0x04
+#define OPTION1_PMAX 0x08
+
+#define OPTION2_APO 0x01
+#define OPTION2_AUTO 0x02
+#define OPTION2_AC 0x04
+#define OPTION2_DC 0x08
+
+struct bk390_serial {
+	const char *device;
+	int fd;
+	struct termios oldtp, newtp;
+};
+
+/*
+ * A decoded reading from the meter.  Everything downstream of the
+ * serial frame (display, rules, output file) works from one of these
+ * rather than re-parsing the raw bytes.
+ *
+ */
+struct bk390_reading {
+	uint64_t ts;        // time the frame arrived, microseconds since epoch
+	int meter;          // which meter, 0 for the first/only port
+	uint8_t d[DATA_FRAME_SIZE]; // frame, translated to the BK390A layout for other meters
+	uint8_t raw[BK390_RAW_MAX]; // frame as the meter sent it
+	uint8_t raw_len;
+	uint8_t dps;        // number of decimal places
+	int counts;         // signed display counts, -9999..9999 on a BK390A
+	int exponent;       // power of ten of the prefix, m = -3, k = 3
+	int ol;             // overload, counts/value/si are meaningless
+	double value;       // value as displayed, 12.34 for 12.34mV
+	double si;          // value in SI base units, 0.01234 for 12.34mV
+	char prefix[8];     // Units prefix u, m, k, M etc
+	char units[16];     // Measurement units F, V, A, R
+	char mmmode[20];    // Multimeter mode, Resistance/diode/cap etc
+	char text[64];      // the display line, "12.34mV"
+
+	/*
+	 * The same after the meter's filter, see bk390_set_filter().
+	 * With no filter set they're copies of the raw ones.
+	 */
+	int fcounts;
+	double fvalue;
+	double fsi;
+	char ftext[64];
+};
+
+/*
+ * Smoothing filters, run on the display counts so the parameters
+ * mean the same on every range.  The state restarts when the meter
+ * changes function or range, and OL readings pass through without
+ * touching it.  Each reading costs O(1), or O(log N) for the median.
+ *
+ *	ema:<alpha>        exponential moving average, alpha is the
+ *	                   weight of the newest reading (default 0.2)
+ *	median:<N>         median of the last N readings (default 5)
+ *	kalman:<q>,<r>     random walk Kalman filter, q and r are the
+ *	                   process and measurement noise variances in
+ *	                   counts squared (default 0.01,4)
+ */
+#define BK390_FILTER_NONE 0
+#define BK390_FILTER_EMA 1
+#define BK390_FILTER_MEDIAN 2
+#define BK390_FILTER_KALMAN 3
+#define BK390_MEDIAN_MAX 255
+
+struct bk390_filter_config {
+	int kind;
+	double alpha;
+	int window;
+	double q, r;
+};
+
+struct bk390_filter {
+	struct bk390_filter_config c;
+	uint8_t function;            // what the state was built from
+	uint8_t range;
+	unsigned long n;             // readings since the state restarted
+	unsigned long resets;
+	double x, p;                 // EMA/Kalman estimate, Kalman variance
+
+	/*
+	 * Moving median, the window in a ring and two heaps of ring
+	 * indexes, lo a max heap of the lower half and hi a min heap
+	 * of the upper.  pos[] says where each ring entry is in the
+	 * heaps, so the reading leaving the window comes out of the
+	 * middle of its heap in O(log N) without a search.
+	 */
+	double ring[BK390_MEDIAN_MAX];
+	int16_t pos[BK390_MEDIAN_MAX];   // lo[pos - 1] if > 0, hi[-pos - 1] if < 0
+	uint8_t lo[BK390_MEDIAN_MAX];
+	uint8_t hi[BK390_MEDIAN_MAX];
+	int nlo, nhi;
+	int head;                        // oldest entry once the ring is full
+};
+
+/*
+ * Calibration, per function and range, applied in fixed point to
+ * the display counts before anything else sees them:
+ *
+ *	counts = counts * gain + offset
+ *
+ * gain is Q2.30 (BK390_CAL_ONE is 1.0, between 0.5 and 2) and
+ * offset is in counts, Q16.16.  Rows are the low nibble of the canonical function byte,
+ * columns the range nibble, so AC and DC volts share an entry.
+ * OL readings are left alone.
+ *
+ * A certificate file has one entry per line, '#' starts a comment:
+ *
+ *	<function> <range|*> <gain> <offset in counts>
+ *
+ * function is one of v ua ma a ohm cont diode hz f temp, or the
+ * function byte (0x3b).
+ */
+#define BK390_CAL_ONE (1 << 30)
+
+struct bk390_cal_entry {
+	int32_t gain;
+	int32_t offset;
+};
+
+struct bk390_cal {
+	int active;                      // anything other than 1.0 and 0 in the table
+	struct bk390_cal_entry e[16][16];
+};
+
+/*
+ * Running statistics of the fresh readings since the meter last
+ * changed function or range (or bk390_stats_reset()).  min/max/mean
+ * are SI values of the non-OL readings, m2 is Welford's sum of
+ * squared differences, see bk390_stats_stddev().
+ *
+ */
+struct bk390_stats {
+	uint64_t since;              // ts of the first reading counted
+	unsigned long count;         // readings, OL included
+	unsigned long ol;
+	uint8_t function;
+	uint8_t range;
+	double min, max, mean, m2;
+};
+
+/*
+ * Quantile sketch (DDSketch) of SI values.  Readings are counted in
+ * buckets whose bounds grow by gamma = (1 + alpha) / (1 - alpha), so
+ * bk390_sketch_quantile() is within alpha of the true value relative
+ * to it (1% by default), for any quantile and any number of readings.
+ * Adding a reading is O(1), and sketches with the same alpha merge
+ * exactly, whichever meter or run they came from.
+ *
+ * Positive and negative values have a store each, a window of
+ * BK390_SKETCH_BINS bucket counts, which at 1% covers a range of
+ * 10^4 in magnitude.  Anything that doesn't fit goes in to the
+ * lowest bucket and is counted in collapsed, so only the smallest
+ * magnitudes lose accuracy.
+ *
+ * A meter keeps BK390_SKETCH_SLOTS of them, one per function and
+ * range it's been on, the least recently used is started again when
+ * it moves to another.  bk390.sketch_alpha sets alpha for new ones,
+ * 0 turns them off.
+ */
+#define BK390_SKETCH_BINS 512
+#ifndef BK390_SKETCH_SLOTS
+#define BK390_SKETCH_SLOTS 4
+#endif
+#define BK390_SKETCH_ALPHA 0.01
+
+struct bk390_sketch_store {
+	int32_t offset;              // bucket index of bins[0]
+	int32_t lo, hi;              // lowest and highest index counted
+	uint64_t n;
+	uint32_t bins[BK390_SKETCH_BINS];
+};
+
+struct bk390_sketch {
+	uint8_t function;            // what the meter was on, for a meter's sketches
+	uint8_t range;
+	double alpha;
+	double lg;                   // ln(gamma)
+	uint64_t count;
+	uint64_t zero;               // readings of 0
+	uint64_t collapsed;          // readings moved to the lowest bucket
+	uint64_t last;               // ts of the newest reading
+	double min, max, sum;
+	struct bk390_sketch_store pos, neg;
+};
+
+/*
+ * Settle detection, for a test fixture that would otherwise wait a
+ * fixed time before it trusts a reading.  A measurement has settled
+ * once the fresh readings over the last window are all within the
+ * tolerance of each other (max - min), and have been since a window
+ * ago, on one function and range and without OL.  A change of
+ * function or range or an OL, which an autoranging meter goes
+ * through as it hunts, starts the window again, so it's all on the
+ * range the meter ends up on.  The min and max are kept in monotonic
+ * deques, so a reading is O(1) amortised.
+ *
+ *	<tolerance>[%|c][,<window ms>[,<timeout ms>]]
+ *
+ * The tolerance is in SI units (0.005 for 5mV), a percentage of the
+ * reading (never less than a count), or display counts on the range
+ * the meter is on.  The window is 1000ms by default and holds the
+ * last BK390_SETTLE_MAX readings of it at most.
+ *
+ * A measurement starts at bk390_settle_arm(), which fixtures call
+ * when they've switched the unit under test, and times out if it's
+ * given one.  Once it has settled, the reading leaving the band, a
+ * change of function or range or an OL starts the next measurement
+ * without an arm, timed from that reading, which is what's wanted
+ * with probes moved by hand.  Each measurement is reported once, to
+ * the settle callback.
+ */
+#define BK390_SETTLE_OFF 0
+#define BK390_SETTLE_ABS 1
+#define BK390_SETTLE_PCT 2
+#define BK390_SETTLE_COUNTS 3
+#ifndef BK390_SETTLE_MAX
+#define BK390_SETTLE_MAX 256         // a power of two, 256 at most
+#endif
+
+#define BK390_SETTLE_IDLE 0          // no reading yet
+#define BK390_SETTLE_WAITING 1
+#define BK390_SETTLE_DONE 2          // reported, waiting for the reading to move on
+
+struct bk390_settle_config {
+	int kind;
+	double tol;
+	uint64_t window_us;
+	uint64_t timeout_us;         // 0 never
+};
+
+struct bk390_settled {
+	int meter;
+	int settled;                 // 0 if it timed out
+	int armed;                   // started by bk390_settle_arm() rather than the reading moving
+	uint64_t start;              // the measurement started
+	uint64_t ts;                 // reading that settled it, or the time it timed out
+	uint8_t function;
+	uint8_t range;
+	unsigned long readings;      // in the window
+	double value;                // SI, mean of the window, NAN if it's empty
+	double span;                 // max - min of the window
+};
+
+struct bk390_settle {
+	struct bk390_settle_config c;
+	int state;
+	int armed;
+	uint64_t start;
+	uint64_t run;                // first reading all the window's are within tolerance of
+	uint8_t function;
+	uint8_t range;
+	unsigned long settled, timeouts;
+	struct bk390_settled last;
+
+	/*
+	 * The window in a ring, and deques of ring indexes for its
+	 * min and max
+	 */
+	uint64_t ts[BK390_SETTLE_MAX];
+	double v[BK390_SETTLE_MAX];
+	uint8_t dmin[BK390_SETTLE_MAX];
+	uint8_t dmax[BK390_SETTLE_MAX];
+	unsigned int head, n;
+	unsigned int hmin, nmin, hmax, nmax;
+	double sum;
+};
+
+/*
+ * Latest reading and stats, written by the acquisition thread only.
+ * seq is odd while an update is in progress.
+ */
+struct bk390_slot {
+	unsigned int seq;
+	int valid;
+	struct bk390_reading r;
+	struct bk390_stats s;
+};
+
+struct bk390;
+
+/*
+ * A meter protocol, see bk390_protocols[] for the ones built in.
+ * read and decode are specialised for the protocol's frame, a port
+ * goes through its protocol's read for every read() it does.
+ */
+struct bk390_protocol {
+	const char *name;
+	const char *desc;
+	const char *params;          // serial parameters the meter uses
+	int frame_size;
+	int (*read)(struct bk390 *b, int meter);
+	void (*decode)(struct bk390 *b, const uint8_t *d, struct bk390_reading *r);
+	int (*valid)(const uint8_t *d, int len);
+};
+
+extern const struct bk390_protocol bk390_protocols[];   // ends with a NULL name
+
+struct bk390_meter {
+	const struct bk390_protocol *proto; // NULL to detect it when opened
+	const struct bk390_protocol *probe; // protocol being tried while proto is NULL
+	uint64_t probe_until;
+	int probe_good;                  // valid frames seen under it
+	struct bk390_serial serial;
+	uint8_t frame[BK390_FRAME_MAX];  // frame being assembled from the port
+	int len;
+	uint8_t dt[BK390_FRAME_MAX];     // last good frame
+	int dt_loaded;                   // set when we have our first valid data
+	int comms_error;
+	uint64_t last_reopen;
+	struct bk390_reading r;          // acquisition thread only
+	struct bk390_stats stats;        // acquisition thread only
+	struct bk390_filter filter;      // acquisition thread only
+	struct bk390_cal cal;
+	struct bk390_sketch sketch[BK390_SKETCH_SLOTS]; // acquisition thread only
+	int sketch_cur;                  // slot of the last reading
+	struct bk390_settle settle;      // acquisition thread only
+	uint64_t settle_arm;             // set from any thread by bk390_settle_arm(), taken by acquisition
+	int stats_reset;                 // set from any thread, cleared by acquisition
+	uint64_t decode_ns;              // time the last frame took to decode
+	struct bk390_slot slot;
+
+	/*
+	 * Acquisition counters, single writer, read them with relaxed
+	 * atomic loads from other threads
+	 */
+	unsigned long frames;            // good length frames
+	unsigned long frames_invalid;    // wrong length
+	unsigned long frames_repeated;   // wrong length, previous frame shown again
+	unsigned long comms_errors;
+	unsigned long reconnects;
+};
+
+/*
+ * Called for every frame, fresh is 0 when the frame was the wrong
+ * length and the previous one has been decoded again in its place.
+ * r belongs to the library and is only good until the callback returns.
+ */
+typedef void (*bk390_callback)(struct bk390 *b, int meter, struct bk390_reading *r, int fresh, void *user);
+
+/*
+ * Called once per settle measurement, on the thread doing the
+ * reading, just before the reading callback for the reading that
+ * settled it.  r is the meter's latest reading, for the units.
+ */
+typedef void (*bk390_settle_callback)(struct bk390 *b, int meter, const struct bk390_settled *e, const struct bk390_reading *r, void *user);
+
+struct bk390 {
+	int count;
+	struct bk390_meter meter[BK390_METERS_MAX];
+	const char *params;          // serial parameters, the protocol's own when NULL
+	int show_mode;               // keep the mode name in reading.mmmode
+	int debug;                   // dump the raw frames to stderr
+	uint64_t (*clock)(void);     // reading timestamps and reopen timing, NULL for bk390_now_us()
+	double sketch_alpha;         // relative accuracy of new sketches, 0 for none
+
+	bk390_callback cb;
+	void *user;
+	bk390_settle_callback settle_cb;
+	void *settle_user;
+
+	pthread_t thread;
+	int running;
+	int stop;
+};
+
+void bk390_init(struct bk390 *b);
+int bk390_add(struct bk390 *b, const char *device);
+int bk390_open(struct bk390 *b, int meter);
+const struct bk390_protocol *bk390_protocol_find(const char *name);
+void bk390_set_protocol(struct bk390 *b, int meter, const struct bk390_protocol *proto);
+void bk390_set_callback(struct bk390 *b, bk390_callback cb, void *user);
+void bk390_close(struct bk390 *b);
+
+int bk390_pollfds(struct bk390 *b, struct pollfd *pfd);
+int bk390_process(struct bk390 *b, struct pollfd *pfd);
+void bk390_tick(struct bk390 *b, uint64_t now);
+
+int bk390_start(struct bk390 *b);
+void bk390_stop(struct bk390 *b);
+
+int bk390_latest(struct bk390 *b, int meter, struct bk390_reading *r, struct bk390_stats *s);
+void bk390_stats_reset(struct bk390 *b, int meter);
+double bk390_stats_stddev(const struct bk390_stats *s);
+
+int bk390_filter_parse(struct bk390_filter_config *c, const char *spec);
+void bk390_set_filter(struct bk390 *b, int meter, const struct bk390_filter_config *c);
+void bk390_filter_reset(struct bk390_filter *f);
+double bk390_filter_add(struct bk390_filter *f, double x);
+const char *bk390_filter_name(int kind);
+
+void bk390_cal_identity(struct bk390_cal *c);
+int bk390_cal_load(struct bk390_cal *c, const char *path);
+void bk390_set_cal(struct bk390 *b, int meter, const struct bk390_cal *c);
+int32_t bk390_cal_apply(const struct bk390_cal_entry *e, int32_t counts);
+void bk390_cal_recal(const struct bk390_cal_entry *from, const struct bk390_cal_entry *to, int32_t *counts, int n);
+
+void bk390_sketch_init(struct bk390_sketch *s, double alpha);
+void bk390_sketch_add(struct bk390_sketch *s, double v);
+int bk390_sketch_merge(struct bk390_sketch *into, const struct bk390_sketch *from);
+double bk390_sketch_quantile(const struct bk390_sketch *s, double q);
+void bk390_sketch_histogram(const struct bk390_sketch *s, double lo, double hi, unsigned long *counts, int n);
+struct bk390_sketch *bk390_sketch_find(struct bk390 *b, int meter, uint8_t function, uint8_t range);
+
+int bk390_settle_parse(struct bk390_settle_config *c, const char *spec);
+void bk390_set_settle(struct bk390 *b, int meter, const struct bk390_settle_config *c);
+void bk390_set_settle_callback(struct bk390 *b, bk390_settle_callback cb, void *user);
+void bk390_settle_arm(struct bk390 *b, int meter);
+void bk390_settle_start(struct bk390_settle *s, uint64_t start, int armed);
+int bk390_settle_add(struct bk390_settle *s, const struct bk390_reading *r, struct bk390_settled *e);
+int bk390_settle_tick(struct bk390_settle *s, uint64_t now, struct bk390_settled *e);
+
+int bk390_prefix_exponent(const char *prefix);
+uint64_t bk390_now_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
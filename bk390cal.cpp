@@ -0,0 +1,167 @@
+/*
+ * libbk390, per meter calibration
+ *
+ * Offset and gain per function and range from a calibration
+ * certificate, applied to the display counts in fixed point.  See
+ * bk390.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+
+#include "bk390.h"
+
+#define FL __FILE__,__LINE__
+
+static const struct {
+	const char *name;
+	uint8_t function;
+} cal_functions[] = {
+	{ "v", FUNCTION_VOLTAGE },
+	{ "ua", FUNCTION_CURRENT_UA },
+	{ "ma", FUNCTION_CURRENT_MA },
+	{ "a", FUNCTION_CURRENT_A },
+	{ "ohm", FUNCTION_OHMS },
+	{ "cont", FUNCTION_CONTINUITY },
+	{ "diode", FUNCTION_DIODE },
+	{ "hz", FUNCTION_FQ_RPM },
+	{ "f", FUNCTION_CAPACITANCE },
+	{ "temp", FUNCTION_TEMPERATURE },
+	{ NULL, 0 }
+};
+
+void bk390_cal_identity(struct bk390_cal *c) {
+	c->active = 0;
+	for (int f = 0; f < 16; f++) {
+		for (int r = 0; r < 16; r++) {
+			c->e[f][r].gain = BK390_CAL_ONE;
+			c->e[f][r].offset = 0;
+		}
+	}
+}
+
+/*
+ * Returns 0 if the whole certificate made sense, the table is only
+ * partly filled in otherwise
+ */
+int bk390_cal_load(struct bk390_cal *c, const char *path) {
+	char line[256];
+	int n = 0;
+	FILE *f;
+
+	bk390_cal_identity(c);
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr,"%s:%d: Unable to open calibration '%s' (%s)\n", FL, path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char fn[16], range[8];
+		double gain, offset;
+		int function = -1, lo, hi;
+		char *hash = strchr(line, '#');
+
+		n++;
+		if (hash) *hash = '\0';
+		if (line[strspn(line, " \t\r\n")] == '\0') continue;
+
+		if (sscanf(line, "%15s %7s %lf %lf", fn, range, &gain, &offset) != 4) {
+			fprintf(stderr,"%s:%d: %s:%d: expected <function> <range> <gain> <offset>\n", FL, path, n);
+			fclose(f);
+			return -1;
+		}
+
+		for (int k = 0; cal_functions[k].name; k++) {
+			if (strcasecmp(fn, cal_functions[k].name) == 0) function = cal_functions[k].function;
+		}
+		if (function < 0 && strncmp(fn, "0x", 2) == 0) function = strtol(fn, NULL, 16) & 0xFF;
+
+		if (strcmp(range, "*") == 0) {
+			lo = 0;
+			hi = 15;
+		} else {
+			lo = hi = atoi(range);
+		}
+
+		if (function < 0 || lo < 0 || hi > 15 || !(gain > 0.5 && gain < 2.0) || !(offset > -32768.0 && offset < 32768.0)) {
+			fprintf(stderr,"%s:%d: %s:%d: bad function, range, gain (0.5 - 2) or offset\n", FL, path, n);
+			fclose(f);
+			return -1;
+		}
+
+		for (int r = lo; r <= hi; r++) {
+			struct bk390_cal_entry *e = &c->e[function & 0x0F][r];
+
+			e->gain = (int32_t)llround(gain * BK390_CAL_ONE);
+			e->offset = (int32_t)llround(offset * 65536.0);
+			if (e->gain != BK390_CAL_ONE || e->offset != 0) c->active = 1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Only before bk390_start(), or from the callback of the meter
+ */
+void bk390_set_cal(struct bk390 *b, int meter, const struct bk390_cal *c) {
+	struct bk390_cal *mc = &b->meter[meter].cal;
+
+	if (c) *mc = *c;
+	else bk390_cal_identity(mc);
+}
+
+/*
+ * Rounded to the nearest count, halves up
+ */
+static inline int32_t cal_apply(int64_t gain, int64_t offset, int32_t counts) {
+	return (int32_t)((counts * gain + (offset << 14) + (1 << 29)) >> 30);
+}
+
+int32_t bk390_cal_apply(const struct bk390_cal_entry *e, int32_t counts) {
+	return cal_apply(e->gain, e->offset, counts);
+}
+
+/*
+ * Counts that were calibrated with from, as if they'd been
+ * calibrated with to instead.
+ *
+ * The raw counts are estimated through the inverse of from (itself
+ * a gain and offset), then nudged by one if from doesn't take them
+ * back to what was stored.  When from's gain is 1 or more no two
+ * raw counts calibrate the same, so this gets the raw counts back
+ * exactly; below 1 it can be a count out where two collide.
+ *
+ * No branches or divisions, the loop vectorises.  The table is
+ * copied out first, or the stores to counts could change it as far
+ * as the compiler knows.  Plain x86-64 has no packed 64 bit multiply
+ * worth using, so there it's built for SSE4.1 and AVX2 as well and
+ * the loader picks one (not in the headless build, which never calls
+ * it and would have to keep all three).
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(BKLOG_STATIC)
+__attribute__((target_clones("avx2", "sse4.1", "default")))
+#endif
+void bk390_cal_recal(const struct bk390_cal_entry *from, const struct bk390_cal_entry *to, int32_t *counts, int n) {
+	double g = (double)from->gain / BK390_CAL_ONE;
+	const int64_t ig = llround(BK390_CAL_ONE / g), io = llround(-from->offset / g);
+	const int64_t fg = from->gain, fo = from->offset;
+	const int64_t tg = to->gain, to_ = to->offset;
+
+	for (int k = 0; k < n; k++) {
+		int32_t c = counts[k];
+		int32_t raw = cal_apply(ig, io, c);
+		int32_t back = cal_apply(fg, fo, raw);
+
+		raw -= (back > c) - (back < c);
+		counts[k] = cal_apply(tg, to_, raw);
+	}
+}
@@ -0,0 +1,216 @@
+/*
+ * libbk390, per meter smoothing filters
+ *
+ * EMA, moving median and a 1-D Kalman filter over the display
+ * counts.  See bk390.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bk390.h"
+
+static const char *filter_names[] = { "none", "ema", "median", "kalman" };
+
+const char *bk390_filter_name(int kind) {
+	if (kind < 0 || kind > BK390_FILTER_KALMAN) return "?";
+	return filter_names[kind];
+}
+
+/*
+ * <name>[:<params>], returns 0 if it made sense
+ */
+int bk390_filter_parse(struct bk390_filter_config *c, const char *spec) {
+	const char *p = strchr(spec, ':');
+	size_t l = p ? (size_t)(p - spec) : strlen(spec);
+
+	memset(c, 0, sizeof(*c));
+	c->alpha = 0.2;
+	c->window = 5;
+	c->q = 0.01;
+	c->r = 4.0;
+
+	for (int k = 0; k <= BK390_FILTER_KALMAN; k++) {
+		if (strlen(filter_names[k]) == l && strncmp(spec, filter_names[k], l) == 0) c->kind = k;
+	}
+	if (c->kind == BK390_FILTER_NONE) return (l == 4 && strncmp(spec, "none", 4) == 0) ? 0 : -1;
+	if (!p) return 0;
+
+	p++;
+	switch (c->kind) {
+		case BK390_FILTER_EMA:
+			c->alpha = strtod(p, NULL);
+			if (c->alpha <= 0.0 || c->alpha > 1.0) return -1;
+			break;
+		case BK390_FILTER_MEDIAN:
+			c->window = atoi(p);
+			if (c->window < 1 || c->window > BK390_MEDIAN_MAX) return -1;
+			break;
+		case BK390_FILTER_KALMAN:
+			if (sscanf(p, "%lf,%lf", &c->q, &c->r) != 2 || c->q < 0.0 || c->r <= 0.0) return -1;
+			break;
+	}
+	return 0;
+}
+
+void bk390_filter_reset(struct bk390_filter *f) {
+	f->n = 0;
+	f->x = 0.0;
+	f->p = 0.0;
+	f->nlo = f->nhi = 0;
+	f->head = 0;
+}
+
+/*
+ * Only before bk390_start(), or from the callback of the meter
+ */
+void bk390_set_filter(struct bk390 *b, int meter, const struct bk390_filter_config *c) {
+	struct bk390_filter *f = &b->meter[meter].filter;
+
+	memset(f, 0, sizeof(*f));
+	if (c) f->c = *c;
+}
+
+/*
+ * Heaps of ring indexes for the moving median, max is 1 for lo
+ */
+static int heap_before(struct bk390_filter *f, int max, int a, int b) {
+	return max ? f->ring[a] > f->ring[b] : f->ring[a] < f->ring[b];
+}
+
+static void heap_set(struct bk390_filter *f, int max, int i, int idx) {
+	if (max) f->lo[i] = idx;
+	else f->hi[i] = idx;
+	f->pos[idx] = max ? i + 1 : -(i + 1);
+}
+
+static void heap_up(struct bk390_filter *f, int max, int i) {
+	uint8_t *h = max ? f->lo : f->hi;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		int idx = h[i];
+
+		if (!heap_before(f, max, idx, h[parent])) break;
+		heap_set(f, max, i, h[parent]);
+		heap_set(f, max, parent, idx);
+		i = parent;
+	}
+}
+
+static void heap_down(struct bk390_filter *f, int max, int i) {
+	uint8_t *h = max ? f->lo : f->hi;
+	int n = max ? f->nlo : f->nhi;
+
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, b = i;
+		int idx = h[i];
+
+		if (l < n && heap_before(f, max, h[l], h[b])) b = l;
+		if (r < n && heap_before(f, max, h[r], h[b])) b = r;
+		if (b == i) break;
+		heap_set(f, max, i, h[b]);
+		heap_set(f, max, b, idx);
+		i = b;
+	}
+}
+
+static void heap_push(struct bk390_filter *f, int max, int idx) {
+	int *n = max ? &f->nlo : &f->nhi;
+
+	heap_set(f, max, *n, idx);
+	(*n)++;
+	heap_up(f, max, *n - 1);
+}
+
+static int heap_pop(struct bk390_filter *f, int max) {
+	uint8_t *h = max ? f->lo : f->hi;
+	int *n = max ? &f->nlo : &f->nhi;
+	int top = h[0];
+
+	(*n)--;
+	if (*n) {
+		heap_set(f, max, 0, h[*n]);
+		heap_down(f, max, 0);
+	}
+	return top;
+}
+
+static void heap_remove(struct bk390_filter *f, int idx) {
+	int max = f->pos[idx] > 0;
+	int i = (max ? f->pos[idx] : -f->pos[idx]) - 1;
+	uint8_t *h = max ? f->lo : f->hi;
+	int *n = max ? &f->nlo : &f->nhi;
+	int moved;
+
+	(*n)--;
+	if (i == *n) return;
+
+	/*
+	 * The last entry fills the hole and goes whichever way it
+	 * needs to
+	 */
+	moved = h[*n];
+	heap_set(f, max, i, moved);
+	heap_up(f, max, i);
+	heap_down(f, max, (max ? f->pos[moved] : -f->pos[moved]) - 1);
+}
+
+/*
+ * lo holds the lower half and one more if the count is odd
+ */
+static double median_add(struct bk390_filter *f, double x) {
+	int idx;
+
+	if ((int)f->n > f->c.window) {
+		idx = f->head;
+		heap_remove(f, idx);
+		f->head = (f->head + 1) % f->c.window;
+	} else {
+		idx = f->n - 1;
+	}
+	f->ring[idx] = x;
+
+	if (!f->nlo || x <= f->ring[f->lo[0]]) heap_push(f, 1, idx);
+	else heap_push(f, 0, idx);
+
+	while (f->nlo > f->nhi + 1) heap_push(f, 0, heap_pop(f, 1));
+	while (f->nhi > f->nlo) heap_push(f, 1, heap_pop(f, 0));
+
+	if (f->nlo > f->nhi) return f->ring[f->lo[0]];
+	return (f->ring[f->lo[0]] + f->ring[f->hi[0]]) / 2.0;
+}
+
+/*
+ * Feed one reading (in counts) through, returns the filtered value
+ */
+double bk390_filter_add(struct bk390_filter *f, double x) {
+	f->n++;
+	switch (f->c.kind) {
+		case BK390_FILTER_EMA:
+			if (f->n == 1) f->x = x;
+			else f->x += f->c.alpha * (x - f->x);
+			return f->x;
+
+		case BK390_FILTER_MEDIAN:
+			return median_add(f, x);
+
+		case BK390_FILTER_KALMAN:
+			if (f->n == 1) {
+				f->x = x;
+				f->p = f->c.r;
+			} else {
+				double k;
+
+				f->p += f->c.q;
+				k = f->p / (f->p + f->c.r);
+				f->x += k * (x - f->x);
+				f->p *= 1.0 - k;
+			}
+			return f->x;
+	}
+	return x;
+}
@@ -0,0 +1,1010 @@
+/*
+ * BK390A reading log segments
+ *
+ * Segment writer, background compressor and reader for both the
+ * raw .seg and compressed .bkz forms.  See bk390log.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include "bk390log.h"
+
+#define FL __FILE__,__LINE__
+
+#define BKLOG_QUEUE_SIZE 32
+
+/*
+ * The static profile compresses in to a fixed block index, segments
+ * are rotated before they outgrow it
+ */
+#ifdef BKLOG_STATIC
+static struct bklog_block block_pool[BKLOG_STATIC_BLOCKS];
+#define BKLOG_SEG_MAX (sizeof(struct bklog_header) + (uint64_t)BKLOG_STATIC_BLOCKS * BKLOG_BLOCK_SIZE * sizeof(struct bklog_record))
+#endif
+
+const uint32_t bklog_tier_secs[BKLOG_TIERS] = { 10, 60, 3600 };
+
+static const double decade[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12 };
+
+double bklog_si(const struct bklog_record *r) {
+	int e = r->exponent - r->dps;
+
+	if (e < 0) return r->counts / decade[-e];
+	return r->counts * decade[e];
+}
+
+static uint64_t bklog_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Buffered output for the compressor, written straight to the fd
+ * so compressing a segment doesn't allocate anything
+ */
+struct outbuf {
+	int fd;
+	int n;
+	int err;
+	uint64_t pos;                // file offset of buf[0]
+	uint8_t buf[8192];
+};
+
+static void out_flush(struct outbuf *o) {
+	if (o->n && write(o->fd, o->buf, o->n) != o->n) o->err = 1;
+	o->pos += o->n;
+	o->n = 0;
+}
+
+static void out_putc(struct outbuf *o, uint8_t c) {
+	o->buf[o->n++] = c;
+	if (o->n == (int)sizeof(o->buf)) out_flush(o);
+}
+
+static void out_write(struct outbuf *o, const void *p, size_t l) {
+	const uint8_t *s = (const uint8_t *)p;
+
+	while (l) {
+		size_t k = sizeof(o->buf) - o->n;
+		if (k > l) k = l;
+		memcpy(o->buf + o->n, s, k);
+		o->n += k;
+		s += k;
+		l -= k;
+		if (o->n == (int)sizeof(o->buf)) out_flush(o);
+	}
+}
+
+static uint64_t out_tell(struct outbuf *o) {
+	return o->pos + o->n;
+}
+
+/*
+ * Bit level writer/reader for the .bkz encoding, MSB first
+ */
+struct bitwriter {
+	struct outbuf *o;
+	uint64_t acc;
+	int nbits;
+};
+
+static void bits_put(struct bitwriter *b, uint64_t v, int n) {
+	if (n > 32) {
+		bits_put(b, v >> 32, n - 32);
+		n = 32;
+	}
+	b->acc = (b->acc << n) | (v & ((1ULL << n) - 1));
+	b->nbits += n;
+	while (b->nbits >= 8) {
+		b->nbits -= 8;
+		out_putc(b->o, (uint8_t)(b->acc >> b->nbits));
+	}
+}
+
+static void bits_flush(struct bitwriter *b) {
+	if (b->nbits) out_putc(b->o, (uint8_t)(b->acc << (8 - b->nbits)));
+	b->nbits = 0;
+}
+
+static int bits_get(struct bklog_reader *rd, int n, uint64_t *v) {
+	uint64_t r = 0;
+
+	if (n > 32) {
+		if (bits_get(rd, n - 32, &r) != 0) return -1;
+		n = 32;
+	}
+	while (rd->nbits < n) {
+		if (rd->pos >= rd->size) return -1;
+		rd->acc = (rd->acc << 8) | rd->map[rd->pos++];
+		rd->nbits += 8;
+	}
+	rd->nbits -= n;
+	*v = (r << n) | ((rd->acc >> rd->nbits) & ((1ULL << n) - 1));
+	return 0;
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+/*
+ * Encoding, per record:
+ *
+ *	timestamp delta-of-delta, zigzagged
+ *		0                  same spacing as last time
+ *		10   + 8 bits
+ *		110  + 14 bits
+ *		1110 + 24 bits
+ *		1111 + 64 bits
+ *
+ *	counts delta, zigzagged
+ *		0                  same value
+ *		10   + 4 bits
+ *		110  + 8 bits
+ *		111  + 32 bits
+ *
+ *	function/range/flags
+ *		0                  unchanged
+ *		1    + 7 bytes     function range status option1 option2 dps exponent
+ *
+ */
+static void bkz_put(struct bitwriter *b, struct bklog_record *prev, int64_t *prev_delta, const struct bklog_record *r) {
+	int64_t delta = (int64_t)(r->ts - prev->ts);
+	uint64_t z = zigzag(delta - *prev_delta);
+
+	if (z == 0) bits_put(b, 0, 1);
+	else if (z < (1ULL << 8)) { bits_put(b, 0x2, 2); bits_put(b, z, 8); }
+	else if (z < (1ULL << 14)) { bits_put(b, 0x6, 3); bits_put(b, z, 14); }
+	else if (z < (1ULL << 24)) { bits_put(b, 0xE, 4); bits_put(b, z, 24); }
+	else { bits_put(b, 0xF, 4); bits_put(b, z, 64); }
+	*prev_delta = delta;
+
+	z = zigzag((int64_t)r->counts - prev->counts);
+	if (z == 0) bits_put(b, 0, 1);
+	else if (z < (1ULL << 4)) { bits_put(b, 0x2, 2); bits_put(b, z, 4); }
+	else if (z < (1ULL << 8)) { bits_put(b, 0x6, 3); bits_put(b, z, 8); }
+	else { bits_put(b, 0x7, 3); bits_put(b, z, 32); }
+
+	if (r->function == prev->function && r->range == prev->range && r->status == prev->status
+			&& r->option1 == prev->option1 && r->option2 == prev->option2 && r->dps == prev->dps && r->exponent == prev->exponent) {
+		bits_put(b, 0, 1);
+	} else {
+		bits_put(b, 1, 1);
+		bits_put(b, r->function, 8);
+		bits_put(b, r->range, 8);
+		bits_put(b, r->status, 8);
+		bits_put(b, r->option1, 8);
+		bits_put(b, r->option2, 8);
+		bits_put(b, r->dps, 8);
+		bits_put(b, (uint8_t)r->exponent, 8);
+	}
+
+	*prev = *r;
+}
+
+static int bkz_get(struct bklog_reader *rd, struct bklog_record *r) {
+	struct bklog_record *prev = &rd->prev;
+	uint64_t v, z;
+	int n;
+
+	*r = *prev;
+
+	/*
+	 * Count the prefix 1s (up to 4) to find the bucket
+	 */
+	for (n = 0; n < 4; n++) {
+		if (bits_get(rd, 1, &v) != 0) return -1;
+		if (v == 0) break;
+	}
+	z = 0;
+	switch (n) {
+		case 0: break;
+		case 1: if (bits_get(rd, 8, &z) != 0) return -1; break;
+		case 2: if (bits_get(rd, 14, &z) != 0) return -1; break;
+		case 3: if (bits_get(rd, 24, &z) != 0) return -1; break;
+		case 4: if (bits_get(rd, 64, &z) != 0) return -1; break;
+	}
+	rd->prev_delta += unzigzag(z);
+	r->ts = prev->ts + rd->prev_delta;
+
+	for (n = 0; n < 3; n++) {
+		if (bits_get(rd, 1, &v) != 0) return -1;
+		if (v == 0) break;
+	}
+	z = 0;
+	switch (n) {
+		case 0: break;
+		case 1: if (bits_get(rd, 4, &z) != 0) return -1; break;
+		case 2: if (bits_get(rd, 8, &z) != 0) return -1; break;
+		case 3: if (bits_get(rd, 32, &z) != 0) return -1; break;
+	}
+	r->counts = (int32_t)(prev->counts + unzigzag(z));
+
+	if (bits_get(rd, 1, &v) != 0) return -1;
+	if (v) {
+		uint64_t b[7];
+		for (int i = 0; i < 7; i++) {
+			if (bits_get(rd, 8, &b[i]) != 0) return -1;
+		}
+		r->function = b[0];
+		r->range = b[1];
+		r->status = b[2];
+		r->option1 = b[3];
+		r->option2 = b[4];
+		r->dps = b[5];
+		r->exponent = (int8_t)b[6];
+	}
+
+	*prev = *r;
+	return 0;
+}
+
+/*
+ * Up to BKLOG_BLOCK_SIZE records, returns how many
+ */
+static int batch_read(struct bklog_reader *rd, struct bklog_record *batch) {
+	int n = 0;
+
+	while (n < BKLOG_BLOCK_SIZE && bklog_next(rd, &batch[n]) == 0) n++;
+	return n;
+}
+
+/*
+ * Write what's left in rd as a .bkz, via a .tmp and rename so a half
+ * written .bkz never exists.  Each block's records go through fn
+ * first, if there is one.  Returns 0 on success.
+ *
+ */
+static int bkz_write(struct bklog_reader *rd, const char *bkz_path, bklog_batch_fn fn, void *arg) {
+	struct bklog_header h;
+	struct bklog_record batch[BKLOG_BLOCK_SIZE], prev;
+	struct bklog_block *blocks = NULL, *bk = NULL;
+	uint32_t nblocks = 0, size = 0;
+	struct bitwriter b;
+	struct outbuf o;
+	char tmp[BKLOG_PATH_SIZE];
+	int64_t prev_delta = 0;
+	uint64_t count = 0;
+	int n, ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", bkz_path);
+	memset(&o, 0, sizeof(o));
+	o.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (o.fd < 0) return -1;
+
+#ifdef BKLOG_STATIC
+	blocks = block_pool;
+	size = BKLOG_STATIC_BLOCKS;
+#endif
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BKLOG_BKZ_MAGIC, 8);
+	h.version = BKLOG_VERSION;
+	h.record_size = sizeof(struct bklog_record);
+	h.meter = rd->meter;
+	out_write(&o, &h, sizeof(h));
+
+	memset(&prev, 0, sizeof(prev));
+	memset(&b, 0, sizeof(b));
+	b.o = &o;
+
+	/*
+	 * Each block starts with a whole record on a byte boundary,
+	 * everything after that in the block is a delta
+	 */
+	while ((n = batch_read(rd, batch)) > 0) {
+		bits_flush(&b);
+		if (nblocks >= size) {
+#ifdef BKLOG_STATIC
+			o.err = 1;
+			break;
+#else
+			size = size ? size * 2 : 64;
+			blocks = (struct bklog_block *)realloc(blocks, size * sizeof(struct bklog_block));
+			if (!blocks) {
+				close(o.fd);
+				unlink(tmp);
+				return -1;
+			}
+#endif
+		}
+		if (fn) fn(batch, n, arg);
+
+		bk = &blocks[nblocks++];
+		memset(bk, 0, sizeof(*bk));
+		bk->offset = out_tell(&o);
+		bk->ts_first = batch[0].ts;
+		bk->min = bk->max = NAN;
+		out_write(&o, &batch[0], sizeof(batch[0]));
+		prev = batch[0];
+		prev_delta = 0;
+
+		for (int k = 0; k < n; k++) {
+			struct bklog_record *r = &batch[k];
+
+			if (k) bkz_put(&b, &prev, &prev_delta, r);
+			bk->ts_last = r->ts;
+			bk->count++;
+			if (r->status & BKLOG_STATUS_OL) {
+				bk->ol++;
+			} else {
+				double v = bklog_si(r);
+				if (isnan(bk->min) || v < bk->min) bk->min = v;
+				if (isnan(bk->max) || v > bk->max) bk->max = v;
+			}
+			count++;
+		}
+	}
+	bits_flush(&b);
+
+	h.count = count;
+	h.blocks = nblocks;
+	h.index = out_tell(&o);
+	if (nblocks) out_write(&o, blocks, nblocks * sizeof(struct bklog_block));
+#ifndef BKLOG_STATIC
+	free(blocks);
+#endif
+	out_flush(&o);
+
+	if (pwrite(o.fd, &h, sizeof(h), 0) != sizeof(h)) o.err = 1;
+
+	ok = (!o.err && fsync(o.fd) == 0);
+	close(o.fd);
+	if (!ok) {
+		unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, bkz_path) != 0) return -1;
+	return 0;
+}
+
+/*
+ * Compress a closed .seg in to a .bkz
+ */
+int bklog_compress(const char *seg_path, const char *bkz_path) {
+	struct bklog_reader rd;
+	int ret;
+
+	if (bklog_open(&rd, seg_path) != 0) return -1;
+	ret = bkz_write(&rd, bkz_path, NULL, NULL);
+	bklog_close(&rd);
+	return ret;
+}
+
+/*
+ * Replace a closed .seg or .bkz with one whose records have been
+ * through fn, a block (or for a .seg, as many records) at a time.
+ * The new file is written alongside and renamed over the old one.
+ */
+int bklog_rewrite(const char *path, bklog_batch_fn fn, void *arg) {
+	struct bklog_reader rd;
+	struct bklog_record batch[BKLOG_BLOCK_SIZE];
+	struct outbuf o;
+	char tmp[BKLOG_PATH_SIZE];
+	int n, ok;
+
+	if (bklog_open(&rd, path) != 0) return -1;
+	if (rd.compressed) {
+		int ret = bkz_write(&rd, path, fn, arg);
+		bklog_close(&rd);
+		return ret;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	memset(&o, 0, sizeof(o));
+	o.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (o.fd < 0) {
+		bklog_close(&rd);
+		return -1;
+	}
+
+	out_write(&o, rd.map, sizeof(struct bklog_header));
+	while ((n = batch_read(&rd, batch)) > 0) {
+		fn(batch, n, arg);
+		out_write(&o, batch, n * sizeof(batch[0]));
+	}
+	bklog_close(&rd);
+	out_flush(&o);
+
+	ok = (!o.err && fsync(o.fd) == 0);
+	close(o.fd);
+	if (!ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reader for either kind of file
+ */
+int bklog_open(struct bklog_reader *rd, const char *path) {
+	const struct bklog_header *h;
+	struct stat st;
+	int fd;
+
+	memset(rd, 0, sizeof(*rd));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct bklog_header)) {
+		close(fd);
+		return -1;
+	}
+
+	rd->size = st.st_size;
+	rd->map = (const uint8_t *)mmap(NULL, rd->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (rd->map == MAP_FAILED) {
+		rd->map = NULL;
+		return -1;
+	}
+
+	h = (const struct bklog_header *)rd->map;
+	rd->meter = h->meter;
+	if (h->record_size != sizeof(struct bklog_record)) {
+		bklog_close(rd);
+		return -1;
+	}
+
+	if (memcmp(h->magic, BKLOG_SEG_MAGIC, 8) == 0) {
+		rd->count = (rd->size - sizeof(*h)) / sizeof(struct bklog_record);
+	} else if (memcmp(h->magic, BKLOG_BKZ_MAGIC, 8) == 0 && h->version == BKLOG_VERSION
+			&& h->index + (uint64_t)h->blocks * sizeof(struct bklog_block) <= rd->size) {
+		rd->compressed = 1;
+		rd->count = h->count;
+		rd->blocks = (const struct bklog_block *)(rd->map + h->index);
+		rd->nblocks = h->blocks;
+		if (rd->nblocks) bklog_seek_block(rd, 0);
+	} else {
+		bklog_close(rd);
+		return -1;
+	}
+
+	return 0;
+}
+
+int bklog_seek_block(struct bklog_reader *rd, uint32_t block) {
+	if (block >= rd->nblocks) return -1;
+
+	rd->block = block;
+	rd->left = rd->blocks[block].count;
+	rd->pos = rd->blocks[block].offset;
+	rd->index = (uint64_t)block * BKLOG_BLOCK_SIZE;
+	rd->acc = 0;
+	rd->nbits = 0;
+	return 0;
+}
+
+int bklog_next(struct bklog_reader *rd, struct bklog_record *r) {
+	if (rd->index >= rd->count) return -1;
+
+	if (!rd->compressed) {
+		memcpy(r, rd->map + sizeof(struct bklog_header) + rd->index * sizeof(*r), sizeof(*r));
+	} else {
+		if (!rd->left && bklog_seek_block(rd, rd->block + 1) != 0) return -1;
+
+		if (rd->left == rd->blocks[rd->block].count) {
+			if (rd->pos + sizeof(*r) > rd->size) return -1;
+			memcpy(r, rd->map + rd->pos, sizeof(*r));
+			rd->pos += sizeof(*r);
+			rd->prev = *r;
+			rd->prev_delta = 0;
+		} else if (bkz_get(rd, r) != 0) {
+			return -1;
+		}
+		rd->left--;
+	}
+
+	rd->index++;
+	return 0;
+}
+
+/*
+ * Position the reader so the next record is the first at or after
+ * ts.  Relies on a meter's timestamps only going forward.
+ *
+ */
+int bklog_seek_ts(struct bklog_reader *rd, uint64_t ts) {
+	struct bklog_record r;
+	uint64_t lo = 0, hi;
+
+	if (!rd->compressed) {
+		const struct bklog_record *recs = (const struct bklog_record *)(rd->map + sizeof(struct bklog_header));
+
+		hi = rd->count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (recs[mid].ts < ts) lo = mid + 1;
+			else hi = mid;
+		}
+		rd->index = lo;
+		return (lo < rd->count) ? 0 : -1;
+	}
+
+	hi = rd->nblocks;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (rd->blocks[mid].ts_last < ts) lo = mid + 1;
+		else hi = mid;
+	}
+	if (bklog_seek_block(rd, lo) != 0) {
+		rd->index = rd->count;
+		return -1;
+	}
+
+	/*
+	 * Decode forward through the block, backing up one record
+	 * once we've found the first one that's in range
+	 */
+	while (1) {
+		struct bklog_reader save = *rd;
+		if (bklog_next(rd, &r) != 0) return -1;
+		if (r.ts >= ts) {
+			*rd = save;
+			return 0;
+		}
+	}
+}
+
+int bklog_span(struct bklog_reader *rd, uint64_t *first, uint64_t *last) {
+	if (!rd->count) return -1;
+
+	if (rd->compressed) {
+		if (!rd->nblocks) return -1;
+		*first = rd->blocks[0].ts_first;
+		*last = rd->blocks[rd->nblocks - 1].ts_last;
+	} else {
+		const struct bklog_record *recs = (const struct bklog_record *)(rd->map + sizeof(struct bklog_header));
+		*first = recs[0].ts;
+		*last = recs[rd->count - 1].ts;
+	}
+	return 0;
+}
+
+void bklog_close(struct bklog_reader *rd) {
+	if (rd->map) munmap((void *)rd->map, rd->size);
+	rd->map = NULL;
+}
+
+/*
+ * Background compressor
+ *
+ * One low priority thread for the whole process, closed segments
+ * are queued to it by path.  Anything left uncompressed by an
+ * earlier run is picked up when it starts.
+ *
+ * A writer holds an flock() on the segment it has open, from before
+ * the header goes in until it's closed.  The compressor only takes a
+ * segment it can lock and that has a header, so it never compresses
+ * one out from under another process logging to the same directory.
+ *
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char queue[BKLOG_QUEUE_SIZE][BKLOG_PATH_SIZE];
+	unsigned int head, tail;
+	int running;
+	int busy;
+	unsigned long done, failed;  // compressor thread only
+} comp;
+
+static void compressor_queue(const char *path) {
+	pthread_mutex_lock(&comp.lock);
+	if (comp.head - comp.tail < BKLOG_QUEUE_SIZE) {
+		snprintf(comp.queue[comp.head % BKLOG_QUEUE_SIZE], BKLOG_PATH_SIZE, "%s", path);
+		comp.head++;
+		pthread_cond_signal(&comp.cond);
+	} else {
+		/*
+		 * It'll get picked up on the next start instead
+		 */
+		fprintf(stderr,"%s:%d: Compressor queue full, leaving '%s' for later\n", FL, path);
+	}
+	pthread_mutex_unlock(&comp.lock);
+}
+
+/*
+ * The segment locked against its writer, or -1 if it's still being
+ * written (or has gone)
+ */
+static int segment_lock(const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct bklog_header)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void *compressor_thread(void *arg) {
+	char seg[BKLOG_PATH_SIZE], bkz[BKLOG_PATH_SIZE];
+
+	(void)arg;
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+	while (1) {
+		size_t l;
+		int lock;
+
+		pthread_mutex_lock(&comp.lock);
+		while (comp.head == comp.tail) pthread_cond_wait(&comp.cond, &comp.lock);
+		snprintf(seg, sizeof(seg), "%s", comp.queue[comp.tail % BKLOG_QUEUE_SIZE]);
+		comp.tail++;
+		comp.busy = 1;
+		pthread_mutex_unlock(&comp.lock);
+
+		l = strlen(seg);
+		if (l > 4 && (lock = segment_lock(seg)) >= 0) {
+			snprintf(bkz, sizeof(bkz), "%.*s.bkz", (int)(l - 4), seg);
+			if (bklog_compress(seg, bkz) == 0) {
+				unlink(seg);
+				__atomic_store_n(&comp.done, comp.done + 1, __ATOMIC_RELAXED);
+			} else {
+				fprintf(stderr,"%s:%d: Unable to compress '%s' (%s)\n", FL, seg, strerror(errno));
+				__atomic_store_n(&comp.failed, comp.failed + 1, __ATOMIC_RELAXED);
+			}
+			close(lock);
+		}
+
+		pthread_mutex_lock(&comp.lock);
+		comp.busy = 0;
+		pthread_cond_broadcast(&comp.cond);
+		pthread_mutex_unlock(&comp.lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim dir for this process until it exits.  The lock file says
+ * which process has it, returns -1 if another one does.
+ */
+int bklog_dir_lock(const char *dir) {
+	char path[BKLOG_PATH_SIZE], pid[32];
+	int fd, l;
+
+	snprintf(path, sizeof(path), "%s/bk390.lock", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\n", FL, path, strerror(errno));
+		return -1;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		l = read(fd, pid, sizeof(pid) - 1);
+		pid[l > 0 ? l : 0] = '\0';
+		if ((l = strcspn(pid, "\n"))) pid[l] = '\0';
+		fprintf(stderr,"%s:%d: '%s' is already in use by another logger (pid %s), give each its own directory\n", FL, dir, pid[0] ? pid : "?");
+		close(fd);
+		return -1;
+	}
+
+	l = snprintf(pid, sizeof(pid), "%d\n", (int)getpid());
+	if (ftruncate(fd, 0) != 0 || write(fd, pid, l) != l) fprintf(stderr,"%s:%d: Unable to write '%s'\n", FL, path);
+	return 0; // fd stays open, and locked, until we exit
+}
+
+void bklog_compressor_start(struct bklog_config *cfg) {
+	DIR *dir;
+	struct dirent *de;
+
+	if (comp.running) return;
+	comp.running = 1;
+	pthread_mutex_init(&comp.lock, NULL);
+	pthread_cond_init(&comp.cond, NULL);
+	pthread_create(&comp.thread, NULL, compressor_thread, NULL);
+	pthread_detach(comp.thread);
+
+	dir = opendir(cfg->dir);
+	if (!dir) return;
+	while ((de = readdir(dir))) {
+		size_t l = strlen(de->d_name);
+		char path[BKLOG_PATH_SIZE];
+
+		if (l > 4 && strcmp(de->d_name + l - 4, ".seg") == 0 && strncmp(de->d_name, "bk390-", 6) == 0) {
+			snprintf(path, sizeof(path), "%s/%s", cfg->dir, de->d_name);
+			compressor_queue(path);
+		}
+	}
+	closedir(dir);
+}
+
+/*
+ * Wait for everything queued so far to be compressed, used on
+ * the way out so the last segments don't need the next start.
+ *
+ */
+void bklog_compressor_drain(void) {
+	if (!comp.running) return;
+	pthread_mutex_lock(&comp.lock);
+	while (comp.head != comp.tail || comp.busy) pthread_cond_wait(&comp.cond, &comp.lock);
+	pthread_mutex_unlock(&comp.lock);
+}
+
+/*
+ * Rollups
+ *
+ * Tier 0 is fed the readings, each bucket it closes is merged in to
+ * tier 1 and so on, so nothing is ever recomputed from the raw data.
+ *
+ */
+void bklog_rollup_merge(struct bklog_rollup *into, const struct bklog_rollup *in) {
+	if (!into->count) {
+		uint64_t ts = into->ts;
+		*into = *in;
+		into->ts = ts;
+		return;
+	}
+
+	into->count += in->count;
+	into->ol += in->ol;
+	into->sum += in->sum;
+	if (!isnan(in->min) && (isnan(into->min) || in->min < into->min)) into->min = in->min;
+	if (!isnan(in->max) && (isnan(into->max) || in->max > into->max)) into->max = in->max;
+}
+
+void bklog_rollup_path(char *path, size_t size, const char *dir, int meter, int tier) {
+	snprintf(path, size, "%s/bk390-m%d-r%u.rollup", dir, meter, bklog_tier_secs[tier]);
+}
+
+static void rollup_add(struct bklog_writer *w, int t, const struct bklog_rollup *in);
+
+static void rollup_emit(struct bklog_writer *w, int t) {
+	struct bklog_rollup *cur = &w->tier[t];
+
+	if (!cur->count) return;
+
+	if (w->tier_fd[t] < 0) {
+		char path[BKLOG_PATH_SIZE];
+
+		bklog_rollup_path(path, sizeof(path), w->cfg->dir, w->meter, t);
+		w->tier_fd[t] = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (w->tier_fd[t] < 0) {
+			fprintf(stderr,"%s:%d: Unable to open rollup '%s' (%s)\n", FL, path, strerror(errno));
+			w->errors++;
+		} else if (lseek(w->tier_fd[t], 0, SEEK_END) == 0) {
+			struct bklog_header h;
+
+			memset(&h, 0, sizeof(h));
+			memcpy(h.magic, BKLOG_RUP_MAGIC, 8);
+			h.version = BKLOG_VERSION;
+			h.record_size = sizeof(struct bklog_rollup);
+			h.meter = w->meter;
+			if (write(w->tier_fd[t], &h, sizeof(h)) != sizeof(h)) w->errors++;
+		}
+	}
+	if (w->tier_fd[t] >= 0 && write(w->tier_fd[t], cur, sizeof(*cur)) != sizeof(*cur)) w->errors++;
+
+	if (t + 1 < BKLOG_TIERS) rollup_add(w, t + 1, cur);
+	cur->count = 0;
+}
+
+static void rollup_add(struct bklog_writer *w, int t, const struct bklog_rollup *in) {
+	struct bklog_rollup *cur = &w->tier[t];
+	uint64_t width = (uint64_t)bklog_tier_secs[t] * 1000000;
+	uint64_t start = in->ts - in->ts % width;
+
+	if (cur->count && (cur->ts != start || cur->function != in->function || cur->range != in->range)) rollup_emit(w, t);
+	if (!cur->count) cur->ts = start;
+	bklog_rollup_merge(cur, in);
+}
+
+int bklog_rollups_open(struct bklog_rollups *rs, const char *path) {
+	const struct bklog_header *h;
+	struct stat st;
+	int fd;
+
+	memset(rs, 0, sizeof(*rs));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct bklog_header)) {
+		close(fd);
+		return -1;
+	}
+
+	rs->size = st.st_size;
+	rs->map = (const uint8_t *)mmap(NULL, rs->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (rs->map == MAP_FAILED) {
+		rs->map = NULL;
+		return -1;
+	}
+
+	h = (const struct bklog_header *)rs->map;
+	if (memcmp(h->magic, BKLOG_RUP_MAGIC, 8) != 0 || h->record_size != sizeof(struct bklog_rollup)) {
+		bklog_rollups_close(rs);
+		return -1;
+	}
+	rs->r = (const struct bklog_rollup *)(rs->map + sizeof(*h));
+	rs->count = (rs->size - sizeof(*h)) / sizeof(struct bklog_rollup);
+	return 0;
+}
+
+/*
+ * Index of the first bucket that ends after ts
+ */
+uint64_t bklog_rollups_find(struct bklog_rollups *rs, uint64_t ts, uint32_t secs) {
+	uint64_t lo = 0, hi = rs->count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (rs->r[mid].ts + (uint64_t)secs * 1000000 <= ts) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+void bklog_rollups_close(struct bklog_rollups *rs) {
+	if (rs->map) munmap((void *)rs->map, rs->size);
+	rs->map = NULL;
+}
+
+/*
+ * For metrics, read without the lock so it never waits on the
+ * compressor
+ */
+void bklog_compressor_stats(unsigned int *queued, unsigned long *done, unsigned long *failed) {
+	*queued = __atomic_load_n(&comp.head, __ATOMIC_RELAXED) - __atomic_load_n(&comp.tail, __ATOMIC_RELAXED);
+	*done = __atomic_load_n(&comp.done, __ATOMIC_RELAXED);
+	*failed = __atomic_load_n(&comp.failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Segment writer, one per meter
+ */
+void bklog_writer_init(struct bklog_writer *w, struct bklog_config *cfg, int meter) {
+	memset(w, 0, sizeof(*w));
+	w->cfg = cfg;
+	w->meter = meter;
+	w->fd = -1;
+	for (int t = 0; t < BKLOG_TIERS; t++) w->tier_fd[t] = -1;
+}
+
+static int writer_open(struct bklog_writer *w, uint64_t now) {
+	struct bklog_header h;
+	char stamp[32];
+	struct tm tm;
+	time_t t = now / 1000000;
+
+	gmtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+	snprintf(w->path, sizeof(w->path), "%s/bk390-m%d-%s-%06u.seg", w->cfg->dir, w->meter, stamp, (unsigned int)(now % 1000000));
+
+	w->fd = open(w->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open log segment '%s' (%s)\n", FL, w->path, strerror(errno));
+		w->errors++;
+		return -1;
+	}
+	flock(w->fd, LOCK_EX); // until it's closed, see compressor_thread()
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BKLOG_SEG_MAGIC, 8);
+	h.version = BKLOG_VERSION;
+	h.record_size = sizeof(struct bklog_record);
+	h.meter = w->meter;
+	if (write(w->fd, &h, sizeof(h)) != sizeof(h)) w->errors++;
+
+	w->opened = now;
+	w->bytes = sizeof(h);
+	w->last_fsync = now;
+	w->segments++;
+	return 0;
+}
+
+static void writer_flush(struct bklog_writer *w, uint64_t now) {
+	ssize_t l = (ssize_t)(w->n * sizeof(struct bklog_record));
+
+	w->last_flush = now;
+	if (!w->n) return;
+	if (w->fd < 0 && writer_open(w, now) != 0) {
+		w->n = 0;
+		return;
+	}
+
+	if (write(w->fd, w->batch, l) != l) {
+		fprintf(stderr,"%s:%d: Short write to log segment '%s' (%s)\n", FL, w->path, strerror(errno));
+		w->errors++;
+	}
+	w->bytes += l;
+	w->n = 0;
+
+	if (w->cfg->fsync_mode == BKLOG_FSYNC_INTERVAL && now - w->last_fsync >= w->cfg->fsync_us) {
+		fdatasync(w->fd);
+		w->last_fsync = now;
+	}
+}
+
+static void writer_rotate(struct bklog_writer *w) {
+	if (w->fd < 0) return;
+	if (w->cfg->fsync_mode != BKLOG_FSYNC_NONE) fdatasync(w->fd);
+	close(w->fd);
+	w->fd = -1;
+	compressor_queue(w->path);
+}
+
+void bklog_write(struct bklog_writer *w, const struct bklog_record *r) {
+	struct bklog_rollup one;
+
+	w->batch[w->n++] = *r;
+	w->records++;
+
+	memset(&one, 0, sizeof(one));
+	one.ts = r->ts;
+	one.count = 1;
+	one.meter = r->meter;
+	one.function = r->function;
+	one.range = r->range;
+	one.dps = r->dps;
+	one.exponent = r->exponent;
+	if (r->status & BKLOG_STATUS_OL) {
+		one.ol = 1;
+		one.min = one.max = NAN;
+	} else {
+		one.min = one.max = one.sum = bklog_si(r);
+	}
+	rollup_add(w, 0, &one);
+
+	if (w->n >= w->cfg->batch || w->n >= BKLOG_BATCH_MAX) bklog_tick(w, r->ts);
+}
+
+/*
+ * Called with every record and from the main loop, flushes the
+ * batch once it's full or a second old and rotates the segment
+ * when it's too big or too old.
+ *
+ */
+void bklog_tick(struct bklog_writer *w, uint64_t now) {
+	if (w->n >= w->cfg->batch || now - w->last_flush >= 1000000) writer_flush(w, now);
+
+	/*
+	 * Close out buckets whose time is up even if the meter has
+	 * gone quiet, lowest tier first as each feeds the next
+	 */
+	for (int t = 0; t < BKLOG_TIERS; t++) {
+		if (w->tier[t].count && now >= w->tier[t].ts + (uint64_t)bklog_tier_secs[t] * 1000000) rollup_emit(w, t);
+	}
+
+	if (w->fd >= 0 && ((w->cfg->rotate_bytes && w->bytes >= w->cfg->rotate_bytes) || (w->cfg->rotate_us && now - w->opened >= w->cfg->rotate_us))) {
+		writer_rotate(w);
+	}
+#ifdef BKLOG_STATIC
+	if (w->fd >= 0 && w->bytes + (uint64_t)BKLOG_BATCH_MAX * sizeof(struct bklog_record) > BKLOG_SEG_MAX) writer_rotate(w);
+#endif
+}
+
+/*
+ * Partly filled buckets are written out too, a later run carrying
+ * on in the same bucket adds a second row that readers merge.
+ */
+void bklog_writer_close(struct bklog_writer *w) {
+	for (int t = 0; t < BKLOG_TIERS; t++) rollup_emit(w, t);
+	writer_flush(w, bklog_now());
+	writer_rotate(w);
+	for (int t = 0; t < BKLOG_TIERS; t++) {
+		if (w->tier_fd[t] >= 0) close(w->tier_fd[t]);
+		w->tier_fd[t] = -1;
+	}
+}
@@ -0,0 +1,210 @@
+/*
+ * BK390A reading log segments
+ *
+ * Readings are logged as fixed size binary records in to segment
+ * files, one stream of segments per meter.  Segments are rotated by
+ * size or age and closed segments are compressed in the background
+ * in to .bkz files using delta-of-delta timestamps and delta counts,
+ * so a meter sitting on a steady value costs a couple of bits per
+ * reading plus the timestamp jitter.
+ *
+ * A .bkz is cut in to blocks of BKLOG_BLOCK_SIZE records, each one
+ * restarting the delta coding on a byte boundary, and ends with an
+ * index of the blocks giving their time span, offset and min/max.
+ * Range queries binary search the index and skip whole blocks that
+ * can't match, rather than decoding the file from the start.
+ *
+ * Only one process logs to a directory at a time, the segment and
+ * rollup names only carry the meter's index within it, so it holds a
+ * lock on the directory's bk390.lock while it's running.
+ *
+ * Alongside the segments each meter has one rollup file per tier
+ * (10s, 1min, 1h buckets) holding min/max/sum/count, built up as the
+ * readings arrive so long spans can be plotted without touching the
+ * raw readings.
+ *
+ */
+#ifndef BK390LOG_H
+#define BK390LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define BKLOG_SEG_MAGIC "BK390SEG"
+#define BKLOG_BKZ_MAGIC "BK390BKZ"
+#define BKLOG_RUP_MAGIC "BK390RUP"
+#define BKLOG_VERSION 2
+
+#define BKLOG_BATCH_MAX 1024
+#define BKLOG_BLOCK_SIZE 256
+#define BKLOG_TIERS 3
+#define BKLOG_PATH_SIZE 4096
+
+/*
+ * Built with -DBKLOG_STATIC the compressor works in a fixed block
+ * index rather than growing one, and segments are kept small enough
+ * to fit it (256 blocks is 65536 readings, 7 hours at 2.5 a second)
+ */
+#ifndef BKLOG_STATIC_BLOCKS
+#define BKLOG_STATIC_BLOCKS 256
+#endif
+
+#define BKLOG_FSYNC_NONE 0
+#define BKLOG_FSYNC_ROTATE 1
+#define BKLOG_FSYNC_INTERVAL 2
+
+/*
+ * One reading, as stored in a .seg file
+ */
+struct bklog_record {
+	uint64_t ts;          // microseconds since epoch
+	int32_t counts;       // signed display counts
+	uint8_t meter;
+	uint8_t function;     // BYTE_FUNCTION
+	uint8_t range;        // BYTE_RANGE & 0x0F
+	uint8_t status;       // BYTE_STATUS & 0x0F, 0x01 is OL
+	uint8_t option1;      // BYTE_OPTION_1 & 0x0F
+	uint8_t option2;      // BYTE_OPTION_2 & 0x0F
+	uint8_t dps;          // decimal places
+	int8_t exponent;      // prefix power of ten, m = -3
+	uint32_t reserved;
+};
+
+#define BKLOG_STATUS_OL 0x01
+
+struct bklog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t meter;
+	uint32_t blocks;      // .bkz only, entries in the block index
+	uint64_t count;       // .bkz only, .seg files are counted by their size
+	uint64_t index;       // .bkz only, file offset of the block index
+};
+
+/*
+ * .bkz block index entry, min/max are SI values of the non-OL
+ * readings in the block, NaN if there weren't any
+ */
+struct bklog_block {
+	uint64_t ts_first;
+	uint64_t ts_last;
+	uint64_t offset;
+	uint32_t count;
+	uint32_t ol;          // OL readings in the block
+	double min, max;
+};
+
+/*
+ * One rollup bucket.  A bucket is split if the meter changes
+ * function or range part way through, so there can be more than
+ * one row with the same ts.  min/max/sum are SI values of the
+ * non-OL readings.
+ */
+struct bklog_rollup {
+	uint64_t ts;          // bucket start, microseconds since epoch
+	uint32_t count;       // readings, OL included
+	uint32_t ol;
+	uint8_t meter;
+	uint8_t function;
+	uint8_t range;
+	uint8_t dps;
+	int8_t exponent;
+	uint8_t reserved[3];
+	double min, max, sum;
+};
+
+struct bklog_rollups {
+	const uint8_t *map;
+	size_t size;
+	const struct bklog_rollup *r;
+	uint64_t count;
+};
+
+extern const uint32_t bklog_tier_secs[BKLOG_TIERS];
+
+struct bklog_config {
+	char *dir;
+	uint64_t rotate_bytes;
+	uint64_t rotate_us;
+	int fsync_mode;
+	uint64_t fsync_us;
+	int batch;            // records buffered before a write()
+};
+
+struct bklog_writer {
+	struct bklog_config *cfg;
+	int meter;
+	int fd;
+	char path[BKLOG_PATH_SIZE];
+	uint64_t opened;
+	uint64_t bytes;
+	uint64_t last_flush;
+	uint64_t last_fsync;
+	int n;
+	struct bklog_record batch[BKLOG_BATCH_MAX];
+	struct bklog_rollup tier[BKLOG_TIERS];   // buckets being filled
+	int tier_fd[BKLOG_TIERS];
+	unsigned long records, segments, errors;
+};
+
+/*
+ * Readers map the whole file, .seg records are read in place and
+ * .bkz blocks are decoded straight out of the mapping.
+ */
+struct bklog_reader {
+	const uint8_t *map;
+	size_t size;
+	int compressed;
+	int meter;
+	uint64_t count;
+	uint64_t index;       // next record to be returned
+
+	/*
+	 * .bkz only
+	 */
+	const struct bklog_block *blocks;
+	uint32_t nblocks;
+	uint32_t block;       // block the next record is in
+	uint32_t left;        // records left in that block
+	size_t pos;
+	uint64_t acc;
+	int nbits;
+	struct bklog_record prev;
+	int64_t prev_delta;
+};
+
+double bklog_si(const struct bklog_record *r);
+
+/*
+ * Called with each batch of records bklog_rewrite() reads, changes
+ * made to them are what's written back
+ */
+typedef void (*bklog_batch_fn)(struct bklog_record *r, int n, void *arg);
+
+int bklog_dir_lock(const char *dir);
+void bklog_compressor_start(struct bklog_config *cfg);
+int bklog_compress(const char *seg_path, const char *bkz_path);
+int bklog_rewrite(const char *path, bklog_batch_fn fn, void *arg);
+void bklog_compressor_drain(void);
+void bklog_compressor_stats(unsigned int *queued, unsigned long *done, unsigned long *failed);
+
+void bklog_writer_init(struct bklog_writer *w, struct bklog_config *cfg, int meter);
+void bklog_write(struct bklog_writer *w, const struct bklog_record *r);
+void bklog_tick(struct bklog_writer *w, uint64_t now);
+void bklog_writer_close(struct bklog_writer *w);
+
+void bklog_rollup_merge(struct bklog_rollup *into, const struct bklog_rollup *in);
+void bklog_rollup_path(char *path, size_t size, const char *dir, int meter, int tier);
+int bklog_rollups_open(struct bklog_rollups *rs, const char *path);
+uint64_t bklog_rollups_find(struct bklog_rollups *rs, uint64_t ts, uint32_t secs);
+void bklog_rollups_close(struct bklog_rollups *rs);
+
+int bklog_open(struct bklog_reader *rd, const char *path);
+int bklog_next(struct bklog_reader *rd, struct bklog_record *r);
+int bklog_seek_block(struct bklog_reader *rd, uint32_t block);
+int bklog_seek_ts(struct bklog_reader *rd, uint64_t ts);
+int bklog_span(struct bklog_reader *rd, uint64_t *first, uint64_t *last);
+void bklog_close(struct bklog_reader *rd);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * libbk390, settle detection
+ *
+ * Decides, a reading at a time, when a meter's reading has stopped
+ * moving, so a test fixture can take it the moment it's good rather
+ * than after a fixed wait.  See bk390.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bk390.h"
+
+#define RING(i) ((i) & (BK390_SETTLE_MAX - 1))
+
+/*
+ * <tolerance>[%|c][,<window ms>[,<timeout ms>]] or none, returns 0
+ * if it made sense
+ */
+int bk390_settle_parse(struct bk390_settle_config *c, const char *spec) {
+	char *p;
+
+	memset(c, 0, sizeof(*c));
+	c->window_us = 1000000;
+	if (strcmp(spec, "none") == 0) return 0;
+
+	c->tol = strtod(spec, &p);
+	if (p == spec || c->tol < 0.0) return -1;
+	c->kind = BK390_SETTLE_ABS;
+	if (*p == '%') {
+		c->kind = BK390_SETTLE_PCT;
+		p++;
+	} else if (*p == 'c') {
+		c->kind = BK390_SETTLE_COUNTS;
+		p++;
+	}
+	if (*p == '\0') return 0;
+
+	if (*p++ != ',') return -1;
+	c->window_us = (uint64_t)(strtod(p, &p) * 1000.0);
+	if (c->window_us < 1000) return -1;
+	if (*p == '\0') return 0;
+
+	if (*p++ != ',') return -1;
+	c->timeout_us = (uint64_t)(strtod(p, &p) * 1000.0);
+	return *p == '\0' ? 0 : -1;
+}
+
+static void window_clear(struct bk390_settle *s) {
+	s->n = s->nmin = s->nmax = 0;
+	s->sum = 0.0;
+}
+
+/*
+ * A new measurement from start, armed ones can time out
+ */
+void bk390_settle_start(struct bk390_settle *s, uint64_t start, int armed) {
+	window_clear(s);
+	s->state = BK390_SETTLE_WAITING;
+	s->armed = armed;
+	s->start = start;
+}
+
+/*
+ * Only before bk390_start(), or from the callback of the meter
+ */
+void bk390_set_settle(struct bk390 *b, int meter, const struct bk390_settle_config *c) {
+	struct bk390_settle *s = &b->meter[meter].settle;
+
+	memset(s, 0, sizeof(*s));
+	if (c) s->c = *c;
+}
+
+/*
+ * Oldest reading out of the window, and out of the front of the
+ * min/max deques if it's there
+ */
+static void window_drop(struct bk390_settle *s) {
+	unsigned int i = s->head;
+
+	if (s->nmin && s->dmin[s->hmin] == i) {
+		s->hmin = RING(s->hmin + 1);
+		s->nmin--;
+	}
+	if (s->nmax && s->dmax[s->hmax] == i) {
+		s->hmax = RING(s->hmax + 1);
+		s->nmax--;
+	}
+	s->sum -= s->v[i];
+	s->head = RING(s->head + 1);
+	s->n--;
+}
+
+/*
+ * Monotonic deques of ring indexes, dmin's values rise from the
+ * front and dmax's fall, so the window's min and max are at the
+ * fronts and each reading goes in and out of each once
+ */
+static void window_push(struct bk390_settle *s, uint64_t ts, double v) {
+	unsigned int i;
+
+	if (s->n == BK390_SETTLE_MAX) window_drop(s);
+	if (!s->n) s->head = s->hmin = s->hmax = 0;
+	i = RING(s->head + s->n);
+	s->ts[i] = ts;
+	s->v[i] = v;
+	s->sum += v;
+	s->n++;
+
+	while (s->nmin && s->v[s->dmin[RING(s->hmin + s->nmin - 1)]] >= v) s->nmin--;
+	s->dmin[RING(s->hmin + s->nmin)] = i;
+	s->nmin++;
+	while (s->nmax && s->v[s->dmax[RING(s->hmax + s->nmax - 1)]] <= v) s->nmax--;
+	s->dmax[RING(s->hmax + s->nmax)] = i;
+	s->nmax++;
+}
+
+static double window_span(const struct bk390_settle *s) {
+	return s->v[s->dmax[s->hmax]] - s->v[s->dmin[s->hmin]];
+}
+
+/*
+ * One display count on the range r is on, in SI units
+ */
+static double count_si(const struct bk390_reading *r) {
+	double c = 1.0;
+
+	for (int e = r->exponent - r->dps; e > 0; e--) c *= 10.0;
+	for (int e = r->exponent - r->dps; e < 0; e++) c /= 10.0;
+	return c;
+}
+
+/*
+ * A percentage is never tighter than a count, or a reading near
+ * zero could never settle.  Readings are whole counts, the sliver of
+ * one added keeps a span of exactly the tolerance inside it whatever
+ * the rounding of the SI values.
+ */
+static double tolerance(const struct bk390_settle *s, const struct bk390_reading *r) {
+	double c = count_si(r);
+	double tol = s->c.tol;
+
+	switch (s->c.kind) {
+		case BK390_SETTLE_PCT:
+			tol = fabs(r->si) * s->c.tol / 100.0;
+			if (tol < c) tol = c;
+			break;
+		case BK390_SETTLE_COUNTS:
+			tol = s->c.tol * c;
+			break;
+	}
+	return tol + c / 1024.0;
+}
+
+static void event_fill(struct bk390_settle *s, struct bk390_settled *e, uint64_t ts, int settled) {
+	memset(e, 0, sizeof(*e));
+	e->settled = settled;
+	e->armed = s->armed;
+	e->start = s->start;
+	e->ts = ts;
+	e->function = s->function;
+	e->range = s->range;
+	e->readings = s->n;
+	e->value = s->n ? s->sum / s->n : NAN;
+	e->span = s->n ? window_span(s) : NAN;
+
+	s->state = BK390_SETTLE_DONE;
+	if (settled) s->settled++;
+	else s->timeouts++;
+	s->last = *e;
+}
+
+/*
+ * An armed measurement that's gone on too long, from
+ * bk390_settle_add() or from bk390_tick() if the meter's gone quiet.
+ * Returns 1 and fills in e if it's timed out.
+ */
+int bk390_settle_tick(struct bk390_settle *s, uint64_t now, struct bk390_settled *e) {
+	if (s->state != BK390_SETTLE_WAITING || !s->armed || !s->c.timeout_us) return 0;
+	if (now < s->start || now - s->start < s->c.timeout_us) return 0;
+	event_fill(s, e, now, 0);
+	return 1;
+}
+
+/*
+ * Feed one fresh reading through.  Returns 1 and fills in e if the
+ * measurement has just settled (or timed out).
+ *
+ * Once it has, anything that moves the reading on starts the next
+ * measurement on its own, timed from that reading: the band being
+ * left, a change of function or range, or OL.
+ */
+int bk390_settle_add(struct bk390_settle *s, const struct bk390_reading *r, struct bk390_settled *e) {
+	uint8_t function = r->d[BYTE_FUNCTION];
+	uint8_t range = r->d[BYTE_RANGE] & 0x0F;
+	double tol;
+	int broke = 0;
+
+	if (s->c.kind == BK390_SETTLE_OFF) return 0;
+	if (s->state == BK390_SETTLE_IDLE) bk390_settle_start(s, r->ts, 0);
+	if (r->ts < s->start) return 0;
+
+	/*
+	 * Autoranging goes through OL and a range or two on the way,
+	 * the window has to be all on the range it ends up on
+	 */
+	if (function != s->function || range != s->range || r->ol) {
+		s->function = function;
+		s->range = range;
+		broke = 1;
+		window_clear(s);
+	}
+
+	if (!r->ol) {
+		tol = tolerance(s, r);
+		window_push(s, r->ts, r->si);
+		while (s->n > 1 && window_span(s) > tol) {
+			window_drop(s);
+			broke = 1;
+		}
+		if (broke || s->n == 1) s->run = s->ts[s->head];
+
+		/*
+		 * Readings that have aged out of the window only
+		 * matter for how long the run has been going
+		 */
+		while (s->n > 1 && r->ts - s->ts[s->head] > s->c.window_us) window_drop(s);
+	}
+
+	if (broke && s->state == BK390_SETTLE_DONE) {
+		bk390_settle_start(s, r->ts, 0);
+		if (!r->ol) {
+			window_push(s, r->ts, r->si);
+			s->run = r->ts;
+		}
+	}
+	if (s->state != BK390_SETTLE_WAITING) return 0;
+
+	if (!r->ol && s->n > 1 && r->ts - s->run >= s->c.window_us) {
+		event_fill(s, e, r->ts, 1);
+		return 1;
+	}
+	return bk390_settle_tick(s, r->ts, e);
+}
@@ -0,0 +1,228 @@
+/*
+ * libbk390, quantile sketches
+ *
+ * DDSketch: readings are counted in buckets whose bounds grow
+ * geometrically, so any quantile comes back within alpha of the
+ * true value relative to it, in a fixed amount of memory.  See
+ * bk390.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bk390.h"
+
+#define SKETCH_MIN 1e-15        // smaller than this counts as zero, below any meter's resolution
+
+void bk390_sketch_init(struct bk390_sketch *s, double alpha) {
+	memset(s, 0, sizeof(*s));
+	if (alpha <= 0.0 || alpha >= 1.0) alpha = BK390_SKETCH_ALPHA;
+	s->alpha = alpha;
+	s->lg = log((1.0 + alpha) / (1.0 - alpha));
+	s->min = s->max = NAN;
+}
+
+/*
+ * Move the window of bins so bins[0] is index off.  Anything below
+ * it is folded in to the lowest bin, which only costs accuracy at
+ * the smallest magnitudes.  Returns how many readings were folded.
+ */
+static uint64_t store_move(struct bk390_sketch_store *st, int32_t off) {
+	uint32_t bins[BK390_SKETCH_BINS];
+	uint64_t folded = 0;
+
+	memset(bins, 0, sizeof(bins));
+	for (int32_t i = st->lo; i <= st->hi; i++) {
+		int32_t j = (i < off ? off : i) - off;
+		bins[j] += st->bins[i - st->offset];
+		if (i < off) folded += st->bins[i - st->offset];
+	}
+	memcpy(st->bins, bins, sizeof(bins));
+	st->offset = off;
+	if (st->lo < off) st->lo = off;
+	if (st->hi < off) st->hi = off;
+	return folded;
+}
+
+/*
+ * The window only moves when a reading lands outside it, and then
+ * with some room to spare so a wandering reading doesn't move it
+ * every time.  Returns how many readings, these n included, ended
+ * up in the lowest bin instead of their own.
+ */
+static uint64_t store_add(struct bk390_sketch_store *st, int32_t i, uint64_t n) {
+	uint64_t collapsed = 0;
+
+	if (!st->n) {
+		st->offset = i - BK390_SKETCH_BINS / 2;
+		st->lo = st->hi = i;
+	}
+
+	if (i < st->offset) {
+		int32_t off = i - BK390_SKETCH_BINS / 8;
+
+		if (off < st->hi - BK390_SKETCH_BINS + 1) off = st->hi - BK390_SKETCH_BINS + 1;
+		if (off > i) {
+			i = off;
+			collapsed = n;
+		}
+		collapsed += store_move(st, off);
+	} else if (i >= st->offset + BK390_SKETCH_BINS) {
+		int32_t off = i - BK390_SKETCH_BINS + 1 + BK390_SKETCH_BINS / 8;
+
+		if (off > st->lo) off = st->lo;
+		if (off < i - BK390_SKETCH_BINS + 1) off = i - BK390_SKETCH_BINS + 1;
+		collapsed = store_move(st, off);
+	}
+
+	st->bins[i - st->offset] += n;
+	st->n += n;
+	if (i < st->lo) st->lo = i;
+	if (i > st->hi) st->hi = i;
+	return collapsed;
+}
+
+void bk390_sketch_add(struct bk390_sketch *s, double v) {
+	double a = v < 0 ? -v : v;
+
+	if (s->count == 0 || v < s->min) s->min = v;
+	if (s->count == 0 || v > s->max) s->max = v;
+	s->count++;
+	s->sum += v;
+
+	if (a < SKETCH_MIN) {
+		s->zero++;
+		return;
+	}
+	s->collapsed += store_add(v < 0 ? &s->neg : &s->pos, (int32_t)ceil(log(a) / s->lg), 1);
+}
+
+/*
+ * Sketches with the same alpha merge exactly, as if every reading
+ * had been added to the one.  Returns -1 if the alphas differ.
+ */
+int bk390_sketch_merge(struct bk390_sketch *into, const struct bk390_sketch *from) {
+	const struct bk390_sketch_store *st[2] = { &from->pos, &from->neg };
+	struct bk390_sketch_store *dt[2] = { &into->pos, &into->neg };
+
+	if (into->alpha != from->alpha) return -1;
+	if (!from->count) return 0;
+
+	if (!into->count || from->min < into->min) into->min = from->min;
+	if (!into->count || from->max > into->max) into->max = from->max;
+	into->count += from->count;
+	into->zero += from->zero;
+	into->sum += from->sum;
+	into->collapsed += from->collapsed;
+	if (from->last > into->last) into->last = from->last;
+
+	for (int k = 0; k < 2; k++) {
+		if (!st[k]->n) continue;
+
+		/*
+		 * Highest first, so the window settles at the top
+		 * and only ever has to move once
+		 */
+		for (int32_t i = st[k]->hi; i >= st[k]->lo; i--) {
+			uint32_t n = st[k]->bins[i - st[k]->offset];
+			if (n) into->collapsed += store_add(dt[k], i, n);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Middle of bucket i, within alpha of anything in it
+ */
+static double bucket_value(const struct bk390_sketch *s, int32_t i) {
+	double gamma = exp(s->lg);
+	return 2.0 * exp(i * s->lg) / (gamma + 1.0);
+}
+
+double bk390_sketch_quantile(const struct bk390_sketch *s, double q) {
+	uint64_t rank, seen = 0;
+	double v = NAN;
+
+	if (!s->count) return NAN;
+	if (q <= 0.0) return s->min;
+	if (q >= 1.0) return s->max;
+	rank = (uint64_t)(q * (s->count - 1) + 0.5);
+
+	/*
+	 * Most negative first, so from the top of the negative store
+	 */
+	for (int32_t i = s->neg.hi; s->neg.n && i >= s->neg.lo; i--) {
+		seen += s->neg.bins[i - s->neg.offset];
+		if (seen > rank) {
+			v = -bucket_value(s, i);
+			goto found;
+		}
+	}
+	seen += s->zero;
+	if (seen > rank) {
+		v = 0.0;
+		goto found;
+	}
+	for (int32_t i = s->pos.lo; s->pos.n && i <= s->pos.hi; i++) {
+		seen += s->pos.bins[i - s->pos.offset];
+		if (seen > rank) {
+			v = bucket_value(s, i);
+			goto found;
+		}
+	}
+	return s->max;
+
+found:
+	if (v < s->min) v = s->min;
+	if (v > s->max) v = s->max;
+	return v;
+}
+
+/*
+ * The buckets spread over n equal width bins from lo to hi, for
+ * drawing.  Each bucket goes in the bin its middle falls in.
+ */
+void bk390_sketch_histogram(const struct bk390_sketch *s, double lo, double hi, unsigned long *counts, int n) {
+	const struct bk390_sketch_store *st[2] = { &s->pos, &s->neg };
+	double w = (hi - lo) / n;
+
+	memset(counts, 0, n * sizeof(counts[0]));
+	if (!s->count || n < 1) return;
+
+	for (int k = 0; k < 2; k++) {
+		for (int32_t i = st[k]->lo; st[k]->n && i <= st[k]->hi; i++) {
+			uint32_t c = st[k]->bins[i - st[k]->offset];
+			double v = k ? -bucket_value(s, i) : bucket_value(s, i);
+			int j = w > 0.0 ? (int)((v - lo) / w) : 0;
+
+			if (!c) continue;
+			if (j < 0) j = 0;
+			if (j >= n) j = n - 1;
+			counts[j] += c;
+		}
+	}
+	if (s->zero) {
+		int j = w > 0.0 ? (int)((0.0 - lo) / w) : 0;
+		if (j < 0) j = 0;
+		if (j >= n) j = n - 1;
+		counts[j] += s->zero;
+	}
+}
+
+/*
+ * The meter's sketch for a function and range, NULL if it doesn't
+ * have one (yet, or any more)
+ */
+struct bk390_sketch *bk390_sketch_find(struct bk390 *b, int meter, uint8_t function, uint8_t range) {
+	struct bk390_meter *mt = &b->meter[meter];
+
+	for (int k = 0; k < BK390_SKETCH_SLOTS; k++) {
+		struct bk390_sketch *s = &mt->sketch[k];
+		if (s->count && s->function == function && s->range == (range & 0x0F)) return s;
+	}
+	return NULL;
+}
@@ -0,0 +1,253 @@
+/*
+ * sigrok session (.sr, srzip) export of BK390A readings
+ *
+ * Just enough zip to write a session: entries are stored rather than
+ * deflated, and each one is complete in memory before it's written,
+ * so the local header goes out with its CRC and size already known
+ * and the file is only ever appended to.  See bk390sr.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bk390sr.h"
+
+#define FL __FILE__,__LINE__
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t zip_crc32(const void *p, size_t l) {
+	const uint8_t *s = (const uint8_t *)p;
+	uint32_t c = 0xFFFFFFFF;
+
+	while (l--) c = crc_table[(c ^ *s++) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+/*
+ * Every entry gets the session's start time, MS-DOS style
+ */
+static void dos_time(uint64_t ts, uint16_t *t, uint16_t *d) {
+	time_t s = ts / 1000000;
+	struct tm tm;
+
+	localtime_r(&s, &tm);
+	*t = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	*d = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+static int zip_entry(struct bksr_writer *w, const char *name, const void *data, uint32_t len) {
+	struct bksr_entry *e;
+	uint8_t h[30];
+	uint16_t t, d;
+	int nl = strlen(name);
+
+	if (w->entries >= BKSR_ENTRIES_MAX) {
+		w->errors++;
+		return -1;
+	}
+	e = &w->dir[w->entries++];
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	e->crc = zip_crc32(data, len);
+	e->size = len;
+	e->offset = (uint32_t)w->offset;
+
+	dos_time(w->start, &t, &d);
+	memset(h, 0, sizeof(h));
+	put32(h, 0x04034b50);
+	put16(h + 4, 20);           // version needed, 2.0
+	put16(h + 10, t);
+	put16(h + 12, d);
+	put32(h + 14, e->crc);
+	put32(h + 18, len);         // stored, compressed size is the size
+	put32(h + 22, len);
+	put16(h + 26, nl);
+
+	if (write(w->fd, h, sizeof(h)) != sizeof(h) || write(w->fd, name, nl) != nl || (len && write(w->fd, data, len) != (ssize_t)len)) {
+		fprintf(stderr,"%s:%d: Short write to sigrok session '%s' (%s)\n", FL, w->path, strerror(errno));
+		w->errors++;
+		return -1;
+	}
+	w->offset += sizeof(h) + nl + len;
+	return 0;
+}
+
+static void zip_finish(struct bksr_writer *w) {
+	uint8_t h[46];
+	uint32_t start = (uint32_t)w->offset, size = 0;
+	uint16_t t, d;
+
+	dos_time(w->start, &t, &d);
+	for (int i = 0; i < w->entries; i++) {
+		struct bksr_entry *e = &w->dir[i];
+		int nl = strlen(e->name);
+
+		memset(h, 0, sizeof(h));
+		put32(h, 0x02014b50);
+		put16(h + 4, 0x0314);       // made by unix, 2.0
+		put16(h + 6, 20);
+		put16(h + 12, t);
+		put16(h + 14, d);
+		put32(h + 16, e->crc);
+		put32(h + 20, e->size);
+		put32(h + 24, e->size);
+		put16(h + 28, nl);
+		put32(h + 38, 0100644 << 16); // external attributes, rw-r--r--
+		put32(h + 42, e->offset);
+		if (write(w->fd, h, sizeof(h)) != sizeof(h) || write(w->fd, e->name, nl) != nl) w->errors++;
+		size += sizeof(h) + nl;
+	}
+
+	memset(h, 0, 22);
+	put32(h, 0x06054b50);
+	put16(h + 8, w->entries);
+	put16(h + 10, w->entries);
+	put32(h + 12, size);
+	put32(h + 16, start);
+	if (write(w->fd, h, 22) != 22) w->errors++;
+}
+
+static void chunk_flush(struct bksr_writer *w) {
+	char name[BKSR_NAME_SIZE];
+
+	if (!w->n) return;
+	snprintf(name, sizeof(name), "analog-1-1-%d", ++w->chunks);
+	zip_entry(w, name, w->chunk, w->n * sizeof(float));
+	w->n = 0;
+}
+
+static void sample_put(struct bksr_writer *w, float v) {
+	w->chunk[w->n++] = v;
+	w->samples++;
+	if (w->n == BKSR_CHUNK) chunk_flush(w);
+}
+
+void bksr_writer_init(struct bksr_writer *w, const char *prefix, int meter, unsigned int samplerate) {
+	pthread_once(&crc_once, crc_init);
+
+	memset(w, 0, sizeof(*w));
+	if (samplerate < 1) samplerate = 1;
+	w->prefix = prefix;
+	w->meter = meter;
+	w->samplerate = samplerate;
+	w->period_us = 1000000 / samplerate;
+	w->gap_us = 2000000;
+	w->fd = -1;
+}
+
+static int session_open(struct bksr_writer *w, uint64_t ts, const char *units) {
+	char tmp[BKSR_PATH_SIZE + 4];
+	char stamp[32];
+	struct tm tm;
+	time_t t = ts / 1000000;
+
+	gmtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+	snprintf(w->path, sizeof(w->path), "%s-m%d-%s-%06u.sr", w->prefix, w->meter, stamp, (unsigned int)(ts % 1000000));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+
+	w->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open sigrok session '%s' (%s)\n", FL, tmp, strerror(errno));
+		w->errors++;
+		return -1;
+	}
+
+	snprintf(w->units, sizeof(w->units), "%s", units);
+	w->start = w->next = w->last = ts;
+	w->offset = 0;
+	w->entries = 0;
+	w->chunks = 0;
+	w->n = 0;
+	w->sessions++;
+	return zip_entry(w, "version", "2", 1);
+}
+
+static void session_close(struct bksr_writer *w) {
+	char meta[512];
+	char tmp[BKSR_PATH_SIZE + 4];
+	int l;
+
+	if (w->fd < 0) return;
+
+	/*
+	 * Grid points up to the last reading, nothing is known
+	 * after it
+	 */
+	while (w->next <= w->last) {
+		sample_put(w, w->held);
+		w->next += w->period_us;
+	}
+	chunk_flush(w);
+
+	l = snprintf(meta, sizeof(meta), "[global]\nsigrok version=0.5.2\n\n"
+			"[device 1]\nsamplerate=%u Hz\ntotal probes=0\ntotal analog=1\nanalog1=M%d%s%s\n"
+			, w->samplerate, w->meter, w->units[0] ? " " : "", w->units);
+	zip_entry(w, "metadata", meta, l);
+	zip_finish(w);
+
+	close(w->fd);
+	w->fd = -1;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+	if (rename(tmp, w->path) != 0) w->errors++;
+}
+
+/*
+ * Grid points before ts get the previous reading (or NaN across a
+ * gap), the point at ts if there is one gets this one
+ */
+void bksr_add(struct bksr_writer *w, uint64_t ts, double value, const char *units) {
+	if (w->fd >= 0) {
+		if (strcmp(units, w->units) != 0
+				|| ts < w->last
+				|| ts - w->last > w->period_us * BKSR_CHUNK
+				|| (w->rotate_us && ts - w->start >= w->rotate_us)
+				|| w->entries + 3 > BKSR_ENTRIES_MAX) {
+			session_close(w);
+		}
+	}
+	if (w->fd < 0 && session_open(w, ts, units) != 0) {
+		if (w->fd >= 0) close(w->fd);
+		w->fd = -1;
+		return;
+	}
+
+	while (w->next < ts) {
+		sample_put(w, w->next - w->last > w->gap_us ? NAN : w->held);
+		w->next += w->period_us;
+	}
+	w->held = value;
+	w->last = ts;
+}
+
+void bksr_writer_close(struct bksr_writer *w) {
+	session_close(w);
+}
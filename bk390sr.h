@@ -0,0 +1,74 @@
+/*
+ * sigrok session (.sr, srzip) export of BK390A readings
+ *
+ * A session is a zip holding a "version" file, an INI style
+ * "metadata" file and the samples of each analog channel as raw
+ * 32 bit floats, cut in to numbered chunk files.  PulseView and
+ * sigrok-cli open them directly, next to logic captures.
+ *
+ * sigrok only knows a fixed samplerate, so the readings are sampled
+ * on to a regular grid, each grid point holding the latest reading at
+ * or before it.  Values are in SI base units.  Overloads and gaps in
+ * the readings (nothing for longer than gap_us) are NaN.
+ *
+ * A session holds one meter and one kind of measurement, the channel
+ * is named for both ("M0 VDC").  When the meter changes units the
+ * session is closed and a new one started, as it is when it's been
+ * open rotate_us, its chunk directory is full or the readings stop
+ * for longer than a chunk.  Sessions are named
+ * <prefix>-m<meter>-<start time>.sr and are written as .sr.tmp, only
+ * renamed once complete.
+ *
+ * Only one chunk per session is held in memory, however long the
+ * capture.
+ *
+ */
+#ifndef BK390SR_H
+#define BK390SR_H
+
+#include <stdint.h>
+
+#define BKSR_CHUNK 65536       // samples per chunk file
+#define BKSR_ENTRIES_MAX 1024   // zip entries per session
+#define BKSR_NAME_SIZE 32
+#define BKSR_PATH_SIZE 4096
+
+struct bksr_entry {
+	char name[BKSR_NAME_SIZE];
+	uint32_t crc;
+	uint32_t size;
+	uint32_t offset;
+};
+
+struct bksr_writer {
+	const char *prefix;
+	int meter;
+	unsigned int samplerate; // Hz
+	uint64_t period_us;      // sample spacing, 1e6 / samplerate
+	uint64_t gap_us;         // readings further apart than this leave NaN between them
+	uint64_t rotate_us;      // 0 to never rotate on age
+
+	int fd;
+	char path[BKSR_PATH_SIZE];
+	char units[16];
+	uint64_t start;        // ts of the first grid point
+	uint64_t next;         // ts of the next grid point to be written
+	uint64_t last;         // ts of the latest reading
+	float held;
+	int have;
+
+	float chunk[BKSR_CHUNK];
+	int n;
+	int chunks;
+	uint64_t offset;
+	struct bksr_entry dir[BKSR_ENTRIES_MAX];
+	int entries;
+
+	unsigned long samples, sessions, errors;
+};
+
+void bksr_writer_init(struct bksr_writer *w, const char *prefix, int meter, unsigned int samplerate);
+void bksr_add(struct bksr_writer *w, uint64_t ts, double value, const char *units);
+void bksr_writer_close(struct bksr_writer *w);
+
+#endif